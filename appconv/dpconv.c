@@ -21,12 +21,15 @@
  */
 #include "dpcommon/conversions.h"
 #include <dpcommon/common.h>
+#include <dpcommon/cpu.h>
 #include <dpcommon/input.h>
 #include <dpcommon/output.h>
+#include <dpcommon/threading.h>
 #include <dpengine/canvas_history.h>
 #include <dpengine/canvas_state.h>
 #include <dpengine/draw_context.h>
 #include <dpengine/image.h>
+#include <dpengine/payload_decoder.h>
 #include <dpmsg/binary_reader.h>
 #include <dpmsg/message.h>
 #include <ctype.h>
@@ -194,6 +197,15 @@ static int parse_args(DP_ConvParams *params, int argc, char **argv)
 }
 
 
+static void handle_command(void *user, DP_DrawContext *dc, DP_Message *msg)
+{
+    DP_CanvasHistory *ch = user;
+    if (!DP_canvas_history_handle(ch, dc, msg)) {
+        warn("Handle: %s", DP_error());
+    }
+}
+
+
 static DP_Input *open_input(const char *path)
 {
     if (!path || eq_ignore_case(path, "-")) {
@@ -223,6 +235,8 @@ int main(int argc, char **argv)
         return ret < 0 ? 0 : ret;
     }
 
+    DP_cpu_support_init();
+
     DP_Input *input = open_input(params.input);
     if (!input) {
         warn("Can't open input '%s': %s", params.input, DP_error());
@@ -239,6 +253,16 @@ int main(int argc, char **argv)
     DP_BinaryReader *reader = DP_binary_reader_new(input);
     DP_CanvasHistory *ch = DP_canvas_history_new(NULL, NULL);
     DP_DrawContext *dc = DP_draw_context_new();
+    DP_PayloadDecoder *pd =
+        DP_payload_decoder_new(DP_thread_cpu_count(), handle_command, ch);
+    if (!pd) {
+        warn("Can't create payload decoder: %s", DP_error());
+        DP_draw_context_free(dc);
+        DP_canvas_history_free(ch);
+        DP_binary_reader_free(reader);
+        DP_output_free(output);
+        return 1;
+    }
 
     while (DP_binary_reader_has_next(reader)) {
         DP_Message *msg = DP_binary_reader_read_next(reader);
@@ -248,14 +272,16 @@ int main(int argc, char **argv)
         }
 
         if (DP_message_type_command(DP_message_type(msg))) {
-            if (!DP_canvas_history_handle(ch, dc, msg)) {
-                warn("Handle: %s", DP_error());
-            }
+            DP_payload_decoder_push_noinc(pd, dc, msg);
+        }
+        else {
+            DP_message_decref(msg);
         }
-
-        DP_message_decref(msg);
     }
 
+    DP_payload_decoder_flush(pd, dc);
+    DP_payload_decoder_free(pd);
+
     // TODO error
     DP_binary_reader_free(reader);
 
@@ -32,7 +32,9 @@
 #include <dpcommon/worker.h>
 #include <dpengine/canvas_diff.h>
 #include <dpengine/canvas_state.h>
+#include <dpengine/flatten_cache.h>
 #include <dpengine/layer_content.h>
+#include <dpengine/paint.h>
 #include <dpmsg/binary_reader.h>
 #include <dpmsg/message.h>
 #include <dpmsg/messages/command.h>
@@ -63,6 +65,7 @@ typedef struct DP_App {
     DP_CanvasState *previous_state;
     DP_TransientLayerContent *tlc;
     DP_CanvasDiff *diff;
+    DP_FlattenCache *flatten_cache;
     DP_CanvasRenderer *canvas_renderer;
     DP_LuaWarnBuffer lua_warn_buffer;
     lua_State *L;
@@ -74,6 +77,8 @@ typedef struct DP_App {
     DP_Thread *thread_gui;
 #endif
     DP_Worker *worker;
+    // Helps flattening the canvas, NULL if there's only a single core.
+    DP_Worker *render_worker;
     DP_UserInputs inputs;
 } DP_App;
 
@@ -84,6 +89,7 @@ static bool init_canvas_renderer(DP_App *app)
     if (cr) {
         app->canvas_renderer = cr;
         app->diff = DP_canvas_diff_new();
+        app->flatten_cache = DP_flatten_cache_new();
         app->tlc = DP_transient_layer_content_new_init(0, 0, NULL);
         app->blank_state = DP_canvas_state_new();
         return true;
@@ -153,9 +159,34 @@ static bool init_gui_thread(DP_UNUSED DP_App *app)
 
 static bool init_worker(DP_App *app)
 {
-    return (app->worker = DP_worker_new(1));
+    return (app->worker = DP_worker_new(1, 1));
 }
 
+#ifdef __EMSCRIPTEN__
+static bool init_render_worker(DP_UNUSED DP_App *app)
+{
+    return true; // Rendering in parallel is slower in the browser.
+}
+#else
+static bool init_render_worker(DP_App *app)
+{
+    // The main thread renders as well, so one less thread is needed.
+    int thread_count = DP_thread_cpu_count() - 1;
+    if (thread_count <= 0) {
+        return true;
+    }
+    else if ((app->render_worker = DP_worker_new(64, thread_count))) {
+        // Nothing is being rendered yet, so the threads can generate the brush
+        // lookup tables in the meantime instead of stalling the first strokes.
+        DP_paint_classic_luts_init(app->render_worker);
+        return true;
+    }
+    else {
+        return false;
+    }
+}
+#endif
+
 
 static int handle_events(DP_App *app)
 {
@@ -214,7 +245,13 @@ static DP_CanvasDiff *prepare_canvas(DP_App *app)
             DP_canvas_state_decref(prev);
         }
         app->previous_state = next;
-        app->tlc = DP_canvas_state_render(next, app->tlc, diff);
+        DP_Worker *render_worker = app->render_worker;
+        DP_FlattenCache *fc = app->flatten_cache;
+        app->tlc = render_worker
+                     ? DP_canvas_state_render_parallel(
+                         next, app->tlc, diff, fc, render_worker,
+                         DP_CANVAS_STATE_RENDER_DEFAULT_MIN_BATCH_SIZE)
+                     : DP_canvas_state_render(next, app->tlc, diff, fc);
         return diff;
     }
     else {
@@ -256,7 +293,7 @@ DP_App *DP_app_new(SDL_Window *window, SDL_GLContext gl_context)
 #if defined(DRAWDANCE_IMGUI) && !defined(__EMSCRIPTEN__)
             NULL, NULL, NULL,
 #endif
-            NULL,
+            NULL, NULL,
         {
             0
         }
@@ -266,7 +303,8 @@ DP_App *DP_app_new(SDL_Window *window, SDL_GLContext gl_context)
     bool ok = init_canvas_renderer(app) //
            && init_lua(app)             //
            && init_gui_thread(app)      //
-           && init_worker(app);
+           && init_worker(app)          //
+           && init_render_worker(app);
 
     if (ok) {
         return app;
@@ -284,6 +322,7 @@ void DP_app_free(DP_App *app)
         DP_Worker *worker = app->worker;
         app->worker = NULL;
         DP_worker_free(worker);
+        DP_worker_free(app->render_worker);
 #if defined(DRAWDANCE_IMGUI) && !defined(__EMSCRIPTEN__)
         if (app->thread_gui) {
             DP_SEMAPHORE_MUST_POST(app->sem_gui_prepare);
@@ -298,6 +337,7 @@ void DP_app_free(DP_App *app)
         }
         DP_lua_warn_buffer_dispose(&app->lua_warn_buffer);
         DP_canvas_renderer_free(app->canvas_renderer);
+        DP_flatten_cache_free(app->flatten_cache);
         DP_canvas_diff_free(app->diff);
         if (app->tlc) {
             DP_transient_layer_content_decref(app->tlc);
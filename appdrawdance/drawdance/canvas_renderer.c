@@ -233,8 +233,22 @@ static bool resize(DP_CanvasRenderer *cr, int layer_width, int layer_height)
 static void write_tile_to_texture(void *layer, int tile_x, int tile_y)
 {
     static const DP_Pixel BLANK_PIXELS[DP_TILE_LENGTH];
+    static DP_Pixel solid_pixels[DP_TILE_LENGTH];
     DP_Tile *tile = DP_layer_content_tile_at_noinc(layer, tile_x, tile_y);
-    const DP_Pixel *pixels = tile ? DP_tile_pixels(tile) : BLANK_PIXELS;
+    const DP_Pixel *pixels;
+    if (!tile) {
+        pixels = BLANK_PIXELS;
+    }
+    else if (DP_tile_solid(tile)) {
+        DP_Pixel pixel = DP_tile_pixel_at(tile, 0, 0);
+        for (int i = 0; i < DP_TILE_LENGTH; ++i) {
+            solid_pixels[i] = pixel;
+        }
+        pixels = solid_pixels;
+    }
+    else {
+        pixels = DP_tile_pixels(tile);
+    }
     DP_GL(glTexSubImage2D, GL_TEXTURE_2D, 0, tile_x * DP_TILE_SIZE,
           tile_y * DP_TILE_SIZE, DP_TILE_SIZE, DP_TILE_SIZE, GL_RGBA,
           GL_UNSIGNED_BYTE, pixels);
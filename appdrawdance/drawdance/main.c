@@ -23,6 +23,7 @@
 #include "emproxy.h"
 #include "gl.h"
 #include <dpcommon/common.h>
+#include <dpcommon/cpu.h>
 #include <SDL.h>
 #include <lauxlib.h>
 #include <lua.h>
@@ -213,6 +214,7 @@ int main(void)
 #endif
     DP_App *app = NULL;
 
+    DP_cpu_support_init();
     bool ok = (sdl_initialized = init_sdl())           //
            && load_config()                            //
            && (window = open_window())                 //
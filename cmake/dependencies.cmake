@@ -62,3 +62,16 @@ else()
 
     find_package(Qt5 COMPONENTS Core Gui)
 endif()
+
+if(USE_LIBDEFLATE)
+    find_path(LIBDEFLATE_INCLUDE_DIR libdeflate.h)
+    find_library(LIBDEFLATE_LIBRARY NAMES deflate libdeflate)
+    if(NOT LIBDEFLATE_INCLUDE_DIR OR NOT LIBDEFLATE_LIBRARY)
+        message(FATAL_ERROR "USE_LIBDEFLATE is on, but libdeflate not found")
+    endif()
+    add_library(libdeflate INTERFACE)
+    target_include_directories(libdeflate INTERFACE
+                               "${LIBDEFLATE_INCLUDE_DIR}")
+    target_link_libraries(libdeflate INTERFACE "${LIBDEFLATE_LIBRARY}")
+    add_dp_export_target(libdeflate)
+endif()
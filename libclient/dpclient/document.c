@@ -25,8 +25,10 @@
 #include <dpcommon/threading.h>
 #include <dpengine/canvas_history.h>
 #include <dpengine/draw_context.h>
+#include <dpengine/payload_decoder.h>
 #include <dpmsg/message.h>
 #include <dpmsg/message_queue.h>
+#include <time.h>
 
 typedef struct DP_Message DP_Message;
 
@@ -40,35 +42,96 @@ struct DP_Document {
     DP_Queue queue;
     DP_DrawContext *draw_context;
     DP_CanvasHistory *canvas_history;
+    DP_PayloadDecoder *payload_decoder;
     DP_Mutex *mutex_queue;
     DP_Semaphore *sem_queue_ready;
     DP_Thread *dequeue_thread;
+    struct {
+        int max_size;
+        int max_latency_ms;
+    } batch; // Guarded by mutex_queue.
 };
 
-static void run_command_thread(void *data)
+static void handle_command(void *user, DP_DrawContext *dc, DP_Message *msg)
+{
+    DP_Document *doc = user;
+    if (!DP_canvas_history_handle(doc->canvas_history, dc, msg)) {
+        DP_warn("Error handling drawing command: %s", DP_error());
+    }
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+static DP_Message *shift_message(DP_Document *doc, bool *out_queue_empty,
+                                 int *out_max_size, int *out_max_latency_ms)
+{
+    DP_Mutex *mutex_queue = doc->mutex_queue;
+    DP_MUTEX_MUST_LOCK(mutex_queue);
+    DP_Message *msg = DP_message_queue_shift(&doc->queue);
+    *out_queue_empty = doc->queue.used == 0;
+    if (out_max_size) {
+        *out_max_size = doc->batch.max_size;
+        *out_max_latency_ms = doc->batch.max_latency_ms;
+    }
+    DP_MUTEX_MUST_UNLOCK(mutex_queue);
+    return msg;
+}
+
+// Handles the message that woke the thread up, plus as many others as are
+// already queued, within the batch limits. The canvas state only gets
+// published once at the end, not for every single message.
+static void handle_batch(DP_Document *doc)
 {
-    DP_Document *doc = data;
-    DP_Queue *queue = &doc->queue;
     DP_DrawContext *dc = doc->draw_context;
+    DP_PayloadDecoder *pd = doc->payload_decoder;
+    bool queue_empty;
+    int max_size, max_latency_ms;
+    DP_Message *msg =
+        shift_message(doc, &queue_empty, &max_size, &max_latency_ms);
+    if (!msg) {
+        DP_warn("Dequeue got NULL message");
+        DP_ASSERT(false); // Shouldn't happen.
+        return;
+    }
+
     DP_CanvasHistory *ch = doc->canvas_history;
-    DP_Mutex *mutex_queue = doc->mutex_queue;
+    DP_canvas_history_batch_begin(ch);
+    long long deadline = now_ms() + max_latency_ms;
+    int handled = 0;
+    while (true) {
+        // Keep decoding payloads ahead while more messages are coming in, but
+        // don't let anything linger once the queue runs dry.
+        DP_payload_decoder_push_noinc(pd, dc, msg);
+        ++handled;
+        if (queue_empty) {
+            DP_payload_decoder_flush(pd, dc);
+            break;
+        }
+        // Messages get pushed before the semaphore is posted, so a failed try
+        // wait just means the rest of the batch isn't fully enqueued yet.
+        if (handled >= max_size || !doc->running || now_ms() >= deadline
+            || !DP_SEMAPHORE_MUST_TRY_WAIT(doc->sem_queue_ready)) {
+            break;
+        }
+        msg = shift_message(doc, &queue_empty, NULL, NULL);
+        DP_ASSERT(msg);
+    }
+    DP_canvas_history_batch_end(ch);
+}
+
+static void run_command_thread(void *data)
+{
+    DP_Document *doc = data;
     DP_Semaphore *sem_queue_ready = doc->sem_queue_ready;
     while (true) {
         DP_SEMAPHORE_MUST_WAIT(sem_queue_ready);
         if (doc->running) {
-            DP_MUTEX_MUST_LOCK(mutex_queue);
-            DP_Message *msg = DP_message_queue_shift(queue);
-            DP_MUTEX_MUST_UNLOCK(mutex_queue);
-            if (msg) {
-                if (!DP_canvas_history_handle(ch, dc, msg)) {
-                    DP_warn("Error handling drawing command: %s", DP_error());
-                }
-                DP_message_decref(msg);
-            }
-            else {
-                DP_warn("Dequeue got NULL message");
-                DP_ASSERT(false); // Shouldn't happen.
-            }
+            handle_batch(doc);
         }
         else {
             break;
@@ -79,8 +142,18 @@ static void run_command_thread(void *data)
 DP_Document *DP_document_new(void)
 {
     DP_Document *doc = DP_malloc(sizeof(*doc));
-    *doc = (DP_Document){0,    NULL, true, DP_QUEUE_NULL, NULL,
-                         NULL, NULL, NULL, NULL};
+    *doc = (DP_Document){0,
+                         NULL,
+                         true,
+                         DP_QUEUE_NULL,
+                         NULL,
+                         NULL,
+                         NULL,
+                         NULL,
+                         NULL,
+                         NULL,
+                         {DP_DOCUMENT_BATCH_MAX_SIZE_DEFAULT,
+                          DP_DOCUMENT_BATCH_MAX_LATENCY_MS_DEFAULT}};
     DP_message_queue_init(&doc->queue, INITIAL_CAPACITY);
     if (!(doc->draw_context = DP_draw_context_new())) {
         DP_document_free(doc);
@@ -90,6 +163,11 @@ DP_Document *DP_document_new(void)
         DP_document_free(doc);
         return NULL;
     }
+    if (!(doc->payload_decoder = DP_payload_decoder_new(
+              DP_thread_cpu_count(), handle_command, doc))) {
+        DP_document_free(doc);
+        return NULL;
+    }
     if (!(doc->mutex_queue = DP_mutex_new())) {
         DP_document_free(doc);
         return NULL;
@@ -120,6 +198,7 @@ void DP_document_free(DP_Document *doc)
             DP_mutex_free(doc->mutex_queue);
         }
         DP_message_queue_dispose(&doc->queue);
+        DP_payload_decoder_free(doc->payload_decoder);
         DP_canvas_history_free(doc->canvas_history);
         DP_draw_context_free(doc->draw_context);
         DP_free(doc->title);
@@ -143,6 +222,19 @@ DP_Queue *DP_document_queue(DP_Document *doc)
     return &doc->queue;
 }
 
+void DP_document_batch_limits_set(DP_Document *doc, int max_size,
+                                  int max_latency_ms)
+{
+    DP_ASSERT(doc);
+    DP_ASSERT(max_size >= 1);
+    DP_ASSERT(max_latency_ms >= 0);
+    DP_Mutex *mutex_queue = doc->mutex_queue;
+    DP_MUTEX_MUST_LOCK(mutex_queue);
+    doc->batch.max_size = max_size;
+    doc->batch.max_latency_ms = max_latency_ms;
+    DP_MUTEX_MUST_UNLOCK(mutex_queue);
+}
+
 DP_CanvasState *DP_document_canvas_state_compare_and_get(DP_Document *doc,
                                                          DP_CanvasState *prev)
 {
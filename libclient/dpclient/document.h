@@ -27,6 +27,13 @@ typedef struct DP_CanvasState DP_CanvasState;
 typedef struct DP_Message DP_Message;
 
 
+// Queued messages are handled in batches of up to this many, with the canvas
+// state getting published once per batch. A batch also ends once it has taken
+// longer than the latency limit, so that a long stream of messages, like when
+// loading a recording, still shows progress.
+#define DP_DOCUMENT_BATCH_MAX_SIZE_DEFAULT       256
+#define DP_DOCUMENT_BATCH_MAX_LATENCY_MS_DEFAULT 16
+
 typedef struct DP_Document DP_Document;
 
 DP_Document *DP_document_new(void);
@@ -35,6 +42,10 @@ void DP_document_free(DP_Document *doc);
 
 const char *DP_document_title(DP_Document *doc, size_t *out_length);
 
+// A maximum size of 1 publishes every message separately.
+void DP_document_batch_limits_set(DP_Document *doc, int max_size,
+                                  int max_latency_ms);
+
 DP_CanvasState *DP_document_canvas_state_compare_and_get(DP_Document *doc,
                                                          DP_CanvasState *prev);
 
@@ -25,6 +25,7 @@
 #include <stdatomic.h>
 
 typedef atomic_int DP_Atomic;
+typedef _Atomic(void *) DP_AtomicPtr;
 
 #define DP_ATOMIC_INIT(X) X
 
@@ -32,8 +33,11 @@ typedef atomic_int DP_Atomic;
 #define DP_atomic_set(X, VALUE) atomic_store((X), (VALUE))
 #define DP_atomic_xch(X, VALUE) atomic_exchange((X), (VALUE))
 #define DP_atomic_add(X, VALUE) ((void)atomic_fetch_add((X), VALUE))
+#define DP_atomic_fetch_add(X, VALUE) atomic_fetch_add((X), VALUE)
 #define DP_atomic_inc(X)        DP_atomic_add((X), 1)
 #define DP_atomic_dec(X)        (atomic_fetch_sub((X), 1) == 1)
+#define DP_atomic_compare_exchange(X, EXPECTED, DESIRED) \
+    atomic_compare_exchange_strong((X), (EXPECTED), (DESIRED))
 
 #define DP_ATOMIC_DECLARE_STATIC_SPIN_LOCK(NAME) static DP_Atomic NAME
 
@@ -26,6 +26,9 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdio.h>
+#ifdef _WIN32
+#    include <malloc.h>
+#endif
 
 DP_ATOMIC_DECLARE_STATIC_SPIN_LOCK(log_lock);
 
@@ -95,6 +98,37 @@ void *DP_realloc(void *ptr, size_t size)
     }
 }
 
+void DP_free_aligned(void *ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+void *DP_malloc_aligned(size_t size, size_t alignment)
+{
+    DP_ASSERT(alignment != 0);
+    DP_ASSERT((alignment & (alignment - 1)) == 0);
+    DP_ASSERT(alignment % sizeof(void *) == 0);
+#ifdef _WIN32
+    void *ptr = _aligned_malloc(size, alignment);
+#else
+    // C11 requires the size to be a multiple of the alignment.
+    size_t remainder = size % alignment;
+    void *ptr = aligned_alloc(
+        alignment, remainder == 0 ? size : size + alignment - remainder);
+#endif
+    if (ptr) {
+        return ptr;
+    }
+    else {
+        fprintf(stderr, "Aligned allocation of %zu bytes failed\n", size);
+        DP_TRAP();
+    }
+}
+
 
 char *DP_vformat(const char *fmt, va_list ap)
 {
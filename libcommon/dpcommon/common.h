@@ -60,17 +60,26 @@
 #        define DP_MALLOC_ATTR \
             __attribute__((malloc, malloc(DP_free, 1), alloc_size(1)))
 #    endif
+#    ifdef __clang__
+#        define DP_MALLOC_ALIGNED_ATTR __attribute__((malloc, alloc_size(1)))
+#    else
+#        define DP_MALLOC_ALIGNED_ATTR \
+            __attribute__((malloc, malloc(DP_free_aligned, 1), alloc_size(1)))
+#    endif
 #    define DP_REALLOC_ATTR __attribute__((malloc, alloc_size(2)))
 #    define DP_MUST_CHECK   __attribute((warn_unused_result))
 #    define DP_INLINE       DP_UNUSED static inline
+#    define DP_FORCE_INLINE __attribute__((always_inline)) inline
 #else
 #    define DP_TRAP()                               abort()
 #    define DP_UNUSED                               // nothing
 #    define DP_UNREACHABLE()                        // nothing
 #    define DP_FORMAT(STRING_INDEX, FIRST_TO_CHECK) // nothing
 #    define DP_MALLOC_ATTR                          // nothing
+#    define DP_MALLOC_ALIGNED_ATTR                  // nothing
 #    define DP_REALLOC_ATTR                         // nothing
 #    define DP_MUST_CHECK                           // nothing
+#    define DP_FORCE_INLINE                         inline
 #endif
 
 #ifdef NDEBUG
@@ -178,6 +187,22 @@ DP_INLINE uint8_t DP_max_uint8(uint8_t x, uint8_t y)
     return x < y ? y : x;
 }
 
+// Index of the lowest set bit. The value must not be zero.
+DP_INLINE int DP_uint64_ctz(uint64_t x)
+{
+    DP_ASSERT(x != 0);
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    int i = 0;
+    while (!(x & 1u)) {
+        x >>= 1;
+        ++i;
+    }
+    return i;
+#endif
+}
+
 DP_INLINE size_t DP_flex_size(size_t type_size, size_t flex_offset,
                               size_t flex_size, size_t count)
 {
@@ -200,6 +225,14 @@ void *DP_malloc(size_t size) DP_MALLOC_ATTR;
 
 void *DP_realloc(void *ptr, size_t size) DP_REALLOC_ATTR;
 
+/*
+ * Memory from DP_malloc_aligned must be freed using DP_free_aligned, not
+ * DP_free. The alignment must be a power of two multiple of sizeof(void *).
+ */
+void DP_free_aligned(void *ptr);
+
+void *DP_malloc_aligned(size_t size, size_t alignment) DP_MALLOC_ALIGNED_ATTR;
+
 
 char *DP_vformat(const char *fmt, va_list ap);
 
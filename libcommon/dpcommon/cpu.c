@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "cpu.h"
+#include "common.h"
+
+
+DP_CpuSupport DP_cpu_support = DP_CPU_SUPPORT_DEFAULT;
+
+void DP_cpu_support_init(void)
+{
+    DP_cpu_support = DP_cpu_support_detect();
+    DP_debug("CPU support: %s", DP_cpu_support_name(DP_cpu_support));
+}
+
+DP_CpuSupport DP_cpu_support_detect(void)
+{
+#if defined(DP_CPU_X64) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return DP_CPU_SUPPORT_AVX2;
+    }
+    else if (__builtin_cpu_supports("sse4.2")) {
+        return DP_CPU_SUPPORT_SSE42;
+    }
+#endif
+    return DP_CPU_SUPPORT_DEFAULT;
+}
+
+const char *DP_cpu_support_name(DP_CpuSupport cpu_support)
+{
+    switch (cpu_support) {
+    case DP_CPU_SUPPORT_DEFAULT:
+        return "default";
+    case DP_CPU_SUPPORT_SSE42:
+        return "SSE4.2";
+    case DP_CPU_SUPPORT_AVX2:
+        return "AVX2";
+    }
+    return "unknown";
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef DPCOMMON_CPU_H
+#define DPCOMMON_CPU_H
+#include "common.h"
+
+
+#if defined(__x86_64__) || defined(_M_X64)
+#    define DP_CPU_X64
+#endif
+
+#ifdef DP_CPU_X64
+#    define DP_STRINGIFY_TARGET(X) #X
+#    if defined(__clang__)
+#        define DP_TARGET_BEGIN(TARGET)                                \
+            _Pragma(DP_STRINGIFY_TARGET(clang attribute push(          \
+                __attribute__((target(TARGET))), apply_to = function)))
+#        define DP_TARGET_END _Pragma("clang attribute pop")
+#    elif defined(__GNUC__)
+#        define DP_TARGET_BEGIN(TARGET) \
+            _Pragma("GCC push_options") \
+                _Pragma(DP_STRINGIFY_TARGET(GCC target(TARGET)))
+#        define DP_TARGET_END _Pragma("GCC pop_options")
+#    else
+#        error "Don't know how to enable target features on this compiler"
+#    endif
+#endif
+
+
+typedef enum DP_CpuSupport {
+    DP_CPU_SUPPORT_DEFAULT,
+    DP_CPU_SUPPORT_SSE42,
+    DP_CPU_SUPPORT_AVX2,
+} DP_CpuSupport;
+
+/*
+ * The instruction set extensions that vectorized code paths may use. Starts
+ * out as DP_CPU_SUPPORT_DEFAULT, meaning only plain C code is run, until
+ * DP_cpu_support_init is called. Tests may also lower it to compare the
+ * different code paths against each other.
+ */
+extern DP_CpuSupport DP_cpu_support;
+
+// Detects the CPU's capabilities and sets DP_cpu_support accordingly. Call this
+// once at startup, before any threads are spawned.
+void DP_cpu_support_init(void);
+
+// Returns what the CPU is capable of, regardless of DP_cpu_support.
+DP_CpuSupport DP_cpu_support_detect(void);
+
+const char *DP_cpu_support_name(DP_CpuSupport cpu_support);
+
+
+#endif
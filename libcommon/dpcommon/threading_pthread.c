@@ -22,9 +22,11 @@
 #include "common.h"
 #include "threading.h"
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <string.h>
+#include <unistd.h>
 
 
 struct DP_Mutex {
@@ -229,6 +231,12 @@ void DP_thread_free_join(DP_Thread *thread)
     }
 }
 
+int DP_thread_cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count < 1 ? 1 : count > INT_MAX ? INT_MAX : (int)count;
+}
+
 
 DP_TlsKey DP_tls_create(void (*destructor)(void *))
 {
@@ -130,6 +130,11 @@ extern "C" void DP_thread_free_join(DP_Thread *thread)
     }
 }
 
+extern "C" int DP_thread_cpu_count(void)
+{
+    return DP_max_int(QThread::idealThreadCount(), 1);
+}
+
 
 class DP_TlsValue {
   public:
@@ -189,6 +189,11 @@ void DP_thread_free_join(DP_Thread *thread)
     SDL_WaitThread((SDL_Thread *)thread, NULL);
 }
 
+int DP_thread_cpu_count(void)
+{
+    return DP_max_int(SDL_GetCPUCount(), 1);
+}
+
 
 static void SDLCALL tls_destroy(void *data)
 {
@@ -21,6 +21,7 @@
  */
 #include "worker.h"
 #include "common.h"
+#include "conversions.h"
 #include "queue.h"
 #include "threading.h"
 
@@ -36,7 +37,8 @@ typedef struct DP_Worker {
     DP_Semaphore *sem;
     DP_Queue queue;
     DP_Mutex *queue_mutex;
-    DP_Thread *thread;
+    int thread_count;
+    DP_Thread *threads[];
 } DP_Worker;
 
 
@@ -77,11 +79,19 @@ static void run_worker_thread(void *data)
     }
 }
 
-DP_Worker *DP_worker_new(size_t initial_capacity)
+DP_Worker *DP_worker_new(size_t initial_capacity, int thread_count)
 {
     DP_ASSERT(initial_capacity > 0);
-    DP_Worker *worker = DP_malloc(sizeof(*worker));
-    *worker = (DP_Worker){NULL, DP_QUEUE_NULL, NULL, NULL};
+    DP_ASSERT(thread_count > 0);
+    DP_Worker *worker = DP_malloc(DP_FLEX_SIZEOF(
+        DP_Worker, threads, DP_int_to_size(thread_count)));
+    worker->sem = NULL;
+    worker->queue = DP_QUEUE_NULL;
+    worker->queue_mutex = NULL;
+    worker->thread_count = thread_count;
+    for (int i = 0; i < thread_count; ++i) {
+        worker->threads[i] = NULL;
+    }
 
     worker->sem = DP_semaphore_new(0);
     if (!worker->sem) {
@@ -97,10 +107,12 @@ DP_Worker *DP_worker_new(size_t initial_capacity)
         return NULL;
     }
 
-    worker->thread = DP_thread_new(run_worker_thread, worker);
-    if (!worker->thread) {
-        DP_worker_free(worker);
-        return NULL;
+    for (int i = 0; i < thread_count; ++i) {
+        worker->threads[i] = DP_thread_new(run_worker_thread, worker);
+        if (!worker->threads[i]) {
+            DP_worker_free(worker);
+            return NULL;
+        }
     }
 
     return worker;
@@ -109,11 +121,17 @@ DP_Worker *DP_worker_new(size_t initial_capacity)
 void DP_worker_free(DP_Worker *worker)
 {
     if (worker) {
+        // Each thread exits when it gets woken up with an empty queue.
         DP_Semaphore *sem = worker->sem;
+        int thread_count = worker->thread_count;
         if (sem) {
-            DP_SEMAPHORE_MUST_POST(sem);
+            for (int i = 0; i < thread_count; ++i) {
+                DP_SEMAPHORE_MUST_POST(sem);
+            }
+        }
+        for (int i = 0; i < thread_count; ++i) {
+            DP_thread_free_join(worker->threads[i]);
         }
-        DP_thread_free_join(worker->thread);
         DP_mutex_free(worker->queue_mutex);
         DP_queue_dispose(&worker->queue);
         DP_semaphore_free(sem);
@@ -132,3 +150,9 @@ void DP_worker_push(DP_Worker *worker, DP_WorkerFn fn, void *user)
     DP_MUTEX_MUST_UNLOCK(queue_mutex);
     DP_SEMAPHORE_MUST_POST(worker->sem);
 }
+
+int DP_worker_thread_count(DP_Worker *worker)
+{
+    DP_ASSERT(worker);
+    return worker->thread_count;
+}
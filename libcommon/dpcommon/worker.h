@@ -28,11 +28,15 @@ typedef struct DP_Worker DP_Worker;
 
 typedef void (*DP_WorkerFn)(void *user);
 
-DP_Worker *DP_worker_new(size_t initial_capacity);
+// Jobs are run by the given number of threads, so they may run concurrently
+// and finish out of order if there's more than one.
+DP_Worker *DP_worker_new(size_t initial_capacity, int thread_count);
 
 void DP_worker_free(DP_Worker *worker);
 
 void DP_worker_push(DP_Worker *worker, DP_WorkerFn fn, void *user);
 
+int DP_worker_thread_count(DP_Worker *worker);
+
 
 #endif
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpcommon/cpu.h>
+#include <dpengine/blend_mode.h>
+#include <dpengine/pixels.h>
+#include <dpengine/tile.h>
+#include <stdio.h>
+#include <time.h>
+
+
+#define ITERATIONS 2000
+
+static DP_Pixel base[DP_TILE_LENGTH];
+static DP_Pixel dst[DP_TILE_LENGTH];
+static DP_Pixel src[DP_TILE_LENGTH];
+static uint8_t mask[DP_TILE_LENGTH];
+
+
+static double now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return DP_long_to_double(ts.tv_sec) + DP_long_to_double(ts.tv_nsec) / 1e9;
+}
+
+static uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void init_pixels(void)
+{
+    uint32_t state = 0xbe7c4u;
+    for (int i = 0; i < DP_TILE_LENGTH; ++i) {
+        base[i] = DP_pixel_premultiply((DP_Pixel){next_random(&state)});
+        src[i] = DP_pixel_premultiply((DP_Pixel){next_random(&state)});
+        // Roughly circular mask, like a soft brush dab.
+        int x = i % DP_TILE_SIZE - DP_TILE_SIZE / 2;
+        int y = i / DP_TILE_SIZE - DP_TILE_SIZE / 2;
+        int r2 = DP_square_int(DP_TILE_SIZE / 2);
+        int d2 = DP_min_int(x * x + y * y, r2);
+        mask[i] = DP_int_to_uint8(255 - d2 * 255 / r2);
+    }
+}
+
+static double bench_mask(int blend_mode)
+{
+    memcpy(dst, base, sizeof(dst));
+    double start = now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        DP_pixels_composite_mask(dst, src[i % DP_TILE_LENGTH], blend_mode,
+                                 mask, DP_TILE_SIZE, DP_TILE_SIZE, 0, 0);
+    }
+    return (now() - start) / ITERATIONS * 1e6;
+}
+
+static double bench_layer(int blend_mode)
+{
+    memcpy(dst, base, sizeof(dst));
+    double start = now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        DP_pixels_composite(dst, src, DP_TILE_LENGTH, 200, blend_mode);
+    }
+    return (now() - start) / ITERATIONS * 1e6;
+}
+
+
+int main(void)
+{
+    static const int blend_modes[] = {
+        DP_BLEND_MODE_NORMAL,   DP_BLEND_MODE_ERASE,
+        DP_BLEND_MODE_MULTIPLY, DP_BLEND_MODE_BEHIND,
+        DP_BLEND_MODE_DIVIDE,   DP_BLEND_MODE_COLOR_ERASE,
+    };
+
+    init_pixels();
+    printf("%-8s %-30s %12s %12s\n", "cpu", "blend mode", "mask us",
+           "layer us");
+
+    DP_CpuSupport max_level = DP_cpu_support_detect();
+    for (int level = 0; level <= (int)max_level; ++level) {
+        DP_cpu_support = (DP_CpuSupport)level;
+        for (size_t i = 0; i < DP_ARRAY_LENGTH(blend_modes); ++i) {
+            int blend_mode = blend_modes[i];
+            double mask_us = bench_mask(blend_mode);
+            double layer_us = bench_layer(blend_mode);
+            printf("%-8s %-30s %12.2f %12.2f\n",
+                   DP_cpu_support_name(DP_cpu_support),
+                   DP_blend_mode_enum_name(blend_mode), mask_us, layer_us);
+        }
+    }
+
+    return 0;
+}
@@ -188,5 +188,5 @@ bool DP_affected_area_concurrent_with(const DP_AffectedArea *a,
                || a->affected_id != b->affected_id
                // Affecting different pixels on the same layer is concurrent.
                || (a_domain == DP_AFFECTED_DOMAIN_PIXELS
-                   && DP_rect_intersects(a->bounds, b->bounds)));
+                   && !DP_rect_intersects(a->bounds, b->bounds)));
 }
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "affected_index.h"
+#include "affected_area.h"
+#include "tile.h"
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpcommon/geom.h>
+#include <limits.h>
+
+
+#define INITIAL_CAPACITY 64
+
+// Pixel areas spanning more tiles than this get counted for their whole layer
+// instead of tile by tile, since wild transforms can have enormous bounds.
+#define MAX_INDEXED_TILES 1024
+
+// Coordinates for counting non-pixel domains and wide pixel areas, as well
+// as the total number of pixel areas on a layer.
+#define NO_TILE   INT_MIN
+#define ALL_TILES (INT_MIN + 1)
+
+typedef struct DP_AffectedIndexKey {
+    int domain;
+    int affected_id;
+    int x, y;
+} DP_AffectedIndexKey;
+
+typedef struct DP_AffectedIndexSlot {
+    DP_AffectedIndexKey key;
+    int count; // Zero means the slot is empty.
+} DP_AffectedIndexSlot;
+
+typedef struct DP_AffectedIndexTiles {
+    int x1, y1, x2, y2;
+} DP_AffectedIndexTiles;
+
+struct DP_AffectedIndex {
+    int count;
+    int everything_count;
+    int used;
+    int capacity;
+    DP_AffectedIndexSlot *slots;
+};
+
+
+static DP_AffectedIndexSlot *alloc_slots(int capacity)
+{
+    size_t size = sizeof(DP_AffectedIndexSlot) * DP_int_to_size(capacity);
+    DP_AffectedIndexSlot *slots = DP_malloc(size);
+    memset(slots, 0, size);
+    return slots;
+}
+
+DP_AffectedIndex *DP_affected_index_new(void)
+{
+    DP_AffectedIndex *ai = DP_malloc(sizeof(*ai));
+    *ai = (DP_AffectedIndex){0, 0, 0, INITIAL_CAPACITY,
+                             alloc_slots(INITIAL_CAPACITY)};
+    return ai;
+}
+
+void DP_affected_index_free(DP_AffectedIndex *ai)
+{
+    if (ai) {
+        DP_free(ai->slots);
+        DP_free(ai);
+    }
+}
+
+void DP_affected_index_clear(DP_AffectedIndex *ai)
+{
+    DP_ASSERT(ai);
+    if (ai->count != 0) {
+        memset(ai->slots, 0,
+               sizeof(*ai->slots) * DP_int_to_size(ai->capacity));
+        ai->count = 0;
+        ai->everything_count = 0;
+        ai->used = 0;
+    }
+}
+
+
+static size_t hash_key(DP_AffectedIndexKey key, int capacity)
+{
+    uint32_t h = DP_int_to_uint32(key.domain) * 0x9e3779b1u;
+    h = (h ^ DP_int_to_uint32(key.affected_id)) * 0x85ebca77u;
+    h = (h ^ (uint32_t)key.x) * 0xc2b2ae3du;
+    h = (h ^ (uint32_t)key.y) * 0x27d4eb2fu;
+    return (size_t)((h ^ (h >> 15)) & DP_int_to_uint32(capacity - 1));
+}
+
+static bool key_equals(DP_AffectedIndexKey a, DP_AffectedIndexKey b)
+{
+    return a.domain == b.domain && a.affected_id == b.affected_id
+        && a.x == b.x && a.y == b.y;
+}
+
+static size_t find_slot(DP_AffectedIndexSlot *slots, int capacity,
+                        DP_AffectedIndexKey key)
+{
+    size_t mask = DP_int_to_size(capacity - 1);
+    size_t i = hash_key(key, capacity);
+    while (slots[i].count != 0 && !key_equals(slots[i].key, key)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void grow(DP_AffectedIndex *ai)
+{
+    int old_capacity = ai->capacity;
+    DP_AffectedIndexSlot *old_slots = ai->slots;
+    int new_capacity = old_capacity * 2;
+    DP_AffectedIndexSlot *new_slots = alloc_slots(new_capacity);
+    for (int i = 0; i < old_capacity; ++i) {
+        DP_AffectedIndexSlot *slot = &old_slots[i];
+        if (slot->count != 0) {
+            new_slots[find_slot(new_slots, new_capacity, slot->key)] = *slot;
+        }
+    }
+    DP_free(old_slots);
+    ai->capacity = new_capacity;
+    ai->slots = new_slots;
+}
+
+static void increment(DP_AffectedIndex *ai, DP_AffectedIndexKey key)
+{
+    // Keep the load factor at or below one half.
+    if ((ai->used + 1) * 2 > ai->capacity) {
+        grow(ai);
+    }
+    DP_AffectedIndexSlot *slot =
+        &ai->slots[find_slot(ai->slots, ai->capacity, key)];
+    if (slot->count == 0) {
+        slot->key = key;
+        ++ai->used;
+    }
+    ++slot->count;
+}
+
+static void decrement(DP_AffectedIndex *ai, DP_AffectedIndexKey key)
+{
+    DP_AffectedIndexSlot *slots = ai->slots;
+    size_t i = find_slot(slots, ai->capacity, key);
+    DP_ASSERT(slots[i].count > 0);
+    if (--slots[i].count == 0) {
+        // Shift following slots back into the gap, so that lookups don't
+        // stop early at it. That avoids the need for tombstones.
+        size_t mask = DP_int_to_size(ai->capacity - 1);
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (slots[j].count == 0) {
+                break;
+            }
+            size_t k = hash_key(slots[j].key, ai->capacity);
+            bool stays = i <= j ? i < k && k <= j : i < k || k <= j;
+            if (!stays) {
+                slots[i] = slots[j];
+                slots[j].count = 0;
+                i = j;
+            }
+        }
+        --ai->used;
+    }
+}
+
+static int lookup(DP_AffectedIndex *ai, DP_AffectedIndexKey key)
+{
+    return ai->slots[find_slot(ai->slots, ai->capacity, key)].count;
+}
+
+
+static int floor_tile(int i)
+{
+    return i < 0 ? -((-(i + 1)) / DP_TILE_SIZE) - 1 : i / DP_TILE_SIZE;
+}
+
+static bool get_tiles(DP_Rect bounds, DP_AffectedIndexTiles *out_tiles)
+{
+    DP_AffectedIndexTiles tiles = {floor_tile(bounds.x1), floor_tile(bounds.y1),
+                                   floor_tile(bounds.x2),
+                                   floor_tile(bounds.y2)};
+    long long tile_count = ((long long)tiles.x2 - (long long)tiles.x1 + 1LL)
+                         * ((long long)tiles.y2 - (long long)tiles.y1 + 1LL);
+    *out_tiles = tiles;
+    return tile_count <= MAX_INDEXED_TILES;
+}
+
+static void update(DP_AffectedIndex *ai, const DP_AffectedArea *aa,
+                   void (*fn)(DP_AffectedIndex *, DP_AffectedIndexKey))
+{
+    int domain = (int)aa->domain;
+    int affected_id = aa->affected_id;
+    DP_AffectedIndexTiles tiles;
+    if (aa->domain != DP_AFFECTED_DOMAIN_PIXELS) {
+        fn(ai, (DP_AffectedIndexKey){domain, affected_id, NO_TILE, NO_TILE});
+    }
+    else if (get_tiles(aa->bounds, &tiles)) {
+        fn(ai, (DP_AffectedIndexKey){domain, affected_id, ALL_TILES, 0});
+        for (int y = tiles.y1; y <= tiles.y2; ++y) {
+            for (int x = tiles.x1; x <= tiles.x2; ++x) {
+                fn(ai, (DP_AffectedIndexKey){domain, affected_id, x, y});
+            }
+        }
+    }
+    else {
+        fn(ai, (DP_AffectedIndexKey){domain, affected_id, ALL_TILES, 0});
+        fn(ai, (DP_AffectedIndexKey){domain, affected_id, NO_TILE, NO_TILE});
+    }
+}
+
+void DP_affected_index_add(DP_AffectedIndex *ai, const DP_AffectedArea *aa)
+{
+    DP_ASSERT(ai);
+    DP_ASSERT(aa);
+    ++ai->count;
+    switch (aa->domain) {
+    case DP_AFFECTED_DOMAIN_USER_ATTRS:
+        break; // Never conflicts with anything but everything.
+    case DP_AFFECTED_DOMAIN_EVERYTHING:
+        ++ai->everything_count;
+        break;
+    default:
+        update(ai, aa, increment);
+        break;
+    }
+}
+
+void DP_affected_index_remove(DP_AffectedIndex *ai, const DP_AffectedArea *aa)
+{
+    DP_ASSERT(ai);
+    DP_ASSERT(aa);
+    DP_ASSERT(ai->count > 0);
+    --ai->count;
+    switch (aa->domain) {
+    case DP_AFFECTED_DOMAIN_USER_ATTRS:
+        break;
+    case DP_AFFECTED_DOMAIN_EVERYTHING:
+        DP_ASSERT(ai->everything_count > 0);
+        --ai->everything_count;
+        break;
+    default:
+        update(ai, aa, decrement);
+        break;
+    }
+}
+
+int DP_affected_index_count(DP_AffectedIndex *ai)
+{
+    DP_ASSERT(ai);
+    return ai->count;
+}
+
+
+static DP_AffectedIndexResult check_pixels(DP_AffectedIndex *ai,
+                                           const DP_AffectedArea *aa)
+{
+    int domain = (int)aa->domain;
+    int layer_id = aa->affected_id;
+    if (lookup(ai, (DP_AffectedIndexKey){domain, layer_id, ALL_TILES, 0})
+        == 0) {
+        return DP_AFFECTED_INDEX_CONCURRENT; // Nothing on this layer.
+    }
+
+    DP_AffectedIndexTiles tiles;
+    if (!get_tiles(aa->bounds, &tiles)
+        || lookup(ai, (DP_AffectedIndexKey){domain, layer_id, NO_TILE, NO_TILE})
+               != 0) {
+        return DP_AFFECTED_INDEX_UNSURE;
+    }
+
+    for (int y = tiles.y1; y <= tiles.y2; ++y) {
+        for (int x = tiles.x1; x <= tiles.x2; ++x) {
+            if (lookup(ai, (DP_AffectedIndexKey){domain, layer_id, x, y})
+                != 0) {
+                return DP_AFFECTED_INDEX_UNSURE;
+            }
+        }
+    }
+    return DP_AFFECTED_INDEX_CONCURRENT;
+}
+
+DP_AffectedIndexResult
+DP_affected_index_concurrent_with(DP_AffectedIndex *ai,
+                                  const DP_AffectedArea *aa)
+{
+    DP_ASSERT(ai);
+    DP_ASSERT(aa);
+    if (ai->count == 0) {
+        return DP_AFFECTED_INDEX_CONCURRENT;
+    }
+    else if (aa->domain == DP_AFFECTED_DOMAIN_EVERYTHING
+             || ai->everything_count != 0) {
+        return DP_AFFECTED_INDEX_CONFLICT;
+    }
+
+    switch (aa->domain) {
+    case DP_AFFECTED_DOMAIN_USER_ATTRS:
+        return DP_AFFECTED_INDEX_CONCURRENT;
+    case DP_AFFECTED_DOMAIN_PIXELS:
+        return check_pixels(ai, aa);
+    default:
+        return lookup(ai, (DP_AffectedIndexKey){(int)aa->domain,
+                                                aa->affected_id, NO_TILE,
+                                                NO_TILE})
+                    == 0
+                 ? DP_AFFECTED_INDEX_CONCURRENT
+                 : DP_AFFECTED_INDEX_CONFLICT;
+    }
+}
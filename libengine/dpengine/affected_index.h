@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef DPENGINE_AFFECTED_INDEX_H
+#define DPENGINE_AFFECTED_INDEX_H
+#include <dpcommon/common.h>
+
+typedef struct DP_AffectedArea DP_AffectedArea;
+
+
+// Keeps count of what a set of affected areas touches, so that checking
+// whether another area is concurrent with all of them doesn't require going
+// through every one. Pixels are tracked per layer at tile granularity, which
+// is coarser than the actual bounds, so overlapping tiles only mean that the
+// areas may conflict and have to be checked exactly.
+typedef struct DP_AffectedIndex DP_AffectedIndex;
+
+typedef enum DP_AffectedIndexResult {
+    DP_AFFECTED_INDEX_CONCURRENT,
+    DP_AFFECTED_INDEX_CONFLICT,
+    DP_AFFECTED_INDEX_UNSURE,
+} DP_AffectedIndexResult;
+
+
+DP_AffectedIndex *DP_affected_index_new(void);
+
+void DP_affected_index_free(DP_AffectedIndex *ai);
+
+void DP_affected_index_clear(DP_AffectedIndex *ai);
+
+void DP_affected_index_add(DP_AffectedIndex *ai, const DP_AffectedArea *aa);
+
+// The area must have been added before.
+void DP_affected_index_remove(DP_AffectedIndex *ai, const DP_AffectedArea *aa);
+
+int DP_affected_index_count(DP_AffectedIndex *ai);
+
+// Whether DP_affected_area_concurrent_with would be true for the given area
+// and every area in the index.
+DP_AffectedIndexResult
+DP_affected_index_concurrent_with(DP_AffectedIndex *ai,
+                                  const DP_AffectedArea *aa);
+
+
+#endif
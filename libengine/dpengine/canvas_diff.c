@@ -24,35 +24,91 @@
 #include "tile.h"
 #include <dpcommon/common.h>
 #include <dpcommon/conversions.h>
+#include <dpcommon/geom.h>
 
 
+// Tile changes are stored as one bit per tile, so that unchanged stretches
+// of the canvas can be skipped a whole word at a time. Bits beyond the tile
+// count in the last word are always kept clear.
+#define WORD_BITS 64
+
 struct DP_CanvasDiff {
     int count;
     int xtiles, ytiles;
-    int tile_changes_reserved;
-    bool *tile_changes;
+    // Previous tile counts and by how many tiles things moved since then.
+    int prev_xtiles, prev_ytiles;
+    int offset_x, offset_y;
+    int words_reserved;
+    uint64_t *tile_changes;
+    int rects_reserved;
+    DP_Rect *rects;
     bool layer_props_changed;
 };
 
 DP_CanvasDiff *DP_canvas_diff_new(void)
 {
     DP_CanvasDiff *diff = DP_malloc(sizeof(*diff));
-    *diff = (DP_CanvasDiff){0, 0, 0, 0, NULL, false};
+    *diff = (DP_CanvasDiff){0, 0, 0, 0, 0, 0, 0, 0, NULL, 0, NULL, false};
     return diff;
 }
 
 void DP_canvas_diff_free(DP_CanvasDiff *diff)
 {
     if (diff) {
+        DP_free(diff->rects);
         DP_free(diff->tile_changes);
         DP_free(diff);
     }
 }
 
 
+static int word_count(int count)
+{
+    return (count + WORD_BITS - 1) / WORD_BITS;
+}
+
+// Mask of the bits in the given word that correspond to actual tiles.
+static uint64_t word_mask(int count, int word_index)
+{
+    int bits = count - word_index * WORD_BITS;
+    return bits >= WORD_BITS ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1u;
+}
+
+static void fill_tile_changes(DP_CanvasDiff *diff, bool value)
+{
+    int count = diff->count;
+    int words = word_count(count);
+    uint64_t *tile_changes = diff->tile_changes;
+    for (int i = 0; i < words; ++i) {
+        tile_changes[i] = value ? word_mask(count, i) : 0u;
+    }
+}
+
+static void mark_exposed_tiles(DP_CanvasDiff *diff)
+{
+    int xtiles = diff->xtiles;
+    int ytiles = diff->ytiles;
+    int prev_xtiles = diff->prev_xtiles;
+    int prev_ytiles = diff->prev_ytiles;
+    int offset_x = diff->offset_x;
+    int offset_y = diff->offset_y;
+    uint64_t *tile_changes = diff->tile_changes;
+    for (int y = 0; y < ytiles; ++y) {
+        int prev_y = y - offset_y;
+        bool row_exposed = prev_y < 0 || prev_y >= prev_ytiles;
+        for (int x = 0; x < xtiles; ++x) {
+            int prev_x = x - offset_x;
+            if (row_exposed || prev_x < 0 || prev_x >= prev_xtiles) {
+                int i = y * xtiles + x;
+                tile_changes[i / WORD_BITS] |= (uint64_t)1 << (i % WORD_BITS);
+            }
+        }
+    }
+}
+
 void DP_canvas_diff_begin(DP_CanvasDiff *diff, int old_width, int old_height,
-                          int current_width, int current_height,
-                          bool layer_props_changed)
+                          int current_width, int current_height, int offset_x,
+                          int offset_y, bool layer_props_changed)
 {
     DP_ASSERT(diff);
     DP_ASSERT(old_width >= 0);
@@ -65,31 +121,75 @@ void DP_canvas_diff_begin(DP_CanvasDiff *diff, int old_width, int old_height,
     diff->count = count;
     diff->xtiles = xtiles;
     diff->ytiles = ytiles;
-    if (diff->tile_changes_reserved < count) {
-        diff->tile_changes_reserved = count;
-        size_t size = DP_int_to_size(count) * sizeof(*diff->tile_changes);
+    int words = word_count(count);
+    if (diff->words_reserved < words) {
+        diff->words_reserved = words;
+        size_t size = DP_int_to_size(words) * sizeof(*diff->tile_changes);
         diff->tile_changes = DP_realloc(diff->tile_changes, size);
     }
-    // TODO: Mark only newly added tiles as changed, not all of them.
-    bool init = old_width != current_width || old_height != current_height;
-    bool *tile_changes = diff->tile_changes;
-    for (int i = 0; i < count; ++i) {
-        tile_changes[i] = init;
+
+    bool resized = old_width != current_width || old_height != current_height
+                || offset_x != 0 || offset_y != 0;
+    // Tiles that moved by whole tile increments can be compared to their
+    // previous position and only newly exposed ones need to be marked. Any
+    // other kind of move shifts every pixel, so everything is changed.
+    bool aligned = offset_x % DP_TILE_SIZE == 0 && offset_y % DP_TILE_SIZE == 0;
+    if (resized && aligned) {
+        diff->prev_xtiles = DP_tile_size_round_up(old_width);
+        diff->prev_ytiles = DP_tile_size_round_up(old_height);
+        diff->offset_x = offset_x / DP_TILE_SIZE;
+        diff->offset_y = offset_y / DP_TILE_SIZE;
+        fill_tile_changes(diff, false);
+        mark_exposed_tiles(diff);
+    }
+    else {
+        diff->prev_xtiles = xtiles;
+        diff->prev_ytiles = ytiles;
+        diff->offset_x = 0;
+        diff->offset_y = 0;
+        fill_tile_changes(diff, resized);
     }
     diff->layer_props_changed = layer_props_changed;
 }
 
+int DP_canvas_diff_prev_index(DP_CanvasDiff *diff, int tile_index)
+{
+    DP_ASSERT(diff);
+    DP_ASSERT(tile_index >= 0);
+    DP_ASSERT(tile_index < diff->count);
+    int xtiles = diff->xtiles;
+    int prev_x = tile_index % xtiles - diff->offset_x;
+    int prev_y = tile_index / xtiles - diff->offset_y;
+    DP_ASSERT(prev_x >= 0 && prev_x < diff->prev_xtiles);
+    DP_ASSERT(prev_y >= 0 && prev_y < diff->prev_ytiles);
+    return prev_y * diff->prev_xtiles + prev_x;
+}
+
+void DP_canvas_diff_tile_offset(DP_CanvasDiff *diff, int *out_x, int *out_y)
+{
+    DP_ASSERT(diff);
+    DP_ASSERT(out_x);
+    DP_ASSERT(out_y);
+    *out_x = diff->offset_x;
+    *out_y = diff->offset_y;
+}
+
 void DP_canvas_diff_check(DP_CanvasDiff *diff, DP_CanvasDiffCheckFn fn,
                           void *data)
 {
     DP_ASSERT(diff);
     DP_ASSERT(fn);
     int count = diff->count;
-    bool *tile_changes = diff->tile_changes;
-    for (int i = 0; i < count; ++i) {
-        bool *tile_change = &tile_changes[i];
-        if (!*tile_change && fn(data, i)) {
-            *tile_change = true;
+    int words = word_count(count);
+    uint64_t *tile_changes = diff->tile_changes;
+    for (int i = 0; i < words; ++i) {
+        uint64_t unchanged = ~tile_changes[i] & word_mask(count, i);
+        while (unchanged != 0) {
+            int bit = DP_uint64_ctz(unchanged);
+            unchanged &= unchanged - 1u;
+            if (fn(data, i * WORD_BITS + bit)) {
+                tile_changes[i] |= (uint64_t)1 << bit;
+            }
         }
     }
 }
@@ -97,11 +197,7 @@ void DP_canvas_diff_check(DP_CanvasDiff *diff, DP_CanvasDiffCheckFn fn,
 void DP_canvas_diff_check_all(DP_CanvasDiff *diff)
 {
     DP_ASSERT(diff);
-    int count = diff->count;
-    bool *tile_changes = diff->tile_changes;
-    for (int i = 0; i < count; ++i) {
-        tile_changes[i] = true;
-    }
+    fill_tile_changes(diff, true);
 }
 
 void DP_canvas_diff_each_index(DP_CanvasDiff *diff, DP_CanvasDiffEachIndexFn fn,
@@ -109,40 +205,123 @@ void DP_canvas_diff_each_index(DP_CanvasDiff *diff, DP_CanvasDiffEachIndexFn fn,
 {
     DP_ASSERT(diff);
     DP_ASSERT(fn);
-    int count = diff->count;
-    bool *tile_changes = diff->tile_changes;
-    for (int i = 0; i < count; ++i) {
-        if (tile_changes[i]) {
-            fn(data, i);
+    int words = word_count(diff->count);
+    uint64_t *tile_changes = diff->tile_changes;
+    for (int i = 0; i < words; ++i) {
+        uint64_t changed = tile_changes[i];
+        while (changed != 0) {
+            int bit = DP_uint64_ctz(changed);
+            changed &= changed - 1u;
+            fn(data, i * WORD_BITS + bit);
         }
     }
 }
 
 
+static void each_pos(void *data, int tile_index)
+{
+    DP_CanvasDiff *diff = ((void **)data)[0];
+    DP_CanvasDiffEachPosFn fn = *(DP_CanvasDiffEachPosFn *)((void **)data)[1];
+    int xtiles = diff->xtiles;
+    fn(((void **)data)[2], tile_index % xtiles, tile_index / xtiles);
+}
+
 void DP_canvas_diff_each_pos(DP_CanvasDiff *diff, DP_CanvasDiffEachPosFn fn,
                              void *data)
 {
     DP_ASSERT(diff);
     DP_ASSERT(fn);
-    int xtiles = diff->xtiles;
-    int ytiles = diff->ytiles;
-    bool *tile_changes = diff->tile_changes;
-    for (int y = 0; y < ytiles; ++y) {
-        for (int x = 0; x < xtiles; ++x) {
-            if (tile_changes[y * xtiles + x]) {
-                fn(data, x, y);
+    DP_canvas_diff_each_index(diff, each_pos, (void *[]){diff, &fn, data});
+}
+
+
+typedef struct DP_CanvasDiffRectState {
+    DP_CanvasDiffEachRectFn fn;
+    void *data;
+    int active;
+    DP_Rect *rects;
+    // The run of changed tiles in a row currently being collected.
+    int run_y, run_x1, run_x2;
+} DP_CanvasDiffRectState;
+
+static void finish_run(DP_CanvasDiffRectState *rs)
+{
+    int y = rs->run_y;
+    int x1 = rs->run_x1;
+    int x2 = rs->run_x2;
+    DP_Rect *rects = rs->rects;
+    DP_Rect *match = NULL;
+    int i = 0;
+    while (i < rs->active) {
+        DP_Rect *rect = &rects[i];
+        if (rect->y2 < y - 1) {
+            // Can't grow any further, since a row was skipped.
+            rs->fn(rs->data, *rect);
+            *rect = rects[--rs->active];
+        }
+        else {
+            if (rect->y2 == y - 1 && rect->x1 == x1 && rect->x2 == x2) {
+                match = rect;
             }
+            ++i;
         }
     }
+
+    if (match) {
+        match->y2 = y;
+    }
+    else {
+        rects[rs->active++] = (DP_Rect){x1, y, x2, y};
+    }
+}
+
+static void add_to_run(void *data, int tile_x, int tile_y)
+{
+    DP_CanvasDiffRectState *rs = data;
+    if (tile_y == rs->run_y && tile_x == rs->run_x2 + 1) {
+        rs->run_x2 = tile_x;
+    }
+    else {
+        if (rs->run_y >= 0) {
+            finish_run(rs);
+        }
+        rs->run_y = tile_y;
+        rs->run_x1 = tile_x;
+        rs->run_x2 = tile_x;
+    }
+}
+
+void DP_canvas_diff_each_rect(DP_CanvasDiff *diff, DP_CanvasDiffEachRectFn fn,
+                              void *data)
+{
+    DP_ASSERT(diff);
+    DP_ASSERT(fn);
+    // Rectangles touching the current and previous row. Each row has at most
+    // one run per two tiles, plus one more for an odd tile count.
+    int max_active = diff->xtiles + 2;
+    if (diff->rects_reserved < max_active) {
+        diff->rects_reserved = max_active;
+        size_t size = DP_int_to_size(max_active) * sizeof(*diff->rects);
+        diff->rects = DP_realloc(diff->rects, size);
+    }
+
+    DP_CanvasDiffRectState rs = {fn, data, 0, diff->rects, -1, -1, -1};
+    DP_canvas_diff_each_pos(diff, add_to_run, &rs);
+    if (rs.run_y >= 0) {
+        finish_run(&rs);
+    }
+    for (int i = 0; i < rs.active; ++i) {
+        fn(data, rs.rects[i]);
+    }
 }
 
 bool DP_canvas_diff_tiles_changed(DP_CanvasDiff *diff)
 {
     DP_ASSERT(diff);
-    int count = diff->count;
-    bool *tile_changes = diff->tile_changes;
-    for (int i = 0; i < count; ++i) {
-        if (tile_changes[i]) {
+    int words = word_count(diff->count);
+    uint64_t *tile_changes = diff->tile_changes;
+    for (int i = 0; i < words; ++i) {
+        if (tile_changes[i] != 0) {
             return true;
         }
     }
@@ -22,20 +22,32 @@
 #ifndef DP_ENGINE_CANVAS_DIFF
 #define DP_ENGINE_CANVAS_DIFF
 #include <dpcommon/common.h>
+#include <dpcommon/geom.h>
 
 
 typedef struct DP_CanvasDiff DP_CanvasDiff;
 typedef bool (*DP_CanvasDiffCheckFn)(void *data, int tile_index);
 typedef void (*DP_CanvasDiffEachIndexFn)(void *data, int tile_index);
 typedef void (*DP_CanvasDiffEachPosFn)(void *data, int tile_x, int tile_y);
+typedef void (*DP_CanvasDiffEachRectFn)(void *data, DP_Rect tile_rect);
 
 DP_CanvasDiff *DP_canvas_diff_new(void);
 
 void DP_canvas_diff_free(DP_CanvasDiff *diff);
 
+// The offset is how far the previous canvas content moved, in pixels. If it's
+// a multiple of the tile size, only tiles that weren't there before get
+// marked, the rest are left to be checked against their previous position.
 void DP_canvas_diff_begin(DP_CanvasDiff *diff, int old_width, int old_height,
-                          int current_width, int current_height,
-                          bool layer_props_changed);
+                          int current_width, int current_height, int offset_x,
+                          int offset_y, bool layer_props_changed);
+
+// Index that the given tile had in the previous canvas. Only valid for tiles
+// that weren't marked as changed by DP_canvas_diff_begin.
+int DP_canvas_diff_prev_index(DP_CanvasDiff *diff, int tile_index);
+
+// How many tiles the previous canvas content moved.
+void DP_canvas_diff_tile_offset(DP_CanvasDiff *diff, int *out_x, int *out_y);
 
 void DP_canvas_diff_check(DP_CanvasDiff *diff, DP_CanvasDiffCheckFn fn,
                           void *data);
@@ -48,6 +60,13 @@ void DP_canvas_diff_each_index(DP_CanvasDiff *diff, DP_CanvasDiffEachIndexFn fn,
 void DP_canvas_diff_each_pos(DP_CanvasDiff *diff, DP_CanvasDiffEachPosFn fn,
                              void *data);
 
+// Merges changed tiles into rectangles, in tile coordinates, and calls the
+// function for each of them. The rectangles don't overlap and cover exactly
+// the changed tiles. Runs of tiles in a row get merged with identical runs in
+// the rows below, which is not always optimal, but close enough for batching.
+void DP_canvas_diff_each_rect(DP_CanvasDiff *diff, DP_CanvasDiffEachRectFn fn,
+                              void *data);
+
 bool DP_canvas_diff_tiles_changed(DP_CanvasDiff *diff);
 
 bool DP_canvas_diff_layer_props_changed_reset(DP_CanvasDiff *diff);
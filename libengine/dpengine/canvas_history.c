@@ -21,17 +21,23 @@
  */
 #include "canvas_history.h"
 #include "affected_area.h"
+#include "affected_index.h"
 #include "canvas_state.h"
 #include "dpmsg/messages/undo.h"
+#include "layer_content_list.h"
+#include "tile.h"
 #include <dpcommon/atomic.h>
 #include <dpcommon/conversions.h>
+#include <dpcommon/geom.h>
 #include <dpcommon/queue.h>
 #include <dpcommon/threading.h>
 #include <dpmsg/message.h>
+#include <dpmsg/messages/draw_dabs.h>
 #include <dpmsg/messages/internal.h>
 #include <dpmsg/messages/undo_point.h>
 
 
+// Capacities must be powers of two, entries are indexed by masking.
 #define INITIAL_CAPACITY              1024
 #define EXPAND_CAPACITY(OLD_CAPACITY) ((OLD_CAPACITY)*2)
 
@@ -51,10 +57,24 @@ typedef enum DP_Undo {
     DP_UNDO_GONE,
 } DP_Undo;
 
+typedef enum DP_Cold {
+    DP_COLD_NONE,
+    DP_COLD_PARTIAL, // Some tiles were still shared, try again later.
+    DP_COLD_FULL,
+} DP_Cold;
+
 typedef struct DP_CanvasHistoryEntry {
     DP_Undo undo;
     DP_Message *msg;
     DP_CanvasState *state;
+    DP_Cold cold;
+    int replay_cost;
+    // Tile memory that a savepoint pins compared to the next newer one, only
+    // tracked when there's a memory limit. Always zero for the newest one.
+    size_t pinned_bytes;
+    // For savepoints, the replay cost of what's done between the previous
+    // savepoint and this one.
+    long long gap_replay_cost;
 } DP_CanvasHistoryEntry;
 
 typedef struct DP_ForkEntry {
@@ -64,24 +84,48 @@ typedef struct DP_ForkEntry {
 
 struct DP_CanvasHistory {
     DP_Mutex *mutex;
+    // What DP_canvas_history_compare_and_get hands out, guarded by the mutex.
+    // Lags behind the current state while a batch is running.
+    DP_CanvasState *published_state;
     DP_CanvasState *current_state;
+    bool batching;
     int offset;
     int capacity;
     int used;
+    // Ring buffer, so that truncating the history doesn't move anything.
+    // Entry 0 is at the head, use entry_at to get at them.
+    int head;
     DP_CanvasHistoryEntry *entries;
     struct {
         int start;
         int fallbehind;
         DP_Queue queue;
+        DP_AffectedIndex *index;
     } fork;
     struct {
         DP_CanvasHistorySavePointFn fn;
         void *user;
+        int cold_age;
+        // Savepoints before this index have already been compressed.
+        int cold_index;
+        // Sum of the pinned bytes of all savepoints.
+        size_t pinned_bytes;
+        // Replay cost of what's done since the newest savepoint.
+        long long replay_cost;
+        DP_CanvasHistorySavepointPolicy policy;
     } save_point;
     DP_Atomic local_pen_down;
 };
 
 
+static DP_CanvasHistoryEntry *entry_at(DP_CanvasHistory *ch, int index)
+{
+    DP_ASSERT(index >= 0);
+    DP_ASSERT(index < ch->capacity);
+    return &ch->entries[(ch->head + index) & (ch->capacity - 1)];
+}
+
+
 static void set_fork_start(DP_CanvasHistory *ch)
 {
     DP_ASSERT(ch->used > 0);
@@ -100,6 +144,7 @@ static void clear_fork_entries(DP_CanvasHistory *ch)
     DP_ASSERT(ch);
     DP_debug("Clearing %zu fork entries", ch->fork.queue.used);
     DP_queue_clear(&ch->fork.queue, sizeof(DP_ForkEntry), dispose_fork_entry);
+    DP_affected_index_clear(ch->fork.index);
 }
 
 static void push_fork_entry_inc(DP_CanvasHistory *ch, DP_Message *msg)
@@ -109,6 +154,7 @@ static void push_fork_entry_inc(DP_CanvasHistory *ch, DP_Message *msg)
     DP_ForkEntry *fe = DP_queue_push(&ch->fork.queue, sizeof(DP_ForkEntry));
     *fe = (DP_ForkEntry){DP_message_incref(msg),
                          DP_affected_area_make(msg, ch->current_state)};
+    DP_affected_index_add(ch->fork.index, &fe->aa);
 }
 
 static DP_Message *peek_fork_entry_message(DP_CanvasHistory *ch)
@@ -122,6 +168,8 @@ static DP_Message *peek_fork_entry_message(DP_CanvasHistory *ch)
 
 static void shift_fork_entry_nodec(DP_CanvasHistory *ch)
 {
+    DP_ForkEntry *fe = DP_queue_peek(&ch->fork.queue, sizeof(DP_ForkEntry));
+    DP_affected_index_remove(ch->fork.index, &fe->aa);
     DP_queue_shift(&ch->fork.queue);
 }
 
@@ -137,8 +185,16 @@ static bool fork_entries_concurrent_with(DP_CanvasHistory *ch, DP_Message *msg)
     DP_ASSERT(ch);
     DP_ASSERT(msg);
     DP_AffectedArea aa = DP_affected_area_make(msg, ch->current_state);
-    return DP_queue_all(&ch->fork.queue, sizeof(DP_ForkEntry),
-                        fork_entry_concurrent_with, &aa);
+    switch (DP_affected_index_concurrent_with(ch->fork.index, &aa)) {
+    case DP_AFFECTED_INDEX_CONCURRENT:
+        return true;
+    case DP_AFFECTED_INDEX_CONFLICT:
+        return false;
+    default:
+        // Only overlapping tiles, the actual bounds may still be disjoint.
+        return DP_queue_all(&ch->fork.queue, sizeof(DP_ForkEntry),
+                            fork_entry_concurrent_with, &aa);
+    }
 }
 
 
@@ -153,8 +209,9 @@ static void call_save_point_fn(DP_CanvasHistory *ch, int history_index,
 
 static void set_initial_entry(DP_CanvasHistory *ch, DP_CanvasState *cs)
 {
-    ch->entries[0] = (DP_CanvasHistoryEntry){
-        DP_UNDO_DONE, DP_msg_undo_point_new(0), DP_canvas_state_incref(cs)};
+    *entry_at(ch, 0) = (DP_CanvasHistoryEntry){
+        DP_UNDO_DONE, DP_msg_undo_point_new(0), DP_canvas_state_incref(cs),
+        DP_COLD_NONE, 0, 0, 0};
     call_save_point_fn(ch, 0, cs);
 }
 
@@ -168,11 +225,10 @@ static void validate_history(DP_CanvasHistory *ch)
 #ifdef NDEBUG
     (void)ch; // Validation only happens in debug mode.
 #else
-    DP_CanvasHistoryEntry *entries = ch->entries;
     int used = ch->used;
     bool have_savepoint = false;
     for (int i = 0; i < used; ++i) {
-        DP_CanvasHistoryEntry *entry = &entries[i];
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
         DP_Message *msg = entry->msg;
         DP_ASSERT(msg); // Message must not be null.
         DP_MessageType type = DP_message_type(msg);
@@ -187,6 +243,9 @@ static void validate_history(DP_CanvasHistory *ch)
     }
     // There must exist at least one savepoint.
     DP_ASSERT(have_savepoint);
+    // The fork index must track exactly what's in the fork.
+    DP_ASSERT(DP_affected_index_count(ch->fork.index)
+              == DP_size_to_int(ch->fork.queue.used));
     // If the local fork contains entries, it must also be consistent.
     if (ch->fork.queue.used != 0) {
         // Fork start can't be beyond the truncation point.
@@ -210,13 +269,17 @@ DP_canvas_history_new(DP_CanvasHistorySavePointFn save_point_fn,
     size_t entries_size = sizeof(*ch->entries) * INITIAL_CAPACITY;
 
     *ch = (DP_CanvasHistory){mutex,
+                             DP_canvas_state_incref(cs),
                              cs,
+                             false,
                              0,
                              INITIAL_CAPACITY,
                              1,
+                             0,
                              DP_malloc(entries_size),
-                             {0, 0, DP_QUEUE_NULL},
-                             {save_point_fn, save_point_user},
+                             {0, 0, DP_QUEUE_NULL, DP_affected_index_new()},
+                             {save_point_fn, save_point_user, 0, 0, 0, 0,
+                              DP_CANVAS_HISTORY_SAVEPOINT_POLICY_DEFAULT},
                              DP_ATOMIC_INIT(0)};
 
     DP_queue_init(&ch->fork.queue, INITIAL_CAPACITY, sizeof(DP_ForkEntry));
@@ -239,14 +302,16 @@ static void truncate_history(DP_CanvasHistory *ch, int until)
              ch->fork.queue.used == 0 ? -1 : ch->fork.start);
     DP_ASSERT(until <= ch->used);
     DP_ASSERT(ch->fork.queue.used == 0 || ch->fork.start >= ch->offset + until);
-    DP_CanvasHistoryEntry *entries = ch->entries;
     for (int i = 0; i < until; ++i) {
-        dispose_entry(&entries[i]);
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
+        ch->save_point.pinned_bytes -= entry->pinned_bytes;
+        dispose_entry(entry);
     }
     ch->used -= until;
     ch->offset += until;
-    size_t size = sizeof(*entries) * DP_int_to_size(ch->used);
-    memmove(entries, entries + until, size);
+    ch->head = (ch->head + until) & (ch->capacity - 1);
+    ch->save_point.cold_index =
+        DP_max_int(0, ch->save_point.cold_index - until);
 }
 
 void DP_canvas_history_free(DP_CanvasHistory *ch)
@@ -254,9 +319,11 @@ void DP_canvas_history_free(DP_CanvasHistory *ch)
     if (ch) {
         clear_fork_entries(ch);
         DP_queue_dispose(&ch->fork.queue);
+        DP_affected_index_free(ch->fork.index);
         truncate_history(ch, ch->used);
         DP_free(ch->entries);
         DP_canvas_state_decref(ch->current_state);
+        DP_canvas_state_decref(ch->published_state);
         DP_mutex_free(ch->mutex);
         DP_free(ch);
     }
@@ -275,28 +342,92 @@ void DP_canvas_history_local_pen_down_set(DP_CanvasHistory *ch,
     DP_atomic_set(&ch->local_pen_down, local_pen_down);
 }
 
+void DP_canvas_history_cold_savepoint_age_set(DP_CanvasHistory *ch,
+                                              int cold_age)
+{
+    DP_ASSERT(ch);
+    DP_ASSERT(cold_age >= 0);
+    ch->save_point.cold_age = cold_age;
+}
+
+DP_CanvasHistorySizeStats DP_canvas_history_size_stats(DP_CanvasHistory *ch)
+{
+    DP_ASSERT(ch);
+    return (DP_CanvasHistorySizeStats){
+        ch->used, ch->offset, ch->capacity,
+        DP_size_to_int(ch->fork.queue.used),
+        sizeof(*ch->entries) * DP_int_to_size(ch->capacity)};
+}
+
 DP_CanvasState *DP_canvas_history_compare_and_get(DP_CanvasHistory *ch,
                                                   DP_CanvasState *prev)
 {
     DP_ASSERT(ch);
     DP_Mutex *mutex = ch->mutex;
     DP_MUTEX_MUST_LOCK(mutex);
-    DP_CanvasState *next = ch->current_state;
+    DP_CanvasState *next = ch->published_state;
     DP_CanvasState *cs = next == prev ? NULL : DP_canvas_state_incref(next);
     DP_MUTEX_MUST_UNLOCK(mutex);
     return cs;
 }
 
+// A run of draw dabs leaves the current state transient, it must be persisted
+// before anything else gets a reference to it. Persisting happens in place.
+static DP_CanvasState *persist_state(DP_CanvasState *cs)
+{
+    if (DP_canvas_state_transient(cs)) {
+        return DP_transient_canvas_state_persist((DP_TransientCanvasState *)cs);
+    }
+    else {
+        return cs;
+    }
+}
+
+static void publish_current_state(DP_CanvasHistory *ch)
+{
+    DP_CanvasState *prev = ch->published_state;
+    DP_CanvasState *next = persist_state(ch->current_state);
+    if (prev != next) {
+        DP_canvas_state_incref(next);
+        DP_Mutex *mutex = ch->mutex;
+        DP_MUTEX_MUST_LOCK(mutex);
+        ch->published_state = next;
+        DP_MUTEX_MUST_UNLOCK(mutex);
+        DP_canvas_state_decref(prev);
+    }
+}
+
 static void set_current_state_noinc(DP_CanvasHistory *ch, DP_CanvasState *next)
 {
     DP_CanvasState *current = ch->current_state;
-    DP_Mutex *mutex = ch->mutex;
-    DP_MUTEX_MUST_LOCK(mutex);
     ch->current_state = next;
-    DP_MUTEX_MUST_UNLOCK(mutex);
+    if (!ch->batching) {
+        publish_current_state(ch);
+    }
     DP_canvas_state_decref(current);
 }
 
+void DP_canvas_history_batch_begin(DP_CanvasHistory *ch)
+{
+    DP_ASSERT(ch);
+    DP_ASSERT(!ch->batching);
+    ch->batching = true;
+}
+
+void DP_canvas_history_batch_end(DP_CanvasHistory *ch)
+{
+    DP_ASSERT(ch);
+    DP_ASSERT(ch->batching);
+    ch->batching = false;
+    publish_current_state(ch);
+}
+
+bool DP_canvas_history_batching(DP_CanvasHistory *ch)
+{
+    DP_ASSERT(ch);
+    return ch->batching;
+}
+
 
 static void reset_to_state_noinc(DP_CanvasHistory *ch, DP_CanvasState *cs)
 {
@@ -306,6 +437,7 @@ static void reset_to_state_noinc(DP_CanvasHistory *ch, DP_CanvasState *cs)
     set_initial_entry(ch, cs);
     ch->used = 1;
     ch->offset = 0;
+    ch->save_point.replay_cost = 0;
     validate_history(ch);
 }
 
@@ -326,7 +458,8 @@ void DP_canvas_history_soft_reset(DP_CanvasHistory *ch)
     // built-in, non-dedicated Drawpile server. It sends a hard reset only to
     // the newly joined client, all the other clients get a soft reset so that
     // they can't undo beyond the point that the new client joined at.
-    reset_to_state_noinc(ch, DP_canvas_state_incref(ch->current_state));
+    reset_to_state_noinc(
+        ch, DP_canvas_state_incref(persist_state(ch->current_state)));
 }
 
 static bool handle_internal(DP_CanvasHistory *ch, DP_MsgInternal *mi)
@@ -352,9 +485,74 @@ static void ensure_append_capacity(DP_CanvasHistory *ch)
     if (ch->used == old_capacity) {
         int new_capacity = EXPAND_CAPACITY(old_capacity);
         size_t new_size = sizeof(*ch->entries) * DP_int_to_size(new_capacity);
-        DP_debug("Resizing history capacity to %d entries", ch->capacity);
-        ch->entries = DP_realloc(ch->entries, new_size);
+        DP_debug("Resizing history capacity to %d entries", new_capacity);
+        // Unwrap the ring buffer while copying, so it starts at the front.
+        DP_CanvasHistoryEntry *old_entries = ch->entries;
+        DP_CanvasHistoryEntry *new_entries = DP_malloc(new_size);
+        int head = ch->head;
+        size_t front_count = DP_int_to_size(old_capacity - head);
+        memcpy(new_entries, old_entries + head,
+               sizeof(*new_entries) * front_count);
+        memcpy(new_entries + front_count, old_entries,
+               sizeof(*new_entries) * DP_int_to_size(head));
+        DP_free(old_entries);
+        ch->entries = new_entries;
         ch->capacity = new_capacity;
+        ch->head = 0;
+    }
+}
+
+static int count_touched_tiles(DP_CanvasState *cs, DP_Rect bounds)
+{
+    int x1 = DP_max_int(bounds.x1, 0);
+    int y1 = DP_max_int(bounds.y1, 0);
+    int x2 = DP_min_int(bounds.x2, DP_canvas_state_width(cs) - 1);
+    int y2 = DP_min_int(bounds.y2, DP_canvas_state_height(cs) - 1);
+    if (x1 <= x2 && y1 <= y2) {
+        return (x2 / DP_TILE_SIZE - x1 / DP_TILE_SIZE + 1)
+             * (y2 / DP_TILE_SIZE - y1 / DP_TILE_SIZE + 1);
+    }
+    else {
+        return 1;
+    }
+}
+
+static int estimate_replay_cost(DP_CanvasState *cs, DP_Message *msg)
+{
+    // Replaying a command costs about as much as the number of tiles it
+    // touches. Commands that don't touch any pixels still cost a little.
+    DP_MessageType type = DP_message_type(msg);
+    switch (type) {
+    case DP_MSG_UNDO_POINT:
+        return 0;
+    case DP_MSG_PEN_UP:
+        return 1; // The dabs before it already counted the tiles.
+    case DP_MSG_DRAW_DABS_CLASSIC:
+    case DP_MSG_DRAW_DABS_PIXEL:
+    case DP_MSG_DRAW_DABS_PIXEL_SQUARE: {
+        // Indirect dabs don't count as affecting any pixels, but they still
+        // have to be drawn when replaying, so get their bounds directly.
+        int x, y, width, height;
+        DP_msg_draw_dabs_bounds(DP_msg_draw_dabs_cast(msg), &x, &y, &width,
+                                &height);
+        return count_touched_tiles(cs, DP_rect_make(x, y, width, height));
+    }
+    default: {
+        DP_AffectedArea aa = DP_affected_area_make(msg, cs);
+        if (aa.domain == DP_AFFECTED_DOMAIN_PIXELS) {
+            return count_touched_tiles(cs, aa.bounds);
+        }
+        else if (aa.domain == DP_AFFECTED_DOMAIN_EVERYTHING) {
+            int layer_count = DP_layer_content_list_count(
+                DP_canvas_state_layer_contents_noinc(cs));
+            int tile_count = DP_tile_total_round(DP_canvas_state_width(cs),
+                                                 DP_canvas_state_height(cs));
+            return DP_max_int(1, layer_count) * DP_max_int(1, tile_count);
+        }
+        else {
+            return 1;
+        }
+    }
     }
 }
 
@@ -363,35 +561,355 @@ static int append_to_history(DP_CanvasHistory *ch, DP_Message *msg)
     DP_ASSERT(DP_message_type(msg) != DP_MSG_UNDO);
     ensure_append_capacity(ch);
     int index = ch->used;
-    ch->entries[index] =
-        (DP_CanvasHistoryEntry){DP_UNDO_DONE, DP_message_incref(msg), NULL};
+    // Estimating isn't free, so only bother when there's a limit to check.
+    int replay_cost = ch->save_point.policy.max_replay_cost > 0
+                        ? estimate_replay_cost(ch->current_state, msg)
+                        : 0;
+    *entry_at(ch, index) = (DP_CanvasHistoryEntry){
+        DP_UNDO_DONE, DP_message_incref(msg), NULL, DP_COLD_NONE, replay_cost,
+        0, 0};
     ch->used = index + 1;
+    ch->save_point.replay_cost += replay_cost;
     return index;
 }
 
 
+static int search_savepoint_index(DP_CanvasHistory *ch, int target_index)
+{
+    for (int i = target_index; i >= 0; --i) {
+        if (entry_at(ch, i)->state) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int next_savepoint_index(DP_CanvasHistory *ch, int index)
+{
+    int used = ch->used;
+    for (int i = index + 1; i < used; ++i) {
+        if (entry_at(ch, i)->state) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool replay_cost_reached(DP_CanvasHistory *ch, long long cost)
+{
+    int max_replay_cost = ch->save_point.policy.max_replay_cost;
+    return max_replay_cost > 0 && cost >= max_replay_cost;
+}
+
+// Whether replaying up to the newer savepoint would cost too much if the one
+// at the given index was dropped.
+static bool drop_reaches_replay_cost(DP_CanvasHistory *ch, int index,
+                                     int newer_index)
+{
+    long long cost = entry_at(ch, index)->gap_replay_cost
+                   + entry_at(ch, newer_index)->gap_replay_cost;
+    return replay_cost_reached(ch, cost);
+}
+
+static bool savepoint_wanted(DP_CanvasHistory *ch, int index)
+{
+    DP_CanvasHistorySavepointPolicy *policy = &ch->save_point.policy;
+    if (policy->min_spacing > 1 || policy->max_replay_cost > 0) {
+        int prev_index = search_savepoint_index(ch, index - 1);
+        return prev_index < 0 || index - prev_index >= policy->min_spacing
+            || replay_cost_reached(ch, ch->save_point.replay_cost);
+    }
+    else {
+        return true;
+    }
+}
+
+static bool pinned_bytes_tracked(DP_CanvasHistory *ch)
+{
+    return ch->save_point.policy.max_bytes != 0;
+}
+
+static size_t unique_tile_bytes(DP_CanvasHistory *ch, int index,
+                                int newer_index)
+{
+    DP_CanvasState *newer = newer_index < 0 ? ch->current_state
+                                            : entry_at(ch, newer_index)->state;
+    return DP_canvas_state_unique_tile_bytes(entry_at(ch, index)->state, newer);
+}
+
+// Only has to be called when the next newer savepoint changes. The newest
+// savepoint gets compared to the current state when needed instead, since
+// that one keeps changing.
+static void set_pinned_bytes(DP_CanvasHistory *ch, int index, int newer_index)
+{
+    DP_CanvasHistoryEntry *entry = entry_at(ch, index);
+    size_t bytes =
+        newer_index < 0 ? 0 : unique_tile_bytes(ch, index, newer_index);
+    ch->save_point.pinned_bytes =
+        ch->save_point.pinned_bytes - entry->pinned_bytes + bytes;
+    entry->pinned_bytes = bytes;
+}
+
+static void forget_pinned_bytes_from(DP_CanvasHistory *ch, int start_index)
+{
+    int used = ch->used;
+    for (int i = start_index; i < used; ++i) {
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
+        ch->save_point.pinned_bytes -= entry->pinned_bytes;
+        entry->pinned_bytes = 0;
+    }
+}
+
+static void measure_pinned_bytes_from(DP_CanvasHistory *ch, int start_index)
+{
+    if (pinned_bytes_tracked(ch)) {
+        int next;
+        for (int i = next_savepoint_index(ch, start_index - 1); i >= 0;
+             i = next) {
+            next = next_savepoint_index(ch, i);
+            set_pinned_bytes(ch, i, next);
+        }
+    }
+}
+
 static void make_savepoint(DP_CanvasHistory *ch, int index)
 {
     DP_ASSERT(index >= 0);
     DP_ASSERT(index < ch->used);
     // Don't make savepoints while a local fork is present, since the local
     // state may be incongruent with what the server thinks is happening.
-    if (ch->fork.queue.used == 0) {
-        DP_CanvasState *cs = ch->current_state;
-        ch->entries[index].state = DP_canvas_state_incref(cs);
+    if (ch->fork.queue.used == 0 && savepoint_wanted(ch, index)) {
+        DP_CanvasState *cs = persist_state(ch->current_state);
+        DP_CanvasHistoryEntry *entry = entry_at(ch, index);
+        entry->state = DP_canvas_state_incref(cs);
+        entry->gap_replay_cost = ch->save_point.replay_cost;
+        ch->save_point.replay_cost = 0;
+        if (pinned_bytes_tracked(ch)) {
+            set_pinned_bytes(ch, search_savepoint_index(ch, index - 1), index);
+        }
         call_save_point_fn(ch, ch->offset + index, cs);
     }
 }
 
+static void clear_savepoint(DP_CanvasHistoryEntry *entry)
+{
+    DP_canvas_state_decref(entry->state);
+    entry->state = NULL;
+    entry->cold = DP_COLD_NONE;
+    entry->gap_replay_cost = 0;
+}
+
+static void drop_savepoint(DP_CanvasHistory *ch, int older_index, int index,
+                           int newer_index)
+{
+    DP_ASSERT(older_index >= 0);
+    DP_ASSERT(older_index < index);
+    DP_ASSERT(newer_index < 0 || newer_index > index);
+    DP_CanvasHistoryEntry *entry = entry_at(ch, index);
+    ch->save_point.pinned_bytes -= entry->pinned_bytes;
+    entry->pinned_bytes = 0;
+    // Replays that went through this savepoint now start further back.
+    if (newer_index < 0) {
+        ch->save_point.replay_cost += entry->gap_replay_cost;
+    }
+    else {
+        entry_at(ch, newer_index)->gap_replay_cost += entry->gap_replay_cost;
+    }
+    clear_savepoint(entry);
+    // The older savepoint may have been sharing tiles with this one, which
+    // it now pins on its own and may get further with compressing.
+    if (pinned_bytes_tracked(ch)) {
+        set_pinned_bytes(ch, older_index, newer_index);
+    }
+    if (older_index < ch->save_point.cold_index) {
+        ch->save_point.cold_index = older_index;
+    }
+}
+
+static void thin_savepoints(DP_CanvasHistory *ch, int base_index)
+{
+    // Walk from newest to oldest, dropping savepoints that are too close to
+    // the next newer one that's being kept. The newest one always stays, as
+    // do those that would leave too long a replay if they were gone.
+    int min_spacing = ch->save_point.policy.min_spacing;
+    int divisor = ch->save_point.policy.thinning_divisor;
+    if (min_spacing > 1 || divisor > 0) {
+        int last = ch->used - 1;
+        int newer = search_savepoint_index(ch, last);
+        int i = search_savepoint_index(ch, newer - 1);
+        while (i > base_index) {
+            int older = search_savepoint_index(ch, i - 1);
+            int spacing = divisor > 0
+                            ? DP_max_int(min_spacing, (last - i) / divisor)
+                            : min_spacing;
+            if (newer - i < spacing
+                && !drop_reaches_replay_cost(ch, i, newer)) {
+                drop_savepoint(ch, older, i, newer);
+            }
+            else {
+                newer = i;
+            }
+            i = older;
+        }
+    }
+}
+
+static size_t sum_pinned_bytes(DP_CanvasHistory *ch, int base_index)
+{
+    size_t total = 0;
+    int next;
+    for (int i = base_index; i >= 0; i = next) {
+        next = next_savepoint_index(ch, i);
+        total += unique_tile_bytes(ch, i, next);
+    }
+    return total;
+}
+
+static void drop_oldest_savepoints(DP_CanvasHistory *ch, int base_index,
+                                   size_t newest_bytes, size_t max_bytes,
+                                   bool keep_replay_cost)
+{
+    int older = base_index;
+    int victim = next_savepoint_index(ch, base_index);
+    while (ch->save_point.pinned_bytes + newest_bytes > max_bytes
+           && victim >= 0) {
+        int newer = next_savepoint_index(ch, victim);
+        if (newer < 0) {
+            break; // Only the base and the newest savepoint are left.
+        }
+        else if (keep_replay_cost
+                 && drop_reaches_replay_cost(ch, victim, newer)) {
+            older = victim;
+        }
+        else {
+            drop_savepoint(ch, older, victim, newer);
+        }
+        victim = newer;
+    }
+}
+
+static void limit_savepoint_memory(DP_CanvasHistory *ch, int base_index)
+{
+    size_t max_bytes = ch->save_point.policy.max_bytes;
+    if (max_bytes != 0) {
+        // Prefer dropping savepoints that don't push replays beyond their
+        // limit, but if that's not enough, memory is more important.
+        int newest_index = search_savepoint_index(ch, ch->used - 1);
+        size_t newest_bytes = unique_tile_bytes(ch, newest_index, -1);
+        drop_oldest_savepoints(ch, base_index, newest_bytes, max_bytes, true);
+        drop_oldest_savepoints(ch, base_index, newest_bytes, max_bytes, false);
+    }
+}
+
+static void prune_savepoints(DP_CanvasHistory *ch)
+{
+    int base_index = next_savepoint_index(ch, -1);
+    DP_ASSERT(base_index >= 0);
+    thin_savepoints(ch, base_index);
+    limit_savepoint_memory(ch, base_index);
+}
+
+void DP_canvas_history_savepoint_policy_set(
+    DP_CanvasHistory *ch, DP_CanvasHistorySavepointPolicy policy)
+{
+    DP_ASSERT(ch);
+    DP_ASSERT(policy.min_spacing >= 1);
+    DP_ASSERT(policy.thinning_divisor >= 0);
+    bool was_tracked = pinned_bytes_tracked(ch);
+    ch->save_point.policy = policy;
+    if (pinned_bytes_tracked(ch) != was_tracked) {
+        forget_pinned_bytes_from(ch, 0);
+        measure_pinned_bytes_from(ch, 0);
+    }
+}
+
+DP_CanvasHistorySavepointStats
+DP_canvas_history_savepoint_stats(DP_CanvasHistory *ch)
+{
+    DP_ASSERT(ch);
+    DP_CanvasHistorySavepointStats stats = {0, 0, 0};
+    int base_index = next_savepoint_index(ch, -1);
+    int newest_index = base_index;
+    int used = ch->used;
+    long long cost = 0;
+    for (int i = base_index; i < used; ++i) {
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
+        if (entry->state) {
+            ++stats.count;
+            newest_index = i;
+            cost = 0;
+        }
+        else {
+            if (is_undo_point_entry(entry) && cost > stats.worst_replay_cost) {
+                stats.worst_replay_cost = cost;
+            }
+            if (entry->undo == DP_UNDO_DONE) {
+                cost += entry->replay_cost;
+            }
+        }
+    }
+    stats.pinned_bytes =
+        pinned_bytes_tracked(ch)
+            ? ch->save_point.pinned_bytes
+                  + unique_tile_bytes(ch, newest_index, -1)
+            : sum_pinned_bytes(ch, base_index);
+    return stats;
+}
+
+static bool compress_savepoint(DP_CanvasHistoryEntry *entry)
+{
+    if (entry->cold != DP_COLD_FULL
+        && DP_canvas_state_refcount(entry->state) == 1) {
+        entry->cold = DP_canvas_state_compress_cold_tiles(entry->state)
+                        ? DP_COLD_FULL
+                        : DP_COLD_PARTIAL;
+        return true;
+    }
+    else {
+        return false;
+    }
+}
+
+static void compress_cold_savepoints(DP_CanvasHistory *ch, int index)
+{
+    // Savepoints beyond the configured age get their tiles compressed. Only
+    // tiles that aren't reachable from anywhere else are affected, so tiles
+    // also in use by the current state or newer savepoints stay as they are.
+    // Each savepoint is visited once when it gets old enough, dropping its
+    // newer neighbor or replaying from it moves the high-water mark back.
+    int cold_age = ch->save_point.cold_age;
+    if (cold_age > 0) {
+        int cold_index = ch->save_point.cold_index;
+        int due_index = -1;
+        int age = 0;
+        for (int i = index; i >= cold_index; --i) {
+            if (entry_at(ch, i)->state && age++ >= cold_age) {
+                due_index = i;
+                break;
+            }
+        }
+        if (due_index >= 0) {
+            for (int i = cold_index; i <= due_index; ++i) {
+                DP_CanvasHistoryEntry *entry = entry_at(ch, i);
+                if (entry->state && compress_savepoint(entry)
+                    && pinned_bytes_tracked(ch)) {
+                    // Compressed tiles take up less memory.
+                    set_pinned_bytes(ch, i, next_savepoint_index(ch, i));
+                }
+            }
+            ch->save_point.cold_index = due_index + 1;
+        }
+    }
+}
+
 static int mark_undone_actions_gone(DP_CanvasHistory *ch, int index,
                                     int *out_depth)
 {
-    unsigned int context_id = DP_message_context_id(ch->entries[index].msg);
-    DP_CanvasHistoryEntry *entries = ch->entries;
+    unsigned int context_id = DP_message_context_id(entry_at(ch, index)->msg);
     int i = index - 1;
     int depth = 1;
     for (; i >= 0 && depth < UNDO_DEPTH_LIMIT; --i) {
-        DP_CanvasHistoryEntry *entry = &entries[i];
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
         if (is_undo_point_entry(entry)) {
             ++depth;
         }
@@ -412,23 +930,161 @@ static int mark_undone_actions_gone(DP_CanvasHistory *ch, int index,
 
 static int find_first_unreachable_index(DP_CanvasHistory *ch, int i, int depth)
 {
-    DP_CanvasHistoryEntry *entries = ch->entries;
     for (; i >= 0 && depth < UNDO_DEPTH_LIMIT; --i) {
-        if (is_undo_point_entry(&entries[i])) {
+        if (is_undo_point_entry(entry_at(ch, i))) {
             ++depth;
         }
     }
     return i;
 }
 
-static void handle_undo_point(DP_CanvasHistory *ch, int index)
+static bool is_draw_dabs(DP_Message *msg)
+{
+    switch (DP_message_type(msg)) {
+    case DP_MSG_DRAW_DABS_CLASSIC:
+    case DP_MSG_DRAW_DABS_PIXEL:
+    case DP_MSG_DRAW_DABS_PIXEL_SQUARE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Returns a new reference to the resulting state or NULL on error. Draw dabs
+// are drawn onto a transient state, which is reused in place for the ones
+// following it. Persisting it is put off until something needs the state.
+static DP_CanvasState *apply_drawing_command(DP_CanvasState *cs,
+                                             DP_DrawContext *dc,
+                                             DP_Message *msg)
+{
+    if (!is_draw_dabs(msg)) {
+        return DP_canvas_state_handle(persist_state(cs), dc, msg);
+    }
+    else if (DP_canvas_state_transient(cs)) {
+        DP_TransientCanvasState *tcs = (DP_TransientCanvasState *)cs;
+        return DP_transient_canvas_state_handle_draw_dabs(tcs, dc, msg)
+                 ? DP_canvas_state_incref(cs)
+                 : NULL;
+    }
+    else {
+        DP_TransientCanvasState *tcs = DP_transient_canvas_state_new(cs);
+        if (DP_transient_canvas_state_handle_draw_dabs(tcs, dc, msg)) {
+            return (DP_CanvasState *)tcs;
+        }
+        else {
+            DP_transient_canvas_state_decref(tcs);
+            return NULL;
+        }
+    }
+}
+
+static DP_CanvasState *
+replay_drawing_command(DP_CanvasState *cs, DP_DrawContext *dc, DP_Message *msg)
+{
+    DP_CanvasState *next = apply_drawing_command(cs, dc, msg);
+    if (next) {
+        DP_canvas_state_decref(cs);
+        return next;
+    }
+    else {
+        DP_warn("Error replaying drawing command: %s", DP_error());
+        return cs;
+    }
+}
+
+static bool thaw_savepoint(DP_CanvasHistory *ch, int index)
+{
+    // Savepoints from here on get thawed or replaced, so they have to be
+    // looked at again when they're old enough.
+    if (index < ch->save_point.cold_index) {
+        ch->save_point.cold_index = index;
+    }
+    DP_CanvasHistoryEntry *entry = entry_at(ch, index);
+    if (entry->cold != DP_COLD_NONE) {
+        if (!DP_canvas_state_decompress_cold_tiles(entry->state)) {
+            return false; // Error message has already been set.
+        }
+        entry->cold = DP_COLD_NONE;
+    }
+    return true;
+}
+
+static int rebase_savepoint(DP_CanvasHistory *ch, DP_DrawContext *dc,
+                            int start_index, int target_index)
+{
+    if (!thaw_savepoint(ch, start_index)) {
+        DP_warn("Error rebasing savepoint: %s", DP_error());
+        return start_index;
+    }
+
+    DP_CanvasHistoryEntry *start_entry = entry_at(ch, start_index);
+    DP_CanvasState *cs = DP_canvas_state_incref(start_entry->state);
+    long long cost = 0;
+    for (int i = start_index + 1; i < target_index; ++i) {
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
+        if (entry->undo == DP_UNDO_DONE && !is_undo_point_entry(entry)) {
+            cs = replay_drawing_command(cs, dc, entry->msg);
+            cost += entry->replay_cost;
+        }
+    }
+
+    DP_CanvasHistoryEntry *target_entry = entry_at(ch, target_index);
+    DP_ASSERT(is_undo_point_entry(target_entry));
+    DP_ASSERT(!target_entry->state);
+    target_entry->state = persist_state(cs);
+    // The new savepoint splits the replay cost of the next newer one.
+    target_entry->gap_replay_cost = cost;
+    int next_index = next_savepoint_index(ch, target_index);
+    if (next_index < 0) {
+        ch->save_point.replay_cost -= cost;
+    }
+    else {
+        entry_at(ch, next_index)->gap_replay_cost -= cost;
+    }
+    // The start savepoint gets truncated away right after, so only the new
+    // one needs its pinned bytes measured.
+    if (pinned_bytes_tracked(ch)) {
+        set_pinned_bytes(ch, target_index, next_index);
+    }
+    return target_index;
+}
+
+static int find_truncate_index(DP_CanvasHistory *ch, DP_DrawContext *dc,
+                               int first_unreachable_index)
+{
+    // Anything reachable has to be replayable, so there must be a savepoint at
+    // or before the first reachable undo point. With sparse savepoints, that
+    // one may be a long way back. If it's further back than the reachable
+    // history is long, replay up to the undo point to make a new savepoint
+    // there, otherwise the history would grow without bound.
+    int reachable_index = first_unreachable_index + 1;
+    int savepoint_index = search_savepoint_index(ch, reachable_index);
+    if (savepoint_index < 0 || savepoint_index == reachable_index) {
+        return first_unreachable_index;
+    }
+    else if (reachable_index - savepoint_index > ch->used - reachable_index) {
+        return rebase_savepoint(ch, dc, savepoint_index, reachable_index);
+    }
+    else {
+        return savepoint_index;
+    }
+}
+
+static void handle_undo_point(DP_CanvasHistory *ch, DP_DrawContext *dc,
+                              int index)
 {
     make_savepoint(ch, index);
+    prune_savepoints(ch);
+    compress_cold_savepoints(ch, index);
     int depth;
     int i = mark_undone_actions_gone(ch, index, &depth);
     int first_unreachable_index = find_first_unreachable_index(ch, i, depth);
-    if (first_unreachable_index > 0) {
-        truncate_history(ch, first_unreachable_index);
+    if (first_unreachable_index >= 0) {
+        int truncate_index =
+            find_truncate_index(ch, dc, first_unreachable_index);
+        if (truncate_index > 0) {
+            truncate_history(ch, truncate_index);
+        }
     }
 }
 
@@ -436,11 +1092,10 @@ static void handle_undo_point(DP_CanvasHistory *ch, int index)
 static int find_first_undo_point(DP_CanvasHistory *ch, unsigned int context_id,
                                  int *out_depth)
 {
-    DP_CanvasHistoryEntry *entries = ch->entries;
     int i;
     int depth = 0;
     for (i = ch->used - 1; i >= 0 && depth <= UNDO_DEPTH_LIMIT; --i) {
-        DP_CanvasHistoryEntry *entry = &entries[i];
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
         if (is_undo_point_entry(entry)) {
             ++depth;
             if (entry->undo == DP_UNDO_DONE
@@ -456,10 +1111,9 @@ static int find_first_undo_point(DP_CanvasHistory *ch, unsigned int context_id,
 static void mark_entries_undone(DP_CanvasHistory *ch, unsigned int context_id,
                                 int undo_start)
 {
-    DP_CanvasHistoryEntry *entries = ch->entries;
     int used = ch->used;
     for (int i = undo_start; i < used; ++i) {
-        DP_CanvasHistoryEntry *entry = &entries[i];
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
         if (entry->undo == DP_UNDO_DONE
             && DP_message_context_id(entry->msg) == context_id) {
             entry->undo = DP_UNDO_UNDONE;
@@ -489,11 +1143,10 @@ static int undo(DP_CanvasHistory *ch, unsigned int context_id)
 static int find_oldest_redo_point(DP_CanvasHistory *ch, unsigned int context_id,
                                   int *out_depth)
 {
-    DP_CanvasHistoryEntry *entries = ch->entries;
     int redo_start = -1;
     int depth = 0;
     for (int i = ch->used - 1; i >= 0 && depth <= UNDO_DEPTH_LIMIT; --i) {
-        DP_CanvasHistoryEntry *entry = &entries[i];
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
         if (is_undo_point_entry(entry)) {
             ++depth;
             if (DP_message_context_id(entry->msg) == context_id) {
@@ -514,11 +1167,10 @@ static int find_oldest_redo_point(DP_CanvasHistory *ch, unsigned int context_id,
 static void mark_entries_redone(DP_CanvasHistory *ch, unsigned int context_id,
                                 int redo_start)
 {
-    DP_CanvasHistoryEntry *entries = ch->entries;
-    entries[redo_start].undo = DP_UNDO_DONE;
+    entry_at(ch, redo_start)->undo = DP_UNDO_DONE;
     int used = ch->used;
     for (int i = redo_start + 1; i < used; ++i) {
-        DP_CanvasHistoryEntry *entry = &entries[i];
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
         if (DP_message_context_id(entry->msg) == context_id) {
             DP_Undo undo = entry->undo;
             if (is_undo_point_entry(entry) && undo != DP_UNDO_GONE) {
@@ -554,29 +1206,17 @@ static void replay_undo_point(DP_CanvasState *cs, DP_CanvasHistoryEntry *entry)
 {
     DP_CanvasState *prev = entry->state;
     entry->state = DP_canvas_state_incref(cs);
+    entry->cold = DP_COLD_NONE;
     DP_canvas_state_decref_nullable(prev);
 }
 
-static DP_CanvasState *
-replay_drawing_command(DP_CanvasState *cs, DP_DrawContext *dc, DP_Message *msg)
-{
-    DP_CanvasState *next = DP_canvas_state_handle(cs, dc, msg);
-    if (next) {
-        DP_canvas_state_decref(cs);
-        return next;
-    }
-    else {
-        DP_warn("Error replaying drawing command: %s", DP_error());
-        return cs;
-    }
-}
-
 static DP_CanvasState *replay(DP_CanvasState *cs, DP_DrawContext *dc,
                               DP_CanvasHistoryEntry *entry)
 {
     DP_Message *msg = entry->msg;
     switch (DP_message_type(msg)) {
     case DP_MSG_UNDO_POINT:
+        cs = persist_state(cs);
         replay_undo_point(cs, entry);
         return cs;
     default:
@@ -584,17 +1224,6 @@ static DP_CanvasState *replay(DP_CanvasState *cs, DP_DrawContext *dc,
     }
 }
 
-static int search_savepoint_index(DP_CanvasHistory *ch, int target_index)
-{
-    DP_CanvasHistoryEntry *entries = ch->entries;
-    for (int i = target_index; i >= 0; --i) {
-        if (entries[i].state) {
-            return i;
-        }
-    }
-    return -1;
-}
-
 static void replay_fork(void *element, void *user)
 {
     DP_ForkEntry *fe = element;
@@ -618,16 +1247,35 @@ static bool replay_from(DP_CanvasHistory *ch, DP_DrawContext *dc,
         return false;
     }
 
-    DP_CanvasHistoryEntry *entries = ch->entries;
-    DP_CanvasState *cs = DP_canvas_state_incref(entries[start_index].state);
+    if (!thaw_savepoint(ch, start_index)) {
+        return false;
+    }
+
+    // Replaying replaces the savepoints after the start, so their pinned
+    // bytes have to be measured again afterwards.
+    forget_pinned_bytes_from(ch, start_index);
+    DP_CanvasHistoryEntry *start_entry = entry_at(ch, start_index);
+    DP_CanvasState *cs = DP_canvas_state_incref(start_entry->state);
     DP_ASSERT(cs);
 
+    // Replay costs since each savepoint get summed up again along the way.
+    long long cost = 0;
     int used = ch->used;
     for (int i = start_index + 1; i < used; ++i) {
-        DP_CanvasHistoryEntry *entry = &entries[i];
+        DP_CanvasHistoryEntry *entry = entry_at(ch, i);
         if (entry->undo == DP_UNDO_DONE) {
             cs = replay(cs, dc, entry);
             validate_history(ch);
+            cost += entry->replay_cost;
+            if (entry->state) {
+                entry->gap_replay_cost = cost;
+                cost = 0;
+            }
+        }
+        else if (entry->state) {
+            // Savepoints of undone undo points don't get replaced during
+            // replay, so they may no longer match what came before them.
+            clear_savepoint(entry);
         }
     }
 
@@ -638,7 +1286,11 @@ static bool replay_from(DP_CanvasHistory *ch, DP_DrawContext *dc,
                       (void *[]){ch, &cs, dc});
     }
 
+    ch->save_point.replay_cost = cost;
     set_current_state_noinc(ch, cs);
+    measure_pinned_bytes_from(ch, start_index);
+    // Replaying put savepoints at every undo point along the way.
+    prune_savepoints(ch);
     return true;
 }
 
@@ -661,7 +1313,7 @@ static bool handle_undo(DP_CanvasHistory *ch, DP_DrawContext *dc,
 static bool handle_drawing_command(DP_CanvasHistory *ch, DP_DrawContext *dc,
                                    DP_Message *msg)
 {
-    DP_CanvasState *next = DP_canvas_state_handle(ch->current_state, dc, msg);
+    DP_CanvasState *next = apply_drawing_command(ch->current_state, dc, msg);
     if (next) {
         set_current_state_noinc(ch, next);
         return true;
@@ -678,7 +1330,7 @@ static bool handle_command(DP_CanvasHistory *ch, DP_DrawContext *dc,
     DP_ASSERT(DP_message_type(msg) == type);
     switch (type) {
     case DP_MSG_UNDO_POINT:
-        handle_undo_point(ch, index);
+        handle_undo_point(ch, dc, index);
         return true;
     case DP_MSG_UNDO:
         return handle_undo(ch, dc, msg);
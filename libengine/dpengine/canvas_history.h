@@ -30,6 +30,48 @@ typedef struct DP_Message DP_Message;
 
 typedef struct DP_CanvasHistory DP_CanvasHistory;
 
+typedef struct DP_CanvasHistorySavepointPolicy {
+    // Upper limit for tile memory pinned by savepoints, meaning memory that
+    // isn't also held by the current canvas state. The oldest savepoints get
+    // dropped to stay under it. Zero means no limit.
+    size_t max_bytes;
+    // Undo points closer than this many history entries to the previous
+    // savepoint don't get a savepoint of their own.
+    int min_spacing;
+    // Spacing between savepoints grows with their age, a savepoint is dropped
+    // if it's closer to the next newer one than its age divided by this.
+    // Zero turns thinning off.
+    int thinning_divisor;
+    // Upper limit for the estimated cost of replaying from a savepoint to an
+    // undo point, measured in tiles touched. Undo points get a savepoint
+    // regardless of spacing once it's reached, and thinning keeps savepoints
+    // that are needed to stay below it. The memory limit takes precedence.
+    // Zero means no limit. Costs are only estimated while a limit is set, so
+    // commands handled before setting one don't count towards it.
+    int max_replay_cost;
+} DP_CanvasHistorySavepointPolicy;
+
+// Makes a savepoint at every undo point and keeps them all around.
+#define DP_CANVAS_HISTORY_SAVEPOINT_POLICY_DEFAULT \
+    ((DP_CanvasHistorySavepointPolicy){0, 1, 0, 0})
+
+typedef struct DP_CanvasHistorySavepointStats {
+    int count;
+    size_t pinned_bytes;
+    // Highest cost of replaying from a savepoint to an undo point without one.
+    long long worst_replay_cost;
+} DP_CanvasHistorySavepointStats;
+
+typedef struct DP_CanvasHistorySizeStats {
+    // Entries currently held, starting at the given history index. Everything
+    // before it has been truncated.
+    int entries;
+    int first_index;
+    int capacity;
+    int fork_entries;
+    size_t entry_bytes;
+} DP_CanvasHistorySizeStats;
+
 typedef void (*DP_CanvasHistorySavePointFn)(DP_CanvasState *cs,
                                             int history_index, void *user);
 
@@ -42,9 +84,36 @@ void DP_canvas_history_free(DP_CanvasHistory *ch);
 void DP_canvas_history_local_pen_down_set(DP_CanvasHistory *ch,
                                           bool local_pen_down);
 
+// Savepoints that are more than the given number of savepoints old get the
+// tiles only they reference compressed to save memory. They're decompressed
+// again when they're replayed from. Zero, the default, turns this off.
+void DP_canvas_history_cold_savepoint_age_set(DP_CanvasHistory *ch,
+                                              int cold_age);
+
+// The oldest savepoint in the history is always kept, since it's needed to
+// replay anything at all, as is the newest one. A stricter policy only takes
+// effect at the next undo point.
+void DP_canvas_history_savepoint_policy_set(
+    DP_CanvasHistory *ch, DP_CanvasHistorySavepointPolicy policy);
+
+DP_CanvasHistorySavepointStats
+DP_canvas_history_savepoint_stats(DP_CanvasHistory *ch);
+
+DP_CanvasHistorySizeStats DP_canvas_history_size_stats(DP_CanvasHistory *ch);
+
 DP_CanvasState *DP_canvas_history_compare_and_get(DP_CanvasHistory *ch,
                                                   DP_CanvasState *prev);
 
+// Between beginning and ending a batch, the canvas state is still updated for
+// every message handled, but DP_canvas_history_compare_and_get keeps returning
+// the one from before the batch. Ending the batch publishes the final state,
+// so a burst of messages costs readers a single update. Batches don't nest.
+void DP_canvas_history_batch_begin(DP_CanvasHistory *ch);
+
+void DP_canvas_history_batch_end(DP_CanvasHistory *ch);
+
+bool DP_canvas_history_batching(DP_CanvasHistory *ch);
+
 void DP_canvas_history_reset(DP_CanvasHistory *ch);
 
 void DP_canvas_history_soft_reset(DP_CanvasHistory *ch);
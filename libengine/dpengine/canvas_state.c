@@ -24,6 +24,8 @@
 #include "blend_mode.h"
 #include "canvas_diff.h"
 #include "compress.h"
+#include "draw_context.h"
+#include "flatten_cache.h"
 #include "image.h"
 #include "layer_content.h"
 #include "layer_content_list.h"
@@ -36,6 +38,8 @@
 #include <dpcommon/common.h>
 #include <dpcommon/conversions.h>
 #include <dpcommon/geom.h>
+#include <dpcommon/threading.h>
+#include <dpcommon/worker.h>
 #include <dpmsg/message.h>
 #include <dpmsg/messages/annotation_create.h>
 #include <dpmsg/messages/annotation_delete.h>
@@ -63,6 +67,7 @@ struct DP_CanvasState {
     DP_Atomic refcount;
     const bool transient;
     const int width, height;
+    const int offset_x, offset_y;
     DP_Tile *const background_tile;
     DP_LayerContentList *const layer_contents;
     DP_LayerPropsList *const layer_props;
@@ -73,6 +78,8 @@ struct DP_TransientCanvasState {
     DP_Atomic refcount;
     bool transient;
     int width, height;
+    // Sum of all resize offsets, to tell how far content moved between states.
+    int offset_x, offset_y;
     DP_Tile *background_tile;
     union {
         DP_LayerContentList *layer_contents;
@@ -94,6 +101,8 @@ struct DP_CanvasState {
     DP_Atomic refcount;
     bool transient;
     int width, height;
+    // Sum of all resize offsets, to tell how far content moved between states.
+    int offset_x, offset_y;
     DP_Tile *background_tile;
     union {
         DP_LayerContentList *layer_contents;
@@ -120,6 +129,8 @@ static DP_TransientCanvasState *allocate_canvas_state(bool transient, int width,
                                     transient,
                                     width,
                                     height,
+                                    0,
+                                    0,
                                     NULL,
                                     {NULL},
                                     {NULL},
@@ -310,11 +321,13 @@ static DP_CanvasState *handle_layer_visibility(DP_CanvasState *cs,
 
 static DP_CanvasState *handle_put_image(DP_CanvasState *cs,
                                         unsigned int context_id,
-                                        DP_MsgPutImage *mpi)
+                                        DP_MsgPutImage *mpi,
+                                        DP_Image *decoded_or_null)
 {
     int blend_mode = DP_msg_put_image_blend_mode(mpi);
     if (!DP_blend_mode_exists(blend_mode)) {
         DP_error_set("Put image: unknown blend mode %d", blend_mode);
+        DP_image_free(decoded_or_null);
         return NULL;
     }
 
@@ -324,9 +337,11 @@ static DP_CanvasState *handle_put_image(DP_CanvasState *cs,
                             blend_mode, DP_msg_put_image_x(mpi),
                             DP_msg_put_image_y(mpi),
                             DP_msg_put_image_width(mpi),
-                            DP_msg_put_image_height(mpi), image, image_size);
+                            DP_msg_put_image_height(mpi), image, image_size,
+                            decoded_or_null);
 }
 
+
 static DP_CanvasState *handle_fill_rect(DP_CanvasState *cs,
                                         unsigned int context_id,
                                         DP_MsgFillRect *mfr)
@@ -406,8 +421,10 @@ static DP_CanvasState *handle_region_move(DP_CanvasState *cs,
     return next;
 }
 
-static DP_CanvasState *
-handle_put_tile(DP_CanvasState *cs, unsigned int context_id, DP_MsgPutTile *mpt)
+static DP_CanvasState *handle_put_tile(DP_CanvasState *cs,
+                                       unsigned int context_id,
+                                       DP_MsgPutTile *mpt,
+                                       DP_Tile *decoded_or_null)
 {
     DP_TileCounts tile_counts = DP_tile_counts_round(cs->width, cs->height);
     int tile_total = tile_counts.x * tile_counts.y;
@@ -417,12 +434,16 @@ handle_put_tile(DP_CanvasState *cs, unsigned int context_id, DP_MsgPutTile *mpt)
     if (start >= tile_total) {
         DP_error_set("Put tile: starting index %d beyond total %d", start,
                      tile_total);
+        DP_tile_decref_nullable(decoded_or_null);
         return NULL;
     }
 
     DP_Tile *tile;
     uint32_t color;
-    if (DP_msg_put_tile_color(mpt, &color)) {
+    if (decoded_or_null) {
+        tile = decoded_or_null;
+    }
+    else if (DP_msg_put_tile_color(mpt, &color)) {
         tile = DP_tile_new_from_bgra(context_id, color);
     }
     else {
@@ -444,11 +465,15 @@ handle_put_tile(DP_CanvasState *cs, unsigned int context_id, DP_MsgPutTile *mpt)
 
 static DP_CanvasState *handle_canvas_background(DP_CanvasState *cs,
                                                 unsigned int context_id,
-                                                DP_MsgCanvasBackground *mcb)
+                                                DP_MsgCanvasBackground *mcb,
+                                                DP_Tile *decoded_or_null)
 {
     DP_Tile *tile;
     uint32_t color;
-    if (DP_msg_canvas_background_color(mcb, &color)) {
+    if (decoded_or_null) {
+        tile = decoded_or_null;
+    }
+    else if (DP_msg_canvas_background_color(mcb, &color)) {
         tile = DP_tile_new_from_bgra(context_id, color);
     }
     else {
@@ -525,26 +550,37 @@ static void *get_pixel_dabs(DP_MsgDrawDabs *mdd, int *out_dab_count)
     return DP_msg_draw_dabs_pixel_dabs(mddp, out_dab_count);
 }
 
-static DP_CanvasState *
-handle_draw_dabs(DP_CanvasState *cs, DP_DrawContext *dc, DP_MessageType type,
-                 unsigned int context_id, DP_MsgDrawDabs *mdd,
-                 void *(*get_dabs)(DP_MsgDrawDabs *, int *))
+typedef struct DP_DrawDabsArgs {
+    int layer_id;
+    int sublayer_id;
+    int sublayer_blend_mode;
+    int sublayer_opacity;
+    DP_PaintDrawDabsParams params;
+} DP_DrawDabsArgs;
+
+// Returns false on error, otherwise whether there's any dabs to draw in
+// out_has_dabs.
+static bool prepare_draw_dabs(DP_DrawContext *dc, DP_MessageType type,
+                              unsigned int context_id, DP_MsgDrawDabs *mdd,
+                              void *(*get_dabs)(DP_MsgDrawDabs *, int *),
+                              DP_DrawDabsArgs *out_args, bool *out_has_dabs)
 {
     int blend_mode = DP_msg_draw_dabs_blend_mode(mdd);
     if (!DP_blend_mode_exists(blend_mode)) {
         DP_error_set("Draw dabs: unknown blend mode %d", blend_mode);
-        return NULL;
+        return false;
     }
     else if (!DP_blend_mode_valid_for_brush(blend_mode)) {
         DP_error_set("Draw dabs: blend mode %s not applicable to brushes",
                      DP_blend_mode_enum_name_unprefixed(blend_mode));
-        return NULL;
+        return false;
     }
 
     int dab_count;
     void *dabs = get_dabs(mdd, &dab_count);
     if (dab_count < 1) {
-        return DP_canvas_state_incref(cs); // Nothing to do here.
+        *out_has_dabs = false; // Nothing to do here.
+        return true;
     }
 
     uint32_t color = DP_msg_draw_dabs_color(mdd);
@@ -562,20 +598,46 @@ handle_draw_dabs(DP_CanvasState *cs, DP_DrawContext *dc, DP_MessageType type,
         dabs_blend_mode = blend_mode;
     }
 
-    DP_PaintDrawDabsParams params = {
-        (int)type,
-        dc,
-        context_id,
-        DP_msg_draw_dabs_origin_x(mdd),
-        DP_msg_draw_dabs_origin_y(mdd),
-        color,
-        dabs_blend_mode,
-        dab_count,
-        dabs,
+    *out_args = (DP_DrawDabsArgs){
+        DP_msg_draw_dabs_layer_id(mdd),
+        sublayer_id,
+        sublayer_blend_mode,
+        sublayer_opacity,
+        {
+            (int)type,
+            dc,
+            context_id,
+            DP_msg_draw_dabs_origin_x(mdd),
+            DP_msg_draw_dabs_origin_y(mdd),
+            color,
+            dabs_blend_mode,
+            dab_count,
+            dabs,
+        },
     };
+    *out_has_dabs = true;
+    return true;
+}
 
-    return DP_ops_draw_dabs(cs, DP_msg_draw_dabs_layer_id(mdd), sublayer_id,
-                            sublayer_blend_mode, sublayer_opacity, &params);
+static DP_CanvasState *
+handle_draw_dabs(DP_CanvasState *cs, DP_DrawContext *dc, DP_MessageType type,
+                 unsigned int context_id, DP_MsgDrawDabs *mdd,
+                 void *(*get_dabs)(DP_MsgDrawDabs *, int *))
+{
+    DP_DrawDabsArgs args;
+    bool has_dabs;
+    if (!prepare_draw_dabs(dc, type, context_id, mdd, get_dabs, &args,
+                           &has_dabs)) {
+        return NULL;
+    }
+    else if (!has_dabs) {
+        return DP_canvas_state_incref(cs);
+    }
+    else {
+        return DP_ops_draw_dabs(cs, args.layer_id, args.sublayer_id,
+                                args.sublayer_blend_mode, args.sublayer_opacity,
+                                &args.params);
+    }
 }
 
 DP_CanvasState *DP_canvas_state_handle(DP_CanvasState *cs, DP_DrawContext *dc,
@@ -607,7 +669,8 @@ DP_CanvasState *DP_canvas_state_handle(DP_CanvasState *cs, DP_DrawContext *dc,
         return handle_layer_visibility(cs, DP_msg_layer_visibility_cast(msg));
     case DP_MSG_PUT_IMAGE:
         return handle_put_image(cs, DP_message_context_id(msg),
-                                DP_msg_put_image_cast(msg));
+                                DP_msg_put_image_cast(msg),
+                                DP_draw_context_decoded_payload_take(dc, msg));
     case DP_MSG_FILL_RECT:
         return handle_fill_rect(cs, DP_message_context_id(msg),
                                 DP_msg_fill_rect_cast(msg));
@@ -616,10 +679,12 @@ DP_CanvasState *DP_canvas_state_handle(DP_CanvasState *cs, DP_DrawContext *dc,
                                   DP_msg_region_move_cast(msg));
     case DP_MSG_PUT_TILE:
         return handle_put_tile(cs, DP_message_context_id(msg),
-                               DP_msg_put_tile_cast(msg));
+                               DP_msg_put_tile_cast(msg),
+                               DP_draw_context_decoded_payload_take(dc, msg));
     case DP_MSG_CANVAS_BACKGROUND:
-        return handle_canvas_background(cs, DP_message_context_id(msg),
-                                        DP_msg_canvas_background_cast(msg));
+        return handle_canvas_background(
+            cs, DP_message_context_id(msg), DP_msg_canvas_background_cast(msg),
+            DP_draw_context_decoded_payload_take(dc, msg));
     case DP_MSG_PEN_UP:
         return handle_pen_up(cs, DP_message_context_id(msg));
     case DP_MSG_ANNOTATION_CREATE:
@@ -723,12 +788,81 @@ DP_TransientTile *DP_canvas_state_flatten_tile_at(DP_CanvasState *cs, int x,
 }
 
 
+bool DP_canvas_state_compress_cold_tiles(DP_CanvasState *cs)
+{
+    DP_ASSERT(cs);
+    DP_ASSERT(DP_atomic_get(&cs->refcount) > 0);
+    DP_ASSERT(!cs->transient);
+    if (DP_atomic_get(&cs->refcount) == 1) {
+        DP_TransientCanvasState *tcs = (DP_TransientCanvasState *)cs;
+        bool complete = true;
+        DP_Tile *t = tcs->background_tile;
+        if (t) {
+            if (DP_tile_refcount(t) == 1) {
+                tcs->background_tile = DP_tile_cold_compress(t);
+            }
+            else if (!DP_tile_solid(t)) {
+                complete = false;
+            }
+        }
+        return DP_layer_content_list_compress_cold_tiles(cs->layer_contents)
+            && complete;
+    }
+    else {
+        return false;
+    }
+}
+
+bool DP_canvas_state_decompress_cold_tiles(DP_CanvasState *cs)
+{
+    DP_ASSERT(cs);
+    DP_ASSERT(DP_atomic_get(&cs->refcount) > 0);
+    DP_ASSERT(!cs->transient);
+    if (DP_atomic_get(&cs->refcount) == 1) {
+        DP_TransientCanvasState *tcs = (DP_TransientCanvasState *)cs;
+        DP_Tile *t = tcs->background_tile;
+        if (t && DP_tile_cold(t)) {
+            DP_Tile *thawed = DP_tile_cold_decompress(t);
+            if (!thawed) {
+                return false;
+            }
+            tcs->background_tile = thawed;
+        }
+        return DP_layer_content_list_decompress_cold_tiles(cs->layer_contents);
+    }
+    else {
+        return true;
+    }
+}
+
+size_t DP_canvas_state_unique_tile_bytes(DP_CanvasState *cs,
+                                         DP_CanvasState *other_or_null)
+{
+    DP_ASSERT(cs);
+    DP_ASSERT(DP_atomic_get(&cs->refcount) > 0);
+    if (cs == other_or_null) {
+        return 0;
+    }
+
+    DP_Tile *t = cs->background_tile;
+    size_t bytes =
+        t && !(other_or_null && other_or_null->background_tile == t)
+            ? DP_tile_memory_size(t)
+            : 0;
+    return bytes
+         + DP_layer_content_list_unique_tile_bytes(
+               cs->layer_contents, cs->layer_props,
+               other_or_null ? other_or_null->layer_contents : NULL,
+               other_or_null ? other_or_null->layer_props : NULL);
+}
+
+
 static void diff_states(DP_CanvasState *cs, DP_CanvasState *prev,
                         DP_CanvasDiff *diff)
 {
-    bool check_all = cs->background_tile != prev->background_tile
-                  || cs->width != prev->width || cs->height != prev->height;
-    if (check_all) {
+    // The background shows through on every tile, so if it looks different,
+    // everything changed. Replacing it with an equal tile is a no-op though.
+    if (!DP_tile_pixels_equal(cs->background_tile, prev->background_tile)) {
         DP_canvas_diff_check_all(diff);
     }
     else {
@@ -749,33 +883,148 @@ void DP_canvas_state_diff(DP_CanvasState *cs, DP_CanvasState *prev_or_null,
         bool change = cs != prev_or_null;
         DP_canvas_diff_begin(
             diff, prev_or_null->width, prev_or_null->height, cs->width,
-            cs->height, change && cs->layer_props != prev_or_null->layer_props);
+            cs->height, cs->offset_x - prev_or_null->offset_x,
+            cs->offset_y - prev_or_null->offset_y,
+            change && cs->layer_props != prev_or_null->layer_props);
         if (change) {
             diff_states(cs, prev_or_null, diff);
         }
     }
     else {
-        DP_canvas_diff_begin(diff, 0, 0, cs->width, cs->height, true);
+        DP_canvas_diff_begin(diff, 0, 0, cs->width, cs->height, 0, 0, true);
     }
 }
 
+// Moves the previously rendered tiles to where the diff says they went.
+static DP_TransientLayerContent *
+resize_render_target(DP_CanvasState *cs, DP_TransientLayerContent *lc,
+                     DP_CanvasDiff *diff)
+{
+    int offset_x, offset_y;
+    DP_canvas_diff_tile_offset(diff, &offset_x, &offset_y);
+    return DP_transient_layer_content_resize_to(
+        lc, 0, offset_y * DP_TILE_SIZE, offset_x * DP_TILE_SIZE, cs->width,
+        cs->height);
+}
+
 static void render_tile(void *data, int tile_index)
 {
     DP_CanvasState *cs = ((void **)data)[0];
     DP_TransientLayerContent *target = ((void **)data)[1];
-    DP_transient_layer_content_render_tile(target, cs, tile_index);
+    DP_FlattenCache *fc_or_null = ((void **)data)[2];
+    DP_transient_layer_content_render_tile(target, cs, tile_index, fc_or_null);
 }
 
 DP_TransientLayerContent *DP_canvas_state_render(DP_CanvasState *cs,
                                                  DP_TransientLayerContent *lc,
-                                                 DP_CanvasDiff *diff)
+                                                 DP_CanvasDiff *diff,
+                                                 DP_FlattenCache *fc_or_null)
+{
+    DP_ASSERT(cs);
+    DP_ASSERT(lc);
+    DP_ASSERT(diff);
+    DP_TransientLayerContent *target = resize_render_target(cs, lc, diff);
+    if (fc_or_null) {
+        DP_flatten_cache_prepare(fc_or_null, cs->width, cs->height);
+    }
+    DP_canvas_diff_each_index(diff, render_tile,
+                              (void *[]){cs, target, fc_or_null});
+    return target;
+}
+
+typedef struct DP_RenderBatches {
+    DP_CanvasState *cs;
+    DP_TransientLayerContent *target;
+    DP_FlattenCache *fc_or_null;
+    int count;
+    int batch_size;
+    DP_Atomic next;
+    DP_Semaphore *sem_done;
+    int *tile_indexes;
+} DP_RenderBatches;
+
+static void collect_tile_index(void *data, int tile_index)
+{
+    DP_RenderBatches *rb = data;
+    rb->tile_indexes[rb->count++] = tile_index;
+}
+
+static void render_batches(DP_RenderBatches *rb)
+{
+    DP_CanvasState *cs = rb->cs;
+    DP_TransientLayerContent *target = rb->target;
+    DP_FlattenCache *fc_or_null = rb->fc_or_null;
+    int count = rb->count;
+    int batch_size = rb->batch_size;
+    int *tile_indexes = rb->tile_indexes;
+    while (true) {
+        int start = DP_atomic_fetch_add(&rb->next, batch_size);
+        if (start >= count) {
+            break;
+        }
+        int end = DP_min_int(start + batch_size, count);
+        for (int i = start; i < end; ++i) {
+            DP_transient_layer_content_render_tile(target, cs, tile_indexes[i],
+                                                   fc_or_null);
+        }
+    }
+}
+
+static void run_render_job(void *user)
+{
+    DP_RenderBatches *rb = user;
+    render_batches(rb);
+    DP_SEMAPHORE_MUST_POST(rb->sem_done);
+}
+
+DP_TransientLayerContent *
+DP_canvas_state_render_parallel(DP_CanvasState *cs,
+                                DP_TransientLayerContent *lc,
+                                DP_CanvasDiff *diff,
+                                DP_FlattenCache *fc_or_null, DP_Worker *worker,
+                                int min_batch_size)
 {
     DP_ASSERT(cs);
     DP_ASSERT(lc);
     DP_ASSERT(diff);
-    DP_TransientLayerContent *target =
-        DP_transient_layer_content_resize_to(lc, 0, cs->width, cs->height);
-    DP_canvas_diff_each_index(diff, render_tile, (void *[]){cs, target});
+    DP_ASSERT(worker);
+    DP_ASSERT(min_batch_size > 0);
+    DP_TransientLayerContent *target = resize_render_target(cs, lc, diff);
+    if (fc_or_null) {
+        DP_flatten_cache_prepare(fc_or_null, cs->width, cs->height);
+    }
+
+    int total = DP_tile_total_round(cs->width, cs->height);
+    DP_RenderBatches rb = {
+        cs,
+        target,
+        fc_or_null,
+        0,
+        min_batch_size,
+        DP_ATOMIC_INIT(0),
+        NULL,
+        DP_malloc(sizeof(*rb.tile_indexes) * DP_int_to_size(total)),
+    };
+    DP_canvas_diff_each_index(diff, collect_tile_index, &rb);
+
+    int batch_count = (rb.count + min_batch_size - 1) / min_batch_size;
+    int helper_count =
+        DP_min_int(DP_worker_thread_count(worker), batch_count - 1);
+    if (helper_count > 0 && (rb.sem_done = DP_semaphore_new(0))) {
+        for (int i = 0; i < helper_count; ++i) {
+            DP_worker_push(worker, run_render_job, &rb);
+        }
+        render_batches(&rb);
+        for (int i = 0; i < helper_count; ++i) {
+            DP_SEMAPHORE_MUST_WAIT(rb.sem_done);
+        }
+        DP_semaphore_free(rb.sem_done);
+    }
+    else {
+        render_batches(&rb);
+    }
+
+    DP_free(rb.tile_indexes);
     return target;
 }
 
@@ -796,6 +1045,8 @@ static DP_TransientCanvasState *new_transient_canvas_state(DP_CanvasState *cs)
     DP_ASSERT(!cs->transient);
     DP_TransientCanvasState *tcs =
         allocate_canvas_state(true, cs->width, cs->height);
+    tcs->offset_x = cs->offset_x;
+    tcs->offset_y = cs->offset_y;
     tcs->background_tile = DP_tile_incref_nullable(cs->background_tile);
     return tcs;
 }
@@ -873,6 +1124,16 @@ void DP_transient_canvas_state_height_set(DP_TransientCanvasState *tcs,
     tcs->height = height;
 }
 
+void DP_transient_canvas_state_offset_add(DP_TransientCanvasState *tcs,
+                                          int offset_x, int offset_y)
+{
+    DP_ASSERT(tcs);
+    DP_ASSERT(DP_atomic_get(&tcs->refcount) > 0);
+    DP_ASSERT(tcs->transient);
+    tcs->offset_x += offset_x;
+    tcs->offset_y += offset_y;
+}
+
 void DP_transient_canvas_state_background_tile_set_noinc(
     DP_TransientCanvasState *tcs, DP_Tile *tile)
 {
@@ -973,3 +1234,43 @@ DP_transient_canvas_state_transient_annotations(DP_TransientCanvasState *tcs,
     }
     return tcs->transient_annotations;
 }
+
+bool DP_transient_canvas_state_handle_draw_dabs(DP_TransientCanvasState *tcs,
+                                                DP_DrawContext *dc,
+                                                DP_Message *msg)
+{
+    DP_ASSERT(tcs);
+    DP_ASSERT(DP_atomic_get(&tcs->refcount) > 0);
+    DP_ASSERT(tcs->transient);
+    DP_ASSERT(msg);
+    DP_MessageType type = DP_message_type(msg);
+    void *(*get_dabs)(DP_MsgDrawDabs *, int *);
+    switch (type) {
+    case DP_MSG_DRAW_DABS_CLASSIC:
+        get_dabs = get_classic_dabs;
+        break;
+    case DP_MSG_DRAW_DABS_PIXEL:
+    case DP_MSG_DRAW_DABS_PIXEL_SQUARE:
+        get_dabs = get_pixel_dabs;
+        break;
+    default:
+        DP_error_set("Not a draw dabs message: %d", (int)type);
+        return false;
+    }
+
+    DP_DrawDabsArgs args;
+    bool has_dabs;
+    if (!prepare_draw_dabs(dc, type, DP_message_context_id(msg),
+                           DP_msg_draw_dabs_cast(msg), get_dabs, &args,
+                           &has_dabs)) {
+        return false;
+    }
+    else if (!has_dabs) {
+        return true;
+    }
+    else {
+        return DP_ops_draw_dabs_transient(
+            tcs, args.layer_id, args.sublayer_id, args.sublayer_blend_mode,
+            args.sublayer_opacity, &args.params);
+    }
+}
@@ -27,17 +27,21 @@
 typedef struct DP_AnnotationList DP_AnnotationList;
 typedef struct DP_CanvasDiff DP_CanvasDiff;
 typedef struct DP_DrawContext DP_DrawContext;
+typedef struct DP_FlattenCache DP_FlattenCache;
 typedef struct DP_Image DP_Image;
 typedef struct DP_LayerContentList DP_LayerContentList;
 typedef struct DP_LayerPropsList DP_LayerPropsList;
 typedef struct DP_Message DP_Message;
 typedef struct DP_Tile DP_Tile;
+typedef struct DP_Worker DP_Worker;
 
 
 #define DP_FLAT_IMAGE_INCLUDE_BACKGROUND   (1 << 0)
 #define DP_FLAT_IMAGE_INCLUDE_FIXED_LAYERS (1 << 1)
 #define DP_FLAT_IMAGE_INCLUDE_SUBLAYERS    (1 << 2)
 
+#define DP_CANVAS_STATE_RENDER_DEFAULT_MIN_BATCH_SIZE 16
+
 typedef struct DP_CanvasState DP_CanvasState;
 
 #ifdef DP_NO_STRICT_ALIASING
@@ -96,12 +100,39 @@ DP_TransientTile *DP_canvas_state_flatten_tile(DP_CanvasState *cs,
 DP_TransientTile *DP_canvas_state_flatten_tile_at(DP_CanvasState *cs, int x,
                                                   int y);
 
+// Compresses tiles only reachable through this canvas state in place. The
+// canvas state mustn't be used in any other way until it's decompressed.
+// Returns false if anything was skipped because it's still shared, so trying
+// again after the other holders let go of it may get further.
+bool DP_canvas_state_compress_cold_tiles(DP_CanvasState *cs);
+
+bool DP_canvas_state_decompress_cold_tiles(DP_CanvasState *cs);
+
+// Tile memory that only this canvas state holds when compared to the other
+// one, meaning how much would be freed if this state went away.
+size_t DP_canvas_state_unique_tile_bytes(DP_CanvasState *cs,
+                                         DP_CanvasState *other_or_null);
+
 void DP_canvas_state_diff(DP_CanvasState *cs, DP_CanvasState *prev_or_null,
                           DP_CanvasDiff *diff);
 
+// If a flatten cache is given, tiles are flattened through it, which saves
+// compositing layers that didn't change since the last render.
 DP_TransientLayerContent *DP_canvas_state_render(DP_CanvasState *cs,
                                                  DP_TransientLayerContent *lc,
-                                                 DP_CanvasDiff *diff);
+                                                 DP_CanvasDiff *diff,
+                                                 DP_FlattenCache *fc_or_null);
+
+// Renders changed tiles on the worker's threads and the calling thread at the
+// same time, handing them out in batches of the given size. Falls back to
+// rendering serially if there's not enough tiles to go around. The result is
+// the same as that of DP_canvas_state_render.
+DP_TransientLayerContent *
+DP_canvas_state_render_parallel(DP_CanvasState *cs,
+                                DP_TransientLayerContent *lc,
+                                DP_CanvasDiff *diff,
+                                DP_FlattenCache *fc_or_null, DP_Worker *worker,
+                                int min_batch_size);
 
 
 DP_TransientCanvasState *DP_transient_canvas_state_new_init(void);
@@ -127,6 +158,9 @@ void DP_transient_canvas_state_width_set(DP_TransientCanvasState *tcs,
 void DP_transient_canvas_state_height_set(DP_TransientCanvasState *tcs,
                                           int height);
 
+void DP_transient_canvas_state_offset_add(DP_TransientCanvasState *tcs,
+                                          int offset_x, int offset_y);
+
 void DP_transient_canvas_state_background_tile_set_noinc(
     DP_TransientCanvasState *tcs, DP_Tile *tile);
 
@@ -151,5 +185,13 @@ DP_TransientAnnotationList *
 DP_transient_canvas_state_transient_annotations(DP_TransientCanvasState *tcs,
                                                 int reserve);
 
+// Draws the dabs of a draw dabs message directly onto the given transient
+// state, rather than going through a new one like DP_canvas_state_handle does.
+// Lets a run of dabs share a single transient state that only gets persisted
+// once at the end. Returns false on error, leaving the state unchanged.
+bool DP_transient_canvas_state_handle_draw_dabs(DP_TransientCanvasState *tcs,
+                                                DP_DrawContext *dc,
+                                                DP_Message *msg);
+
 
 #endif
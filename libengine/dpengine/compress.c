@@ -22,8 +22,13 @@
 #include "compress.h"
 #include <dpcommon/binary.h>
 #include <dpcommon/common.h>
+#include <dpcommon/atomic.h>
 #include <dpcommon/conversions.h>
+#include <dpcommon/threading.h>
 #include <zlib.h>
+#ifdef DP_USE_LIBDEFLATE
+#    include <libdeflate.h>
+#endif
 
 
 static voidpf malloc_z(DP_UNUSED voidpf opaque, uInt items, uInt size)
@@ -42,15 +47,149 @@ static const char *get_z_error(z_stream *stream)
     return msg ? msg : "no error message";
 }
 
-static void free_z_stream(z_stream *stream)
+// Inflating happens for every single tile and image that comes in, so the
+// decompressor state is kept around per thread instead of being set up and
+// torn down every time. If libdeflate is available, that's used instead of
+// zlib, since the output size is always known up front.
+DP_ATOMIC_DECLARE_STATIC_SPIN_LOCK(inflate_tls_lock);
+static DP_TlsKey inflate_tls = DP_TLS_UNDEFINED;
+
+#ifdef DP_USE_LIBDEFLATE
+
+static void free_decompressor(void *arg)
+{
+    libdeflate_free_decompressor(arg);
+}
+
+static struct libdeflate_decompressor *get_decompressor(void)
+{
+    if (inflate_tls == DP_TLS_UNDEFINED) {
+        DP_atomic_lock(&inflate_tls_lock);
+        if (inflate_tls == DP_TLS_UNDEFINED) {
+            inflate_tls = DP_tls_create(free_decompressor);
+        }
+        DP_atomic_unlock(&inflate_tls_lock);
+    }
+
+    struct libdeflate_decompressor *d = DP_tls_get(inflate_tls);
+    if (!d) {
+        d = libdeflate_alloc_decompressor();
+        if (!d) {
+            DP_error_set("Failed to allocate decompressor");
+            return NULL;
+        }
+        DP_tls_set(inflate_tls, d);
+    }
+    return d;
+}
+
+static bool inflate_to(const unsigned char *in, size_t in_size,
+                       unsigned char *out, size_t out_size)
+{
+    struct libdeflate_decompressor *d = get_decompressor();
+    if (!d) {
+        return false;
+    }
+
+    size_t actual_out_size;
+    enum libdeflate_result result = libdeflate_zlib_decompress(
+        d, in, in_size, out, out_size, &actual_out_size);
+    if (result != LIBDEFLATE_SUCCESS) {
+        DP_error_set("Inflate decompression error %d", (int)result);
+        return false;
+    }
+    else if (actual_out_size != out_size) {
+        DP_error_set("Inflate result is %zu bytes too short",
+                     out_size - actual_out_size);
+        return false;
+    }
+    else {
+        return true;
+    }
+}
+
+#else
+
+static void free_z_stream(void *arg)
 {
+    z_stream *stream = arg;
     int ret = inflateEnd(stream);
     if (ret != Z_OK) {
         DP_warn("Tile decompression end error %d: %s", ret,
                 get_z_error(stream));
     }
+    DP_free(stream);
+}
+
+static z_stream *get_z_stream(void)
+{
+    if (inflate_tls == DP_TLS_UNDEFINED) {
+        DP_atomic_lock(&inflate_tls_lock);
+        if (inflate_tls == DP_TLS_UNDEFINED) {
+            inflate_tls = DP_tls_create(free_z_stream);
+        }
+        DP_atomic_unlock(&inflate_tls_lock);
+    }
+
+    z_stream *stream = DP_tls_get(inflate_tls);
+    if (stream) {
+        int ret = inflateReset(stream);
+        if (ret == Z_OK) {
+            return stream;
+        }
+        // Shouldn't happen, but try to recover by starting from scratch.
+        DP_warn("Inflate reset error %d: %s", ret, get_z_error(stream));
+        DP_tls_set(inflate_tls, NULL);
+        free_z_stream(stream);
+    }
+
+    stream = DP_malloc(sizeof(*stream));
+    *stream = (z_stream){0};
+    stream->zalloc = malloc_z;
+    stream->zfree = free_z;
+
+    int ret = inflateInit(stream);
+    if (ret != Z_OK) {
+        DP_error_set("Inflate init error %d: %s", ret, get_z_error(stream));
+        DP_free(stream);
+        return NULL;
+    }
+
+    DP_tls_set(inflate_tls, stream);
+    return stream;
+}
+
+static bool inflate_to(const unsigned char *in, size_t in_size,
+                       unsigned char *out, size_t out_size)
+{
+    z_stream *stream = get_z_stream();
+    if (!stream) {
+        return false;
+    }
+
+    stream->avail_out = DP_size_to_uint(out_size);
+    stream->next_out = out;
+    stream->avail_in = DP_size_to_uint(in_size);
+    stream->next_in = (z_const unsigned char *)in;
+
+    int ret = inflate(stream, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        DP_error_set("Inflate decompression error %d: %s", ret,
+                     get_z_error(stream));
+        return false;
+    }
+
+    unsigned int left = stream->avail_out;
+    if (left != 0) {
+        DP_error_set("Inflate result is %u bytes too short", left);
+        return false;
+    }
+
+    return true;
 }
 
+#endif
+
 bool DP_compress_inflate(const unsigned char *in, size_t in_size,
                          unsigned char *(*get_output_buffer)(size_t, void *),
                          void *user)
@@ -66,35 +205,49 @@ bool DP_compress_inflate(const unsigned char *in, size_t in_size,
         return false; // The function should have already set the error message.
     }
 
+    return inflate_to(in + 4, in_size - 4, out, out_size);
+}
+
+
+size_t DP_compress_deflate(const unsigned char *in, size_t in_size, int level,
+                           unsigned char *(*get_output_buffer)(size_t, void *),
+                           void *user)
+{
+    if (in_size > UINT32_MAX) {
+        DP_error_set("Deflate input too large");
+        return 0;
+    }
+
     z_stream stream = {0};
     stream.zalloc = malloc_z;
     stream.zfree = free_z;
 
-    int ret = inflateInit(&stream);
+    int ret = deflateInit(&stream, level);
     if (ret != Z_OK) {
-        DP_error_set("Inflate init error %d: %s", ret, get_z_error(&stream));
-        return NULL;
+        DP_error_set("Deflate init error %d: %s", ret, get_z_error(&stream));
+        return 0;
     }
 
-    stream.avail_out = DP_size_to_uint(out_size);
-    stream.next_out = out;
-    stream.avail_in = DP_size_to_uint(in_size - 4);
-    stream.next_in = (z_const unsigned char *)(in + 4);
-
-    ret = inflate(&stream, Z_FINISH);
-    if (ret != Z_STREAM_END) {
-        DP_error_set("Inflate decompression error %d: %s", ret,
-                     get_z_error(&stream));
-        free_z_stream(&stream);
-        return false;
+    size_t bound = deflateBound(&stream, DP_size_to_ulong(in_size));
+    unsigned char *out = get_output_buffer(bound + 4, user);
+    if (!out) {
+        deflateEnd(&stream);
+        return 0; // The function should have already set the error message.
     }
 
-    unsigned int left = stream.avail_out;
-    free_z_stream(&stream);
-    if (left != 0) {
-        DP_error_set("Inflate result is %u bytes too short", left);
-        return false;
+    DP_write_bigendian_uint32(DP_size_to_uint32(in_size), out);
+    stream.avail_out = DP_size_to_uint(bound);
+    stream.next_out = out + 4;
+    stream.avail_in = DP_size_to_uint(in_size);
+    stream.next_in = (z_const unsigned char *)in;
+
+    ret = deflate(&stream, Z_FINISH);
+    size_t out_size = bound - stream.avail_out + 4;
+    deflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+        DP_error_set("Deflate compression error %d", ret);
+        return 0;
     }
 
-    return true;
+    return out_size;
 }
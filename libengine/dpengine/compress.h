@@ -28,5 +28,13 @@ bool DP_compress_inflate(const unsigned char *in, size_t in_size,
                          unsigned char *(*get_output_buffer)(size_t, void *),
                          void *user);
 
+// Compresses into the same format that DP_compress_inflate takes: a 32 bit
+// big-endian uncompressed size followed by a zlib stream. The buffer gets
+// requested with the maximum size the output may take up. Returns the actual
+// size of the output, or 0 on error.
+size_t DP_compress_deflate(const unsigned char *in, size_t in_size, int level,
+                           unsigned char *(*get_output_buffer)(size_t, void *),
+                           void *user);
+
 
 #endif
@@ -27,10 +27,21 @@
  * See 3rdparty/licenses/qt/license.GPL3 for details.
  */
 #include "draw_context.h"
+#include "layer_content.h"
+#include "paint.h"
 #include "pixels.h"
 #include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpcommon/threading.h>
 
 
+typedef struct DP_StampCacheEntry {
+    uint64_t key;
+    unsigned long long last_used; // Zero if this entry is empty.
+    size_t capacity;
+    DP_BrushStamp stamp;
+} DP_StampCacheEntry;
+
 struct DP_DrawContext {
     // Brush stamps and transformations are used by distinct,
     // operations, so their buffers can share the same memory.
@@ -46,6 +57,28 @@ struct DP_DrawContext {
     // Memory pool used by qgrayraster during region move transform.
     size_t raster_pool_size;
     unsigned char *raster_pool;
+    // Stamps of a draw dabs message waiting to be applied tile by tile.
+    struct {
+        uint8_t *masks;
+        DP_BrushStamp *stamps;
+        DP_BrushStampTileRef *tile_refs;
+    } dab;
+    // Optional threads to apply those stamps with, not owned by this.
+    struct {
+        DP_Worker *worker;
+        int min_batch_size;
+        int *group_starts;
+        DP_Semaphore *sem_done;
+    } paint;
+    // Recently used classic brush stamps, see paint.c.
+    struct {
+        unsigned long long clock;
+        DP_StampCacheStats stats;
+        DP_StampCacheEntry entries[DP_DRAW_CONTEXT_STAMP_CACHE_COUNT];
+    } stamp_cache;
+    // Payload of a message decoded ahead of time, see payload_decoder.c.
+    DP_Message *decoded_msg;
+    void *decoded_payload;
 };
 
 
@@ -54,12 +87,36 @@ DP_DrawContext *DP_draw_context_new(void)
     DP_DrawContext *dc = DP_malloc(sizeof(*dc));
     dc->raster_pool_size = DP_DRAW_CONTEXT_RASTER_POOL_MIN_SIZE;
     dc->raster_pool = DP_malloc(DP_DRAW_CONTEXT_RASTER_POOL_MIN_SIZE);
+    dc->dab.masks = NULL;
+    dc->dab.stamps = NULL;
+    dc->dab.tile_refs = NULL;
+    dc->paint.worker = NULL;
+    dc->paint.min_batch_size = DP_DRAW_CONTEXT_PAINT_MIN_BATCH_SIZE_DEFAULT;
+    dc->paint.group_starts = NULL;
+    dc->paint.sem_done = NULL;
+    dc->stamp_cache.clock = 0;
+    dc->stamp_cache.stats = (DP_StampCacheStats){0, 0};
+    for (int i = 0; i < DP_DRAW_CONTEXT_STAMP_CACHE_COUNT; ++i) {
+        dc->stamp_cache.entries[i] =
+            (DP_StampCacheEntry){0, 0, 0, {0, 0, 0, NULL}};
+    }
+    dc->decoded_msg = NULL;
+    dc->decoded_payload = NULL;
     return dc;
 }
 
 void DP_draw_context_free(DP_DrawContext *dc)
 {
     if (dc) {
+        DP_ASSERT(!dc->decoded_msg);
+        for (int i = 0; i < DP_DRAW_CONTEXT_STAMP_CACHE_COUNT; ++i) {
+            DP_free(dc->stamp_cache.entries[i].stamp.data);
+        }
+        DP_semaphore_free(dc->paint.sem_done);
+        DP_free(dc->paint.group_starts);
+        DP_free(dc->dab.tile_refs);
+        DP_free(dc->dab.stamps);
+        DP_free(dc->dab.masks);
         DP_free(dc->raster_pool);
         DP_free(dc);
     }
@@ -83,6 +140,137 @@ DP_Pixel *DP_draw_context_transform_buffer(DP_DrawContext *dc)
     return dc->transform_buffer;
 }
 
+uint8_t *DP_draw_context_dab_mask_buffer(DP_DrawContext *dc)
+{
+    DP_ASSERT(dc);
+    if (!dc->dab.masks) {
+        dc->dab.masks = DP_malloc(DP_DRAW_CONTEXT_DAB_MASK_BUFFER_SIZE);
+    }
+    return dc->dab.masks;
+}
+
+DP_BrushStamp *DP_draw_context_dab_stamp_buffer(DP_DrawContext *dc)
+{
+    DP_ASSERT(dc);
+    if (!dc->dab.stamps) {
+        dc->dab.stamps = DP_malloc(sizeof(*dc->dab.stamps)
+                                   * DP_DRAW_CONTEXT_DAB_STAMP_BUFFER_COUNT);
+    }
+    return dc->dab.stamps;
+}
+
+DP_BrushStampTileRef *DP_draw_context_dab_tile_ref_buffer(DP_DrawContext *dc)
+{
+    DP_ASSERT(dc);
+    if (!dc->dab.tile_refs) {
+        dc->dab.tile_refs =
+            DP_malloc(sizeof(*dc->dab.tile_refs)
+                      * DP_DRAW_CONTEXT_DAB_TILE_REF_BUFFER_COUNT);
+    }
+    return dc->dab.tile_refs;
+}
+
+bool DP_draw_context_paint_worker_set(DP_DrawContext *dc,
+                                      DP_Worker *worker_or_null,
+                                      int min_batch_size)
+{
+    DP_ASSERT(dc);
+    DP_ASSERT(min_batch_size > 0);
+    if (worker_or_null && !dc->paint.sem_done) {
+        DP_Semaphore *sem_done = DP_semaphore_new(0);
+        if (!sem_done) {
+            return false; // Error message has already been set.
+        }
+        dc->paint.sem_done = sem_done;
+        dc->paint.group_starts =
+            DP_malloc(sizeof(*dc->paint.group_starts)
+                      * DP_DRAW_CONTEXT_PAINT_GROUP_BUFFER_COUNT);
+    }
+    dc->paint.worker = worker_or_null;
+    dc->paint.min_batch_size = min_batch_size;
+    return true;
+}
+
+DP_Worker *DP_draw_context_paint_worker(DP_DrawContext *dc,
+                                        int *out_min_batch_size)
+{
+    DP_ASSERT(dc);
+    if (out_min_batch_size) {
+        *out_min_batch_size = dc->paint.min_batch_size;
+    }
+    return dc->paint.worker;
+}
+
+int *DP_draw_context_paint_group_buffer(DP_DrawContext *dc)
+{
+    DP_ASSERT(dc);
+    return dc->paint.group_starts;
+}
+
+DP_Semaphore *DP_draw_context_paint_semaphore(DP_DrawContext *dc)
+{
+    DP_ASSERT(dc);
+    return dc->paint.sem_done;
+}
+
+DP_BrushStamp *DP_draw_context_stamp_cache_get(DP_DrawContext *dc,
+                                               uint64_t key)
+{
+    DP_ASSERT(dc);
+    for (int i = 0; i < DP_DRAW_CONTEXT_STAMP_CACHE_COUNT; ++i) {
+        DP_StampCacheEntry *entry = &dc->stamp_cache.entries[i];
+        if (entry->last_used != 0 && entry->key == key) {
+            entry->last_used = ++dc->stamp_cache.clock;
+            ++dc->stamp_cache.stats.hits;
+            return &entry->stamp;
+        }
+    }
+    ++dc->stamp_cache.stats.misses;
+    return NULL;
+}
+
+DP_BrushStamp *DP_draw_context_stamp_cache_put(DP_DrawContext *dc,
+                                               uint64_t key, int diameter)
+{
+    DP_ASSERT(dc);
+    DP_ASSERT(diameter > 0);
+    DP_ASSERT(diameter <= DP_DRAW_CONTEXT_STAMP_MAX_DIAMETER);
+    DP_StampCacheEntry *entry = &dc->stamp_cache.entries[0];
+    for (int i = 1; i < DP_DRAW_CONTEXT_STAMP_CACHE_COUNT; ++i) {
+        DP_StampCacheEntry *candidate = &dc->stamp_cache.entries[i];
+        if (candidate->last_used < entry->last_used) {
+            entry = candidate;
+        }
+    }
+
+    size_t size = DP_int_to_size(DP_square_int(diameter));
+    if (entry->capacity < size) {
+        DP_free(entry->stamp.data);
+        entry->stamp.data = DP_malloc(size);
+        entry->capacity = size;
+    }
+    entry->key = key;
+    entry->last_used = ++dc->stamp_cache.clock;
+    entry->stamp.diameter = diameter;
+    return &entry->stamp;
+}
+
+void DP_draw_context_stamp_cache_clear(DP_DrawContext *dc)
+{
+    DP_ASSERT(dc);
+    for (int i = 0; i < DP_DRAW_CONTEXT_STAMP_CACHE_COUNT; ++i) {
+        DP_StampCacheEntry *entry = &dc->stamp_cache.entries[i];
+        DP_free(entry->stamp.data);
+        *entry = (DP_StampCacheEntry){0, 0, 0, {0, 0, 0, NULL}};
+    }
+}
+
+DP_StampCacheStats DP_draw_context_stamp_cache_stats(DP_DrawContext *dc)
+{
+    DP_ASSERT(dc);
+    return dc->stamp_cache.stats;
+}
+
 unsigned char *DP_draw_context_raster_pool(DP_DrawContext *dc, size_t *out_size)
 {
     DP_ASSERT(dc);
@@ -102,3 +290,24 @@ unsigned char *DP_draw_context_raster_pool_resize(DP_DrawContext *dc,
     dc->raster_pool_size = new_size;
     return new_raster_pool;
 }
+
+void DP_draw_context_decoded_payload_set(DP_DrawContext *dc, DP_Message *msg,
+                                         void *payload)
+{
+    DP_ASSERT(dc);
+    dc->decoded_msg = msg;
+    dc->decoded_payload = payload;
+}
+
+void *DP_draw_context_decoded_payload_take(DP_DrawContext *dc, DP_Message *msg)
+{
+    if (dc && msg && dc->decoded_msg == msg) {
+        void *payload = dc->decoded_payload;
+        dc->decoded_msg = NULL;
+        dc->decoded_payload = NULL;
+        return payload;
+    }
+    else {
+        return NULL;
+    }
+}
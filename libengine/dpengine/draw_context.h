@@ -30,7 +30,12 @@
 #define DPENGINE_DRAW_CONTEXT_H
 #include <dpcommon/common.h>
 
+typedef struct DP_BrushStamp DP_BrushStamp;
+typedef struct DP_BrushStampTileRef DP_BrushStampTileRef;
+typedef struct DP_Message DP_Message;
 typedef union DP_Pixel DP_Pixel;
+typedef struct DP_Semaphore DP_Semaphore;
+typedef struct DP_Worker DP_Worker;
 
 
 #define DP_DRAW_CONTEXT_STAMP_MAX_DIAMETER 260
@@ -41,6 +46,27 @@ typedef union DP_Pixel DP_Pixel;
 #define DP_DRAW_CONTEXT_RASTER_POOL_MIN_SIZE  8192
 #define DP_DRAW_CONTEXT_RASTER_POOL_MAX_SIZE  (1024 * 1024)
 
+// Draw dabs collect the stamps of a message in these before applying them tile
+// by tile. The stamp masks go into the mask buffer, the tile refs buffer has
+// enough room for the largest possible stamps.
+#define DP_DRAW_CONTEXT_DAB_MASK_BUFFER_SIZE      (1024 * 1024)
+#define DP_DRAW_CONTEXT_DAB_STAMP_BUFFER_COUNT    2048
+#define DP_DRAW_CONTEXT_DAB_TILE_REF_BUFFER_COUNT 16384
+
+// Smallest number of tiles handed to a paint worker thread at a time.
+#define DP_DRAW_CONTEXT_PAINT_MIN_BATCH_SIZE_DEFAULT 4
+// Tiles touched by a batch of stamps, plus one for the end of the last one.
+#define DP_DRAW_CONTEXT_PAINT_GROUP_BUFFER_COUNT \
+    (DP_DRAW_CONTEXT_DAB_TILE_REF_BUFFER_COUNT + 1)
+
+// Number of classic brush stamps kept around for reuse, at most about 2 MiB.
+#define DP_DRAW_CONTEXT_STAMP_CACHE_COUNT 32
+
+typedef struct DP_StampCacheStats {
+    long long hits;
+    long long misses;
+} DP_StampCacheStats;
+
 typedef uint8_t DP_BrushStampBuffer[DP_DRAW_CONTEXT_STAMP_BUFFER_SIZE];
 
 typedef struct DP_DrawContext DP_DrawContext;
@@ -54,11 +80,57 @@ uint8_t *DP_draw_context_stamp_buffer2(DP_DrawContext *dc);
 
 DP_Pixel *DP_draw_context_transform_buffer(DP_DrawContext *dc);
 
+// The dab buffers are allocated on first use.
+uint8_t *DP_draw_context_dab_mask_buffer(DP_DrawContext *dc);
+
+DP_BrushStamp *DP_draw_context_dab_stamp_buffer(DP_DrawContext *dc);
+
+DP_BrushStampTileRef *DP_draw_context_dab_tile_ref_buffer(DP_DrawContext *dc);
+
+// With a paint worker set, draw dabs spread their tiles over its threads. The
+// worker isn't owned by the draw context, pass NULL to go back to painting on
+// the calling thread alone. Setting a worker for the first time allocates the
+// buffers below, returns false if that fails and leaves the worker unset.
+bool DP_draw_context_paint_worker_set(DP_DrawContext *dc,
+                                      DP_Worker *worker_or_null,
+                                      int min_batch_size);
+
+DP_Worker *DP_draw_context_paint_worker(DP_DrawContext *dc,
+                                        int *out_min_batch_size);
+
+// Start of each tile's stamps when painting in parallel and the semaphore the
+// worker threads post when they're done. NULL until a worker has been set.
+int *DP_draw_context_paint_group_buffer(DP_DrawContext *dc);
+
+DP_Semaphore *DP_draw_context_paint_semaphore(DP_DrawContext *dc);
+
+// Least recently used cache of generated brush stamps. The key is up to the
+// caller, a stamp returned from here stays valid until the next put or clear.
+DP_BrushStamp *DP_draw_context_stamp_cache_get(DP_DrawContext *dc,
+                                               uint64_t key);
+
+// Evicts the least recently used stamp to make room for one with the given key
+// and diameter. The caller is responsible for filling in the returned stamp.
+DP_BrushStamp *DP_draw_context_stamp_cache_put(DP_DrawContext *dc,
+                                               uint64_t key, int diameter);
+
+void DP_draw_context_stamp_cache_clear(DP_DrawContext *dc);
+
+DP_StampCacheStats DP_draw_context_stamp_cache_stats(DP_DrawContext *dc);
+
 unsigned char *DP_draw_context_raster_pool(DP_DrawContext *dc,
                                            size_t *out_size);
 
 unsigned char *DP_draw_context_raster_pool_resize(DP_DrawContext *dc,
                                                   size_t new_size);
 
+// Hands over a payload decoded ahead of time for the given message. Taking it
+// transfers ownership, it returns NULL if the message doesn't match.
+void DP_draw_context_decoded_payload_set(DP_DrawContext *dc, DP_Message *msg,
+                                         void *payload);
+
+void *DP_draw_context_decoded_payload_take(DP_DrawContext *dc,
+                                           DP_Message *msg);
+
 
 #endif
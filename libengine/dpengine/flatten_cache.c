@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "flatten_cache.h"
+#include "blend_mode.h"
+#include "canvas_state.h"
+#include "layer_content.h"
+#include "layer_content_list.h"
+#include "layer_props.h"
+#include "layer_props_list.h"
+#include "tile.h"
+#include <dpcommon/atomic.h>
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+
+
+#define INITIAL_KEY_CAPACITY 8
+
+typedef struct DP_FlattenCacheKey {
+    DP_Tile *tile;
+    // Layers with sublayers get flattened into a new tile every time, so
+    // there's no identity to compare and they never match. The pointer is
+    // only used while the tile is being flattened.
+    DP_LayerContent *group;
+    int blend_mode;
+    uint8_t opacity;
+} DP_FlattenCacheKey;
+
+typedef struct DP_FlattenCacheKeys {
+    int count;
+    int capacity;
+    DP_FlattenCacheKey *elements;
+} DP_FlattenCacheKeys;
+
+typedef struct DP_FlattenCacheEntry {
+    DP_Tile *background;
+    DP_Tile *result;
+    // The background with the first prefix_count keys composited onto it.
+    DP_Tile *prefix;
+    int prefix_count;
+    // The keys from above_start to above_end composited onto nothing.
+    DP_Tile *above;
+    int above_start;
+    int above_end;
+    // What the result was made from, holds references to the tiles.
+    DP_FlattenCacheKeys keys;
+    // What it's being made from now, doesn't hold any references.
+    DP_FlattenCacheKeys next;
+} DP_FlattenCacheEntry;
+
+struct DP_FlattenCache {
+    int width, height;
+    int count;
+    int hot_layer_id;
+    DP_FlattenCacheEntry *entries;
+    DP_Atomic hits;
+    DP_Atomic prefix_hits;
+    DP_Atomic above_hits;
+    DP_Atomic misses;
+    DP_Atomic composited_layers;
+};
+
+
+DP_FlattenCache *DP_flatten_cache_new(void)
+{
+    DP_FlattenCache *fc = DP_malloc(sizeof(*fc));
+    *fc = (DP_FlattenCache){0,
+                            0,
+                            0,
+                            0,
+                            NULL,
+                            DP_ATOMIC_INIT(0),
+                            DP_ATOMIC_INIT(0),
+                            DP_ATOMIC_INIT(0),
+                            DP_ATOMIC_INIT(0),
+                            DP_ATOMIC_INIT(0)};
+    return fc;
+}
+
+static void keys_release(DP_FlattenCacheKeys *keys)
+{
+    int count = keys->count;
+    for (int i = 0; i < count; ++i) {
+        DP_tile_decref_nullable(keys->elements[i].tile);
+    }
+    keys->count = 0;
+}
+
+static void entry_reset(DP_FlattenCacheEntry *e)
+{
+    keys_release(&e->keys);
+    DP_tile_decref_nullable(e->above);
+    e->above = NULL;
+    DP_tile_decref_nullable(e->prefix);
+    e->prefix = NULL;
+    e->prefix_count = 0;
+    DP_tile_decref_nullable(e->result);
+    e->result = NULL;
+    DP_tile_decref_nullable(e->background);
+    e->background = NULL;
+}
+
+static void dispose_entries(DP_FlattenCache *fc)
+{
+    int count = fc->count;
+    for (int i = 0; i < count; ++i) {
+        DP_FlattenCacheEntry *e = &fc->entries[i];
+        entry_reset(e);
+        DP_free(e->next.elements);
+        DP_free(e->keys.elements);
+    }
+}
+
+void DP_flatten_cache_free(DP_FlattenCache *fc)
+{
+    if (fc) {
+        dispose_entries(fc);
+        DP_free(fc->entries);
+        DP_free(fc);
+    }
+}
+
+void DP_flatten_cache_prepare(DP_FlattenCache *fc, int width, int height)
+{
+    DP_ASSERT(fc);
+    DP_ASSERT(width >= 0);
+    DP_ASSERT(height >= 0);
+    if (fc->width != width || fc->height != height) {
+        dispose_entries(fc);
+        int count = DP_tile_total_round(width, height);
+        size_t size = sizeof(*fc->entries) * DP_int_to_size(count);
+        fc->entries = DP_realloc(fc->entries, size);
+        memset(fc->entries, 0, size);
+        fc->width = width;
+        fc->height = height;
+        fc->count = count;
+    }
+}
+
+void DP_flatten_cache_clear(DP_FlattenCache *fc)
+{
+    DP_ASSERT(fc);
+    int count = fc->count;
+    for (int i = 0; i < count; ++i) {
+        entry_reset(&fc->entries[i]);
+    }
+}
+
+int DP_flatten_cache_hot_layer_id(DP_FlattenCache *fc)
+{
+    DP_ASSERT(fc);
+    return fc->hot_layer_id;
+}
+
+void DP_flatten_cache_hot_layer_id_set(DP_FlattenCache *fc, int layer_id)
+{
+    DP_ASSERT(fc);
+    fc->hot_layer_id = layer_id;
+}
+
+
+static void keys_push(DP_FlattenCacheKeys *keys, DP_FlattenCacheKey key)
+{
+    int count = keys->count;
+    if (count == keys->capacity) {
+        int capacity = count == 0 ? INITIAL_KEY_CAPACITY : count * 2;
+        keys->elements = DP_realloc(
+            keys->elements, sizeof(*keys->elements) * DP_int_to_size(capacity));
+        keys->capacity = capacity;
+    }
+    keys->elements[count] = key;
+    keys->count = count + 1;
+}
+
+// Gathers what goes into the tile into the entry's next keys. If the hot
+// layer is visible, its keys are the range from out_hot_start to out_hot_end,
+// which is empty if it doesn't have anything on this tile. Otherwise they're
+// both set to -1.
+static void collect_keys(DP_FlattenCache *fc, DP_FlattenCacheEntry *e,
+                         DP_CanvasState *cs, int tile_index, int *out_hot_start,
+                         int *out_hot_end)
+{
+    DP_FlattenCacheKeys *next = &e->next;
+    next->count = 0;
+    *out_hot_start = -1;
+    *out_hot_end = -1;
+
+    int hot_layer_id = fc->hot_layer_id;
+    DP_LayerContentList *lcl = DP_canvas_state_layer_contents_noinc(cs);
+    DP_LayerPropsList *lpl = DP_canvas_state_layer_props_noinc(cs);
+    int count = DP_layer_content_list_count(lcl);
+    for (int i = 0; i < count; ++i) {
+        DP_LayerProps *lp = DP_layer_props_list_at_noinc(lpl, i);
+        if (!DP_layer_props_visible(lp)) {
+            continue;
+        }
+
+        bool hot = hot_layer_id != 0 && DP_layer_props_id(lp) == hot_layer_id;
+        if (hot) {
+            *out_hot_start = next->count;
+        }
+
+        DP_LayerContent *lc = DP_layer_content_list_at_noinc(lcl, i);
+        bool group = DP_layer_content_list_count(
+                         DP_layer_content_sub_contents_noinc(lc))
+                  != 0;
+        DP_Tile *t = DP_layer_content_tile_at_index_noinc(lc, tile_index);
+        if (group) {
+            keys_push(next, (DP_FlattenCacheKey){NULL, lc,
+                                                 DP_layer_props_blend_mode(lp),
+                                                 DP_layer_props_opacity(lp)});
+        }
+        else if (t) {
+            keys_push(next, (DP_FlattenCacheKey){t, NULL,
+                                                 DP_layer_props_blend_mode(lp),
+                                                 DP_layer_props_opacity(lp)});
+        }
+
+        if (hot) {
+            *out_hot_end = next->count;
+        }
+    }
+}
+
+static bool key_equal(DP_FlattenCacheKey *a, DP_FlattenCacheKey *b)
+{
+    return !a->group && !b->group && a->tile == b->tile
+        && a->opacity == b->opacity && a->blend_mode == b->blend_mode;
+}
+
+static int first_change(DP_FlattenCacheEntry *e)
+{
+    int count = DP_min_int(e->keys.count, e->next.count);
+    for (int i = 0; i < count; ++i) {
+        if (!key_equal(&e->keys.elements[i], &e->next.elements[i])) {
+            return i;
+        }
+    }
+    return count;
+}
+
+static void commit_keys(DP_FlattenCacheEntry *e)
+{
+    DP_FlattenCacheKeys next = e->next;
+    for (int i = 0; i < next.count; ++i) {
+        DP_tile_incref_nullable(next.elements[i].tile);
+    }
+    keys_release(&e->keys);
+    e->next = e->keys;
+    e->keys = next;
+}
+
+
+static void composite_keys(DP_FlattenCache *fc, DP_TransientTile *tt,
+                           DP_FlattenCacheKeys *keys, int start, int end,
+                           int tile_index)
+{
+    for (int i = start; i < end; ++i) {
+        DP_FlattenCacheKey *key = &keys->elements[i];
+        if (key->group) {
+            DP_layer_content_flatten_tile_to(key->group, tile_index, tt,
+                                             key->opacity, key->blend_mode);
+        }
+        else {
+            DP_transient_tile_merge(tt, key->tile, key->opacity,
+                                    key->blend_mode);
+        }
+    }
+    DP_atomic_add(&fc->composited_layers, end - start);
+}
+
+// Composites the layers up to where the snapshot should go, starting from the
+// last snapshot if nothing below it changed, and takes a new snapshot there.
+static DP_TransientTile *composite_below(DP_FlattenCache *fc,
+                                         DP_FlattenCacheEntry *e,
+                                         int tile_index, int changed,
+                                         int snapshot_at)
+{
+    DP_TransientTile *tt;
+    int start;
+    int prefix_count = e->prefix_count;
+    bool prefix_valid =
+        e->prefix && prefix_count <= changed && prefix_count <= snapshot_at;
+    if (prefix_valid) {
+        DP_atomic_inc(&fc->prefix_hits);
+        tt = DP_transient_tile_new(e->prefix, 0);
+        start = prefix_count;
+    }
+    else {
+        DP_atomic_inc(&fc->misses);
+        tt = e->background ? DP_transient_tile_new(e->background, 0)
+                           : DP_transient_tile_new_blank(0);
+        start = 0;
+    }
+
+    composite_keys(fc, tt, &e->next, start, snapshot_at, tile_index);
+
+    if (!prefix_valid || prefix_count != snapshot_at) {
+        DP_tile_decref_nullable(e->prefix);
+        if (snapshot_at == 0) {
+            e->prefix = NULL;
+        }
+        else {
+            e->prefix = DP_transient_tile_persist(
+                DP_transient_tile_new((DP_Tile *)tt, 0));
+        }
+        e->prefix_count = snapshot_at;
+    }
+    return tt;
+}
+
+// Normal blending is the only mode where compositing a stack of layers onto
+// nothing and then the result onto something else gives the same thing as
+// compositing them one by one, give or take rounding.
+static bool can_merge_above(DP_FlattenCacheKeys *keys, int start, int end)
+{
+    if (end - start < 2) {
+        return false; // Nothing to be gained from merging a single layer.
+    }
+    for (int i = start; i < end; ++i) {
+        DP_FlattenCacheKey *key = &keys->elements[i];
+        if (key->group || key->blend_mode != DP_BLEND_MODE_NORMAL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool above_valid(DP_FlattenCacheEntry *e, int start, int end)
+{
+    if (!e->above || e->above_start != start || e->above_end != end
+        || e->keys.count < end) {
+        return false;
+    }
+    for (int i = start; i < end; ++i) {
+        if (!key_equal(&e->keys.elements[i], &e->next.elements[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void merge_above(DP_FlattenCache *fc, DP_FlattenCacheEntry *e,
+                        DP_TransientTile *tt, int tile_index, int start,
+                        int end)
+{
+    if (above_valid(e, start, end)) {
+        DP_atomic_inc(&fc->above_hits);
+    }
+    else {
+        DP_tile_decref_nullable(e->above);
+        DP_TransientTile *above_tt = DP_transient_tile_new_blank(0);
+        composite_keys(fc, above_tt, &e->next, start, end, tile_index);
+        e->above = DP_transient_tile_persist(above_tt);
+        e->above_start = start;
+        e->above_end = end;
+    }
+    DP_transient_tile_merge(tt, e->above, 255, DP_BLEND_MODE_NORMAL);
+    DP_atomic_inc(&fc->composited_layers);
+}
+
+DP_Tile *DP_flatten_cache_flatten_tile(DP_FlattenCache *fc, DP_CanvasState *cs,
+                                       int tile_index)
+{
+    DP_ASSERT(fc);
+    DP_ASSERT(cs);
+    DP_ASSERT(fc->width == DP_canvas_state_width(cs));
+    DP_ASSERT(fc->height == DP_canvas_state_height(cs));
+    DP_ASSERT(tile_index >= 0);
+    DP_ASSERT(tile_index < fc->count);
+    DP_FlattenCacheEntry *e = &fc->entries[tile_index];
+
+    DP_Tile *background = DP_canvas_state_background_tile_noinc(cs);
+    if (e->background != background) {
+        entry_reset(e);
+        e->background = DP_tile_incref_nullable(background);
+    }
+
+    int hot_start, hot_end;
+    collect_keys(fc, e, cs, tile_index, &hot_start, &hot_end);
+    int count = e->next.count;
+    int changed = first_change(e);
+    if (e->result && changed == count && count == e->keys.count) {
+        DP_atomic_inc(&fc->hits);
+        return DP_tile_incref(e->result);
+    }
+
+    DP_TransientTile *tt;
+    bool keep_above = false;
+    if (hot_start < 0) {
+        tt = composite_below(fc, e, tile_index, changed, changed);
+        composite_keys(fc, tt, &e->next, changed, count, tile_index);
+    }
+    else {
+        tt = composite_below(fc, e, tile_index, changed, hot_start);
+        composite_keys(fc, tt, &e->next, hot_start, hot_end, tile_index);
+        if (can_merge_above(&e->next, hot_end, count)) {
+            merge_above(fc, e, tt, tile_index, hot_end, count);
+            keep_above = true;
+        }
+        else {
+            composite_keys(fc, tt, &e->next, hot_end, count, tile_index);
+        }
+    }
+
+    if (!keep_above) {
+        DP_tile_decref_nullable(e->above);
+        e->above = NULL;
+    }
+    commit_keys(e);
+    DP_tile_decref_nullable(e->result);
+    e->result = DP_transient_tile_persist(tt);
+    return DP_tile_incref(e->result);
+}
+
+
+DP_FlattenCacheStats DP_flatten_cache_stats(DP_FlattenCache *fc)
+{
+    DP_ASSERT(fc);
+    return (DP_FlattenCacheStats){
+        DP_atomic_get(&fc->hits),
+        DP_atomic_get(&fc->prefix_hits),
+        DP_atomic_get(&fc->above_hits),
+        DP_atomic_get(&fc->misses),
+        DP_atomic_get(&fc->composited_layers),
+    };
+}
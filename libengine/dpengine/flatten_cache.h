@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef DPENGINE_FLATTEN_CACHE_H
+#define DPENGINE_FLATTEN_CACHE_H
+#include <dpcommon/common.h>
+
+typedef struct DP_CanvasState DP_CanvasState;
+typedef struct DP_Tile DP_Tile;
+
+
+// Remembers, for each tile of the canvas, which layer tiles, opacities and
+// blend modes went into the last flattened result. Flattening a tile again
+// hands out that result if nothing changed. Otherwise it continues from a
+// snapshot taken below the lowest changed layer the previous time, so that
+// repeatedly painting on one layer only composites the layers from there up.
+//
+// The cache holds references to the tiles it's keyed on, so they can't be
+// freed and reused while it still compares against them. Different tiles may
+// be flattened from different threads at the same time, but the same tile
+// index must only be flattened from one thread at a time.
+//
+// A hot layer can be designated, usually the one being drawn on. The snapshot
+// below is then always kept just below that layer and the layers above it get
+// merged into a tile of their own, so that changes to the hot layer cost three
+// composites regardless of how many layers there are. The layers above are
+// only merged if they all use normal blending, since that's the only one that
+// can be grouped like that. The merged result can be off from compositing
+// each layer separately by a rounding error.
+typedef struct DP_FlattenCache DP_FlattenCache;
+
+typedef struct DP_FlattenCacheStats {
+    int hits;
+    int prefix_hits;
+    int above_hits;
+    int misses;
+    int composited_layers;
+} DP_FlattenCacheStats;
+
+DP_FlattenCache *DP_flatten_cache_new(void);
+
+void DP_flatten_cache_free(DP_FlattenCache *fc);
+
+// Makes room for a canvas of the given size, dropping all entries if it
+// changed. Must be called before flattening any tiles of a canvas state.
+void DP_flatten_cache_prepare(DP_FlattenCache *fc, int width, int height);
+
+void DP_flatten_cache_clear(DP_FlattenCache *fc);
+
+int DP_flatten_cache_hot_layer_id(DP_FlattenCache *fc);
+
+// Pass 0 to not have a hot layer. Only top-level layers can be hot. Must not
+// be changed while tiles are being flattened.
+void DP_flatten_cache_hot_layer_id_set(DP_FlattenCache *fc, int layer_id);
+
+// Returns a new reference to the flattened tile, background included.
+DP_Tile *DP_flatten_cache_flatten_tile(DP_FlattenCache *fc, DP_CanvasState *cs,
+                                       int tile_index);
+
+DP_FlattenCacheStats DP_flatten_cache_stats(DP_FlattenCache *fc);
+
+
+#endif
@@ -22,6 +22,7 @@
 #include "layer_content.h"
 #include "blend_mode.h"
 #include "canvas_diff.h"
+#include "flatten_cache.h"
 #include "image.h"
 #include "layer_content_list.h"
 #include "layer_props.h"
@@ -32,6 +33,8 @@
 #include <dpcommon/common.h>
 #include <dpcommon/conversions.h>
 #include <dpcommon/geom.h>
+#include <dpcommon/threading.h>
+#include <dpcommon/worker.h>
 
 
 #ifdef DP_NO_STRICT_ALIASING
@@ -158,11 +161,13 @@ static bool mark_both(void *data, int tile_index)
 {
     DP_ASSERT(data);
     DP_ASSERT(tile_index >= 0);
-    DP_LayerContent *a = ((DP_LayerContent **)data)[0];
-    DP_LayerContent *b = ((DP_LayerContent **)data)[1];
+    DP_LayerContent *a = ((void **)data)[0];
+    DP_LayerContent *b = ((void **)data)[1];
+    DP_CanvasDiff *diff = ((void **)data)[2];
+    int prev_index = DP_canvas_diff_prev_index(diff, tile_index);
     DP_ASSERT(tile_index < DP_tile_total_round(a->width, a->height));
-    DP_ASSERT(tile_index < DP_tile_total_round(b->width, b->height));
-    return a->elements[tile_index].tile || b->elements[tile_index].tile;
+    DP_ASSERT(prev_index < DP_tile_total_round(b->width, b->height));
+    return a->elements[tile_index].tile || b->elements[prev_index].tile;
 }
 
 static void layer_content_diff_mark_both(DP_LayerContent *lc,
@@ -174,20 +179,20 @@ static void layer_content_diff_mark_both(DP_LayerContent *lc,
     DP_ASSERT(diff);
     DP_ASSERT(DP_atomic_get(&lc->refcount) > 0);
     DP_ASSERT(DP_atomic_get(&prev_lc->refcount) > 0);
-    DP_ASSERT(lc->width == prev_lc->width);   // Different sizes could be
-    DP_ASSERT(lc->height == prev_lc->height); // supported, but aren't yet.
-    DP_canvas_diff_check(diff, mark_both, (DP_LayerContent *[]){lc, prev_lc});
+    DP_canvas_diff_check(diff, mark_both, (void *[]){lc, prev_lc, diff});
 }
 
 static bool diff_tile(void *data, int tile_index)
 {
     DP_ASSERT(data);
     DP_ASSERT(tile_index >= 0);
-    DP_LayerContent *a = ((DP_LayerContent **)data)[0];
-    DP_LayerContent *b = ((DP_LayerContent **)data)[1];
+    DP_LayerContent *a = ((void **)data)[0];
+    DP_LayerContent *b = ((void **)data)[1];
+    DP_CanvasDiff *diff = ((void **)data)[2];
+    int prev_index = DP_canvas_diff_prev_index(diff, tile_index);
     DP_ASSERT(tile_index < DP_tile_total_round(a->width, a->height));
-    DP_ASSERT(tile_index < DP_tile_total_round(b->width, b->height));
-    return a->elements[tile_index].tile != b->elements[tile_index].tile;
+    DP_ASSERT(prev_index < DP_tile_total_round(b->width, b->height));
+    return a->elements[tile_index].tile != b->elements[prev_index].tile;
 }
 
 static void layer_content_diff(DP_LayerContent *lc, DP_LayerContent *prev_lc,
@@ -198,9 +203,7 @@ static void layer_content_diff(DP_LayerContent *lc, DP_LayerContent *prev_lc,
     DP_ASSERT(diff);
     DP_ASSERT(DP_atomic_get(&lc->refcount) > 0);
     DP_ASSERT(DP_atomic_get(&prev_lc->refcount) > 0);
-    DP_ASSERT(lc->width == prev_lc->width);   // Different sizes could be
-    DP_ASSERT(lc->height == prev_lc->height); // supported, but aren't yet.
-    DP_canvas_diff_check(diff, diff_tile, (DP_LayerContent *[]){lc, prev_lc});
+    DP_canvas_diff_check(diff, diff_tile, (void *[]){lc, prev_lc, diff});
 }
 
 void DP_layer_content_diff(DP_LayerContent *lc, DP_LayerProps *lp,
@@ -226,25 +229,38 @@ static bool mark(void *data, int tile_index)
 {
     DP_ASSERT(data);
     DP_ASSERT(tile_index >= 0);
-    DP_LayerContent *lc = data;
+    DP_LayerContent *lc = ((void **)data)[0];
     DP_ASSERT(tile_index < DP_tile_total_round(lc->width, lc->height));
     return lc->elements[tile_index].tile;
 }
 
-static void layer_content_diff_mark(DP_LayerContent *lc, DP_CanvasDiff *diff)
+static bool mark_prev(void *data, int tile_index)
+{
+    DP_ASSERT(data);
+    DP_ASSERT(tile_index >= 0);
+    DP_LayerContent *lc = ((void **)data)[0];
+    DP_CanvasDiff *diff = ((void **)data)[1];
+    int prev_index = DP_canvas_diff_prev_index(diff, tile_index);
+    DP_ASSERT(prev_index < DP_tile_total_round(lc->width, lc->height));
+    return lc->elements[prev_index].tile;
+}
+
+static void layer_content_diff_mark(DP_LayerContent *lc, DP_CanvasDiff *diff,
+                                    bool prev)
 {
     DP_ASSERT(lc);
     DP_ASSERT(diff);
     DP_ASSERT(DP_atomic_get(&lc->refcount) > 0);
-    DP_canvas_diff_check(diff, mark, lc);
+    DP_canvas_diff_check(diff, prev ? mark_prev : mark, (void *[]){lc, diff});
 }
 
-void DP_layer_content_diff_mark(DP_LayerContent *lc, DP_CanvasDiff *diff)
+void DP_layer_content_diff_mark(DP_LayerContent *lc, DP_CanvasDiff *diff,
+                                bool prev)
 {
     DP_ASSERT(lc);
     DP_ASSERT(diff);
-    layer_content_diff_mark(lc, diff);
-    DP_layer_content_list_diff_mark(lc->sub.contents, diff);
+    layer_content_diff_mark(lc, diff, prev);
+    DP_layer_content_list_diff_mark(lc->sub.contents, diff, prev);
 }
 
 
@@ -273,6 +289,16 @@ DP_Tile *DP_layer_content_tile_at_noinc(DP_LayerContent *lc, int x, int y)
     return lc->elements[y * DP_tile_count_round(lc->width) + x].tile;
 }
 
+DP_Tile *DP_layer_content_tile_at_index_noinc(DP_LayerContent *lc,
+                                              int tile_index)
+{
+    DP_ASSERT(lc);
+    DP_ASSERT(DP_atomic_get(&lc->refcount) > 0);
+    DP_ASSERT(tile_index >= 0);
+    DP_ASSERT(tile_index < DP_tile_total_round(lc->width, lc->height));
+    return lc->elements[tile_index].tile;
+}
+
 static DP_Pixel layer_content_pixel_at(DP_LayerContent *lc, int x, int y)
 {
     DP_ASSERT(lc);
@@ -612,6 +638,88 @@ void DP_layer_content_flatten_tile_to(DP_LayerContent *lc, int tile_index,
 }
 
 
+bool DP_layer_content_compress_cold_tiles(DP_LayerContent *lc)
+{
+    DP_ASSERT(lc);
+    DP_ASSERT(DP_atomic_get(&lc->refcount) > 0);
+    DP_ASSERT(!lc->transient);
+    if (DP_atomic_get(&lc->refcount) == 1) {
+        // Nobody else can see this layer, so we can swap out its tiles.
+        DP_TransientLayerContent *tlc = (DP_TransientLayerContent *)lc;
+        bool complete = true;
+        int count = DP_tile_total_round(lc->width, lc->height);
+        for (int i = 0; i < count; ++i) {
+            DP_Tile *t = tlc->elements[i].tile;
+            if (t) {
+                if (DP_tile_refcount(t) == 1) {
+                    tlc->elements[i].tile = DP_tile_cold_compress(t);
+                }
+                else if (!DP_tile_solid(t)) {
+                    complete = false;
+                }
+            }
+        }
+        return DP_layer_content_list_compress_cold_tiles(lc->sub.contents)
+            && complete;
+    }
+    else {
+        return false;
+    }
+}
+
+bool DP_layer_content_decompress_cold_tiles(DP_LayerContent *lc)
+{
+    DP_ASSERT(lc);
+    DP_ASSERT(DP_atomic_get(&lc->refcount) > 0);
+    DP_ASSERT(!lc->transient);
+    if (DP_atomic_get(&lc->refcount) == 1) {
+        DP_TransientLayerContent *tlc = (DP_TransientLayerContent *)lc;
+        int count = DP_tile_total_round(lc->width, lc->height);
+        for (int i = 0; i < count; ++i) {
+            DP_Tile *t = tlc->elements[i].tile;
+            if (t && DP_tile_cold(t)) {
+                DP_Tile *thawed = DP_tile_cold_decompress(t);
+                if (!thawed) {
+                    return false;
+                }
+                tlc->elements[i].tile = thawed;
+            }
+        }
+        return DP_layer_content_list_decompress_cold_tiles(lc->sub.contents);
+    }
+    else {
+        return true;
+    }
+}
+
+size_t DP_layer_content_unique_tile_bytes(DP_LayerContent *lc,
+                                          DP_LayerContent *other_or_null)
+{
+    DP_ASSERT(lc);
+    DP_ASSERT(DP_atomic_get(&lc->refcount) > 0);
+    if (lc == other_or_null) {
+        return 0;
+    }
+
+    bool comparable = other_or_null && lc->width == other_or_null->width
+                   && lc->height == other_or_null->height;
+    size_t bytes = 0;
+    int count = DP_tile_total_round(lc->width, lc->height);
+    for (int i = 0; i < count; ++i) {
+        DP_Tile *t = lc->elements[i].tile;
+        if (t && !(comparable && other_or_null->elements[i].tile == t)) {
+            bytes += DP_tile_memory_size(t);
+        }
+    }
+
+    return bytes
+         + DP_layer_content_list_unique_tile_bytes(
+               lc->sub.contents, lc->sub.props,
+               other_or_null ? other_or_null->sub.contents : NULL,
+               other_or_null ? other_or_null->sub.props : NULL);
+}
+
+
 static bool has_content(DP_LayerContent *lc)
 {
     DP_ASSERT(lc);
@@ -917,7 +1025,8 @@ DP_transient_layer_content_persist(DP_TransientLayerContent *tlc)
     for (int i = 0; i < count; ++i) {
         DP_Tile *tile = tlc->elements[i].tile;
         if (tile && DP_tile_transient(tile)) {
-            DP_transient_tile_persist(tlc->elements[i].transient_tile);
+            tlc->elements[i].tile =
+                DP_transient_tile_persist(tlc->elements[i].transient_tile);
         }
     }
     if (DP_layer_content_list_transient(tlc->sub.contents)) {
@@ -987,21 +1096,22 @@ DP_transient_layer_content_sub_props_noinc(DP_TransientLayerContent *tlc)
 
 DP_TransientLayerContent *
 DP_transient_layer_content_resize_to(DP_TransientLayerContent *tlc,
-                                     unsigned int context_id, int width,
-                                     int height)
+                                     unsigned int context_id, int top,
+                                     int left, int width, int height)
 {
     DP_ASSERT(tlc);
     DP_ASSERT(DP_atomic_get(&tlc->refcount) > 0);
     DP_ASSERT(tlc->transient);
     int layer_width = tlc->width;
     int layer_height = tlc->height;
-    if (layer_width == width && layer_height == height) {
+    if (layer_width == width && layer_height == height && top == 0
+        && left == 0) {
         return tlc;
     }
     else {
         DP_TransientLayerContent *next = DP_layer_content_resize(
-            (DP_LayerContent *)tlc, context_id, 0, width - layer_width,
-            height - layer_height, 0);
+            (DP_LayerContent *)tlc, context_id, top, width - layer_width - left,
+            height - layer_height - top, left);
         DP_transient_layer_content_decref(tlc);
         return next;
     }
@@ -1332,6 +1442,219 @@ void DP_transient_layer_content_brush_stamp_apply(DP_TransientLayerContent *tlc,
     }
 }
 
+int DP_brush_stamp_max_tile_count(int diameter)
+{
+    DP_ASSERT(diameter >= 0);
+    int tiles_per_side = (diameter + DP_TILE_SIZE - 2) / DP_TILE_SIZE + 1;
+    return tiles_per_side * tiles_per_side;
+}
+
+static int compare_tile_refs(const void *a, const void *b)
+{
+    const DP_BrushStampTileRef *ra = a;
+    const DP_BrushStampTileRef *rb = b;
+    if (ra->tile_index != rb->tile_index) {
+        return ra->tile_index < rb->tile_index ? -1 : 1;
+    }
+    else {
+        return ra->stamp_index < rb->stamp_index ? -1
+             : ra->stamp_index > rb->stamp_index ? 1
+                                                 : 0;
+    }
+}
+
+static int collect_tile_refs(int width, int height, int stamp_count,
+                             DP_BrushStamp *stamps,
+                             DP_BrushStampTileRef *tile_refs)
+{
+    int xtiles = DP_tile_count_round(width);
+    int ref_count = 0;
+    for (int i = 0; i < stamp_count; ++i) {
+        int top = stamps[i].top;
+        int left = stamps[i].left;
+        int d = stamps[i].diameter;
+        if (left + d > 0 && top + d > 0 && left < width && top < height) {
+            int xi0 = DP_max_int(left, 0) / DP_TILE_SIZE;
+            int xi1 = (DP_min_int(left + d, width) - 1) / DP_TILE_SIZE;
+            int yi0 = DP_max_int(top, 0) / DP_TILE_SIZE;
+            int yi1 = (DP_min_int(top + d, height) - 1) / DP_TILE_SIZE;
+            for (int yi = yi0; yi <= yi1; ++yi) {
+                for (int xi = xi0; xi <= xi1; ++xi) {
+                    tile_refs[ref_count++] =
+                        (DP_BrushStampTileRef){yi * xtiles + xi, i};
+                }
+            }
+        }
+    }
+    return ref_count;
+}
+
+static int sort_tile_refs(DP_TransientLayerContent *tlc, int stamp_count,
+                          DP_BrushStamp *stamps,
+                          DP_BrushStampTileRef *tile_refs)
+{
+    int ref_count = collect_tile_refs(tlc->width, tlc->height, stamp_count,
+                                      stamps, tile_refs);
+    // Sorting by tile and then stamp index keeps the order within each tile.
+    qsort(tile_refs, DP_int_to_size(ref_count), sizeof(*tile_refs),
+          compare_tile_refs);
+    return ref_count;
+}
+
+static void brush_stamp_apply_to_tile(DP_TransientTile *tt, uint32_t color,
+                                      int blend_mode, DP_BrushStamp *stamp,
+                                      int tile_x, int tile_y)
+{
+    // Like DP_transient_layer_content_brush_stamp_apply, this only clips to
+    // the tile, not the layer bounds.
+    int d = stamp->diameter;
+    int x0 = DP_max_int(stamp->left, tile_x);
+    int y0 = DP_max_int(stamp->top, tile_y);
+    int x1 = DP_min_int(stamp->left + d, tile_x + DP_TILE_SIZE);
+    int y1 = DP_min_int(stamp->top + d, tile_y + DP_TILE_SIZE);
+    int w = x1 - x0;
+    uint8_t *mask = stamp->data + (y0 - stamp->top) * d + (x0 - stamp->left);
+    DP_transient_tile_brush_apply(tt, (DP_Pixel){color}, blend_mode, mask,
+                                  x0 - tile_x, y0 - tile_y, w, y1 - y0, d - w);
+}
+
+void DP_transient_layer_content_brush_stamps_apply(
+    DP_TransientLayerContent *tlc, unsigned int context_id, uint32_t color,
+    int blend_mode, int stamp_count, DP_BrushStamp *stamps,
+    DP_BrushStampTileRef *tile_refs)
+{
+    DP_ASSERT(tlc);
+    DP_ASSERT(DP_atomic_get(&tlc->refcount) > 0);
+    DP_ASSERT(tlc->transient);
+    DP_ASSERT(stamp_count >= 0);
+    DP_ASSERT(stamps || stamp_count == 0);
+    DP_ASSERT(tile_refs || stamp_count == 0);
+
+    int ref_count = sort_tile_refs(tlc, stamp_count, stamps, tile_refs);
+    int xtiles = DP_tile_count_round(tlc->width);
+    int i = 0;
+    while (i < ref_count) {
+        int tile_index = tile_refs[i].tile_index;
+        int tile_x = tile_index % xtiles * DP_TILE_SIZE;
+        int tile_y = tile_index / xtiles * DP_TILE_SIZE;
+        DP_TransientTile *tt =
+            get_or_create_transient_tile(tlc, context_id, tile_index);
+        do {
+            brush_stamp_apply_to_tile(tt, color, blend_mode,
+                                      &stamps[tile_refs[i].stamp_index],
+                                      tile_x, tile_y);
+            ++i;
+        } while (i < ref_count && tile_refs[i].tile_index == tile_index);
+    }
+}
+
+typedef struct DP_BrushStampBatches {
+    DP_TransientLayerContent *tlc;
+    uint32_t color;
+    int blend_mode;
+    DP_BrushStamp *stamps;
+    DP_BrushStampTileRef *tile_refs;
+    int group_count;
+    int batch_size;
+    DP_Atomic next;
+    DP_Semaphore *sem_done;
+    int *group_starts;
+} DP_BrushStampBatches;
+
+static void apply_brush_stamp_batches(DP_BrushStampBatches *bsb)
+{
+    DP_TransientLayerContent *tlc = bsb->tlc;
+    DP_BrushStamp *stamps = bsb->stamps;
+    DP_BrushStampTileRef *tile_refs = bsb->tile_refs;
+    int *group_starts = bsb->group_starts;
+    int group_count = bsb->group_count;
+    int batch_size = bsb->batch_size;
+    int xtiles = DP_tile_count_round(tlc->width);
+    while (true) {
+        int start = DP_atomic_fetch_add(&bsb->next, batch_size);
+        if (start >= group_count) {
+            break;
+        }
+        int end = DP_min_int(start + batch_size, group_count);
+        for (int group = start; group < end; ++group) {
+            int first = group_starts[group];
+            int tile_index = tile_refs[first].tile_index;
+            int tile_x = tile_index % xtiles * DP_TILE_SIZE;
+            int tile_y = tile_index / xtiles * DP_TILE_SIZE;
+            DP_TransientTile *tt = tlc->elements[tile_index].transient_tile;
+            for (int i = first; i < group_starts[group + 1]; ++i) {
+                brush_stamp_apply_to_tile(tt, bsb->color, bsb->blend_mode,
+                                          &stamps[tile_refs[i].stamp_index],
+                                          tile_x, tile_y);
+            }
+        }
+    }
+}
+
+static void run_brush_stamp_job(void *user)
+{
+    DP_BrushStampBatches *bsb = user;
+    apply_brush_stamp_batches(bsb);
+    DP_SEMAPHORE_MUST_POST(bsb->sem_done);
+}
+
+void DP_transient_layer_content_brush_stamps_apply_parallel(
+    DP_TransientLayerContent *tlc, unsigned int context_id, uint32_t color,
+    int blend_mode, int stamp_count, DP_BrushStamp *stamps,
+    DP_BrushStampTileRef *tile_refs, int *group_starts, DP_Worker *worker,
+    DP_Semaphore *sem_done, int min_batch_size)
+{
+    DP_ASSERT(tlc);
+    DP_ASSERT(DP_atomic_get(&tlc->refcount) > 0);
+    DP_ASSERT(tlc->transient);
+    DP_ASSERT(stamp_count >= 0);
+    DP_ASSERT(stamps || stamp_count == 0);
+    DP_ASSERT(tile_refs || stamp_count == 0);
+    DP_ASSERT(group_starts || stamp_count == 0);
+    DP_ASSERT(worker);
+    DP_ASSERT(sem_done);
+    DP_ASSERT(min_batch_size > 0);
+
+    int ref_count = sort_tile_refs(tlc, stamp_count, stamps, tile_refs);
+    if (ref_count == 0) {
+        return;
+    }
+
+    // Each tile is touched by exactly one thread, so it's only the creation
+    // of the transient tiles that must happen up front on this thread.
+    DP_BrushStampBatches bsb = {
+        tlc,
+        color,
+        blend_mode,
+        stamps,
+        tile_refs,
+        0,
+        min_batch_size,
+        DP_ATOMIC_INIT(0),
+        sem_done,
+        group_starts,
+    };
+    for (int i = 0; i < ref_count; ++i) {
+        int tile_index = tile_refs[i].tile_index;
+        if (i == 0 || tile_refs[i - 1].tile_index != tile_index) {
+            bsb.group_starts[bsb.group_count++] = i;
+            get_or_create_transient_tile(tlc, context_id, tile_index);
+        }
+    }
+    bsb.group_starts[bsb.group_count] = ref_count;
+
+    int batch_count = (bsb.group_count + min_batch_size - 1) / min_batch_size;
+    int helper_count =
+        DP_min_int(DP_worker_thread_count(worker), batch_count - 1);
+    for (int i = 0; i < helper_count; ++i) {
+        DP_worker_push(worker, run_brush_stamp_job, &bsb);
+    }
+    apply_brush_stamp_batches(&bsb);
+    for (int i = 0; i < helper_count; ++i) {
+        DP_SEMAPHORE_MUST_WAIT(sem_done);
+    }
+}
+
 
 void DP_transient_layer_content_list_transient_sublayer_at(
     DP_TransientLayerContent *tlc, int sublayer_index,
@@ -1410,7 +1733,8 @@ void DP_transient_layer_content_merge_all_sublayers(
 }
 
 void DP_transient_layer_content_render_tile(DP_TransientLayerContent *tlc,
-                                            DP_CanvasState *cs, int tile_index)
+                                            DP_CanvasState *cs, int tile_index,
+                                            DP_FlattenCache *fc_or_null)
 {
     DP_ASSERT(tlc);
     DP_ASSERT(DP_atomic_get(&tlc->refcount) > 0);
@@ -1420,6 +1744,7 @@ void DP_transient_layer_content_render_tile(DP_TransientLayerContent *tlc,
     DP_ASSERT(tile_index < DP_tile_total_round(tlc->width, tlc->height));
     DP_Tile **pp = &tlc->elements[tile_index].tile;
     DP_tile_decref_nullable(*pp);
-    *pp =
-        DP_transient_tile_persist(DP_canvas_state_flatten_tile(cs, tile_index));
+    *pp = fc_or_null ? DP_flatten_cache_flatten_tile(fc_or_null, cs, tile_index)
+                     : DP_transient_tile_persist(
+                         DP_canvas_state_flatten_tile(cs, tile_index));
 }
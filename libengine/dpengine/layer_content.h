@@ -26,9 +26,12 @@
 typedef struct DP_BrushStamp DP_BrushStamp;
 typedef struct DP_CanvasDiff DP_CanvasDiff;
 typedef struct DP_CanvasState DP_CanvasState;
+typedef struct DP_FlattenCache DP_FlattenCache;
 typedef struct DP_Image DP_Image;
 typedef struct DP_Rect DP_Rect;
+typedef struct DP_Semaphore DP_Semaphore;
 typedef struct DP_Tile DP_Tile;
+typedef struct DP_Worker DP_Worker;
 
 #ifdef DP_NO_STRICT_ALIASING
 typedef struct DP_LayerContent DP_LayerContent;
@@ -52,6 +55,15 @@ typedef struct DP_LayerPropsList DP_TransientLayerPropsList;
 typedef struct DP_Tile DP_TransientTile;
 #endif
 
+typedef struct DP_BrushStampTileRef {
+    int tile_index;
+    int stamp_index;
+} DP_BrushStampTileRef;
+
+
+// Upper bound on the number of tiles a stamp of the given diameter can touch.
+int DP_brush_stamp_max_tile_count(int diameter);
+
 
 DP_LayerContent *DP_layer_content_incref(DP_LayerContent *lc);
 
@@ -69,7 +81,9 @@ void DP_layer_content_diff(DP_LayerContent *lc, DP_LayerProps *lp,
                            DP_LayerContent *prev_lc, DP_LayerProps *prev_lp,
                            DP_CanvasDiff *diff);
 
-void DP_layer_content_diff_mark(DP_LayerContent *lc, DP_CanvasDiff *diff);
+// Pass true for prev if the layer content is from the previous canvas state.
+void DP_layer_content_diff_mark(DP_LayerContent *lc, DP_CanvasDiff *diff,
+                                bool prev);
 
 int DP_layer_content_width(DP_LayerContent *lc);
 
@@ -77,6 +91,9 @@ int DP_layer_content_height(DP_LayerContent *lc);
 
 DP_Tile *DP_layer_content_tile_at_noinc(DP_LayerContent *lc, int x, int y);
 
+DP_Tile *DP_layer_content_tile_at_index_noinc(DP_LayerContent *lc,
+                                              int tile_index);
+
 uint32_t DP_layer_content_sample_color_at(DP_LayerContent *lc,
                                           uint8_t *stamp_buffer, int x, int y,
                                           int diameter, int last_diameter);
@@ -110,6 +127,19 @@ void DP_layer_content_flatten_tile_to(DP_LayerContent *lc, int tile_index,
                                       DP_TransientTile *tt, uint8_t opacity,
                                       int blend_mode);
 
+// Compresses tiles in place. Only acts on parts of the layer content that
+// aren't shared with anyone else, since compressed tiles are unusable. Returns
+// false if any shared parts were skipped.
+bool DP_layer_content_compress_cold_tiles(DP_LayerContent *lc);
+
+bool DP_layer_content_decompress_cold_tiles(DP_LayerContent *lc);
+
+// Tile memory, including sublayers, that this layer content holds and the
+// other one doesn't have in the same position. Without another layer content
+// to compare against, that's all of it.
+size_t DP_layer_content_unique_tile_bytes(DP_LayerContent *lc,
+                                          DP_LayerContent *other_or_null);
+
 
 DP_TransientLayerContent *DP_transient_layer_content_new(DP_LayerContent *lc);
 
@@ -142,10 +172,12 @@ DP_transient_layer_content_sub_contents_noinc(DP_TransientLayerContent *tlc);
 DP_LayerPropsList *
 DP_transient_layer_content_sub_props_noinc(DP_TransientLayerContent *tlc);
 
+// Moves the content by the given top and left offset and resizes it to the
+// given dimensions. Offsets that are multiples of the tile size are cheap.
 DP_TransientLayerContent *
 DP_transient_layer_content_resize_to(DP_TransientLayerContent *tlc,
-                                     unsigned int context_id, int width,
-                                     int height);
+                                     unsigned int context_id, int top,
+                                     int left, int width, int height);
 
 void DP_transient_layer_content_merge(DP_TransientLayerContent *tlc,
                                       unsigned int context_id,
@@ -173,6 +205,25 @@ void DP_transient_layer_content_brush_stamp_apply(DP_TransientLayerContent *tlc,
                                                   int blend_mode,
                                                   DP_BrushStamp *stamp);
 
+// Same result as applying each stamp in order, but goes tile by tile instead,
+// applying all stamps that touch a tile back-to-back while it's in cache. The
+// tile refs buffer needs room for DP_brush_stamp_max_tile_count of every stamp.
+void DP_transient_layer_content_brush_stamps_apply(
+    DP_TransientLayerContent *tlc, unsigned int context_id, uint32_t color,
+    int blend_mode, int stamp_count, DP_BrushStamp *stamps,
+    DP_BrushStampTileRef *tile_refs);
+
+// Like the above, but spreads the tiles over the worker's threads in batches of
+// the given number of tiles. The calling thread works on them too and the
+// stamps on each tile are still applied in order, so the result is identical.
+// The group starts buffer needs room for one more than the tile refs, the
+// semaphore must be at zero. See DP_draw_context_paint_group_buffer.
+void DP_transient_layer_content_brush_stamps_apply_parallel(
+    DP_TransientLayerContent *tlc, unsigned int context_id, uint32_t color,
+    int blend_mode, int stamp_count, DP_BrushStamp *stamps,
+    DP_BrushStampTileRef *tile_refs, int *group_starts, DP_Worker *worker,
+    DP_Semaphore *sem_done, int min_batch_size);
+
 void DP_transient_layer_content_list_transient_sublayer_at(
     DP_TransientLayerContent *tlc, int sublayer_index,
     DP_TransientLayerContent **out_tlc, DP_TransientLayerProps **out_tlp);
@@ -189,7 +240,8 @@ void DP_transient_layer_content_merge_all_sublayers(
     DP_TransientLayerContent *tl, unsigned int context_id);
 
 void DP_transient_layer_content_render_tile(DP_TransientLayerContent *tlc,
-                                            DP_CanvasState *cs, int tile_index);
+                                            DP_CanvasState *cs, int tile_index,
+                                            DP_FlattenCache *fc_or_null);
 
 
 #endif
@@ -149,11 +149,11 @@ static void diff_layers(DP_LayerContentList *lcl, DP_LayerPropsList *lpl,
 }
 
 static void mark_layers(DP_LayerContentList *lcl, DP_CanvasDiff *diff,
-                        int start, int end)
+                        int start, int end, bool prev)
 {
     for (int i = start; i < end; ++i) {
         DP_layer_content_diff_mark(DP_layer_content_list_at_noinc(lcl, i),
-                                   diff);
+                                   diff, prev);
     }
 }
 
@@ -175,22 +175,22 @@ void DP_layer_content_list_diff(DP_LayerContentList *lcl,
         int old_count = prev_lcl->count;
         if (new_count <= old_count) {
             diff_layers(lcl, lpl, prev_lcl, prev_lpl, diff, new_count);
-            mark_layers(prev_lcl, diff, new_count, old_count);
+            mark_layers(prev_lcl, diff, new_count, old_count, true);
         }
         else {
             diff_layers(lcl, lpl, prev_lcl, prev_lpl, diff, old_count);
-            mark_layers(lcl, diff, old_count, new_count);
+            mark_layers(lcl, diff, old_count, new_count, false);
         }
     }
 }
 
 void DP_layer_content_list_diff_mark(DP_LayerContentList *lcl,
-                                     DP_CanvasDiff *diff)
+                                     DP_CanvasDiff *diff, bool prev)
 {
     DP_ASSERT(lcl);
     DP_ASSERT(diff);
     DP_ASSERT(DP_atomic_get(&lcl->refcount) > 0);
-    mark_layers(lcl, diff, 0, lcl->count);
+    mark_layers(lcl, diff, 0, lcl->count, prev);
 }
 
 
@@ -287,6 +287,93 @@ void DP_layer_content_list_flatten_tile_to(DP_LayerContentList *lcl,
     }
 }
 
+bool DP_layer_content_list_compress_cold_tiles(DP_LayerContentList *lcl)
+{
+    DP_ASSERT(lcl);
+    DP_ASSERT(DP_atomic_get(&lcl->refcount) > 0);
+    DP_ASSERT(!lcl->transient);
+    int count = lcl->count;
+    if (count == 0) {
+        return true; // Empty lists are shared a lot, but there's nothing here.
+    }
+    else if (DP_atomic_get(&lcl->refcount) == 1) {
+        bool complete = true;
+        for (int i = 0; i < count; ++i) {
+            if (!DP_layer_content_compress_cold_tiles(
+                    lcl->elements[i].layer_content)) {
+                complete = false;
+            }
+        }
+        return complete;
+    }
+    else {
+        return false;
+    }
+}
+
+bool DP_layer_content_list_decompress_cold_tiles(DP_LayerContentList *lcl)
+{
+    DP_ASSERT(lcl);
+    DP_ASSERT(DP_atomic_get(&lcl->refcount) > 0);
+    DP_ASSERT(!lcl->transient);
+    if (DP_atomic_get(&lcl->refcount) == 1) {
+        int count = lcl->count;
+        for (int i = 0; i < count; ++i) {
+            if (!DP_layer_content_decompress_cold_tiles(
+                    lcl->elements[i].layer_content)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static DP_LayerContent *find_same_layer(DP_LayerPropsList *lpl, int index,
+                                        DP_LayerContentList *other_lcl,
+                                        DP_LayerPropsList *other_lpl)
+{
+    int layer_id = DP_layer_props_id(DP_layer_props_list_at_noinc(lpl, index));
+    // Layers usually stay where they are, so check the same index first.
+    int other_index;
+    if (index < other_lcl->count
+        && DP_layer_props_id(DP_layer_props_list_at_noinc(other_lpl, index))
+               == layer_id) {
+        other_index = index;
+    }
+    else {
+        other_index = DP_layer_props_list_index_by_id(other_lpl, layer_id);
+    }
+    return other_index < 0 ? NULL
+                           : other_lcl->elements[other_index].layer_content;
+}
+
+size_t DP_layer_content_list_unique_tile_bytes(
+    DP_LayerContentList *lcl, DP_LayerPropsList *lpl,
+    DP_LayerContentList *other_lcl_or_null,
+    DP_LayerPropsList *other_lpl_or_null)
+{
+    DP_ASSERT(lcl);
+    DP_ASSERT(lpl);
+    DP_ASSERT(DP_atomic_get(&lcl->refcount) > 0);
+    DP_ASSERT(lcl->count == DP_layer_props_list_count(lpl));
+    DP_ASSERT(!other_lcl_or_null == !other_lpl_or_null);
+    if (lcl == other_lcl_or_null) {
+        return 0;
+    }
+
+    size_t bytes = 0;
+    int count = lcl->count;
+    for (int i = 0; i < count; ++i) {
+        DP_LayerContent *other_lc_or_null =
+            other_lcl_or_null ? find_same_layer(lpl, i, other_lcl_or_null,
+                                                other_lpl_or_null)
+                              : NULL;
+        bytes += DP_layer_content_unique_tile_bytes(
+            lcl->elements[i].layer_content, other_lc_or_null);
+    }
+    return bytes;
+}
+
 
 DP_TransientLayerContentList *
 DP_transient_layer_content_list_new_init(int reserve)
@@ -63,7 +63,7 @@ void DP_layer_content_list_diff(DP_LayerContentList *lcl,
                                 DP_CanvasDiff *diff);
 
 void DP_layer_content_list_diff_mark(DP_LayerContentList *lcl,
-                                     DP_CanvasDiff *diff);
+                                     DP_CanvasDiff *diff, bool prev);
 
 int DP_layer_content_list_count(DP_LayerContentList *lcl);
 
@@ -85,6 +85,16 @@ void DP_layer_content_list_flatten_tile_to(DP_LayerContentList *lcl,
                                            int tile_index,
                                            DP_TransientTile *tt);
 
+bool DP_layer_content_list_compress_cold_tiles(DP_LayerContentList *lcl);
+
+bool DP_layer_content_list_decompress_cold_tiles(DP_LayerContentList *lcl);
+
+// Layers are matched up with the other list by id.
+size_t DP_layer_content_list_unique_tile_bytes(
+    DP_LayerContentList *lcl, DP_LayerPropsList *lpl,
+    DP_LayerContentList *other_lcl_or_null,
+    DP_LayerPropsList *other_lpl_or_null);
+
 
 DP_TransientLayerContentList *
 DP_transient_layer_content_list_new_init(int reserve);
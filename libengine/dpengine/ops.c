@@ -60,6 +60,7 @@ DP_CanvasState *DP_ops_canvas_resize(DP_CanvasState *cs,
     DP_TransientCanvasState *tcs = DP_transient_canvas_state_new(cs);
     DP_transient_canvas_state_width_set(tcs, width);
     DP_transient_canvas_state_height_set(tcs, height);
+    DP_transient_canvas_state_offset_add(tcs, left, top);
 
     DP_LayerContentList *lcl =
         DP_transient_canvas_state_layer_contents_noinc(tcs);
@@ -323,17 +324,21 @@ DP_CanvasState *DP_ops_layer_visibility(DP_CanvasState *cs, int layer_id,
 DP_CanvasState *DP_ops_put_image(DP_CanvasState *cs, unsigned int context_id,
                                  int layer_id, int blend_mode, int x, int y,
                                  int width, int height,
-                                 const unsigned char *image, size_t image_size)
+                                 const unsigned char *image, size_t image_size,
+                                 DP_Image *decoded_or_null)
 {
     int index = DP_layer_props_list_index_by_id(
         DP_canvas_state_layer_props_noinc(cs), layer_id);
     if (index < 0) {
         DP_error_set("Put image: id %d not found", layer_id);
+        DP_image_free(decoded_or_null);
         return NULL;
     }
 
     DP_Image *img =
-        DP_image_new_from_compressed(width, height, image, image_size);
+        decoded_or_null
+            ? decoded_or_null
+            : DP_image_new_from_compressed(width, height, image, image_size);
     if (!img) {
         return NULL;
     }
@@ -643,10 +648,18 @@ DP_CanvasState *DP_ops_annotation_delete(DP_CanvasState *cs, int annotation_id)
 }
 
 
-DP_CanvasState *DP_ops_draw_dabs(DP_CanvasState *cs, int layer_id,
-                                 int sublayer_id, int sublayer_blend_mode,
-                                 int sublayer_opacity,
-                                 DP_PaintDrawDabsParams *params)
+static int draw_dabs_layer_index(DP_LayerPropsList *lpl, int layer_id)
+{
+    int index = DP_layer_props_list_index_by_id(lpl, layer_id);
+    if (index < 0) {
+        DP_error_set("Draw dabs: id %d not found", layer_id);
+    }
+    return index;
+}
+
+static void draw_dabs(DP_TransientCanvasState *tcs, int index, int sublayer_id,
+                      int sublayer_blend_mode, int sublayer_opacity,
+                      DP_PaintDrawDabsParams *params)
 {
     DP_ASSERT(params);
     DP_ASSERT(sublayer_id >= 0);
@@ -655,14 +668,6 @@ DP_CanvasState *DP_ops_draw_dabs(DP_CanvasState *cs, int layer_id,
     DP_ASSERT(sublayer_id == 0 || sublayer_opacity >= 0);
     DP_ASSERT(sublayer_id == 0 || sublayer_opacity <= UINT8_MAX);
 
-    int index = DP_layer_props_list_index_by_id(
-        DP_canvas_state_layer_props_noinc(cs), layer_id);
-    if (index < 0) {
-        DP_error_set("Draw dabs: id %d not found", layer_id);
-        return NULL;
-    }
-
-    DP_TransientCanvasState *tcs = DP_transient_canvas_state_new(cs);
     DP_TransientLayerContentList *tlcl =
         DP_transient_canvas_state_transient_layer_contents(tcs, 0);
     DP_TransientLayerContent *tlc =
@@ -693,6 +698,37 @@ DP_CanvasState *DP_ops_draw_dabs(DP_CanvasState *cs, int layer_id,
     }
 
     DP_paint_draw_dabs(params, target);
+}
 
+DP_CanvasState *DP_ops_draw_dabs(DP_CanvasState *cs, int layer_id,
+                                 int sublayer_id, int sublayer_blend_mode,
+                                 int sublayer_opacity,
+                                 DP_PaintDrawDabsParams *params)
+{
+    int index = draw_dabs_layer_index(DP_canvas_state_layer_props_noinc(cs),
+                                      layer_id);
+    if (index < 0) {
+        return NULL;
+    }
+
+    DP_TransientCanvasState *tcs = DP_transient_canvas_state_new(cs);
+    draw_dabs(tcs, index, sublayer_id, sublayer_blend_mode, sublayer_opacity,
+              params);
     return DP_transient_canvas_state_persist(tcs);
 }
+
+bool DP_ops_draw_dabs_transient(DP_TransientCanvasState *tcs, int layer_id,
+                                int sublayer_id, int sublayer_blend_mode,
+                                int sublayer_opacity,
+                                DP_PaintDrawDabsParams *params)
+{
+    int index = draw_dabs_layer_index(
+        DP_transient_canvas_state_layer_props_noinc(tcs), layer_id);
+    if (index < 0) {
+        return false;
+    }
+
+    draw_dabs(tcs, index, sublayer_id, sublayer_blend_mode, sublayer_opacity,
+              params);
+    return true;
+}
@@ -31,6 +31,12 @@ typedef struct DP_Quad DP_Quad;
 typedef struct DP_Rect DP_Rect;
 typedef struct DP_Tile DP_Tile;
 
+#ifdef DP_NO_STRICT_ALIASING
+typedef struct DP_TransientCanvasState DP_TransientCanvasState;
+#else
+typedef struct DP_CanvasState DP_TransientCanvasState;
+#endif
+
 
 DP_CanvasState *DP_ops_canvas_resize(DP_CanvasState *cs,
                                      unsigned int context_id, int top,
@@ -58,10 +64,13 @@ DP_CanvasState *DP_ops_layer_delete(DP_CanvasState *cs, unsigned int context_id,
 DP_CanvasState *DP_ops_layer_visibility(DP_CanvasState *cs, int layer_id,
                                         bool visible);
 
+// Takes ownership of the decoded image, if one is given. Otherwise the image
+// is decompressed, but only after the layer has been found.
 DP_CanvasState *DP_ops_put_image(DP_CanvasState *cs, unsigned int context_id,
                                  int layer_id, int blend_mode, int x, int y,
                                  int width, int height,
-                                 const unsigned char *image, size_t image_size);
+                                 const unsigned char *image, size_t image_size,
+                                 DP_Image *decoded_or_null);
 
 DP_CanvasState *DP_ops_region_move(DP_CanvasState *cs, DP_DrawContext *dc,
                                    unsigned int context_id, int layer_id,
@@ -96,5 +105,12 @@ DP_CanvasState *DP_ops_draw_dabs(DP_CanvasState *cs, int layer_id,
                                  int sublayer_opacity,
                                  DP_PaintDrawDabsParams *params);
 
+// Like DP_ops_draw_dabs, but draws onto the given transient canvas state in
+// place. On error, the state is left untouched.
+bool DP_ops_draw_dabs_transient(DP_TransientCanvasState *tcs, int layer_id,
+                                int sublayer_id, int sublayer_blend_mode,
+                                int sublayer_opacity,
+                                DP_PaintDrawDabsParams *params);
+
 
 #endif
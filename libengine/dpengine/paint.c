@@ -32,10 +32,16 @@
 #include <dpcommon/atomic.h>
 #include <dpcommon/common.h>
 #include <dpcommon/conversions.h>
+#include <dpcommon/cpu.h>
+#include <dpcommon/worker.h>
 #include <dpmsg/message.h>
 #include <dpmsg/messages/draw_dabs.h>
 #include <math.h>
 
+#ifdef DP_CPU_X64
+#    include <immintrin.h>
+#endif
+
 
 // These "classic" brush stamps are based on GIMP, see license above.
 
@@ -46,57 +52,567 @@
 #define CLASSIC_LUT_COUNT \
     (CLASSIC_LUT_MAX_HARDNESS - CLASSIC_LUT_MIN_HARDNESS + 1)
 
-static float *generate_classic_lut(int index)
+// Reduced-precision tables store their values scaled to this. They're padded
+// by one entry so that vector code can load them 32 bits at a time.
+#define CLASSIC_LUT_COMPACT_MAX 65535.0f
+
+typedef struct DP_ClassicLut {
+    const float *values;
+    const uint16_t *compact_values; // Used instead of values if not NULL.
+} DP_ClassicLut;
+
+static DP_AtomicPtr classic_luts[CLASSIC_LUT_COUNT];
+static DP_AtomicPtr compact_classic_luts[CLASSIC_LUT_COUNT];
+static DP_Atomic classic_luts_compact;
+
+static double classic_lut_exponent(int index)
 {
-    DP_debug("Generating classic dab lookup table for index %d", index);
-    float *cl = DP_malloc(sizeof(*cl) * CLASSIC_LUT_SIZE);
     double h = 1.0 - (index / 100.0);
-    double exponent = h < 0.0000004 ? 1000000.0 : 0.4 / h;
+    return h < 0.0000004 ? 1000000.0 : 0.4 / h;
+}
+
+static double classic_lut_generate_value(double exponent, int i)
+{
     double radius = CLASSIC_LUT_RADIUS;
+    return 1.0 - pow(pow(sqrt(i) / radius, exponent), 2.0);
+}
+
+static void *generate_classic_lut(int index)
+{
+    DP_debug("Generating classic dab lookup table for index %d", index);
+    float *cl = DP_malloc(sizeof(*cl) * CLASSIC_LUT_SIZE);
+    double exponent = classic_lut_exponent(index);
     for (int i = 0; i < CLASSIC_LUT_SIZE; ++i) {
-        double d = 1.0 - pow(pow(sqrt(i) / radius, exponent), 2.0);
-        cl[i] = DP_double_to_float(d);
+        cl[i] = DP_double_to_float(classic_lut_generate_value(exponent, i));
     }
     return cl;
 }
 
-static const float *get_classic_lut(double hardness)
+static void *generate_compact_classic_lut(int index)
+{
+    DP_debug("Generating compact classic dab lookup table for index %d",
+             index);
+    uint16_t *ccl = DP_malloc(sizeof(*ccl) * (CLASSIC_LUT_SIZE + 1));
+    double exponent = classic_lut_exponent(index);
+    for (int i = 0; i < CLASSIC_LUT_SIZE; ++i) {
+        double d = DP_min_double(
+            DP_max_double(classic_lut_generate_value(exponent, i), 0.0), 1.0);
+        ccl[i] = DP_double_to_uint16(d * CLASSIC_LUT_COMPACT_MAX + 0.5);
+    }
+    ccl[CLASSIC_LUT_SIZE] = 0;
+    return ccl;
+}
+
+// Tables are generated without holding a lock. If several threads race to
+// generate the same one, the first one wins and the others toss theirs.
+static void *get_or_generate_classic_lut(DP_AtomicPtr *luts, int index,
+                                         void *(*generate)(int))
+{
+    void *lut = DP_atomic_get(&luts[index]);
+    if (lut) {
+        return lut;
+    }
+    else {
+        void *expected = NULL;
+        lut = generate(index);
+        if (DP_atomic_compare_exchange(&luts[index], &expected, lut)) {
+            return lut;
+        }
+        else {
+            DP_free(lut);
+            return expected;
+        }
+    }
+}
+
+static int get_classic_lut_index(double hardness)
 {
-    DP_ATOMIC_DECLARE_STATIC_SPIN_LOCK(lock);
-    static float *classic_luts[CLASSIC_LUT_COUNT];
     int index = DP_double_to_int(hardness * 100.0);
     DP_ASSERT(index >= CLASSIC_LUT_MIN_HARDNESS);
     DP_ASSERT(index <= CLASSIC_LUT_MAX_HARDNESS);
-    float *cl = classic_luts[index];
-    if (cl) {
-        return cl;
+    return index;
+}
+
+static const float *get_classic_lut(double hardness)
+{
+    return get_or_generate_classic_lut(
+        classic_luts, get_classic_lut_index(hardness), generate_classic_lut);
+}
+
+static DP_ClassicLut get_classic_stamp_lut(double hardness)
+{
+    int index = get_classic_lut_index(hardness);
+    if (DP_atomic_get(&classic_luts_compact)) {
+        return (DP_ClassicLut){
+            NULL, get_or_generate_classic_lut(compact_classic_luts, index,
+                                              generate_compact_classic_lut)};
     }
     else {
-        DP_atomic_lock(&lock);
-        cl = classic_luts[index];
-        if (!cl) {
-            cl = generate_classic_lut(index);
-            classic_luts[index] = cl;
+        return (DP_ClassicLut){get_or_generate_classic_lut(
+                                   classic_luts, index, generate_classic_lut),
+                               NULL};
+    }
+}
+
+static float classic_lut_at(const DP_ClassicLut *lut, int i)
+{
+    const uint16_t *compact_values = lut->compact_values;
+    return compact_values ? compact_values[i] / CLASSIC_LUT_COMPACT_MAX
+                          : lut->values[i];
+}
+
+static void generate_classic_lut_job(void *user)
+{
+    DP_AtomicPtr *slot = user;
+    get_or_generate_classic_lut(classic_luts,
+                                (int)(slot - classic_luts),
+                                generate_classic_lut);
+}
+
+static void generate_compact_classic_lut_job(void *user)
+{
+    DP_AtomicPtr *slot = user;
+    get_or_generate_classic_lut(compact_classic_luts,
+                                (int)(slot - compact_classic_luts),
+                                generate_compact_classic_lut);
+}
+
+void DP_paint_classic_luts_init(DP_Worker *worker_or_null)
+{
+    bool compact = DP_atomic_get(&classic_luts_compact);
+    DP_AtomicPtr *luts = compact ? compact_classic_luts : classic_luts;
+    for (int i = 0; i < CLASSIC_LUT_COUNT; ++i) {
+        if (worker_or_null) {
+            DP_worker_push(worker_or_null,
+                           compact ? generate_compact_classic_lut_job
+                                   : generate_classic_lut_job,
+                           &luts[i]);
+        }
+        else {
+            get_or_generate_classic_lut(luts, i,
+                                        compact ? generate_compact_classic_lut
+                                                : generate_classic_lut);
         }
-        DP_atomic_unlock(&lock);
-        return cl;
     }
 }
 
+bool DP_paint_classic_luts_compact(void)
+{
+    return DP_atomic_get(&classic_luts_compact);
+}
+
+void DP_paint_classic_luts_compact_set(bool compact)
+{
+    DP_atomic_set(&classic_luts_compact, compact);
+}
+
 
 static DP_BrushStamp make_brush_stamp1(DP_DrawContext *dc)
 {
     return (DP_BrushStamp){0, 0, 0, DP_draw_context_stamp_buffer1(dc)};
 }
 
-static DP_BrushStamp make_brush_stamp2(DP_DrawContext *dc)
+
+// Stamps are collected and then applied tile by tile, rather than one after
+// the other, see DP_transient_layer_content_brush_stamps_apply. The batch gets
+// flushed when one of the draw context's buffers runs out of room.
+typedef struct DP_DabBatch {
+    DP_TransientLayerContent *tlc;
+    unsigned int context_id;
+    uint32_t color;
+    int blend_mode;
+    uint8_t *masks;
+    size_t mask_used;
+    DP_BrushStamp *stamps;
+    int stamp_count;
+    DP_BrushStampTileRef *tile_refs;
+    int tile_ref_bound;
+    int *group_starts;
+    DP_Worker *worker;
+    DP_Semaphore *sem_done;
+    int min_batch_size;
+} DP_DabBatch;
+
+static DP_DabBatch dab_batch_make(DP_PaintDrawDabsParams *params,
+                                  DP_TransientLayerContent *tlc)
+{
+    DP_DrawContext *dc = params->draw_context;
+    int min_batch_size;
+    DP_Worker *worker = DP_draw_context_paint_worker(dc, &min_batch_size);
+    return (DP_DabBatch){tlc,
+                         params->context_id,
+                         params->color,
+                         params->blend_mode,
+                         DP_draw_context_dab_mask_buffer(dc),
+                         0,
+                         DP_draw_context_dab_stamp_buffer(dc),
+                         0,
+                         DP_draw_context_dab_tile_ref_buffer(dc),
+                         0,
+                         DP_draw_context_paint_group_buffer(dc),
+                         worker,
+                         DP_draw_context_paint_semaphore(dc),
+                         min_batch_size};
+}
+
+static void dab_batch_flush(DP_DabBatch *batch)
+{
+    if (batch->stamp_count != 0) {
+        if (batch->worker) {
+            DP_transient_layer_content_brush_stamps_apply_parallel(
+                batch->tlc, batch->context_id, batch->color, batch->blend_mode,
+                batch->stamp_count, batch->stamps, batch->tile_refs,
+                batch->group_starts, batch->worker, batch->sem_done,
+                batch->min_batch_size);
+        }
+        else {
+            DP_transient_layer_content_brush_stamps_apply(
+                batch->tlc, batch->context_id, batch->color, batch->blend_mode,
+                batch->stamp_count, batch->stamps, batch->tile_refs);
+        }
+        batch->mask_used = 0;
+        batch->stamp_count = 0;
+        batch->tile_ref_bound = 0;
+    }
+}
+
+// Makes room for one more stamp and its mask, flushing the batch if it's full.
+// Returns true if that happened, masks pushed before are gone in that case.
+static bool dab_batch_reserve(DP_DabBatch *batch, int diameter)
+{
+    size_t mask_size = DP_int_to_size(DP_square_int(diameter));
+    if (batch->stamp_count == DP_DRAW_CONTEXT_DAB_STAMP_BUFFER_COUNT
+        || batch->mask_used + mask_size > DP_DRAW_CONTEXT_DAB_MASK_BUFFER_SIZE
+        || batch->tile_ref_bound + DP_brush_stamp_max_tile_count(diameter)
+               > DP_DRAW_CONTEXT_DAB_TILE_REF_BUFFER_COUNT) {
+        dab_batch_flush(batch);
+        return true;
+    }
+    else {
+        return false;
+    }
+}
+
+static uint8_t *dab_batch_mask_push(DP_DabBatch *batch, int diameter)
+{
+    size_t mask_size = DP_int_to_size(DP_square_int(diameter));
+    DP_ASSERT(batch->mask_used + mask_size
+              <= DP_DRAW_CONTEXT_DAB_MASK_BUFFER_SIZE);
+    uint8_t *mask = batch->masks + batch->mask_used;
+    batch->mask_used += mask_size;
+    return mask;
+}
+
+static void dab_batch_stamp_push(DP_DabBatch *batch, DP_BrushStamp *stamp)
+{
+    DP_ASSERT(batch->stamp_count < DP_DRAW_CONTEXT_DAB_STAMP_BUFFER_COUNT);
+    batch->stamps[batch->stamp_count++] = *stamp;
+    batch->tile_ref_bound += DP_brush_stamp_max_tile_count(stamp->diameter);
+    DP_ASSERT(batch->tile_ref_bound
+              <= DP_DRAW_CONTEXT_DAB_TILE_REF_BUFFER_COUNT);
+}
+
+
+// Mask kernels, split out so that they can be vectorized. The vectorized
+// versions use the same double-precision math in the same order as the plain
+// ones, so that they generate identical masks.
+
+static uint8_t classic_mask_value(const DP_ClassicLut *lut, double dist,
+                                  uint8_t o)
+{
+    int i = DP_double_to_int(dist);
+    return i < CLASSIC_LUT_SIZE ? DP_double_to_uint8(classic_lut_at(lut, i) * o)
+                                : 0;
+}
+
+static double classic_lut_value(const DP_ClassicLut *lut, double dist)
+{
+    int i = DP_double_to_int(dist);
+    return i < CLASSIC_LUT_SIZE ? classic_lut_at(lut, i) : 0.0;
+}
+
+static void fill_classic_mask(uint8_t *d, int diameter, double r,
+                              float offset, float fudge,
+                              const DP_ClassicLut *lut, float lut_scale,
+                              uint8_t o)
+{
+    for (int y = 0; y < diameter; ++y) {
+        double yy = DP_square_double(y - r + offset);
+        for (int x = 0; x < diameter; ++x) {
+            double dist =
+                (DP_square_double(x - r + offset) + yy) * fudge * lut_scale;
+            *(d++) = classic_mask_value(lut, dist, o);
+        }
+    }
+}
+
+static uint8_t high_res_mask_value(const DP_ClassicLut *lut, float lut_scale,
+                                   double o, double xx0, double xx1,
+                                   double yy0, double yy1)
+{
+    double d = classic_lut_value(lut, (xx0 + yy0) * lut_scale)
+             + classic_lut_value(lut, (xx0 + yy1) * lut_scale)
+             + classic_lut_value(lut, (xx1 + yy0) * lut_scale)
+             + classic_lut_value(lut, (xx1 + yy1) * lut_scale);
+    return DP_double_to_uint8(d * o);
+}
+
+static void fill_high_res_mask(uint8_t *ptr, int diameter, double radius,
+                               float offset, const DP_ClassicLut *lut,
+                               float lut_scale, double o)
+{
+    for (int y = 0; y < diameter; ++y) {
+        double yy0 = DP_square_double(y * 2.0 - radius + offset);
+        double yy1 = DP_square_double(y * 2.0 + 1.0 - radius + offset);
+        for (int x = 0; x < diameter; ++x) {
+            double xx0 = DP_square_double(x * 2.0 - radius + offset);
+            double xx1 = DP_square_double(x * 2.0 + 1.0 - radius + offset);
+            *(ptr++) =
+                high_res_mask_value(lut, lut_scale, o, xx0, xx1, yy0, yy1);
+        }
+    }
+}
+
+static void fill_round_pixel_mask(uint8_t *data, int diameter, uint8_t opacity)
+{
+    double r = diameter / 2.0;
+    double rr = DP_square_double(r);
+    for (int y = 0; y < diameter; ++y) {
+        double yy = DP_square_double(y - r + 0.5);
+        for (int x = 0; x < diameter; ++x) {
+            double xx = DP_square_double(x - r + 0.5);
+            *(data++) = xx + yy <= rr ? opacity : 0;
+        }
+    }
+}
+
+static uint8_t offset_mask_value(const uint8_t *src, int diameter, double k0,
+                                 double k1, double k2, double k3)
+{
+    return DP_double_to_uint8(src[0] * k0 + src[1] * k1 + src[diameter] * k2
+                              + src[diameter + 1] * k3);
+}
+
+static void fill_offset_mask(uint8_t *dst, const uint8_t *src, int diameter,
+                             double k0, double k1, double k2, double k3)
+{
+    *(dst++) = DP_double_to_uint8(src[0] * k3);
+    for (int x = 0; x < diameter - 1; ++x) {
+        *(dst++) = DP_double_to_uint8(src[x] * k2 + src[x + 1] * k3);
+    }
+    for (int y = 0; y < diameter - 1; ++y) {
+        int yd = y * diameter;
+        *(dst++) = DP_double_to_uint8(src[yd] * k1 + src[yd + diameter] * k3);
+        for (int x = 0; x < diameter - 1; ++x) {
+            *(dst++) =
+                offset_mask_value(src + yd + x, diameter, k0, k1, k2, k3);
+        }
+    }
+}
+
+#ifdef DP_CPU_X64
+
+DP_TARGET_BEGIN("avx2")
+
+static DP_FORCE_INLINE __m256d iota_avx2(int x)
+{
+    return _mm256_add_pd(_mm256_set1_pd(x), _mm256_setr_pd(0.0, 1.0, 2.0, 3.0));
+}
+
+static DP_FORCE_INLINE __m256d square_avx2(__m256d a)
 {
-    return (DP_BrushStamp){0, 0, 0, DP_draw_context_stamp_buffer2(dc)};
+    return _mm256_mul_pd(a, a);
 }
 
+static DP_FORCE_INLINE __m128 gather_classic_lut_avx2(const DP_ClassicLut *lut,
+                                                      __m256d dist)
+{
+    __m128i i = _mm256_cvttpd_epi32(dist);
+    __m128i in_range = _mm_cmplt_epi32(i, _mm_set1_epi32(CLASSIC_LUT_SIZE));
+    const uint16_t *compact_values = lut->compact_values;
+    if (compact_values) {
+        // Loads 32 bits per entry and masks off the next one, the table has
+        // padding at the end so that this doesn't read out of bounds.
+        __m128i values = _mm_and_si128(
+            _mm_mask_i32gather_epi32(_mm_setzero_si128(),
+                                     (const int *)compact_values, i, in_range,
+                                     2),
+            _mm_set1_epi32(0xffff));
+        return _mm_div_ps(_mm_cvtepi32_ps(values),
+                          _mm_set1_ps(CLASSIC_LUT_COMPACT_MAX));
+    }
+    else {
+        return _mm_mask_i32gather_ps(_mm_setzero_ps(), lut->values, i,
+                                     _mm_castsi128_ps(in_range), 4);
+    }
+}
+
+// Stores four 32 bit values between 0 and 255 as bytes.
+static DP_FORCE_INLINE void store_mask_avx2(uint8_t *dst, __m128i values)
+{
+    __m128i packed = _mm_packus_epi16(_mm_packus_epi32(values, values),
+                                      _mm_setzero_si128());
+    int32_t m = _mm_cvtsi128_si32(packed);
+    memcpy(dst, &m, sizeof(m));
+}
+
+static DP_FORCE_INLINE __m256d load_mask_avx2(const uint8_t *src)
+{
+    int32_t m;
+    memcpy(&m, src, sizeof(m));
+    return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(m)));
+}
+
+static void fill_classic_mask_avx2(uint8_t *d, int diameter, double r,
+                                   float offset, float fudge,
+                                   const DP_ClassicLut *lut, float lut_scale,
+                                   uint8_t o)
+{
+    int vector_w = diameter - diameter % 4;
+    __m256d vr = _mm256_set1_pd(r);
+    __m256d voffset = _mm256_set1_pd(offset);
+    __m256d vfudge = _mm256_set1_pd(fudge);
+    __m256d vscale = _mm256_set1_pd(lut_scale);
+    __m128 vo = _mm_set1_ps(o);
+    for (int y = 0; y < diameter; ++y) {
+        double yy = DP_square_double(y - r + offset);
+        __m256d vyy = _mm256_set1_pd(yy);
+        int x = 0;
+        for (; x < vector_w; x += 4, d += 4) {
+            __m256d xx = square_avx2(
+                _mm256_add_pd(_mm256_sub_pd(iota_avx2(x), vr), voffset));
+            __m256d dist = _mm256_mul_pd(
+                _mm256_mul_pd(_mm256_add_pd(xx, vyy), vfudge), vscale);
+            __m128 values = gather_classic_lut_avx2(lut, dist);
+            store_mask_avx2(d, _mm_cvttps_epi32(_mm_mul_ps(values, vo)));
+        }
+        for (; x < diameter; ++x) {
+            double dist =
+                (DP_square_double(x - r + offset) + yy) * fudge * lut_scale;
+            *(d++) = classic_mask_value(lut, dist, o);
+        }
+    }
+}
+
+static void fill_high_res_mask_avx2(uint8_t *ptr, int diameter, double radius,
+                                    float offset, const DP_ClassicLut *lut,
+                                    float lut_scale, double o)
+{
+    int vector_w = diameter - diameter % 4;
+    __m256d vradius = _mm256_set1_pd(radius);
+    __m256d voffset = _mm256_set1_pd(offset);
+    __m256d vscale = _mm256_set1_pd(lut_scale);
+    __m256d vo = _mm256_set1_pd(o);
+    __m256d two = _mm256_set1_pd(2.0);
+    __m256d one = _mm256_set1_pd(1.0);
+    for (int y = 0; y < diameter; ++y) {
+        double yy0 = DP_square_double(y * 2.0 - radius + offset);
+        double yy1 = DP_square_double(y * 2.0 + 1.0 - radius + offset);
+        __m256d vyy0 = _mm256_set1_pd(yy0);
+        __m256d vyy1 = _mm256_set1_pd(yy1);
+        int x = 0;
+        for (; x < vector_w; x += 4, ptr += 4) {
+            __m256d x2 = _mm256_mul_pd(iota_avx2(x), two);
+            __m256d xx0 = square_avx2(
+                _mm256_add_pd(_mm256_sub_pd(x2, vradius), voffset));
+            __m256d xx1 = square_avx2(_mm256_add_pd(
+                _mm256_sub_pd(_mm256_add_pd(x2, one), vradius), voffset));
+            __m256d d = _mm256_add_pd(
+                _mm256_add_pd(
+                    _mm256_add_pd(
+                        _mm256_cvtps_pd(gather_classic_lut_avx2(
+                            lut, _mm256_mul_pd(_mm256_add_pd(xx0, vyy0),
+                                               vscale))),
+                        _mm256_cvtps_pd(gather_classic_lut_avx2(
+                            lut, _mm256_mul_pd(_mm256_add_pd(xx0, vyy1),
+                                               vscale)))),
+                    _mm256_cvtps_pd(gather_classic_lut_avx2(
+                        lut,
+                        _mm256_mul_pd(_mm256_add_pd(xx1, vyy0), vscale)))),
+                _mm256_cvtps_pd(gather_classic_lut_avx2(
+                    lut, _mm256_mul_pd(_mm256_add_pd(xx1, vyy1), vscale))));
+            store_mask_avx2(ptr, _mm256_cvttpd_epi32(_mm256_mul_pd(d, vo)));
+        }
+        for (; x < diameter; ++x) {
+            double xx0 = DP_square_double(x * 2.0 - radius + offset);
+            double xx1 = DP_square_double(x * 2.0 + 1.0 - radius + offset);
+            *(ptr++) =
+                high_res_mask_value(lut, lut_scale, o, xx0, xx1, yy0, yy1);
+        }
+    }
+}
+
+static void fill_round_pixel_mask_avx2(uint8_t *data, int diameter,
+                                       uint8_t opacity)
+{
+    int vector_w = diameter - diameter % 4;
+    double r = diameter / 2.0;
+    double rr = DP_square_double(r);
+    __m256d vr = _mm256_set1_pd(r);
+    __m256d vrr = _mm256_set1_pd(rr);
+    __m256d half = _mm256_set1_pd(0.5);
+    __m256d vopacity = _mm256_set1_pd(opacity);
+    for (int y = 0; y < diameter; ++y) {
+        double yy = DP_square_double(y - r + 0.5);
+        __m256d vyy = _mm256_set1_pd(yy);
+        int x = 0;
+        for (; x < vector_w; x += 4, data += 4) {
+            __m256d xx = square_avx2(
+                _mm256_add_pd(_mm256_sub_pd(iota_avx2(x), vr), half));
+            __m256d inside =
+                _mm256_cmp_pd(_mm256_add_pd(xx, vyy), vrr, _CMP_LE_OQ);
+            store_mask_avx2(
+                data, _mm256_cvttpd_epi32(_mm256_and_pd(inside, vopacity)));
+        }
+        for (; x < diameter; ++x) {
+            double xx = DP_square_double(x - r + 0.5);
+            *(data++) = xx + yy <= rr ? opacity : 0;
+        }
+    }
+}
+
+static void fill_offset_mask_avx2(uint8_t *dst, const uint8_t *src,
+                                  int diameter, double k0, double k1,
+                                  double k2, double k3)
+{
+    *(dst++) = DP_double_to_uint8(src[0] * k3);
+    for (int x = 0; x < diameter - 1; ++x) {
+        *(dst++) = DP_double_to_uint8(src[x] * k2 + src[x + 1] * k3);
+    }
+    int w = diameter - 1;
+    int vector_w = w - w % 4;
+    __m256d vk0 = _mm256_set1_pd(k0);
+    __m256d vk1 = _mm256_set1_pd(k1);
+    __m256d vk2 = _mm256_set1_pd(k2);
+    __m256d vk3 = _mm256_set1_pd(k3);
+    for (int y = 0; y < diameter - 1; ++y) {
+        int yd = y * diameter;
+        *(dst++) = DP_double_to_uint8(src[yd] * k1 + src[yd + diameter] * k3);
+        int x = 0;
+        for (; x < vector_w; x += 4, dst += 4) {
+            const uint8_t *s = src + yd + x;
+            __m256d sum = _mm256_add_pd(
+                _mm256_add_pd(
+                    _mm256_add_pd(_mm256_mul_pd(load_mask_avx2(s), vk0),
+                                  _mm256_mul_pd(load_mask_avx2(s + 1), vk1)),
+                    _mm256_mul_pd(load_mask_avx2(s + diameter), vk2)),
+                _mm256_mul_pd(load_mask_avx2(s + diameter + 1), vk3));
+            store_mask_avx2(dst, _mm256_cvttpd_epi32(sum));
+        }
+        for (; x < w; ++x) {
+            *(dst++) =
+                offset_mask_value(src + yd + x, diameter, k0, k1, k2, k3);
+        }
+    }
+}
+
+DP_TARGET_END
+
+#endif
+
 
 static void prepare_stamp(DP_BrushStamp *stamp, double hardness, double radius,
-                          int diameter, const float **out_lut,
+                          int diameter, DP_ClassicLut *out_lut,
                           float *out_lut_scale)
 {
     DP_ASSERT(diameter <= DP_DRAW_CONTEXT_STAMP_MAX_DIAMETER);
@@ -107,7 +623,7 @@ static void prepare_stamp(DP_BrushStamp *stamp, double hardness, double radius,
     stamp->top = stamp_offsets;
     stamp->left = stamp_offsets;
 
-    *out_lut = get_classic_lut(hardness);
+    *out_lut = get_classic_stamp_lut(hardness);
     *out_lut_scale = DP_double_to_float(
         DP_square_double((CLASSIC_LUT_RADIUS - 1.0) / radius));
 }
@@ -145,20 +661,20 @@ static void get_mask(DP_BrushStamp *stamp, double radius, double hardness,
                     : raw_diameter_even && r < 8.0 ? 0.9f
                                                    : 1.0f;
 
-        const float *lut;
+        DP_ClassicLut lut;
         float lut_scale;
         prepare_stamp(stamp, hardness, r, diameter, &lut, &lut_scale);
-        uint8_t *d = stamp->data;
-
-        for (int y = 0; y < diameter; ++y) {
-            double yy = DP_square_double(y - r + offset);
-            for (int x = 0; x < diameter; ++x) {
-                double dist =
-                    (DP_square_double(x - r + offset) + yy) * fudge * lut_scale;
-                int i = DP_double_to_int(dist);
-                *d = i < CLASSIC_LUT_SIZE ? DP_double_to_uint8(lut[i] * o) : 0;
-                ++d;
-            }
+        switch (DP_cpu_support) {
+#ifdef DP_CPU_X64
+        case DP_CPU_SUPPORT_AVX2:
+            fill_classic_mask_avx2(stamp->data, diameter, r, offset, fudge,
+                                   &lut, lut_scale, o);
+            break;
+#endif
+        default:
+            fill_classic_mask(stamp->data, diameter, r, offset, fudge, &lut,
+                              lut_scale, o);
+            break;
         }
     }
 }
@@ -180,31 +696,21 @@ static void get_high_res_mask(DP_BrushStamp *stamp, double radius,
         offset = raw_offset - 1.5f;
     }
 
-    const float *lut;
+    DP_ClassicLut lut;
     float lut_scale;
     prepare_stamp(stamp, hardness, radius, diameter, &lut, &lut_scale);
-    uint8_t *ptr = stamp->data;
     double o = opacity * (255 / 4);
-
-    for (int y = 0; y < diameter; ++y) {
-        double yy0 = DP_square_double(y * 2.0 - radius + offset);
-        double yy1 = DP_square_double(y * 2.0 + 1.0 - radius + offset);
-
-        for (int x = 0; x < diameter; ++x) {
-            double xx0 = DP_square_double(x * 2.0 - radius + offset);
-            double xx1 = DP_square_double(x * 2.0 + 1.0 - radius + offset);
-
-            int dist00 = DP_double_to_int((xx0 + yy0) * lut_scale);
-            int dist01 = DP_double_to_int((xx0 + yy1) * lut_scale);
-            int dist10 = DP_double_to_int((xx1 + yy0) * lut_scale);
-            int dist11 = DP_double_to_int((xx1 + yy1) * lut_scale);
-
-            double d = (dist00 < CLASSIC_LUT_SIZE ? lut[dist00] : 0.0)
-                     + (dist01 < CLASSIC_LUT_SIZE ? lut[dist01] : 0.0)
-                     + (dist10 < CLASSIC_LUT_SIZE ? lut[dist10] : 0.0)
-                     + (dist11 < CLASSIC_LUT_SIZE ? lut[dist11] : 0.0);
-            *(ptr++) = DP_double_to_uint8(d * o);
-        }
+    switch (DP_cpu_support) {
+#ifdef DP_CPU_X64
+    case DP_CPU_SUPPORT_AVX2:
+        fill_high_res_mask_avx2(stamp->data, diameter, radius, offset, &lut,
+                                lut_scale, o);
+        break;
+#endif
+    default:
+        fill_high_res_mask(stamp->data, diameter, radius, offset, &lut,
+                           lut_scale, o);
+        break;
     }
 }
 
@@ -217,22 +723,17 @@ static void offset_mask(DP_BrushStamp *dst_stamp, DP_BrushStamp *src_stamp,
     double k1 = (1.0 - xfrac) * yfrac;
     double k2 = xfrac * (1.0 - yfrac);
     double k3 = (1.0 - xfrac) * (1.0 - yfrac);
-    uint8_t *src = src_stamp->data;
-    uint8_t *dst = dst_stamp->data;
-
-    *(dst++) = DP_double_to_uint8(src[0] * k3);
-    for (int x = 0; x < diameter - 1; ++x) {
-        *(dst++) = DP_double_to_uint8(src[x] * k2 + src[x + 1] * k3);
-    }
-    for (int y = 0; y < diameter - 1; ++y) {
-        int yd = y * diameter;
-        *(dst++) = DP_double_to_uint8(src[yd] * k1 + src[yd + diameter] * k3);
-        for (int x = 0; x < diameter - 1; ++x) {
-            *(dst++) =
-                DP_double_to_uint8(src[yd + x] * k0 + src[yd + x + 1] * k1
-                                   + src[yd + diameter + x] * k2
-                                   + src[yd + diameter + x + 1] * k3);
-        }
+    switch (DP_cpu_support) {
+#ifdef DP_CPU_X64
+    case DP_CPU_SUPPORT_AVX2:
+        fill_offset_mask_avx2(dst_stamp->data, src_stamp->data, diameter, k0,
+                              k1, k2, k3);
+        break;
+#endif
+    default:
+        fill_offset_mask(dst_stamp->data, src_stamp->data, diameter, k0, k1,
+                         k2, k3);
+        break;
     }
 }
 
@@ -281,37 +782,81 @@ static void get_classic_offset_stamp(DP_BrushStamp *offset_stamp,
     offset_mask(offset_stamp, mask_stamp, xfrac, yfrac);
 }
 
+// Classic stamps only depend on the dab's size, hardness and opacity and on the
+// subpixel part of its position, which is given in quarter pixels.
+static uint64_t classic_stamp_cache_key(DP_ClassicBrushDab *dab, int xfrac,
+                                        int yfrac)
+{
+    uint64_t size = DP_int_to_uint32(DP_classic_brush_dab_size(dab));
+    uint32_t hardness = DP_classic_brush_dab_hardness(dab);
+    uint32_t opacity = DP_classic_brush_dab_opacity(dab);
+    return (size << 20) | (hardness << 12) | (opacity << 4)
+         | (DP_int_to_uint32(xfrac) << 2) | DP_int_to_uint32(yfrac);
+}
+
+// Returns a stamp positioned relative to the whole pixel the dab is on.
+static DP_BrushStamp *get_classic_cached_stamp(DP_DrawContext *dc,
+                                               DP_ClassicBrushDab *dab,
+                                               uint64_t key, int xfrac,
+                                               int yfrac)
+{
+    DP_BrushStamp *cached = DP_draw_context_stamp_cache_get(dc, key);
+    if (!cached) {
+        DP_BrushStamp mask_stamp = make_brush_stamp1(dc);
+        get_classic_mask_stamp(&mask_stamp,
+                               DP_classic_brush_dab_size(dab) / 256.0,
+                               DP_classic_brush_dab_hardness(dab) / 255.0,
+                               DP_classic_brush_dab_opacity(dab) / 255.0);
+        cached = DP_draw_context_stamp_cache_put(dc, key, mask_stamp.diameter);
+        get_classic_offset_stamp(cached, &mask_stamp, xfrac / 4.0,
+                                 yfrac / 4.0);
+    }
+    return cached;
+}
+
 static void draw_dabs_classic(DP_PaintDrawDabsParams *params,
                               DP_TransientLayerContent *tlc)
 {
-    DP_DrawContext *dc = params->draw_context;
-    unsigned int context_id = params->context_id;
-    uint32_t color = params->color;
-    int blend_mode = params->blend_mode;
     int dab_count = params->dab_count;
     DP_ClassicBrushDab *dabs = params->dabs;
 
     int last_x = params->origin_x;
     int last_y = params->origin_y;
-    DP_BrushStamp mask_stamp = make_brush_stamp1(dc);
-    DP_BrushStamp offset_stamp = make_brush_stamp2(dc);
+    DP_DrawContext *dc = params->draw_context;
+    DP_DabBatch batch = dab_batch_make(params, tlc);
+
+    uint64_t last_key = 0;
+    uint8_t *last_mask = NULL;
     for (int i = 0; i < dab_count; ++i) {
         DP_ClassicBrushDab *dab = DP_classic_brush_dab_at(dabs, i);
-
-        get_classic_mask_stamp(&mask_stamp,
-                               DP_classic_brush_dab_size(dab) / 256.0,
-                               DP_classic_brush_dab_hardness(dab) / 255.0,
-                               DP_classic_brush_dab_opacity(dab) / 255.0);
-
         int x = last_x + DP_classic_brush_dab_x(dab);
         int y = last_y + DP_classic_brush_dab_y(dab);
-        get_classic_offset_stamp(&offset_stamp, &mask_stamp, x / 4.0, y / 4.0);
+        int xfrac = x & 3;
+        int yfrac = y & 3;
+
+        uint64_t key = classic_stamp_cache_key(dab, xfrac, yfrac);
+        DP_BrushStamp *cached =
+            get_classic_cached_stamp(dc, dab, key, xfrac, yfrac);
+        int diameter = cached->diameter;
+
+        // Consecutive dabs with the same key share their mask.
+        bool flushed = dab_batch_reserve(&batch, diameter);
+        if (flushed || !last_mask || key != last_key) {
+            last_mask = dab_batch_mask_push(&batch, diameter);
+            memcpy(last_mask, cached->data,
+                   DP_int_to_size(DP_square_int(diameter)));
+            last_key = key;
+        }
+
+        DP_BrushStamp stamp = {cached->top + (y - yfrac) / 4,
+                               cached->left + (x - xfrac) / 4, diameter,
+                               last_mask};
+        dab_batch_stamp_push(&batch, &stamp);
 
-        DP_transient_layer_content_brush_stamp_apply(tlc, context_id, color,
-                                                     blend_mode, &offset_stamp);
         last_x = x;
         last_y = y;
     }
+    dab_batch_flush(&batch);
 }
 
 
@@ -321,17 +866,15 @@ static void get_round_pixel_mask_stamp(DP_BrushStamp *stamp, int diameter,
     DP_ASSERT(diameter <= DP_DRAW_CONTEXT_STAMP_MAX_DIAMETER);
     DP_ASSERT(DP_square_int(diameter) <= DP_DRAW_CONTEXT_STAMP_BUFFER_SIZE);
     stamp->diameter = diameter;
-
-    uint8_t *data = stamp->data;
-    double r = diameter / 2.0;
-    double rr = DP_square_double(r);
-    for (int y = 0; y < diameter; ++y) {
-        double yy = DP_square_double(y - r + 0.5);
-        for (int x = 0; x < diameter; ++x) {
-            double xx = DP_square_double(x - r + 0.5);
-            uint8_t value = xx + yy <= rr ? opacity : 0;
-            data[y * diameter + x] = value;
-        }
+    switch (DP_cpu_support) {
+#ifdef DP_CPU_X64
+    case DP_CPU_SUPPORT_AVX2:
+        fill_round_pixel_mask_avx2(stamp->data, diameter, opacity);
+        break;
+#endif
+    default:
+        fill_round_pixel_mask(stamp->data, diameter, opacity);
+        break;
     }
 }
 
@@ -349,24 +892,25 @@ static void draw_dabs_pixel(DP_PaintDrawDabsParams *params,
                             DP_TransientLayerContent *tlc,
                             void (*get_stamp)(DP_BrushStamp *, int, uint8_t))
 {
-    unsigned int context_id = params->context_id;
-    uint32_t color = params->color;
-    int blend_mode = params->blend_mode;
     int dab_count = params->dab_count;
     DP_PixelBrushDab *dabs = params->dabs;
 
     int last_x = params->origin_x;
     int last_y = params->origin_y;
-    DP_BrushStamp stamp = make_brush_stamp1(params->draw_context);
+    DP_BrushStamp stamp = {0, 0, 0, NULL};
+    DP_DabBatch batch = dab_batch_make(params, tlc);
 
     int last_size = -1;
     uint8_t last_opacity = 0;
     for (int i = 0; i < dab_count; ++i) {
         DP_PixelBrushDab *dab = DP_pixel_brush_dab_at(dabs, i);
 
+        // Consecutive dabs with the same size and opacity share their mask.
         int size = DP_pixel_brush_dab_size(dab);
         uint8_t opacity = DP_pixel_brush_dab_opacity(dab);
-        if (size != last_size || opacity != last_opacity) {
+        bool flushed = dab_batch_reserve(&batch, size);
+        if (flushed || size != last_size || opacity != last_opacity) {
+            stamp.data = dab_batch_mask_push(&batch, size);
             get_stamp(&stamp, size, opacity);
             last_size = size;
             last_opacity = opacity;
@@ -377,12 +921,12 @@ static void draw_dabs_pixel(DP_PaintDrawDabsParams *params,
         int offset = size / 2;
         stamp.left = x - offset;
         stamp.top = y - offset;
+        dab_batch_stamp_push(&batch, &stamp);
 
-        DP_transient_layer_content_brush_stamp_apply(tlc, context_id, color,
-                                                     blend_mode, &stamp);
         last_x = x;
         last_y = y;
     }
+    dab_batch_flush(&batch);
 }
 
 
@@ -409,6 +953,44 @@ void DP_paint_draw_dabs(DP_PaintDrawDabsParams *params,
 }
 
 
+DP_BrushStamp DP_paint_classic_brush_stamp_make(DP_DrawContext *dc,
+                                                uint8_t *data, int size,
+                                                uint8_t hardness,
+                                                uint8_t opacity, int x, int y)
+{
+    DP_ASSERT(dc);
+    DP_ASSERT(data);
+    DP_BrushStamp mask_stamp = make_brush_stamp1(dc);
+    DP_ASSERT(data != mask_stamp.data);
+    get_classic_mask_stamp(&mask_stamp, size / 256.0, hardness / 255.0,
+                           opacity / 255.0);
+    DP_BrushStamp offset_stamp = {0, 0, 0, data};
+    get_classic_offset_stamp(&offset_stamp, &mask_stamp, x / 4.0, y / 4.0);
+    return offset_stamp;
+}
+
+DP_BrushStamp DP_paint_pixel_brush_stamp_make(uint8_t *data, int type,
+                                              int size, uint8_t opacity, int x,
+                                              int y)
+{
+    DP_ASSERT(data);
+    DP_BrushStamp stamp = {0, 0, 0, data};
+    switch (type) {
+    case DP_MSG_DRAW_DABS_PIXEL:
+        get_round_pixel_mask_stamp(&stamp, size, opacity);
+        break;
+    case DP_MSG_DRAW_DABS_PIXEL_SQUARE:
+        get_square_pixel_mask_stamp(&stamp, size, opacity);
+        break;
+    default:
+        DP_panic("Unknown pixel paint type %d", type);
+    }
+    int offset = size / 2;
+    stamp.left = x - offset;
+    stamp.top = y - offset;
+    return stamp;
+}
+
 DP_BrushStamp DP_paint_color_sampling_stamp_make(uint8_t *data, int diameter,
                                                  int left, int top,
                                                  int last_diameter)
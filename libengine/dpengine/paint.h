@@ -26,6 +26,7 @@
 typedef struct DP_ClassicBrushDab DP_ClassicBrushDab;
 typedef struct DP_DrawContext DP_DrawContext;
 typedef struct DP_PixelBrushDab DP_PixelBrushDab;
+typedef struct DP_Worker DP_Worker;
 
 #ifdef DP_NO_STRICT_ALIASING
 typedef struct DP_TransientLayerContent DP_TransientLayerContent;
@@ -54,9 +55,36 @@ typedef struct DP_PaintDrawDabsParams {
 } DP_PaintDrawDabsParams;
 
 
+// Classic brush lookup tables are generated on first use, one per hardness
+// percentage, which stalls the first dab of each. This generates all of them up
+// front. With a worker, that happens on its threads and this returns right
+// away, without one it happens on the calling thread.
+void DP_paint_classic_luts_init(DP_Worker *worker_or_null);
+
+// Compact lookup tables store 16 bit integers instead of floats, taking half
+// the memory. Masks generated from them may be off by one here and there, so
+// this shouldn't be toggled in the middle of drawing.
+bool DP_paint_classic_luts_compact(void);
+
+void DP_paint_classic_luts_compact_set(bool compact);
+
+
 void DP_paint_draw_dabs(DP_PaintDrawDabsParams *params,
                         DP_TransientLayerContent *tlc);
 
+// Generate the stamp for a single dab, the same way drawing dabs does. The data
+// needs room for DP_DRAW_CONTEXT_STAMP_BUFFER_SIZE bytes. Classic dabs take
+// their position in quarter pixels, use the draw context's first stamp buffer
+// as scratch space and bypass its stamp cache.
+DP_BrushStamp DP_paint_classic_brush_stamp_make(DP_DrawContext *dc,
+                                                uint8_t *data, int size,
+                                                uint8_t hardness,
+                                                uint8_t opacity, int x, int y);
+
+DP_BrushStamp DP_paint_pixel_brush_stamp_make(uint8_t *data, int type,
+                                              int size, uint8_t opacity, int x,
+                                              int y);
+
 DP_BrushStamp DP_paint_color_sampling_stamp_make(uint8_t *data, int diameter,
                                                  int left, int top,
                                                  int last_diameter);
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "payload_decoder.h"
+#include "draw_context.h"
+#include "image.h"
+#include "tile.h"
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpcommon/threading.h>
+#include <dpcommon/worker.h>
+#include <dpmsg/message.h>
+#include <dpmsg/messages/canvas_background.h>
+#include <dpmsg/messages/put_image.h>
+#include <dpmsg/messages/put_tile.h>
+
+
+// Enough messages in flight to keep every thread busy while the handling
+// thread catches up, without piling up too much decompressed memory.
+#define SLOTS_PER_THREAD 16
+
+typedef struct DP_PayloadDecoderSlot {
+    DP_Message *msg;
+    void *payload;
+    bool pending;
+    DP_Semaphore *sem;
+} DP_PayloadDecoderSlot;
+
+struct DP_PayloadDecoder {
+    DP_PayloadDecoderHandleFn handle;
+    void *user;
+    DP_Worker *worker;
+    int capacity;
+    int used;
+    int head;
+    DP_PayloadDecoderSlot slots[];
+};
+
+
+static bool needs_decoding(DP_Message *msg)
+{
+    switch (DP_message_type(msg)) {
+    case DP_MSG_PUT_IMAGE:
+        return true;
+    case DP_MSG_PUT_TILE:
+        return !DP_msg_put_tile_color(DP_msg_put_tile_cast(msg), NULL);
+    case DP_MSG_CANVAS_BACKGROUND:
+        return !DP_msg_canvas_background_color(
+            DP_msg_canvas_background_cast(msg), NULL);
+    default:
+        return false;
+    }
+}
+
+static void *decode(DP_Message *msg)
+{
+    size_t image_size;
+    const unsigned char *image;
+    DP_MessageType type = DP_message_type(msg);
+    if (type == DP_MSG_PUT_IMAGE) {
+        DP_MsgPutImage *mpi = DP_msg_put_image_cast(msg);
+        image = DP_msg_put_image_image(mpi, &image_size);
+        return DP_image_new_from_compressed(DP_msg_put_image_width(mpi),
+                                            DP_msg_put_image_height(mpi),
+                                            image, image_size);
+    }
+    else if (type == DP_MSG_PUT_TILE) {
+        image = DP_msg_put_tile_image(DP_msg_put_tile_cast(msg), &image_size);
+    }
+    else {
+        DP_ASSERT(type == DP_MSG_CANVAS_BACKGROUND);
+        image = DP_msg_canvas_background_image(
+            DP_msg_canvas_background_cast(msg), &image_size);
+    }
+    return DP_tile_new_from_compressed(DP_message_context_id(msg), image,
+                                       image_size);
+}
+
+static void free_payload(DP_Message *msg, void *payload)
+{
+    if (payload) {
+        if (DP_message_type(msg) == DP_MSG_PUT_IMAGE) {
+            DP_image_free(payload);
+        }
+        else {
+            DP_tile_decref(payload);
+        }
+    }
+}
+
+static void run_decode_job(void *user)
+{
+    // Errors are ignored here, the message will just be decoded again when
+    // it's handled, which reports the error on the right thread.
+    DP_PayloadDecoderSlot *slot = user;
+    slot->payload = decode(slot->msg);
+    DP_SEMAPHORE_MUST_POST(slot->sem);
+}
+
+
+DP_PayloadDecoder *DP_payload_decoder_new(int thread_count,
+                                          DP_PayloadDecoderHandleFn handle,
+                                          void *user)
+{
+    DP_ASSERT(thread_count > 0);
+    DP_ASSERT(handle);
+    int capacity = thread_count * SLOTS_PER_THREAD;
+    DP_PayloadDecoder *pd = DP_malloc(DP_FLEX_SIZEOF(
+        DP_PayloadDecoder, slots, DP_int_to_size(capacity)));
+    pd->handle = handle;
+    pd->user = user;
+    pd->worker = NULL;
+    pd->capacity = capacity;
+    pd->used = 0;
+    pd->head = 0;
+    for (int i = 0; i < capacity; ++i) {
+        pd->slots[i] = (DP_PayloadDecoderSlot){NULL, NULL, false, NULL};
+    }
+
+    for (int i = 0; i < capacity; ++i) {
+        if (!(pd->slots[i].sem = DP_semaphore_new(0))) {
+            DP_payload_decoder_free(pd);
+            return NULL;
+        }
+    }
+
+    pd->worker = DP_worker_new(DP_int_to_size(capacity), thread_count);
+    if (!pd->worker) {
+        DP_payload_decoder_free(pd);
+        return NULL;
+    }
+
+    return pd;
+}
+
+static DP_PayloadDecoderSlot *shift_slot(DP_PayloadDecoder *pd)
+{
+    DP_ASSERT(pd->used > 0);
+    DP_PayloadDecoderSlot *slot = &pd->slots[pd->head];
+    if (slot->pending) {
+        DP_SEMAPHORE_MUST_WAIT(slot->sem);
+        slot->pending = false;
+    }
+    pd->head = (pd->head + 1) % pd->capacity;
+    --pd->used;
+    return slot;
+}
+
+void DP_payload_decoder_free(DP_PayloadDecoder *pd)
+{
+    if (pd) {
+        while (pd->used > 0) {
+            DP_PayloadDecoderSlot *slot = shift_slot(pd);
+            free_payload(slot->msg, slot->payload);
+            DP_message_decref(slot->msg);
+        }
+        DP_worker_free(pd->worker);
+        for (int i = 0; i < pd->capacity; ++i) {
+            DP_semaphore_free(pd->slots[i].sem);
+        }
+        DP_free(pd);
+    }
+}
+
+static void handle_next(DP_PayloadDecoder *pd, DP_DrawContext *dc)
+{
+    DP_PayloadDecoderSlot *slot = shift_slot(pd);
+    DP_Message *msg = slot->msg;
+    void *payload = slot->payload;
+    slot->msg = NULL;
+    slot->payload = NULL;
+
+    if (payload) {
+        DP_draw_context_decoded_payload_set(dc, msg, payload);
+    }
+    pd->handle(pd->user, dc, msg);
+    // If the message didn't make it to the point of using its payload.
+    free_payload(msg, DP_draw_context_decoded_payload_take(dc, msg));
+    DP_message_decref(msg);
+}
+
+void DP_payload_decoder_push_noinc(DP_PayloadDecoder *pd, DP_DrawContext *dc,
+                                   DP_Message *msg)
+{
+    DP_ASSERT(pd);
+    DP_ASSERT(dc);
+    DP_ASSERT(msg);
+    if (pd->used == pd->capacity) {
+        handle_next(pd, dc);
+    }
+
+    DP_PayloadDecoderSlot *slot =
+        &pd->slots[(pd->head + pd->used) % pd->capacity];
+    slot->msg = msg;
+    slot->payload = NULL;
+    slot->pending = needs_decoding(msg);
+    ++pd->used;
+    if (slot->pending) {
+        DP_worker_push(pd->worker, run_decode_job, slot);
+    }
+}
+
+void DP_payload_decoder_flush(DP_PayloadDecoder *pd, DP_DrawContext *dc)
+{
+    DP_ASSERT(pd);
+    DP_ASSERT(dc);
+    while (pd->used > 0) {
+        handle_next(pd, dc);
+    }
+}
+
+int DP_payload_decoder_pending(DP_PayloadDecoder *pd)
+{
+    DP_ASSERT(pd);
+    return pd->used;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef DPENGINE_PAYLOAD_DECODER_H
+#define DPENGINE_PAYLOAD_DECODER_H
+#include <dpcommon/common.h>
+
+typedef struct DP_DrawContext DP_DrawContext;
+typedef struct DP_Message DP_Message;
+
+
+// Decompresses PutTile, PutImage and CanvasBackground payloads on a pool of
+// threads ahead of them being handled. Messages are handed to the handle
+// function in the order they were pushed, with their decoded payload put into
+// the draw context so that DP_canvas_state_handle picks it up instead of
+// decompressing it again. Messages without payloads just pass through.
+typedef struct DP_PayloadDecoder DP_PayloadDecoder;
+
+typedef void (*DP_PayloadDecoderHandleFn)(void *user, DP_DrawContext *dc,
+                                          DP_Message *msg);
+
+DP_PayloadDecoder *DP_payload_decoder_new(int thread_count,
+                                          DP_PayloadDecoderHandleFn handle,
+                                          void *user);
+
+// Drops any messages that haven't been handled yet, call flush beforehand.
+void DP_payload_decoder_free(DP_PayloadDecoder *pd);
+
+// Takes ownership of the message. May handle earlier messages if too many are
+// waiting, but never the one just pushed.
+void DP_payload_decoder_push_noinc(DP_PayloadDecoder *pd, DP_DrawContext *dc,
+                                   DP_Message *msg);
+
+// Handles all pending messages.
+void DP_payload_decoder_flush(DP_PayloadDecoder *pd, DP_DrawContext *dc);
+
+int DP_payload_decoder_pending(DP_PayloadDecoder *pd);
+
+
+#endif
@@ -40,6 +40,11 @@
 #include "blend_mode.h"
 #include <dpcommon/common.h>
 #include <dpcommon/conversions.h>
+#include <dpcommon/cpu.h>
+
+#ifdef DP_CPU_X64
+#    include <immintrin.h>
+#endif
 
 static_assert(sizeof(DP_Pixel) == sizeof(uint32_t), "DP_Pixel is 32 bits");
 static_assert(sizeof(uint32_t) == 4, "uint32_t is 4 bytes long");
@@ -445,6 +450,804 @@ static void composite_mask_blend(DP_Pixel *dst, DP_Pixel src, uint8_t *mask,
     mask_composite_with(dst, src, mask, w, h, mask_skip, dst_skip, blend_blend);
 }
 
+#ifdef DP_CPU_X64
+
+DP_TARGET_BEGIN("sse4.2")
+
+static DP_FORCE_INLINE __m128i mul_sse42(__m128i a, __m128i b)
+{
+    __m128i c = _mm_add_epi32(_mm_mullo_epi16(a, b), _mm_set1_epi32(0x80));
+    return _mm_srli_epi32(_mm_add_epi32(_mm_srli_epi32(c, 8), c), 8);
+}
+
+static DP_FORCE_INLINE __m128i blend_sse42(__m128i a, __m128i b,
+                                           __m128i alpha)
+{
+    __m128i alpha1 = _mm_sub_epi32(_mm_set1_epi32(255), alpha);
+    __m128i c = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi16(a, alpha),
+                                            _mm_mullo_epi16(b, alpha1)),
+                              _mm_set1_epi32(0x80));
+    return _mm_srli_epi32(_mm_add_epi32(_mm_srli_epi32(c, 8), c), 8);
+}
+
+static DP_FORCE_INLINE __m128i div_sse42(__m128i a, __m128i b)
+{
+    // Single-precision division truncates to the same result as integer
+    // division for all dividends up to 65535 and divisors up to 256.
+    return _mm_cvttps_epi32(
+        _mm_div_ps(_mm_cvtepi32_ps(a), _mm_cvtepi32_ps(b)));
+}
+
+static DP_FORCE_INLINE void split_sse42(__m128i pixels, __m128i *out_b,
+                                        __m128i *out_g, __m128i *out_r,
+                                        __m128i *out_a)
+{
+    __m128i lo = _mm_set1_epi32(0xff);
+    *out_b = _mm_and_si128(pixels, lo);
+    *out_g = _mm_and_si128(_mm_srli_epi32(pixels, 8), lo);
+    *out_r = _mm_and_si128(_mm_srli_epi32(pixels, 16), lo);
+    *out_a = _mm_srli_epi32(pixels, 24);
+}
+
+// Channels are truncated to 8 bits, same as assigning to a uint8_t does.
+static DP_FORCE_INLINE __m128i join_sse42(__m128i b, __m128i g, __m128i r,
+                                          __m128i a)
+{
+    __m128i lo = _mm_set1_epi32(0xff);
+    return _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(b, lo),
+                     _mm_slli_epi32(_mm_and_si128(g, lo), 8)),
+        _mm_or_si128(_mm_slli_epi32(_mm_and_si128(r, lo), 16),
+                     _mm_slli_epi32(a, 24)));
+}
+
+static DP_FORCE_INLINE __m128i unpremultiply_factors_sse42(__m128i a)
+{
+    return _mm_setr_epi32(
+        DP_uint_to_int(unpremultiply_factors[_mm_extract_epi32(a, 0)]),
+        DP_uint_to_int(unpremultiply_factors[_mm_extract_epi32(a, 1)]),
+        DP_uint_to_int(unpremultiply_factors[_mm_extract_epi32(a, 2)]),
+        DP_uint_to_int(unpremultiply_factors[_mm_extract_epi32(a, 3)]));
+}
+
+static DP_FORCE_INLINE __m128i unpremultiply_sse42(__m128i c, __m128i factors)
+{
+    return _mm_and_si128(
+        _mm_srli_epi32(
+            _mm_add_epi32(_mm_mullo_epi32(c, factors), _mm_set1_epi32(0x8000)),
+            16),
+        _mm_set1_epi32(0xff));
+}
+
+static DP_FORCE_INLINE __m128i premultiply_sse42(__m128i c, __m128i a)
+{
+    __m128i t = _mm_mullo_epi16(c, a);
+    return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(t, _mm_srli_epi32(t, 8)),
+                                        _mm_set1_epi32(0x80)),
+                          8);
+}
+
+static DP_FORCE_INLINE bool all_zero_sse42(__m128i a)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(a, _mm_setzero_si128()))
+        == 0xffff;
+}
+
+static DP_FORCE_INLINE bool all_opaque_sse42(__m128i a)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(a, _mm_set1_epi32(255)))
+        == 0xffff;
+}
+
+static DP_FORCE_INLINE __m128i load_mask_sse42(uint8_t *mask)
+{
+    int32_t m;
+    memcpy(&m, mask, sizeof(m));
+    return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(m));
+}
+
+#    define FOR_MASK_PIXEL_SSE42(DST, SRC, MASK, W, H, MASK_SKIP, DST_SKIP, \
+                                 SCALAR_FN, D, A, ...)                    \
+        do {                                                                \
+            int _remaining = W % 4;                                         \
+            int _vector_w = W - _remaining;                                 \
+            for (int _y = 0; _y < H; ++_y) {                                \
+                for (int _x = 0; _x < _vector_w;                            \
+                     _x += 4, DST += 4, MASK += 4) {                        \
+                    __m128i D = _mm_loadu_si128((__m128i *)DST);            \
+                    __m128i A = load_mask_sse42(MASK);                      \
+                    __VA_ARGS__                                             \
+                    _mm_storeu_si128((__m128i *)DST, D);                    \
+                }                                                           \
+                SCALAR_FN(DST, SRC, MASK, _remaining, 1, 0, 0);             \
+                DST += _remaining + DST_SKIP;                               \
+                MASK += _remaining + MASK_SKIP;                             \
+            }                                                               \
+        } while (0)
+
+static void composite_mask_copy_sse42(DP_Pixel *dst, DP_Pixel src,
+                                      uint8_t *mask, int w, int h,
+                                      int mask_skip, int dst_skip)
+{
+    __m128i sb, sg, sr, sa;
+    split_sse42(_mm_set1_epi32(DP_uint32_to_int32(src.color)), &sb, &sg, &sr,
+                &sa);
+    FOR_MASK_PIXEL_SSE42(dst, src, mask, w, h, mask_skip, dst_skip,
+                         composite_mask_copy, d, a, {
+                             d = join_sse42(mul_sse42(sb, a), mul_sse42(sg, a),
+                                            mul_sse42(sr, a), mul_sse42(sa, a));
+                         });
+}
+
+static void composite_mask_erase_sse42(DP_Pixel *dst, DP_Pixel src,
+                                       uint8_t *mask, int w, int h,
+                                       int mask_skip, int dst_skip)
+{
+    __m128i zero = _mm_setzero_si128();
+    FOR_MASK_PIXEL_SSE42(
+        dst, src, mask, w, h, mask_skip, dst_skip, composite_mask_erase, d, a,
+        {
+            __m128i db, dg, dr, da;
+            split_sse42(d, &db, &dg, &dr, &da);
+            __m128i a1 = _mm_sub_epi32(_mm_set1_epi32(255), a);
+            __m128i result = join_sse42(mul_sse42(db, a1), mul_sse42(dg, a1),
+                                        mul_sse42(dr, a1), mul_sse42(da, a1));
+            d = _mm_blendv_epi8(result, d, _mm_cmpeq_epi32(da, zero));
+        });
+}
+
+static void composite_mask_alpha_blend_sse42(DP_Pixel *dst, DP_Pixel src,
+                                             uint8_t *mask, int w, int h,
+                                             int mask_skip, int dst_skip)
+{
+    // Treating the source as opaque makes the fully opaque and fully
+    // transparent mask cases fall out of the general formula.
+    __m128i sb, sg, sr, sa;
+    __m128i s = _mm_set1_epi32(DP_uint32_to_int32(src.color | 0xff000000u));
+    split_sse42(s, &sb, &sg, &sr, &sa);
+    FOR_MASK_PIXEL_SSE42(
+        dst, src, mask, w, h, mask_skip, dst_skip, composite_mask_alpha_blend,
+        d, a, {
+            __m128i db, dg, dr, da;
+            split_sse42(d, &db, &dg, &dr, &da);
+            __m128i a1 = _mm_sub_epi32(_mm_set1_epi32(255), a);
+            d = join_sse42(_mm_add_epi32(mul_sse42(sb, a), mul_sse42(db, a1)),
+                           _mm_add_epi32(mul_sse42(sg, a), mul_sse42(dg, a1)),
+                           _mm_add_epi32(mul_sse42(sr, a), mul_sse42(dr, a1)),
+                           _mm_add_epi32(mul_sse42(sa, a), mul_sse42(da, a1)));
+        });
+}
+
+static void composite_mask_alpha_under_sse42(DP_Pixel *dst, DP_Pixel src,
+                                             uint8_t *mask, int w, int h,
+                                             int mask_skip, int dst_skip)
+{
+    __m128i sb, sg, sr, sa;
+    split_sse42(_mm_set1_epi32(DP_uint32_to_int32(src.color)), &sb, &sg, &sr,
+                &sa);
+    FOR_MASK_PIXEL_SSE42(
+        dst, src, mask, w, h, mask_skip, dst_skip, composite_mask_alpha_under,
+        d, a, {
+            __m128i db, dg, dr, da;
+            split_sse42(d, &db, &dg, &dr, &da);
+            __m128i a1 =
+                mul_sse42(_mm_sub_epi32(_mm_set1_epi32(255), da), a);
+            d = join_sse42(_mm_add_epi32(mul_sse42(sb, a1), db),
+                           _mm_add_epi32(mul_sse42(sg, a1), dg),
+                           _mm_add_epi32(mul_sse42(sr, a1), dr),
+                           _mm_add_epi32(a1, da));
+        });
+}
+
+static DP_FORCE_INLINE __m128i blend_multiply_sse42(__m128i base,
+                                                    __m128i blend)
+{
+    return mul_sse42(base, blend);
+}
+
+static DP_FORCE_INLINE __m128i blend_divide_sse42(__m128i base, __m128i blend)
+{
+    __m128i n =
+        _mm_add_epi32(_mm_slli_epi32(base, 8), _mm_srli_epi32(blend, 1));
+    __m128i d = _mm_add_epi32(blend, _mm_set1_epi32(1));
+    return _mm_min_epi32(div_sse42(n, d), _mm_set1_epi32(255));
+}
+
+static DP_FORCE_INLINE __m128i blend_darken_sse42(__m128i base, __m128i blend)
+{
+    return _mm_min_epi32(base, blend);
+}
+
+static DP_FORCE_INLINE __m128i blend_lighten_sse42(__m128i base,
+                                                   __m128i blend)
+{
+    return _mm_max_epi32(base, blend);
+}
+
+static DP_FORCE_INLINE __m128i blend_dodge_sse42(__m128i base, __m128i blend)
+{
+    __m128i n = _mm_slli_epi32(base, 8);
+    __m128i d = _mm_sub_epi32(_mm_set1_epi32(256), blend);
+    return _mm_min_epi32(div_sse42(n, d), _mm_set1_epi32(255));
+}
+
+static DP_FORCE_INLINE __m128i blend_burn_sse42(__m128i base, __m128i blend)
+{
+    __m128i n = _mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(255), base), 8);
+    __m128i d = _mm_add_epi32(blend, _mm_set1_epi32(1));
+    return _mm_max_epi32(_mm_sub_epi32(_mm_set1_epi32(255), div_sse42(n, d)),
+                         _mm_setzero_si128());
+}
+
+static DP_FORCE_INLINE __m128i blend_add_sse42(__m128i base, __m128i blend)
+{
+    return _mm_min_epi32(_mm_add_epi32(base, blend), _mm_set1_epi32(255));
+}
+
+static DP_FORCE_INLINE __m128i blend_subtract_sse42(__m128i base,
+                                                    __m128i blend)
+{
+    return _mm_max_epi32(_mm_sub_epi32(base, blend), _mm_setzero_si128());
+}
+
+static DP_FORCE_INLINE __m128i blend_blend_sse42(DP_UNUSED __m128i base,
+                                                 __m128i blend)
+{
+    return blend;
+}
+
+static DP_FORCE_INLINE void
+mask_composite_with_sse42(DP_Pixel *dst, DP_Pixel src, uint8_t *mask, int w,
+                          int h, int mask_skip, int dst_skip,
+                          DP_CompositeBrushFn scalar_fn,
+                          __m128i (*blend_op)(__m128i, __m128i))
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i sb, sg, sr, sa;
+    split_sse42(_mm_set1_epi32(DP_uint32_to_int32(src.color)), &sb, &sg, &sr,
+                &sa);
+    FOR_MASK_PIXEL_SSE42(
+        dst, src, mask, w, h, mask_skip, dst_skip, scalar_fn, d, a, {
+            __m128i db, dg, dr, da;
+            split_sse42(d, &db, &dg, &dr, &da);
+            __m128i factors = unpremultiply_factors_sse42(da);
+            db = unpremultiply_sse42(db, factors);
+            dg = unpremultiply_sse42(dg, factors);
+            dr = unpremultiply_sse42(dr, factors);
+            db = blend_sse42(blend_op(db, sb), db, a);
+            dg = blend_sse42(blend_op(dg, sg), dg, a);
+            dr = blend_sse42(blend_op(dr, sr), dr, a);
+            __m128i result =
+                join_sse42(premultiply_sse42(db, da), premultiply_sse42(dg, da),
+                           premultiply_sse42(dr, da), da);
+            __m128i keep = _mm_or_si128(_mm_cmpeq_epi32(a, zero),
+                                        _mm_cmpeq_epi32(d, zero));
+            d = _mm_blendv_epi8(result, d, keep);
+        });
+}
+
+// Color erase is done in double precision like the scalar version, with the
+// same operations in the same order, so the results are exactly equal. The
+// branches are computed on all lanes and then selected between.
+static DP_FORCE_INLINE __m128d color_erase_alpha_sse42(__m128d fsrc,
+                                                       __m128d ufdst)
+{
+    // Divisions are slow, so only do one with the operands of whichever
+    // branch applies. That's still the same operation as the scalar version.
+    __m128d above = _mm_cmpgt_pd(ufdst, fsrc);
+    __m128d n = _mm_blendv_pd(_mm_sub_pd(fsrc, ufdst), _mm_sub_pd(ufdst, fsrc),
+                              above);
+    __m128d d =
+        _mm_blendv_pd(fsrc, _mm_sub_pd(_mm_set1_pd(1.0), fsrc), above);
+    __m128d ufalpha = _mm_and_pd(_mm_div_pd(n, d), _mm_cmpneq_pd(ufdst, fsrc));
+    return _mm_blendv_pd(ufalpha, ufdst,
+                         _mm_cmplt_pd(fsrc, _mm_set1_pd(0.0001)));
+}
+
+// Returns two premultiplied pixels in the low half of the result.
+static DP_FORCE_INLINE __m128i
+color_erase_sse42(__m128d fsrc_b, __m128d fsrc_g, __m128d fsrc_r,
+                  __m128d fsrc_a, __m128d ufdst_b, __m128d ufdst_g,
+                  __m128d ufdst_r, __m128d ufdst_a)
+{
+    __m128d ufalpha_r = color_erase_alpha_sse42(fsrc_r, ufdst_r);
+    __m128d ufalpha_g = color_erase_alpha_sse42(fsrc_g, ufdst_g);
+    __m128d ufalpha_b = color_erase_alpha_sse42(fsrc_b, ufdst_b);
+
+    __m128d r_or_b =
+        _mm_blendv_pd(ufalpha_b, ufalpha_r, _mm_cmpgt_pd(ufalpha_r, ufalpha_b));
+    __m128d g_or_b =
+        _mm_blendv_pd(ufalpha_b, ufalpha_g, _mm_cmpgt_pd(ufalpha_g, ufalpha_b));
+    __m128d out_a =
+        _mm_blendv_pd(g_or_b, r_or_b, _mm_cmpgt_pd(ufalpha_r, ufalpha_g));
+
+    out_a = _mm_add_pd(_mm_sub_pd(_mm_set1_pd(1.0), fsrc_a),
+                       _mm_mul_pd(out_a, fsrc_a));
+
+    __m128d apply = _mm_cmpge_pd(out_a, _mm_set1_pd(0.0001));
+    __m128d out_r = _mm_blendv_pd(
+        ufdst_r,
+        _mm_add_pd(_mm_div_pd(_mm_sub_pd(ufdst_r, fsrc_r), out_a), fsrc_r),
+        apply);
+    __m128d out_g = _mm_blendv_pd(
+        ufdst_g,
+        _mm_add_pd(_mm_div_pd(_mm_sub_pd(ufdst_g, fsrc_g), out_a), fsrc_g),
+        apply);
+    __m128d out_b = _mm_blendv_pd(
+        ufdst_b,
+        _mm_add_pd(_mm_div_pd(_mm_sub_pd(ufdst_b, fsrc_b), out_a), fsrc_b),
+        apply);
+    out_a = _mm_blendv_pd(out_a, _mm_mul_pd(out_a, ufdst_a), apply);
+
+    __m128d max = _mm_set1_pd(255.0);
+    __m128i b = _mm_cvttpd_epi32(_mm_mul_pd(out_b, max));
+    __m128i g = _mm_cvttpd_epi32(_mm_mul_pd(out_g, max));
+    __m128i r = _mm_cvttpd_epi32(_mm_mul_pd(out_r, max));
+    __m128i a = _mm_cvttpd_epi32(_mm_mul_pd(out_a, max));
+    return join_sse42(premultiply_sse42(b, a), premultiply_sse42(g, a),
+                      premultiply_sse42(r, a), a);
+}
+
+static DP_FORCE_INLINE __m128d to_fraction_lo_sse42(__m128i c)
+{
+    return _mm_div_pd(_mm_cvtepi32_pd(c), _mm_set1_pd(255.0));
+}
+
+static DP_FORCE_INLINE __m128d to_fraction_hi_sse42(__m128i c)
+{
+    return _mm_div_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(c, c)),
+                      _mm_set1_pd(255.0));
+}
+
+static void composite_mask_color_erase_sse42(DP_Pixel *dst, DP_Pixel src,
+                                             uint8_t *mask, int w, int h,
+                                             int mask_skip, int dst_skip)
+{
+    __m128d fsrc_b = _mm_set1_pd(src.b / 255.0);
+    __m128d fsrc_g = _mm_set1_pd(src.g / 255.0);
+    __m128d fsrc_r = _mm_set1_pd(src.r / 255.0);
+    FOR_MASK_PIXEL_SSE42(
+        dst, src, mask, w, h, mask_skip, dst_skip, composite_mask_color_erase,
+        d, a, {
+            if (all_zero_sse42(a)) {
+                continue;
+            }
+            __m128i db, dg, dr, da;
+            split_sse42(d, &db, &dg, &dr, &da);
+            __m128i factors = unpremultiply_factors_sse42(da);
+            db = unpremultiply_sse42(db, factors);
+            dg = unpremultiply_sse42(dg, factors);
+            dr = unpremultiply_sse42(dr, factors);
+            __m128i lo = color_erase_sse42(
+                fsrc_b, fsrc_g, fsrc_r, to_fraction_lo_sse42(a),
+                to_fraction_lo_sse42(db), to_fraction_lo_sse42(dg),
+                to_fraction_lo_sse42(dr), to_fraction_lo_sse42(da));
+            __m128i hi = color_erase_sse42(
+                fsrc_b, fsrc_g, fsrc_r, to_fraction_hi_sse42(a),
+                to_fraction_hi_sse42(db), to_fraction_hi_sse42(dg),
+                to_fraction_hi_sse42(dr), to_fraction_hi_sse42(da));
+            d = _mm_blendv_epi8(_mm_unpacklo_epi64(lo, hi), d,
+                                _mm_cmpeq_epi32(a, _mm_setzero_si128()));
+        });
+}
+
+#    define DEFINE_MASK_COMPOSITE_WITH_SSE42(NAME)                          \
+        static void composite_mask_##NAME##_sse42(                          \
+            DP_Pixel *dst, DP_Pixel src, uint8_t *mask, int w, int h,       \
+            int mask_skip, int dst_skip)                                    \
+        {                                                                   \
+            mask_composite_with_sse42(dst, src, mask, w, h, mask_skip,      \
+                                      dst_skip, composite_mask_##NAME,      \
+                                      blend_##NAME##_sse42);                \
+        }
+
+DEFINE_MASK_COMPOSITE_WITH_SSE42(multiply)
+DEFINE_MASK_COMPOSITE_WITH_SSE42(divide)
+DEFINE_MASK_COMPOSITE_WITH_SSE42(burn)
+DEFINE_MASK_COMPOSITE_WITH_SSE42(dodge)
+DEFINE_MASK_COMPOSITE_WITH_SSE42(darken)
+DEFINE_MASK_COMPOSITE_WITH_SSE42(lighten)
+DEFINE_MASK_COMPOSITE_WITH_SSE42(subtract)
+DEFINE_MASK_COMPOSITE_WITH_SSE42(add)
+DEFINE_MASK_COMPOSITE_WITH_SSE42(blend)
+
+DP_TARGET_END
+
+
+DP_TARGET_BEGIN("avx2")
+
+static DP_FORCE_INLINE __m256i mul_avx2(__m256i a, __m256i b)
+{
+    __m256i c =
+        _mm256_add_epi32(_mm256_mullo_epi16(a, b), _mm256_set1_epi32(0x80));
+    return _mm256_srli_epi32(_mm256_add_epi32(_mm256_srli_epi32(c, 8), c), 8);
+}
+
+static DP_FORCE_INLINE __m256i blend_avx2(__m256i a, __m256i b,
+                                          __m256i alpha)
+{
+    __m256i alpha1 = _mm256_sub_epi32(_mm256_set1_epi32(255), alpha);
+    __m256i c =
+        _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi16(a, alpha),
+                                          _mm256_mullo_epi16(b, alpha1)),
+                         _mm256_set1_epi32(0x80));
+    return _mm256_srli_epi32(_mm256_add_epi32(_mm256_srli_epi32(c, 8), c), 8);
+}
+
+static DP_FORCE_INLINE __m256i div_avx2(__m256i a, __m256i b)
+{
+    // See div_sse42 for why this is exact.
+    return _mm256_cvttps_epi32(
+        _mm256_div_ps(_mm256_cvtepi32_ps(a), _mm256_cvtepi32_ps(b)));
+}
+
+static DP_FORCE_INLINE void split_avx2(__m256i pixels, __m256i *out_b,
+                                       __m256i *out_g, __m256i *out_r,
+                                       __m256i *out_a)
+{
+    __m256i lo = _mm256_set1_epi32(0xff);
+    *out_b = _mm256_and_si256(pixels, lo);
+    *out_g = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), lo);
+    *out_r = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), lo);
+    *out_a = _mm256_srli_epi32(pixels, 24);
+}
+
+static DP_FORCE_INLINE __m256i join_avx2(__m256i b, __m256i g, __m256i r,
+                                         __m256i a)
+{
+    __m256i lo = _mm256_set1_epi32(0xff);
+    return _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(b, lo),
+                        _mm256_slli_epi32(_mm256_and_si256(g, lo), 8)),
+        _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(r, lo), 16),
+                        _mm256_slli_epi32(a, 24)));
+}
+
+static DP_FORCE_INLINE __m256i unpremultiply_factors_avx2(__m256i a)
+{
+    return _mm256_i32gather_epi32((const int *)unpremultiply_factors, a, 4);
+}
+
+static DP_FORCE_INLINE __m256i unpremultiply_avx2(__m256i c, __m256i factors)
+{
+    return _mm256_and_si256(
+        _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(c, factors),
+                                           _mm256_set1_epi32(0x8000)),
+                          16),
+        _mm256_set1_epi32(0xff));
+}
+
+static DP_FORCE_INLINE __m256i premultiply_avx2(__m256i c, __m256i a)
+{
+    __m256i t = _mm256_mullo_epi16(c, a);
+    return _mm256_srli_epi32(
+        _mm256_add_epi32(_mm256_add_epi32(t, _mm256_srli_epi32(t, 8)),
+                         _mm256_set1_epi32(0x80)),
+        8);
+}
+
+static DP_FORCE_INLINE bool all_zero_avx2(__m256i a)
+{
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi32(a, _mm256_setzero_si256()))
+        == -1;
+}
+
+static DP_FORCE_INLINE bool all_opaque_avx2(__m256i a)
+{
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi32(a, _mm256_set1_epi32(255)))
+        == -1;
+}
+
+static DP_FORCE_INLINE __m256i load_mask_avx2(uint8_t *mask)
+{
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)mask));
+}
+
+#    define FOR_MASK_PIXEL_AVX2(DST, SRC, MASK, W, H, MASK_SKIP, DST_SKIP, \
+                                SCALAR_FN, D, A, ...)                    \
+        do {                                                               \
+            int _remaining = W % 8;                                        \
+            int _vector_w = W - _remaining;                                \
+            for (int _y = 0; _y < H; ++_y) {                               \
+                for (int _x = 0; _x < _vector_w;                           \
+                     _x += 8, DST += 8, MASK += 8) {                       \
+                    __m256i D = _mm256_loadu_si256((__m256i *)DST);        \
+                    __m256i A = load_mask_avx2(MASK);                      \
+                    __VA_ARGS__                                            \
+                    _mm256_storeu_si256((__m256i *)DST, D);                \
+                }                                                          \
+                SCALAR_FN(DST, SRC, MASK, _remaining, 1, 0, 0);            \
+                DST += _remaining + DST_SKIP;                              \
+                MASK += _remaining + MASK_SKIP;                            \
+            }                                                              \
+        } while (0)
+
+static void composite_mask_copy_avx2(DP_Pixel *dst, DP_Pixel src,
+                                     uint8_t *mask, int w, int h,
+                                     int mask_skip, int dst_skip)
+{
+    __m256i sb, sg, sr, sa;
+    split_avx2(_mm256_set1_epi32(DP_uint32_to_int32(src.color)), &sb, &sg, &sr,
+               &sa);
+    FOR_MASK_PIXEL_AVX2(dst, src, mask, w, h, mask_skip, dst_skip,
+                        composite_mask_copy, d, a, {
+                            d = join_avx2(mul_avx2(sb, a), mul_avx2(sg, a),
+                                          mul_avx2(sr, a), mul_avx2(sa, a));
+                        });
+}
+
+static void composite_mask_erase_avx2(DP_Pixel *dst, DP_Pixel src,
+                                      uint8_t *mask, int w, int h,
+                                      int mask_skip, int dst_skip)
+{
+    __m256i zero = _mm256_setzero_si256();
+    FOR_MASK_PIXEL_AVX2(
+        dst, src, mask, w, h, mask_skip, dst_skip, composite_mask_erase, d, a,
+        {
+            __m256i db, dg, dr, da;
+            split_avx2(d, &db, &dg, &dr, &da);
+            __m256i a1 = _mm256_sub_epi32(_mm256_set1_epi32(255), a);
+            __m256i result = join_avx2(mul_avx2(db, a1), mul_avx2(dg, a1),
+                                       mul_avx2(dr, a1), mul_avx2(da, a1));
+            d = _mm256_blendv_epi8(result, d, _mm256_cmpeq_epi32(da, zero));
+        });
+}
+
+static void composite_mask_alpha_blend_avx2(DP_Pixel *dst, DP_Pixel src,
+                                            uint8_t *mask, int w, int h,
+                                            int mask_skip, int dst_skip)
+{
+    // See composite_mask_alpha_blend_sse42 for why this is treated as opaque.
+    __m256i sb, sg, sr, sa;
+    __m256i s =
+        _mm256_set1_epi32(DP_uint32_to_int32(src.color | 0xff000000u));
+    split_avx2(s, &sb, &sg, &sr, &sa);
+    FOR_MASK_PIXEL_AVX2(
+        dst, src, mask, w, h, mask_skip, dst_skip, composite_mask_alpha_blend,
+        d, a, {
+            __m256i db, dg, dr, da;
+            split_avx2(d, &db, &dg, &dr, &da);
+            __m256i a1 = _mm256_sub_epi32(_mm256_set1_epi32(255), a);
+            d = join_avx2(_mm256_add_epi32(mul_avx2(sb, a), mul_avx2(db, a1)),
+                          _mm256_add_epi32(mul_avx2(sg, a), mul_avx2(dg, a1)),
+                          _mm256_add_epi32(mul_avx2(sr, a), mul_avx2(dr, a1)),
+                          _mm256_add_epi32(mul_avx2(sa, a), mul_avx2(da, a1)));
+        });
+}
+
+static void composite_mask_alpha_under_avx2(DP_Pixel *dst, DP_Pixel src,
+                                            uint8_t *mask, int w, int h,
+                                            int mask_skip, int dst_skip)
+{
+    __m256i sb, sg, sr, sa;
+    split_avx2(_mm256_set1_epi32(DP_uint32_to_int32(src.color)), &sb, &sg, &sr,
+               &sa);
+    FOR_MASK_PIXEL_AVX2(
+        dst, src, mask, w, h, mask_skip, dst_skip, composite_mask_alpha_under,
+        d, a, {
+            __m256i db, dg, dr, da;
+            split_avx2(d, &db, &dg, &dr, &da);
+            __m256i a1 =
+                mul_avx2(_mm256_sub_epi32(_mm256_set1_epi32(255), da), a);
+            d = join_avx2(_mm256_add_epi32(mul_avx2(sb, a1), db),
+                          _mm256_add_epi32(mul_avx2(sg, a1), dg),
+                          _mm256_add_epi32(mul_avx2(sr, a1), dr),
+                          _mm256_add_epi32(a1, da));
+        });
+}
+
+static DP_FORCE_INLINE __m256i blend_multiply_avx2(__m256i base, __m256i blend)
+{
+    return mul_avx2(base, blend);
+}
+
+static DP_FORCE_INLINE __m256i blend_divide_avx2(__m256i base, __m256i blend)
+{
+    __m256i n = _mm256_add_epi32(_mm256_slli_epi32(base, 8),
+                                 _mm256_srli_epi32(blend, 1));
+    __m256i d = _mm256_add_epi32(blend, _mm256_set1_epi32(1));
+    return _mm256_min_epi32(div_avx2(n, d), _mm256_set1_epi32(255));
+}
+
+static DP_FORCE_INLINE __m256i blend_darken_avx2(__m256i base, __m256i blend)
+{
+    return _mm256_min_epi32(base, blend);
+}
+
+static DP_FORCE_INLINE __m256i blend_lighten_avx2(__m256i base, __m256i blend)
+{
+    return _mm256_max_epi32(base, blend);
+}
+
+static DP_FORCE_INLINE __m256i blend_dodge_avx2(__m256i base, __m256i blend)
+{
+    __m256i n = _mm256_slli_epi32(base, 8);
+    __m256i d = _mm256_sub_epi32(_mm256_set1_epi32(256), blend);
+    return _mm256_min_epi32(div_avx2(n, d), _mm256_set1_epi32(255));
+}
+
+static DP_FORCE_INLINE __m256i blend_burn_avx2(__m256i base, __m256i blend)
+{
+    __m256i n =
+        _mm256_slli_epi32(_mm256_sub_epi32(_mm256_set1_epi32(255), base), 8);
+    __m256i d = _mm256_add_epi32(blend, _mm256_set1_epi32(1));
+    return _mm256_max_epi32(
+        _mm256_sub_epi32(_mm256_set1_epi32(255), div_avx2(n, d)),
+        _mm256_setzero_si256());
+}
+
+static DP_FORCE_INLINE __m256i blend_add_avx2(__m256i base, __m256i blend)
+{
+    return _mm256_min_epi32(_mm256_add_epi32(base, blend),
+                            _mm256_set1_epi32(255));
+}
+
+static DP_FORCE_INLINE __m256i blend_subtract_avx2(__m256i base, __m256i blend)
+{
+    return _mm256_max_epi32(_mm256_sub_epi32(base, blend),
+                            _mm256_setzero_si256());
+}
+
+static DP_FORCE_INLINE __m256i blend_blend_avx2(DP_UNUSED __m256i base,
+                                                __m256i blend)
+{
+    return blend;
+}
+
+static DP_FORCE_INLINE void
+mask_composite_with_avx2(DP_Pixel *dst, DP_Pixel src, uint8_t *mask, int w,
+                         int h, int mask_skip, int dst_skip,
+                         DP_CompositeBrushFn scalar_fn,
+                         __m256i (*blend_op)(__m256i, __m256i))
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sb, sg, sr, sa;
+    split_avx2(_mm256_set1_epi32(DP_uint32_to_int32(src.color)), &sb, &sg, &sr,
+               &sa);
+    FOR_MASK_PIXEL_AVX2(
+        dst, src, mask, w, h, mask_skip, dst_skip, scalar_fn, d, a, {
+            __m256i db, dg, dr, da;
+            split_avx2(d, &db, &dg, &dr, &da);
+            __m256i factors = unpremultiply_factors_avx2(da);
+            db = unpremultiply_avx2(db, factors);
+            dg = unpremultiply_avx2(dg, factors);
+            dr = unpremultiply_avx2(dr, factors);
+            db = blend_avx2(blend_op(db, sb), db, a);
+            dg = blend_avx2(blend_op(dg, sg), dg, a);
+            dr = blend_avx2(blend_op(dr, sr), dr, a);
+            __m256i result =
+                join_avx2(premultiply_avx2(db, da), premultiply_avx2(dg, da),
+                          premultiply_avx2(dr, da), da);
+            __m256i keep = _mm256_or_si256(_mm256_cmpeq_epi32(a, zero),
+                                           _mm256_cmpeq_epi32(d, zero));
+            d = _mm256_blendv_epi8(result, d, keep);
+        });
+}
+
+// See color_erase_alpha_sse42 on how this stays exact.
+static DP_FORCE_INLINE __m256d color_erase_alpha_avx2(__m256d fsrc,
+                                                      __m256d ufdst)
+{
+    __m256d above = _mm256_cmp_pd(ufdst, fsrc, _CMP_GT_OQ);
+    __m256d n = _mm256_blendv_pd(_mm256_sub_pd(fsrc, ufdst),
+                                 _mm256_sub_pd(ufdst, fsrc), above);
+    __m256d d = _mm256_blendv_pd(
+        fsrc, _mm256_sub_pd(_mm256_set1_pd(1.0), fsrc), above);
+    __m256d ufalpha = _mm256_and_pd(_mm256_div_pd(n, d),
+                                    _mm256_cmp_pd(ufdst, fsrc, _CMP_NEQ_OQ));
+    return _mm256_blendv_pd(
+        ufalpha, ufdst,
+        _mm256_cmp_pd(fsrc, _mm256_set1_pd(0.0001), _CMP_LT_OQ));
+}
+
+static DP_FORCE_INLINE __m128i
+color_erase_avx2(__m256d fsrc_b, __m256d fsrc_g, __m256d fsrc_r,
+                 __m256d fsrc_a, __m256d ufdst_b, __m256d ufdst_g,
+                 __m256d ufdst_r, __m256d ufdst_a)
+{
+    __m256d ufalpha_r = color_erase_alpha_avx2(fsrc_r, ufdst_r);
+    __m256d ufalpha_g = color_erase_alpha_avx2(fsrc_g, ufdst_g);
+    __m256d ufalpha_b = color_erase_alpha_avx2(fsrc_b, ufdst_b);
+
+    __m256d r_or_b =
+        _mm256_blendv_pd(ufalpha_b, ufalpha_r,
+                         _mm256_cmp_pd(ufalpha_r, ufalpha_b, _CMP_GT_OQ));
+    __m256d g_or_b =
+        _mm256_blendv_pd(ufalpha_b, ufalpha_g,
+                         _mm256_cmp_pd(ufalpha_g, ufalpha_b, _CMP_GT_OQ));
+    __m256d out_a = _mm256_blendv_pd(
+        g_or_b, r_or_b, _mm256_cmp_pd(ufalpha_r, ufalpha_g, _CMP_GT_OQ));
+
+    out_a = _mm256_add_pd(_mm256_sub_pd(_mm256_set1_pd(1.0), fsrc_a),
+                          _mm256_mul_pd(out_a, fsrc_a));
+
+    __m256d apply = _mm256_cmp_pd(out_a, _mm256_set1_pd(0.0001), _CMP_GE_OQ);
+    __m256d out_r = _mm256_blendv_pd(
+        ufdst_r,
+        _mm256_add_pd(_mm256_div_pd(_mm256_sub_pd(ufdst_r, fsrc_r), out_a),
+                      fsrc_r),
+        apply);
+    __m256d out_g = _mm256_blendv_pd(
+        ufdst_g,
+        _mm256_add_pd(_mm256_div_pd(_mm256_sub_pd(ufdst_g, fsrc_g), out_a),
+                      fsrc_g),
+        apply);
+    __m256d out_b = _mm256_blendv_pd(
+        ufdst_b,
+        _mm256_add_pd(_mm256_div_pd(_mm256_sub_pd(ufdst_b, fsrc_b), out_a),
+                      fsrc_b),
+        apply);
+    out_a = _mm256_blendv_pd(out_a, _mm256_mul_pd(out_a, ufdst_a), apply);
+
+    __m256d max = _mm256_set1_pd(255.0);
+    __m128i b = _mm256_cvttpd_epi32(_mm256_mul_pd(out_b, max));
+    __m128i g = _mm256_cvttpd_epi32(_mm256_mul_pd(out_g, max));
+    __m128i r = _mm256_cvttpd_epi32(_mm256_mul_pd(out_r, max));
+    __m128i a = _mm256_cvttpd_epi32(_mm256_mul_pd(out_a, max));
+    return join_sse42(premultiply_sse42(b, a), premultiply_sse42(g, a),
+                      premultiply_sse42(r, a), a);
+}
+
+static DP_FORCE_INLINE __m256d to_fraction_avx2(__m128i c)
+{
+    return _mm256_div_pd(_mm256_cvtepi32_pd(c), _mm256_set1_pd(255.0));
+}
+
+static void composite_mask_color_erase_avx2(DP_Pixel *dst, DP_Pixel src,
+                                            uint8_t *mask, int w, int h,
+                                            int mask_skip, int dst_skip)
+{
+    __m256d fsrc_b = _mm256_set1_pd(src.b / 255.0);
+    __m256d fsrc_g = _mm256_set1_pd(src.g / 255.0);
+    __m256d fsrc_r = _mm256_set1_pd(src.r / 255.0);
+    // Only four pixels at a time, since the math happens on doubles.
+    FOR_MASK_PIXEL_SSE42(
+        dst, src, mask, w, h, mask_skip, dst_skip, composite_mask_color_erase,
+        d, a, {
+            if (all_zero_sse42(a)) {
+                continue;
+            }
+            __m128i db, dg, dr, da;
+            split_sse42(d, &db, &dg, &dr, &da);
+            __m128i factors = _mm_i32gather_epi32(
+                (const int *)unpremultiply_factors, da, 4);
+            db = unpremultiply_sse42(db, factors);
+            dg = unpremultiply_sse42(dg, factors);
+            dr = unpremultiply_sse42(dr, factors);
+            __m128i result = color_erase_avx2(
+                fsrc_b, fsrc_g, fsrc_r, to_fraction_avx2(a),
+                to_fraction_avx2(db), to_fraction_avx2(dg),
+                to_fraction_avx2(dr), to_fraction_avx2(da));
+            d = _mm_blendv_epi8(result, d,
+                                _mm_cmpeq_epi32(a, _mm_setzero_si128()));
+        });
+}
+
+#    define DEFINE_MASK_COMPOSITE_WITH_AVX2(NAME)                          \
+        static void composite_mask_##NAME##_avx2(                          \
+            DP_Pixel *dst, DP_Pixel src, uint8_t *mask, int w, int h,      \
+            int mask_skip, int dst_skip)                                   \
+        {                                                                  \
+            mask_composite_with_avx2(dst, src, mask, w, h, mask_skip,      \
+                                     dst_skip, composite_mask_##NAME,      \
+                                     blend_##NAME##_avx2);                 \
+        }
+
+DEFINE_MASK_COMPOSITE_WITH_AVX2(multiply)
+DEFINE_MASK_COMPOSITE_WITH_AVX2(divide)
+DEFINE_MASK_COMPOSITE_WITH_AVX2(burn)
+DEFINE_MASK_COMPOSITE_WITH_AVX2(dodge)
+DEFINE_MASK_COMPOSITE_WITH_AVX2(darken)
+DEFINE_MASK_COMPOSITE_WITH_AVX2(lighten)
+DEFINE_MASK_COMPOSITE_WITH_AVX2(subtract)
+DEFINE_MASK_COMPOSITE_WITH_AVX2(add)
+DEFINE_MASK_COMPOSITE_WITH_AVX2(blend)
+
+DP_TARGET_END
+
+#endif
+
+
 static DP_CompositeBrushFn
 get_composite_composite_mask_operation(int blend_mode)
 {
@@ -484,11 +1287,100 @@ get_composite_composite_mask_operation(int blend_mode)
     }
 }
 
+#ifdef DP_CPU_X64
+static DP_CompositeBrushFn
+get_composite_composite_mask_operation_sse42(int blend_mode)
+{
+    switch (blend_mode) {
+    case DP_BLEND_MODE_ERASE:
+        return composite_mask_erase_sse42;
+    case DP_BLEND_MODE_NORMAL:
+        return composite_mask_alpha_blend_sse42;
+    case DP_BLEND_MODE_MULTIPLY:
+        return composite_mask_multiply_sse42;
+    case DP_BLEND_MODE_DIVIDE:
+        return composite_mask_divide_sse42;
+    case DP_BLEND_MODE_BURN:
+        return composite_mask_burn_sse42;
+    case DP_BLEND_MODE_DODGE:
+        return composite_mask_dodge_sse42;
+    case DP_BLEND_MODE_DARKEN:
+        return composite_mask_darken_sse42;
+    case DP_BLEND_MODE_LIGHTEN:
+        return composite_mask_lighten_sse42;
+    case DP_BLEND_MODE_SUBTRACT:
+        return composite_mask_subtract_sse42;
+    case DP_BLEND_MODE_ADD:
+        return composite_mask_add_sse42;
+    case DP_BLEND_MODE_RECOLOR:
+        return composite_mask_blend_sse42;
+    case DP_BLEND_MODE_BEHIND:
+        return composite_mask_alpha_under_sse42;
+    case DP_BLEND_MODE_COLOR_ERASE:
+        return composite_mask_color_erase_sse42;
+    case DP_BLEND_MODE_REPLACE:
+        return composite_mask_copy_sse42;
+    default:
+        return get_composite_composite_mask_operation(blend_mode);
+    }
+}
+
+static DP_CompositeBrushFn
+get_composite_composite_mask_operation_avx2(int blend_mode)
+{
+    switch (blend_mode) {
+    case DP_BLEND_MODE_ERASE:
+        return composite_mask_erase_avx2;
+    case DP_BLEND_MODE_NORMAL:
+        return composite_mask_alpha_blend_avx2;
+    case DP_BLEND_MODE_MULTIPLY:
+        return composite_mask_multiply_avx2;
+    case DP_BLEND_MODE_DIVIDE:
+        return composite_mask_divide_avx2;
+    case DP_BLEND_MODE_BURN:
+        return composite_mask_burn_avx2;
+    case DP_BLEND_MODE_DODGE:
+        return composite_mask_dodge_avx2;
+    case DP_BLEND_MODE_DARKEN:
+        return composite_mask_darken_avx2;
+    case DP_BLEND_MODE_LIGHTEN:
+        return composite_mask_lighten_avx2;
+    case DP_BLEND_MODE_SUBTRACT:
+        return composite_mask_subtract_avx2;
+    case DP_BLEND_MODE_ADD:
+        return composite_mask_add_avx2;
+    case DP_BLEND_MODE_RECOLOR:
+        return composite_mask_blend_avx2;
+    case DP_BLEND_MODE_BEHIND:
+        return composite_mask_alpha_under_avx2;
+    case DP_BLEND_MODE_COLOR_ERASE:
+        return composite_mask_color_erase_avx2;
+    case DP_BLEND_MODE_REPLACE:
+        return composite_mask_copy_avx2;
+    default:
+        return get_composite_composite_mask_operation(blend_mode);
+    }
+}
+#endif
+
 void DP_pixels_composite_mask(DP_Pixel *dst, DP_Pixel src, int blend_mode,
                               uint8_t *mask, int w, int h, int mask_skip,
                               int dst_skip)
 {
-    DP_CompositeBrushFn op = get_composite_composite_mask_operation(blend_mode);
+    DP_CompositeBrushFn op;
+    switch (DP_cpu_support) {
+#ifdef DP_CPU_X64
+    case DP_CPU_SUPPORT_AVX2:
+        op = get_composite_composite_mask_operation_avx2(blend_mode);
+        break;
+    case DP_CPU_SUPPORT_SSE42:
+        op = get_composite_composite_mask_operation_sse42(blend_mode);
+        break;
+#endif
+    default:
+        op = get_composite_composite_mask_operation(blend_mode);
+        break;
+    }
     op(dst, src, mask, w, h, mask_skip, dst_skip);
 }
 
@@ -654,6 +1546,397 @@ static void composite_blend(DP_Pixel *DP_RESTRICT dst,
     composite_with(dst, src, pixel_count, opacity, blend_blend);
 }
 
+#ifdef DP_CPU_X64
+
+DP_TARGET_BEGIN("sse4.2")
+
+#    define FOR_PIXEL_SSE42(DST, SRC, PIXEL_COUNT, OPACITY, SCALAR_FN, D, S, \
+                            ...)                                           \
+        do {                                                               \
+            int _remaining = PIXEL_COUNT % 4;                              \
+            int _vector_count = PIXEL_COUNT - _remaining;                  \
+            for (int _i = 0; _i < _vector_count;                           \
+                 _i += 4, DST += 4, SRC += 4) {                            \
+                __m128i D = _mm_loadu_si128((__m128i *)DST);               \
+                __m128i S = _mm_loadu_si128((__m128i *)SRC);               \
+                __VA_ARGS__                                                \
+                _mm_storeu_si128((__m128i *)DST, D);                       \
+            }                                                              \
+            SCALAR_FN(DST, SRC, _remaining, OPACITY);                      \
+        } while (0)
+
+static void composite_erase_sse42(DP_Pixel *DP_RESTRICT dst,
+                                  DP_Pixel *DP_RESTRICT src, int pixel_count,
+                                  uint8_t opacity)
+{
+    __m128i o = _mm_set1_epi32(opacity);
+    FOR_PIXEL_SSE42(dst, src, pixel_count, opacity, composite_erase, d, s, {
+        __m128i db, dg, dr, da;
+        split_sse42(d, &db, &dg, &dr, &da);
+        __m128i a1 = _mm_sub_epi32(_mm_set1_epi32(255),
+                                   mul_sse42(_mm_srli_epi32(s, 24), o));
+        d = join_sse42(mul_sse42(db, a1), mul_sse42(dg, a1), mul_sse42(dr, a1),
+                       mul_sse42(da, a1));
+    });
+}
+
+static DP_FORCE_INLINE void
+composite_alpha_blend_sse42_with(DP_Pixel *DP_RESTRICT dst,
+                                 DP_Pixel *DP_RESTRICT src, int pixel_count,
+                                 uint8_t opacity, bool opaque)
+{
+    __m128i o = _mm_set1_epi32(opacity);
+    FOR_PIXEL_SSE42(
+        dst, src, pixel_count, opacity, composite_alpha_blend, d, s, {
+            __m128i sb, sg, sr, sa;
+            split_sse42(s, &sb, &sg, &sr, &sa);
+            if (all_zero_sse42(sa)) {
+                continue; // Source is transparent, nothing to do.
+            }
+            else if (opaque && all_opaque_sse42(sa)) {
+                d = s; // Source is opaque, just replace the destination.
+            }
+            else {
+                if (!opaque) {
+                    sb = mul_sse42(sb, o);
+                    sg = mul_sse42(sg, o);
+                    sr = mul_sse42(sr, o);
+                    sa = mul_sse42(sa, o);
+                }
+                __m128i db, dg, dr, da;
+                split_sse42(d, &db, &dg, &dr, &da);
+                __m128i sa1 = _mm_sub_epi32(_mm_set1_epi32(255), sa);
+                __m128i result =
+                    join_sse42(_mm_add_epi32(sb, mul_sse42(db, sa1)),
+                               _mm_add_epi32(sg, mul_sse42(dg, sa1)),
+                               _mm_add_epi32(sr, mul_sse42(dr, sa1)),
+                               _mm_add_epi32(sa, mul_sse42(da, sa1)));
+                __m128i keep = _mm_cmpeq_epi32(sa, _mm_setzero_si128());
+                d = _mm_blendv_epi8(result, d, keep);
+            }
+        });
+}
+
+static void composite_alpha_blend_sse42(DP_Pixel *DP_RESTRICT dst,
+                                        DP_Pixel *DP_RESTRICT src,
+                                        int pixel_count, uint8_t opacity)
+{
+    if (opacity == 255) {
+        composite_alpha_blend_sse42_with(dst, src, pixel_count, opacity, true);
+    }
+    else {
+        composite_alpha_blend_sse42_with(dst, src, pixel_count, opacity,
+                                         false);
+    }
+}
+
+static void composite_alpha_under_sse42(DP_Pixel *DP_RESTRICT dst,
+                                        DP_Pixel *DP_RESTRICT src,
+                                        int pixel_count, uint8_t opacity)
+{
+    __m128i o = _mm_set1_epi32(opacity);
+    FOR_PIXEL_SSE42(
+        dst, src, pixel_count, opacity, composite_alpha_under, d, s, {
+            __m128i db, dg, dr, da, sb, sg, sr, sa;
+            split_sse42(d, &db, &dg, &dr, &da);
+            if (all_opaque_sse42(da)) {
+                continue; // Destination is opaque, nothing to do.
+            }
+            split_sse42(s, &sb, &sg, &sr, &sa);
+            __m128i sa1 = mul_sse42(_mm_sub_epi32(_mm_set1_epi32(255), da),
+                                    mul_sse42(sa, o));
+            d = join_sse42(_mm_add_epi32(mul_sse42(sb, sa1), db),
+                           _mm_add_epi32(mul_sse42(sg, sa1), dg),
+                           _mm_add_epi32(mul_sse42(sr, sa1), dr),
+                           _mm_add_epi32(mul_sse42(sa, sa1), da));
+        });
+}
+
+static void composite_color_erase_sse42(DP_Pixel *DP_RESTRICT dst,
+                                        DP_Pixel *DP_RESTRICT src,
+                                        int pixel_count, uint8_t opacity)
+{
+    __m128d o = _mm_set1_pd(opacity / 255.0);
+    FOR_PIXEL_SSE42(
+        dst, src, pixel_count, opacity, composite_color_erase, d, s, {
+            __m128i db, dg, dr, da, sb, sg, sr, sa;
+            split_sse42(d, &db, &dg, &dr, &da);
+            split_sse42(s, &sb, &sg, &sr, &sa);
+            __m128i dfactors = unpremultiply_factors_sse42(da);
+            db = unpremultiply_sse42(db, dfactors);
+            dg = unpremultiply_sse42(dg, dfactors);
+            dr = unpremultiply_sse42(dr, dfactors);
+            __m128i sfactors = unpremultiply_factors_sse42(sa);
+            sb = unpremultiply_sse42(sb, sfactors);
+            sg = unpremultiply_sse42(sg, sfactors);
+            sr = unpremultiply_sse42(sr, sfactors);
+            __m128i lo = color_erase_sse42(
+                to_fraction_lo_sse42(sb), to_fraction_lo_sse42(sg),
+                to_fraction_lo_sse42(sr),
+                _mm_mul_pd(to_fraction_lo_sse42(sa), o),
+                to_fraction_lo_sse42(db), to_fraction_lo_sse42(dg),
+                to_fraction_lo_sse42(dr), to_fraction_lo_sse42(da));
+            __m128i hi = color_erase_sse42(
+                to_fraction_hi_sse42(sb), to_fraction_hi_sse42(sg),
+                to_fraction_hi_sse42(sr),
+                _mm_mul_pd(to_fraction_hi_sse42(sa), o),
+                to_fraction_hi_sse42(db), to_fraction_hi_sse42(dg),
+                to_fraction_hi_sse42(dr), to_fraction_hi_sse42(da));
+            d = _mm_unpacklo_epi64(lo, hi);
+        });
+}
+
+static DP_FORCE_INLINE void
+composite_with_sse42(DP_Pixel *DP_RESTRICT dst, DP_Pixel *DP_RESTRICT src,
+                     int pixel_count, uint8_t opacity,
+                     DP_CompositeLayerFn scalar_fn,
+                     __m128i (*blend_op)(__m128i, __m128i))
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i o = _mm_set1_epi32(opacity);
+    FOR_PIXEL_SSE42(dst, src, pixel_count, opacity, scalar_fn, d, s, {
+        __m128i keep =
+            _mm_or_si128(_mm_cmpeq_epi32(d, zero), _mm_cmpeq_epi32(s, zero));
+        if (_mm_movemask_epi8(keep) == 0xffff) {
+            continue;
+        }
+        __m128i db, dg, dr, da, sb, sg, sr, sa;
+        split_sse42(d, &db, &dg, &dr, &da);
+        split_sse42(s, &sb, &sg, &sr, &sa);
+        __m128i dfactors = unpremultiply_factors_sse42(da);
+        db = unpremultiply_sse42(db, dfactors);
+        dg = unpremultiply_sse42(dg, dfactors);
+        dr = unpremultiply_sse42(dr, dfactors);
+        __m128i sfactors = unpremultiply_factors_sse42(sa);
+        sb = unpremultiply_sse42(sb, sfactors);
+        sg = unpremultiply_sse42(sg, sfactors);
+        sr = unpremultiply_sse42(sr, sfactors);
+        __m128i a = mul_sse42(sa, o);
+        db = blend_sse42(blend_op(db, sb), db, a);
+        dg = blend_sse42(blend_op(dg, sg), dg, a);
+        dr = blend_sse42(blend_op(dr, sr), dr, a);
+        __m128i result =
+            join_sse42(premultiply_sse42(db, da), premultiply_sse42(dg, da),
+                       premultiply_sse42(dr, da), da);
+        d = _mm_blendv_epi8(result, d, keep);
+    });
+}
+
+#    define DEFINE_COMPOSITE_WITH_SSE42(NAME)                              \
+        static void composite_##NAME##_sse42(DP_Pixel *DP_RESTRICT dst,    \
+                                             DP_Pixel *DP_RESTRICT src,    \
+                                             int pixel_count,              \
+                                             uint8_t opacity)              \
+        {                                                                  \
+            composite_with_sse42(dst, src, pixel_count, opacity,           \
+                                 composite_##NAME, blend_##NAME##_sse42);  \
+        }
+
+DEFINE_COMPOSITE_WITH_SSE42(multiply)
+DEFINE_COMPOSITE_WITH_SSE42(divide)
+DEFINE_COMPOSITE_WITH_SSE42(burn)
+DEFINE_COMPOSITE_WITH_SSE42(dodge)
+DEFINE_COMPOSITE_WITH_SSE42(darken)
+DEFINE_COMPOSITE_WITH_SSE42(lighten)
+DEFINE_COMPOSITE_WITH_SSE42(subtract)
+DEFINE_COMPOSITE_WITH_SSE42(add)
+DEFINE_COMPOSITE_WITH_SSE42(blend)
+
+DP_TARGET_END
+
+
+DP_TARGET_BEGIN("avx2")
+
+#    define FOR_PIXEL_AVX2(DST, SRC, PIXEL_COUNT, OPACITY, SCALAR_FN, D, S, \
+                           ...)                                           \
+        do {                                                              \
+            int _remaining = PIXEL_COUNT % 8;                             \
+            int _vector_count = PIXEL_COUNT - _remaining;                 \
+            for (int _i = 0; _i < _vector_count;                          \
+                 _i += 8, DST += 8, SRC += 8) {                           \
+                __m256i D = _mm256_loadu_si256((__m256i *)DST);           \
+                __m256i S = _mm256_loadu_si256((__m256i *)SRC);           \
+                __VA_ARGS__                                               \
+                _mm256_storeu_si256((__m256i *)DST, D);                   \
+            }                                                             \
+            SCALAR_FN(DST, SRC, _remaining, OPACITY);                     \
+        } while (0)
+
+static void composite_erase_avx2(DP_Pixel *DP_RESTRICT dst,
+                                 DP_Pixel *DP_RESTRICT src, int pixel_count,
+                                 uint8_t opacity)
+{
+    __m256i o = _mm256_set1_epi32(opacity);
+    FOR_PIXEL_AVX2(dst, src, pixel_count, opacity, composite_erase, d, s, {
+        __m256i db, dg, dr, da;
+        split_avx2(d, &db, &dg, &dr, &da);
+        __m256i a1 = _mm256_sub_epi32(_mm256_set1_epi32(255),
+                                      mul_avx2(_mm256_srli_epi32(s, 24), o));
+        d = join_avx2(mul_avx2(db, a1), mul_avx2(dg, a1), mul_avx2(dr, a1),
+                      mul_avx2(da, a1));
+    });
+}
+
+static DP_FORCE_INLINE void
+composite_alpha_blend_avx2_with(DP_Pixel *DP_RESTRICT dst,
+                                DP_Pixel *DP_RESTRICT src, int pixel_count,
+                                uint8_t opacity, bool opaque)
+{
+    __m256i o = _mm256_set1_epi32(opacity);
+    FOR_PIXEL_AVX2(
+        dst, src, pixel_count, opacity, composite_alpha_blend, d, s, {
+            __m256i sb, sg, sr, sa;
+            split_avx2(s, &sb, &sg, &sr, &sa);
+            if (all_zero_avx2(sa)) {
+                continue; // Source is transparent, nothing to do.
+            }
+            else if (opaque && all_opaque_avx2(sa)) {
+                d = s; // Source is opaque, just replace the destination.
+            }
+            else {
+                if (!opaque) {
+                    sb = mul_avx2(sb, o);
+                    sg = mul_avx2(sg, o);
+                    sr = mul_avx2(sr, o);
+                    sa = mul_avx2(sa, o);
+                }
+                __m256i db, dg, dr, da;
+                split_avx2(d, &db, &dg, &dr, &da);
+                __m256i sa1 = _mm256_sub_epi32(_mm256_set1_epi32(255), sa);
+                __m256i result =
+                    join_avx2(_mm256_add_epi32(sb, mul_avx2(db, sa1)),
+                              _mm256_add_epi32(sg, mul_avx2(dg, sa1)),
+                              _mm256_add_epi32(sr, mul_avx2(dr, sa1)),
+                              _mm256_add_epi32(sa, mul_avx2(da, sa1)));
+                __m256i keep = _mm256_cmpeq_epi32(sa, _mm256_setzero_si256());
+                d = _mm256_blendv_epi8(result, d, keep);
+            }
+        });
+}
+
+static void composite_alpha_blend_avx2(DP_Pixel *DP_RESTRICT dst,
+                                       DP_Pixel *DP_RESTRICT src,
+                                       int pixel_count, uint8_t opacity)
+{
+    if (opacity == 255) {
+        composite_alpha_blend_avx2_with(dst, src, pixel_count, opacity, true);
+    }
+    else {
+        composite_alpha_blend_avx2_with(dst, src, pixel_count, opacity, false);
+    }
+}
+
+static void composite_alpha_under_avx2(DP_Pixel *DP_RESTRICT dst,
+                                       DP_Pixel *DP_RESTRICT src,
+                                       int pixel_count, uint8_t opacity)
+{
+    __m256i o = _mm256_set1_epi32(opacity);
+    FOR_PIXEL_AVX2(
+        dst, src, pixel_count, opacity, composite_alpha_under, d, s, {
+            __m256i db, dg, dr, da, sb, sg, sr, sa;
+            split_avx2(d, &db, &dg, &dr, &da);
+            if (all_opaque_avx2(da)) {
+                continue; // Destination is opaque, nothing to do.
+            }
+            split_avx2(s, &sb, &sg, &sr, &sa);
+            __m256i sa1 = mul_avx2(
+                _mm256_sub_epi32(_mm256_set1_epi32(255), da), mul_avx2(sa, o));
+            d = join_avx2(_mm256_add_epi32(mul_avx2(sb, sa1), db),
+                          _mm256_add_epi32(mul_avx2(sg, sa1), dg),
+                          _mm256_add_epi32(mul_avx2(sr, sa1), dr),
+                          _mm256_add_epi32(mul_avx2(sa, sa1), da));
+        });
+}
+
+static void composite_color_erase_avx2(DP_Pixel *DP_RESTRICT dst,
+                                       DP_Pixel *DP_RESTRICT src,
+                                       int pixel_count, uint8_t opacity)
+{
+    __m256d o = _mm256_set1_pd(opacity / 255.0);
+    FOR_PIXEL_SSE42(
+        dst, src, pixel_count, opacity, composite_color_erase, d, s, {
+            __m128i db, dg, dr, da, sb, sg, sr, sa;
+            split_sse42(d, &db, &dg, &dr, &da);
+            split_sse42(s, &sb, &sg, &sr, &sa);
+            __m128i dfactors = _mm_i32gather_epi32(
+                (const int *)unpremultiply_factors, da, 4);
+            db = unpremultiply_sse42(db, dfactors);
+            dg = unpremultiply_sse42(dg, dfactors);
+            dr = unpremultiply_sse42(dr, dfactors);
+            __m128i sfactors = _mm_i32gather_epi32(
+                (const int *)unpremultiply_factors, sa, 4);
+            sb = unpremultiply_sse42(sb, sfactors);
+            sg = unpremultiply_sse42(sg, sfactors);
+            sr = unpremultiply_sse42(sr, sfactors);
+            d = color_erase_avx2(
+                to_fraction_avx2(sb), to_fraction_avx2(sg),
+                to_fraction_avx2(sr), _mm256_mul_pd(to_fraction_avx2(sa), o),
+                to_fraction_avx2(db), to_fraction_avx2(dg),
+                to_fraction_avx2(dr), to_fraction_avx2(da));
+        });
+}
+
+static DP_FORCE_INLINE void
+composite_with_avx2(DP_Pixel *DP_RESTRICT dst, DP_Pixel *DP_RESTRICT src,
+                    int pixel_count, uint8_t opacity,
+                    DP_CompositeLayerFn scalar_fn,
+                    __m256i (*blend_op)(__m256i, __m256i))
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i o = _mm256_set1_epi32(opacity);
+    FOR_PIXEL_AVX2(dst, src, pixel_count, opacity, scalar_fn, d, s, {
+        __m256i keep = _mm256_or_si256(_mm256_cmpeq_epi32(d, zero),
+                                       _mm256_cmpeq_epi32(s, zero));
+        if (_mm256_movemask_epi8(keep) == -1) {
+            continue;
+        }
+        __m256i db, dg, dr, da, sb, sg, sr, sa;
+        split_avx2(d, &db, &dg, &dr, &da);
+        split_avx2(s, &sb, &sg, &sr, &sa);
+        __m256i dfactors = unpremultiply_factors_avx2(da);
+        db = unpremultiply_avx2(db, dfactors);
+        dg = unpremultiply_avx2(dg, dfactors);
+        dr = unpremultiply_avx2(dr, dfactors);
+        __m256i sfactors = unpremultiply_factors_avx2(sa);
+        sb = unpremultiply_avx2(sb, sfactors);
+        sg = unpremultiply_avx2(sg, sfactors);
+        sr = unpremultiply_avx2(sr, sfactors);
+        __m256i a = mul_avx2(sa, o);
+        db = blend_avx2(blend_op(db, sb), db, a);
+        dg = blend_avx2(blend_op(dg, sg), dg, a);
+        dr = blend_avx2(blend_op(dr, sr), dr, a);
+        __m256i result =
+            join_avx2(premultiply_avx2(db, da), premultiply_avx2(dg, da),
+                      premultiply_avx2(dr, da), da);
+        d = _mm256_blendv_epi8(result, d, keep);
+    });
+}
+
+#    define DEFINE_COMPOSITE_WITH_AVX2(NAME)                             \
+        static void composite_##NAME##_avx2(DP_Pixel *DP_RESTRICT dst,   \
+                                            DP_Pixel *DP_RESTRICT src,   \
+                                            int pixel_count,             \
+                                            uint8_t opacity)             \
+        {                                                                \
+            composite_with_avx2(dst, src, pixel_count, opacity,          \
+                                composite_##NAME, blend_##NAME##_avx2);  \
+        }
+
+DEFINE_COMPOSITE_WITH_AVX2(multiply)
+DEFINE_COMPOSITE_WITH_AVX2(divide)
+DEFINE_COMPOSITE_WITH_AVX2(burn)
+DEFINE_COMPOSITE_WITH_AVX2(dodge)
+DEFINE_COMPOSITE_WITH_AVX2(darken)
+DEFINE_COMPOSITE_WITH_AVX2(lighten)
+DEFINE_COMPOSITE_WITH_AVX2(subtract)
+DEFINE_COMPOSITE_WITH_AVX2(add)
+DEFINE_COMPOSITE_WITH_AVX2(blend)
+
+DP_TARGET_END
+
+#endif
+
+
 static DP_CompositeLayerFn get_composite_operation(int blend_mode)
 {
     switch (blend_mode) {
@@ -692,11 +1975,107 @@ static DP_CompositeLayerFn get_composite_operation(int blend_mode)
     }
 }
 
+#ifdef DP_CPU_X64
+static DP_CompositeLayerFn get_composite_operation_sse42(int blend_mode)
+{
+    switch (blend_mode) {
+    case DP_BLEND_MODE_ERASE:
+        return composite_erase_sse42;
+    case DP_BLEND_MODE_NORMAL:
+        return composite_alpha_blend_sse42;
+    case DP_BLEND_MODE_MULTIPLY:
+        return composite_multiply_sse42;
+    case DP_BLEND_MODE_DIVIDE:
+        return composite_divide_sse42;
+    case DP_BLEND_MODE_BURN:
+        return composite_burn_sse42;
+    case DP_BLEND_MODE_DODGE:
+        return composite_dodge_sse42;
+    case DP_BLEND_MODE_DARKEN:
+        return composite_darken_sse42;
+    case DP_BLEND_MODE_LIGHTEN:
+        return composite_lighten_sse42;
+    case DP_BLEND_MODE_SUBTRACT:
+        return composite_subtract_sse42;
+    case DP_BLEND_MODE_ADD:
+        return composite_add_sse42;
+    case DP_BLEND_MODE_RECOLOR:
+        return composite_blend_sse42;
+    case DP_BLEND_MODE_BEHIND:
+        return composite_alpha_under_sse42;
+    case DP_BLEND_MODE_COLOR_ERASE:
+        return composite_color_erase_sse42;
+    default:
+        return get_composite_operation(blend_mode);
+    }
+}
+
+static DP_CompositeLayerFn get_composite_operation_avx2(int blend_mode)
+{
+    switch (blend_mode) {
+    case DP_BLEND_MODE_ERASE:
+        return composite_erase_avx2;
+    case DP_BLEND_MODE_NORMAL:
+        return composite_alpha_blend_avx2;
+    case DP_BLEND_MODE_MULTIPLY:
+        return composite_multiply_avx2;
+    case DP_BLEND_MODE_DIVIDE:
+        return composite_divide_avx2;
+    case DP_BLEND_MODE_BURN:
+        return composite_burn_avx2;
+    case DP_BLEND_MODE_DODGE:
+        return composite_dodge_avx2;
+    case DP_BLEND_MODE_DARKEN:
+        return composite_darken_avx2;
+    case DP_BLEND_MODE_LIGHTEN:
+        return composite_lighten_avx2;
+    case DP_BLEND_MODE_SUBTRACT:
+        return composite_subtract_avx2;
+    case DP_BLEND_MODE_ADD:
+        return composite_add_avx2;
+    case DP_BLEND_MODE_RECOLOR:
+        return composite_blend_avx2;
+    case DP_BLEND_MODE_BEHIND:
+        return composite_alpha_under_avx2;
+    case DP_BLEND_MODE_COLOR_ERASE:
+        return composite_color_erase_avx2;
+    default:
+        return get_composite_operation(blend_mode);
+    }
+}
+#endif
+
+// Whether compositing with zero opacity leaves the destination untouched. Not
+// the case for the other blend modes, since they round-trip the destination
+// through unpremultiplication or ignore the opacity altogether.
+static bool composite_noop(uint8_t opacity, int blend_mode)
+{
+    return opacity == 0
+        && (blend_mode == DP_BLEND_MODE_NORMAL
+            || blend_mode == DP_BLEND_MODE_ERASE
+            || blend_mode == DP_BLEND_MODE_BEHIND);
+}
+
 void DP_pixels_composite(DP_Pixel *dst, DP_Pixel *src, int pixel_count,
                          uint8_t opacity, int blend_mode)
 {
-    DP_CompositeLayerFn op = get_composite_operation(blend_mode);
-    op(dst, src, pixel_count, opacity);
+    if (!composite_noop(opacity, blend_mode)) {
+        DP_CompositeLayerFn op;
+        switch (DP_cpu_support) {
+#ifdef DP_CPU_X64
+        case DP_CPU_SUPPORT_AVX2:
+            op = get_composite_operation_avx2(blend_mode);
+            break;
+        case DP_CPU_SUPPORT_SSE42:
+            op = get_composite_operation_sse42(blend_mode);
+            break;
+#endif
+        default:
+            op = get_composite_operation(blend_mode);
+            break;
+        }
+        op(dst, src, pixel_count, opacity);
+    }
 }
 
 
@@ -27,6 +27,7 @@
 #include <dpcommon/binary.h>
 #include <dpcommon/common.h>
 #include <dpcommon/conversions.h>
+#include <dpcommon/threading.h>
 
 
 #ifdef DP_NO_STRICT_ALIASING
@@ -34,15 +35,31 @@
 struct DP_Tile {
     DP_Atomic refcount;
     const bool transient;
+    const bool solid;
     const unsigned int context_id;
-    DP_Pixel pixels[DP_TILE_LENGTH];
+    const DP_Pixel solid_pixel;
+    bool interned;
+    uint64_t hash;
+    struct DP_Tile *intern_next;
+    bool cold;
+    size_t cold_size;
+    unsigned char *cold_data;
+    alignas(DP_TILE_ALIGNMENT) DP_Pixel pixels[];
 };
 
 struct DP_TransientTile {
     DP_Atomic refcount;
     bool transient;
+    bool solid;
     unsigned int context_id;
-    DP_Pixel pixels[DP_TILE_LENGTH];
+    DP_Pixel solid_pixel;
+    bool interned;
+    uint64_t hash;
+    struct DP_Tile *intern_next;
+    bool cold;
+    size_t cold_size;
+    unsigned char *cold_data;
+    alignas(DP_TILE_ALIGNMENT) DP_Pixel pixels[];
 };
 
 #else
@@ -50,22 +67,406 @@ struct DP_TransientTile {
 struct DP_Tile {
     DP_Atomic refcount;
     bool transient;
+    bool solid;
     unsigned int context_id;
-    DP_Pixel pixels[DP_TILE_LENGTH];
+    DP_Pixel solid_pixel;
+    bool interned;
+    uint64_t hash;
+    struct DP_Tile *intern_next;
+    bool cold;
+    size_t cold_size;
+    unsigned char *cold_data;
+    alignas(DP_TILE_ALIGNMENT) DP_Pixel pixels[];
 };
 
 #endif
 
+// Solid tiles are persistent tiles that only store a single pixel value and
+// don't have any space allocated for the pixels array. Transient tiles never
+// are solid, they get expanded when a transient copy is made. Cold tiles are
+// similar, they keep their pixels compressed in a separate buffer.
+#define SOLID_TILE_SIZE sizeof(DP_Tile)
+#define COLD_TILE_SIZE  sizeof(DP_Tile)
+#define FULL_TILE_SIZE  DP_FLEX_SIZEOF(DP_Tile, pixels, DP_TILE_LENGTH)
+
+
+// Freed tiles are kept around in free lists instead of going back to the
+// system allocator. Each thread has a small cache of its own, which spills
+// over into a global pool. The total number of pooled tiles is capped by
+// the pool limit, anything beyond that is freed for real.
+#define THREAD_CACHE_MAX 32
+
+typedef struct DP_TileFreeNode {
+    struct DP_TileFreeNode *next;
+} DP_TileFreeNode;
+
+typedef struct DP_TileThreadCache {
+    int count;
+    DP_TileFreeNode *head;
+} DP_TileThreadCache;
+
+static DP_Atomic live_tiles;
+static DP_Atomic solid_tiles;
+static DP_Atomic cold_tiles;
+static DP_Atomic pooled_tiles;
+static DP_Atomic pool_limit = DP_ATOMIC_INIT(DP_TILE_POOL_DEFAULT_LIMIT);
+
+DP_ATOMIC_DECLARE_STATIC_SPIN_LOCK(pool_lock);
+static DP_TileFreeNode *pool_head;
+
+DP_ATOMIC_DECLARE_STATIC_SPIN_LOCK(cache_tls_lock);
+static DP_TlsKey cache_tls = DP_TLS_UNDEFINED;
+
+
+static void pool_push(DP_TileFreeNode *first, DP_TileFreeNode *last)
+{
+    DP_atomic_lock(&pool_lock);
+    last->next = pool_head;
+    pool_head = first;
+    DP_atomic_unlock(&pool_lock);
+}
+
+static DP_TileFreeNode *pool_take(int max_count, int *out_count)
+{
+    DP_atomic_lock(&pool_lock);
+    DP_TileFreeNode *first = pool_head;
+    DP_TileFreeNode *last = NULL;
+    int count = 0;
+    for (DP_TileFreeNode *node = first; node && count < max_count;
+         node = node->next) {
+        last = node;
+        ++count;
+    }
+    if (last) {
+        pool_head = last->next;
+        last->next = NULL;
+    }
+    DP_atomic_unlock(&pool_lock);
+    *out_count = count;
+    return count == 0 ? NULL : first;
+}
+
+static void free_thread_cache(void *arg)
+{
+    DP_TileThreadCache *cache = arg;
+    DP_TileFreeNode *first = cache->head;
+    if (first) {
+        DP_TileFreeNode *last = first;
+        while (last->next) {
+            last = last->next;
+        }
+        pool_push(first, last);
+    }
+    DP_free(cache);
+}
+
+static DP_TileThreadCache *get_thread_cache(void)
+{
+    if (cache_tls == DP_TLS_UNDEFINED) {
+        DP_atomic_lock(&cache_tls_lock);
+        if (cache_tls == DP_TLS_UNDEFINED) {
+            cache_tls = DP_tls_create(free_thread_cache);
+        }
+        DP_atomic_unlock(&cache_tls_lock);
+    }
+
+    DP_TileThreadCache *cache = DP_tls_get(cache_tls);
+    if (!cache) {
+        cache = DP_malloc(sizeof(*cache));
+        *cache = (DP_TileThreadCache){0, NULL};
+        DP_tls_set(cache_tls, cache);
+    }
+    return cache;
+}
+
+static void *take_pooled_tile(void)
+{
+    DP_TileThreadCache *cache = get_thread_cache();
+    if (!cache->head) {
+        cache->head = pool_take(THREAD_CACHE_MAX / 2, &cache->count);
+        if (!cache->head) {
+            return NULL;
+        }
+    }
+    DP_TileFreeNode *node = cache->head;
+    cache->head = node->next;
+    --cache->count;
+    DP_atomic_add(&pooled_tiles, -1);
+    return node;
+}
 
 static void *alloc_tile(bool transient, unsigned int context_id)
 {
-    DP_TransientTile *tt = DP_malloc(sizeof(*tt));
+    DP_TransientTile *tt = DP_atomic_get(&pooled_tiles) == 0
+                             ? NULL
+                             : take_pooled_tile();
+    if (!tt) {
+        tt = DP_malloc_aligned(FULL_TILE_SIZE, DP_TILE_ALIGNMENT);
+    }
+    DP_atomic_inc(&live_tiles);
     DP_atomic_set(&tt->refcount, 1);
     tt->transient = transient;
+    tt->solid = false;
     tt->context_id = context_id;
+    tt->solid_pixel.color = 0;
+    tt->interned = false;
+    tt->cold = false;
     return tt;
 }
 
+static DP_Tile *alloc_solid_tile(unsigned int context_id, uint32_t bgra)
+{
+    DP_TransientTile *tt =
+        DP_malloc_aligned(SOLID_TILE_SIZE, DP_TILE_ALIGNMENT);
+    DP_atomic_inc(&solid_tiles);
+    DP_atomic_set(&tt->refcount, 1);
+    tt->transient = false;
+    tt->solid = true;
+    tt->context_id = context_id;
+    tt->solid_pixel.color = bgra;
+    tt->interned = false;
+    tt->cold = false;
+    return (DP_Tile *)tt;
+}
+
+static void free_tile(DP_Tile *tile)
+{
+    if (tile->cold) {
+        DP_atomic_add(&cold_tiles, -1);
+        DP_free(tile->cold_data);
+        DP_free_aligned(tile);
+        return;
+    }
+
+    if (tile->solid) {
+        DP_atomic_add(&solid_tiles, -1);
+        DP_free_aligned(tile);
+        return;
+    }
+
+    DP_atomic_add(&live_tiles, -1);
+    if (DP_atomic_get(&pooled_tiles) >= DP_atomic_get(&pool_limit)) {
+        DP_free_aligned(tile);
+        return;
+    }
+
+    DP_atomic_inc(&pooled_tiles);
+    DP_TileThreadCache *cache = get_thread_cache();
+    DP_TileFreeNode *node = (DP_TileFreeNode *)tile;
+    node->next = cache->head;
+    cache->head = node;
+    if (++cache->count >= THREAD_CACHE_MAX) {
+        // Spill half of the cache into the global pool.
+        DP_TileFreeNode *last = node;
+        for (int i = 1; i < THREAD_CACHE_MAX / 2; ++i) {
+            last = last->next;
+        }
+        cache->head = last->next;
+        cache->count -= THREAD_CACHE_MAX / 2;
+        pool_push(node, last);
+    }
+}
+
+
+DP_TileMemoryStats DP_tile_memory_stats(void)
+{
+    int live = DP_atomic_get(&live_tiles);
+    int solid = DP_atomic_get(&solid_tiles);
+    int cold = DP_atomic_get(&cold_tiles);
+    int pooled = DP_atomic_get(&pooled_tiles);
+    return (DP_TileMemoryStats){
+        live + solid + cold, solid, cold, pooled,
+        DP_int_to_size(live) * FULL_TILE_SIZE
+            + DP_int_to_size(solid) * SOLID_TILE_SIZE,
+        DP_int_to_size(pooled) * FULL_TILE_SIZE};
+}
+
+int DP_tile_pool_limit(void)
+{
+    return DP_atomic_get(&pool_limit);
+}
+
+void DP_tile_pool_limit_set(int max_pooled_tiles)
+{
+    DP_ASSERT(max_pooled_tiles >= 0);
+    DP_atomic_set(&pool_limit, max_pooled_tiles);
+}
+
+static void free_tile_list(DP_TileFreeNode *node)
+{
+    while (node) {
+        DP_TileFreeNode *next = node->next;
+        DP_free_aligned(node);
+        DP_atomic_add(&pooled_tiles, -1);
+        node = next;
+    }
+}
+
+void DP_tile_pool_trim(void)
+{
+    if (cache_tls != DP_TLS_UNDEFINED) {
+        DP_TileThreadCache *cache = DP_tls_get(cache_tls);
+        if (cache) {
+            free_tile_list(cache->head);
+            *cache = (DP_TileThreadCache){0, NULL};
+        }
+    }
+
+    DP_atomic_lock(&pool_lock);
+    DP_TileFreeNode *node = pool_head;
+    pool_head = NULL;
+    DP_atomic_unlock(&pool_lock);
+    free_tile_list(node);
+}
+
+
+// Optional interning of tile contents. Persisted tiles are looked up in a
+// hash table by their pixels and context id, equal tiles collapse into a
+// single instance. The table doesn't hold references, tiles are removed from
+// it when their refcount drops to zero. For that to not race with lookups,
+// decrementing the refcount of an interned tile happens under the lock.
+#define INTERN_INITIAL_CAPACITY 1024
+
+static DP_Atomic intern_enabled;
+static DP_Atomic intern_hits;
+static DP_Atomic intern_misses;
+
+DP_ATOMIC_DECLARE_STATIC_SPIN_LOCK(intern_lock);
+static int intern_count;
+static int intern_capacity;
+static DP_Tile **intern_buckets;
+
+
+static uint64_t hash_tile(DP_Tile *t)
+{
+    uint64_t h = 0xcbf29ce484222325u ^ t->context_id;
+    for (int i = 0; i < DP_TILE_LENGTH; i += 2) {
+        uint64_t w = (uint64_t)t->pixels[i].color
+                   | ((uint64_t)t->pixels[i + 1].color << (uint64_t)32);
+        h = (h ^ w) * 0x9e3779b97f4a7c15u;
+        h ^= h >> (uint64_t)32;
+    }
+    return h;
+}
+
+static bool tiles_equal(DP_Tile *a, DP_Tile *b)
+{
+    return a->hash == b->hash && a->context_id == b->context_id
+        && memcmp(a->pixels, b->pixels, DP_TILE_BYTES) == 0;
+}
+
+static DP_Tile **intern_bucket(uint64_t hash)
+{
+    uint64_t mask = (uint64_t)intern_capacity - 1;
+    return &intern_buckets[(size_t)(hash & mask)];
+}
+
+static void intern_grow(void)
+{
+    DP_Tile **old_buckets = intern_buckets;
+    int old_capacity = intern_capacity;
+    intern_capacity =
+        old_capacity == 0 ? INTERN_INITIAL_CAPACITY : old_capacity * 2;
+    size_t size = sizeof(*intern_buckets) * DP_int_to_size(intern_capacity);
+    intern_buckets = DP_malloc(size);
+    memset(intern_buckets, 0, size);
+
+    for (int i = 0; i < old_capacity; ++i) {
+        DP_Tile *t = old_buckets[i];
+        while (t) {
+            DP_Tile *next = t->intern_next;
+            DP_Tile **bucket = intern_bucket(t->hash);
+            t->intern_next = *bucket;
+            *bucket = t;
+            t = next;
+        }
+    }
+    DP_free(old_buckets);
+}
+
+static DP_Tile *intern_tile(DP_TransientTile *tt)
+{
+    DP_ASSERT(!tt->transient);
+    DP_ASSERT(!tt->solid);
+    DP_ASSERT(!tt->interned);
+    // If someone else holds a reference to this tile, it can't be swapped out
+    // or marked as interned safely, so just leave it alone.
+    if (DP_atomic_get(&tt->refcount) != 1) {
+        return (DP_Tile *)tt;
+    }
+
+    DP_Tile *t = (DP_Tile *)tt;
+    uint64_t hash = hash_tile(t);
+    tt->hash = hash;
+
+    DP_atomic_lock(&intern_lock);
+    if (intern_capacity != 0) {
+        for (DP_Tile *other = *intern_bucket(hash); other;
+             other = other->intern_next) {
+            if (tiles_equal(t, other)) {
+                DP_atomic_inc(&other->refcount);
+                DP_atomic_unlock(&intern_lock);
+                DP_atomic_inc(&intern_hits);
+                DP_tile_decref(t);
+                return other;
+            }
+        }
+    }
+
+    if (intern_count >= intern_capacity) {
+        intern_grow();
+    }
+    DP_Tile **bucket = intern_bucket(hash);
+    tt->interned = true;
+    tt->intern_next = *bucket;
+    *bucket = t;
+    ++intern_count;
+    DP_atomic_unlock(&intern_lock);
+    DP_atomic_inc(&intern_misses);
+    return t;
+}
+
+static bool intern_decref(DP_Tile *t)
+{
+    DP_atomic_lock(&intern_lock);
+    bool freed = DP_atomic_dec(&t->refcount);
+    if (freed) {
+        DP_Tile **pp = intern_bucket(t->hash);
+        while (*pp != t) {
+            pp = &(*pp)->intern_next;
+        }
+        *pp = t->intern_next;
+        --intern_count;
+    }
+    DP_atomic_unlock(&intern_lock);
+    return freed;
+}
+
+static DP_Tile *maybe_intern_tile(DP_TransientTile *tt)
+{
+    return DP_atomic_get(&intern_enabled) ? intern_tile(tt) : (DP_Tile *)tt;
+}
+
+
+bool DP_tile_interning_enabled(void)
+{
+    return DP_atomic_get(&intern_enabled);
+}
+
+void DP_tile_interning_enabled_set(bool enabled)
+{
+    DP_atomic_set(&intern_enabled, enabled);
+}
+
+DP_TileInternStats DP_tile_intern_stats(void)
+{
+    DP_atomic_lock(&intern_lock);
+    int count = intern_count;
+    DP_atomic_unlock(&intern_lock);
+    return (DP_TileInternStats){count, DP_atomic_get(&intern_hits),
+                                DP_atomic_get(&intern_misses)};
+}
+
 
 DP_Tile *DP_tile_new(unsigned int context_id)
 {
@@ -74,11 +475,7 @@ DP_Tile *DP_tile_new(unsigned int context_id)
 
 DP_Tile *DP_tile_new_from_bgra(unsigned int context_id, uint32_t bgra)
 {
-    DP_TransientTile *tt = alloc_tile(false, context_id);
-    for (int i = 0; i < DP_TILE_LENGTH; ++i) {
-        tt->pixels[i].color = bgra;
-    }
-    return (DP_Tile *)tt;
+    return alloc_solid_tile(context_id, bgra);
 }
 
 
@@ -118,7 +515,16 @@ DP_Tile *DP_tile_new_from_compressed(unsigned int context_id,
 #else
 #    error "Unknown byte order"
 #endif
-        return (DP_Tile *)args.tt;
+        // Uniform tiles get stored compactly, there's plenty of them.
+        DP_Tile *t = (DP_Tile *)args.tt;
+        DP_Pixel pixel;
+        if (DP_tile_same_pixel(t, &pixel)) {
+            DP_tile_decref(t);
+            return alloc_solid_tile(context_id, pixel.color);
+        }
+        else {
+            return maybe_intern_tile(args.tt);
+        }
     }
     else {
         DP_tile_decref_nullable((DP_Tile *)args.tt);
@@ -158,8 +564,8 @@ void DP_tile_decref(DP_Tile *tile)
 {
     DP_ASSERT(tile);
     DP_ASSERT(DP_atomic_get(&tile->refcount) > 0);
-    if (DP_atomic_dec(&tile->refcount)) {
-        DP_free(tile);
+    if (tile->interned ? intern_decref(tile) : DP_atomic_dec(&tile->refcount)) {
+        free_tile(tile);
     }
 }
 
@@ -170,6 +576,13 @@ void DP_tile_decref_nullable(DP_Tile *tile_or_null)
     }
 }
 
+int DP_tile_refcount(DP_Tile *tile)
+{
+    DP_ASSERT(tile);
+    DP_ASSERT(DP_atomic_get(&tile->refcount) > 0);
+    return DP_atomic_get(&tile->refcount);
+}
+
 bool DP_tile_transient(DP_Tile *tile)
 {
     DP_ASSERT(tile);
@@ -177,6 +590,112 @@ bool DP_tile_transient(DP_Tile *tile)
     return tile->transient;
 }
 
+bool DP_tile_solid(DP_Tile *tile)
+{
+    DP_ASSERT(tile);
+    DP_ASSERT(DP_atomic_get(&tile->refcount) > 0);
+    DP_ASSERT(!tile->cold);
+    return tile->solid;
+}
+
+bool DP_tile_cold(DP_Tile *tile)
+{
+    DP_ASSERT(tile);
+    DP_ASSERT(DP_atomic_get(&tile->refcount) > 0);
+    return tile->cold;
+}
+
+
+static unsigned char *get_cold_buffer(size_t out_size, void *user)
+{
+    unsigned char **buffer = user;
+    *buffer = DP_malloc(out_size);
+    return *buffer;
+}
+
+DP_Tile *DP_tile_cold_compress(DP_Tile *tile)
+{
+    DP_ASSERT(tile);
+    DP_ASSERT(DP_atomic_get(&tile->refcount) > 0);
+    if (tile->transient || tile->solid || tile->cold
+        || DP_atomic_get(&tile->refcount) != 1) {
+        return tile;
+    }
+
+    unsigned char *buffer = NULL;
+    size_t size =
+        DP_compress_deflate((const unsigned char *)tile->pixels, DP_TILE_BYTES,
+                            1, get_cold_buffer, &buffer);
+    // Noisy tiles don't compress well, not worth paying for decompression.
+    if (size == 0 || size > DP_TILE_BYTES / 4 * 3) {
+        DP_free(buffer);
+        return tile;
+    }
+
+    DP_TransientTile *ct = DP_malloc_aligned(COLD_TILE_SIZE, DP_TILE_ALIGNMENT);
+    DP_atomic_inc(&cold_tiles);
+    DP_atomic_set(&ct->refcount, 1);
+    ct->transient = false;
+    ct->solid = false;
+    ct->context_id = tile->context_id;
+    ct->solid_pixel.color = 0;
+    ct->interned = false;
+    ct->cold = true;
+    ct->cold_size = size;
+    ct->cold_data = DP_realloc(buffer, size);
+    DP_tile_decref(tile);
+    return (DP_Tile *)ct;
+}
+
+static unsigned char *get_thawed_buffer(size_t out_size, void *user)
+{
+    if (out_size == DP_TILE_BYTES) {
+        DP_TransientTile *tt = user;
+        return (unsigned char *)tt->pixels;
+    }
+    else {
+        DP_error_set("Cold tile decompression needs size %zu, but got %zu",
+                     (size_t)DP_TILE_BYTES, out_size);
+        return NULL;
+    }
+}
+
+DP_Tile *DP_tile_cold_decompress(DP_Tile *tile)
+{
+    DP_ASSERT(tile);
+    DP_ASSERT(DP_atomic_get(&tile->refcount) > 0);
+    if (!tile->cold) {
+        return tile;
+    }
+
+    DP_ASSERT(DP_atomic_get(&tile->refcount) == 1);
+    DP_TransientTile *tt = alloc_tile(false, tile->context_id);
+    if (DP_compress_inflate(tile->cold_data, tile->cold_size,
+                            get_thawed_buffer, tt)) {
+        DP_tile_decref(tile);
+        return (DP_Tile *)tt;
+    }
+    else {
+        DP_tile_decref((DP_Tile *)tt);
+        return NULL;
+    }
+}
+
+size_t DP_tile_memory_size(DP_Tile *tile)
+{
+    DP_ASSERT(tile);
+    DP_ASSERT(DP_atomic_get(&tile->refcount) > 0);
+    if (tile->solid) {
+        return SOLID_TILE_SIZE;
+    }
+    else if (tile->cold) {
+        return COLD_TILE_SIZE + tile->cold_size;
+    }
+    else {
+        return FULL_TILE_SIZE;
+    }
+}
+
 
 unsigned int DP_tile_context_id(DP_Tile *tile)
 {
@@ -189,6 +708,8 @@ DP_Pixel *DP_tile_pixels(DP_Tile *tile)
 {
     DP_ASSERT(tile);
     DP_ASSERT(DP_atomic_get(&tile->refcount) > 0);
+    DP_ASSERT(!tile->solid);
+    DP_ASSERT(!tile->cold);
     return tile->pixels;
 }
 
@@ -196,15 +717,20 @@ DP_Pixel DP_tile_pixel_at(DP_Tile *tile, int x, int y)
 {
     DP_ASSERT(tile);
     DP_ASSERT(DP_atomic_get(&tile->refcount) > 0);
+    DP_ASSERT(!tile->cold);
     DP_ASSERT(x >= 0);
     DP_ASSERT(y >= 0);
     DP_ASSERT(x < DP_TILE_SIZE);
     DP_ASSERT(y < DP_TILE_SIZE);
-    return tile->pixels[y * DP_TILE_SIZE + x];
+    return tile->solid ? tile->solid_pixel : tile->pixels[y * DP_TILE_SIZE + x];
 }
 
 bool DP_tile_blank(DP_Tile *tile)
 {
+    if (DP_tile_solid(tile)) {
+        return tile->solid_pixel.color == 0;
+    }
+
     DP_Pixel *pixels = DP_tile_pixels(tile);
     for (int i = 0; i < DP_TILE_LENGTH; ++i) {
         // Colors should be premultiplied.
@@ -218,7 +744,10 @@ bool DP_tile_blank(DP_Tile *tile)
 bool DP_tile_same_pixel(DP_Tile *tile_or_null, DP_Pixel *out_pixel)
 {
     DP_Pixel pixel;
-    if (tile_or_null) {
+    if (tile_or_null && DP_tile_solid(tile_or_null)) {
+        pixel = tile_or_null->solid_pixel;
+    }
+    else if (tile_or_null) {
         DP_Pixel *pixels = DP_tile_pixels(tile_or_null);
         pixel = pixels[0];
         for (int i = 1; i < DP_TILE_LENGTH; ++i) {
@@ -237,6 +766,27 @@ bool DP_tile_same_pixel(DP_Tile *tile_or_null, DP_Pixel *out_pixel)
     return true;
 }
 
+bool DP_tile_pixels_equal(DP_Tile *a_or_null, DP_Tile *b_or_null)
+{
+    if (a_or_null == b_or_null) {
+        return true;
+    }
+
+    bool a_full = a_or_null && !DP_tile_solid(a_or_null);
+    bool b_full = b_or_null && !DP_tile_solid(b_or_null);
+    if (a_full && b_full) {
+        return memcmp(DP_tile_pixels(a_or_null), DP_tile_pixels(b_or_null),
+                      DP_TILE_BYTES)
+            == 0;
+    }
+    else {
+        DP_Pixel a_pixel, b_pixel;
+        return DP_tile_same_pixel(a_or_null, &a_pixel)
+            && DP_tile_same_pixel(b_or_null, &b_pixel)
+            && a_pixel.color == b_pixel.color;
+    }
+}
+
 
 void DP_tile_copy_to_image(DP_Tile *tile_or_null, DP_Image *img, int x, int y)
 {
@@ -247,7 +797,16 @@ void DP_tile_copy_to_image(DP_Tile *tile_or_null, DP_Image *img, int x, int y)
     DP_Pixel *dst = DP_image_pixels(img) + y * img_width + x;
     size_t bytes = DP_int_to_size(width) * sizeof(*dst);
 
-    if (tile_or_null) {
+    if (tile_or_null && DP_tile_solid(tile_or_null)) {
+        DP_Pixel pixel = tile_or_null->solid_pixel;
+        for (int i = 0; i < height; ++i) {
+            DP_Pixel *row = dst + i * img_width;
+            for (int j = 0; j < width; ++j) {
+                row[j] = pixel;
+            }
+        }
+    }
+    else if (tile_or_null) {
         DP_ASSERT(DP_atomic_get(&tile_or_null->refcount) > 0);
         DP_Pixel *src = tile_or_null->pixels;
         for (int i = 0; i < height; ++i) {
@@ -262,6 +821,13 @@ void DP_tile_copy_to_image(DP_Tile *tile_or_null, DP_Image *img, int x, int y)
 }
 
 
+static void fill_row(DP_Pixel *row, DP_Pixel pixel)
+{
+    for (int i = 0; i < DP_TILE_SIZE; ++i) {
+        row[i] = pixel;
+    }
+}
+
 static DP_TileWeightedAverage sample_empty(uint8_t *mask, int width, int height,
                                            int skip)
 {
@@ -279,7 +845,18 @@ DP_TileWeightedAverage DP_tile_weighted_average(DP_Tile *tile_or_null,
                                                 uint8_t *mask, int x, int y,
                                                 int width, int height, int skip)
 {
-    if (tile_or_null) {
+    if (tile_or_null && DP_tile_solid(tile_or_null)) {
+        // Sample from a single row of the solid pixel, rewinding the source
+        // to the start of it after every line.
+        DP_TileWeightedAverage twa;
+        DP_Pixel row[DP_TILE_SIZE];
+        fill_row(row, tile_or_null->solid_pixel);
+        DP_pixels_sample_mask(row, mask, width, height, skip, -width,
+                              &twa.weight, &twa.red, &twa.green, &twa.blue,
+                              &twa.alpha);
+        return twa;
+    }
+    else if (tile_or_null) {
         DP_TileWeightedAverage twa;
         DP_Pixel *src = tile_or_null->pixels + y * DP_TILE_SIZE + x;
         DP_pixels_sample_mask(src, mask, width, height, skip,
@@ -297,8 +874,17 @@ DP_TransientTile *DP_transient_tile_new(DP_Tile *tile, unsigned int context_id)
 {
     DP_ASSERT(tile);
     DP_ASSERT(DP_atomic_get(&tile->refcount) > 0);
+    DP_ASSERT(!tile->cold);
     DP_TransientTile *tt = alloc_tile(true, context_id);
-    memcpy(tt->pixels, tile->pixels, DP_TILE_BYTES);
+    if (tile->solid) {
+        DP_Pixel pixel = tile->solid_pixel;
+        for (int i = 0; i < DP_TILE_LENGTH; ++i) {
+            tt->pixels[i] = pixel;
+        }
+    }
+    else {
+        memcpy(tt->pixels, tile->pixels, DP_TILE_BYTES);
+    }
     return tt;
 }
 
@@ -322,7 +908,7 @@ DP_Tile *DP_transient_tile_persist(DP_TransientTile *tt)
     DP_ASSERT(DP_atomic_get(&tt->refcount) > 0);
     DP_ASSERT(tt->transient);
     tt->transient = false;
-    return (DP_Tile *)tt;
+    return maybe_intern_tile(tt);
 }
 
 
@@ -383,8 +969,19 @@ void DP_transient_tile_merge(DP_TransientTile *DP_RESTRICT tt,
 {
     DP_ASSERT(tt);
     DP_ASSERT(t);
-    DP_pixels_composite(tt->pixels, t->pixels, DP_TILE_LENGTH, opacity,
-                        blend_mode);
+    DP_ASSERT(!t->cold);
+    if (t->solid) {
+        DP_Pixel row[DP_TILE_SIZE];
+        fill_row(row, t->solid_pixel);
+        for (int i = 0; i < DP_TILE_SIZE; ++i) {
+            DP_pixels_composite(tt->pixels + i * DP_TILE_SIZE, row,
+                                DP_TILE_SIZE, opacity, blend_mode);
+        }
+    }
+    else {
+        DP_pixels_composite(tt->pixels, t->pixels, DP_TILE_LENGTH, opacity,
+                            blend_mode);
+    }
 }
 
 void DP_transient_tile_brush_apply(DP_TransientTile *tt, DP_Pixel src,
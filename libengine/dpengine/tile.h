@@ -31,10 +31,31 @@ typedef union DP_Pixel DP_Pixel;
 #define DP_TILE_LENGTH (DP_TILE_SIZE * DP_TILE_SIZE)
 #define DP_TILE_BYTES  (DP_TILE_LENGTH * sizeof(uint32_t))
 
+// Tile pixels are aligned to a cache line so that SIMD loads don't split.
+#define DP_TILE_ALIGNMENT 64
+
+// Maximum number of freed tiles kept around for reuse, 16 MiB worth.
+#define DP_TILE_POOL_DEFAULT_LIMIT 1024
+
 typedef struct DP_TileCounts {
     int x, y;
 } DP_TileCounts;
 
+typedef struct DP_TileMemoryStats {
+    int live_tiles;
+    int solid_tiles;
+    int cold_tiles;
+    int pooled_tiles;
+    size_t live_bytes;
+    size_t pooled_bytes;
+} DP_TileMemoryStats;
+
+typedef struct DP_TileInternStats {
+    int interned_tiles;
+    int hits;
+    int misses;
+} DP_TileInternStats;
+
 typedef struct DP_TileWeightedAverage {
     uint32_t weight;
     uint32_t red;
@@ -85,6 +106,27 @@ DP_INLINE int DP_tile_total_round(int width, int height)
 }
 
 
+DP_TileMemoryStats DP_tile_memory_stats(void);
+
+int DP_tile_pool_limit(void);
+
+// Pooled tiles beyond the new limit aren't freed until the next trim.
+void DP_tile_pool_limit_set(int max_pooled_tiles);
+
+// Frees the global pool and the calling thread's cache.
+void DP_tile_pool_trim(void);
+
+
+// When interning is enabled, tiles with the same pixels and context id get
+// collapsed into a single instance when they're persisted or decompressed.
+// Disabled by default, since it costs hashing every persisted tile.
+bool DP_tile_interning_enabled(void);
+
+void DP_tile_interning_enabled_set(bool enabled);
+
+DP_TileInternStats DP_tile_intern_stats(void);
+
+
 DP_Tile *DP_tile_new(unsigned int context_id);
 
 DP_Tile *DP_tile_new_from_bgra(unsigned int context_id, uint32_t bgra);
@@ -105,8 +147,29 @@ void DP_tile_decref(DP_Tile *tile);
 
 void DP_tile_decref_nullable(DP_Tile *tile_or_null);
 
+int DP_tile_refcount(DP_Tile *tile);
+
 bool DP_tile_transient(DP_Tile *tile);
 
+// Solid tiles consist of a single pixel value, DP_tile_pixels can't be used on
+// them. Use DP_tile_same_pixel or DP_tile_pixel_at to get at their color.
+bool DP_tile_solid(DP_Tile *tile);
+
+// Cold tiles have their pixels compressed and can't be used for anything
+// except being decompressed again. Only use these on tiles that nothing else
+// can get at, like ones only held by old savepoints. Both functions take over
+// the reference to the given tile and return a reference to a new one, or the
+// same one if there's nothing to do. Decompression returns NULL on error and
+// leaves the given tile alone.
+bool DP_tile_cold(DP_Tile *tile);
+
+DP_Tile *DP_tile_cold_compress(DP_Tile *tile);
+
+DP_Tile *DP_tile_cold_decompress(DP_Tile *tile);
+
+// Heap memory held by this tile, including compressed data of cold tiles.
+size_t DP_tile_memory_size(DP_Tile *tile);
+
 
 unsigned int DP_tile_context_id(DP_Tile *tile);
 
@@ -118,6 +181,10 @@ bool DP_tile_blank(DP_Tile *tile);
 
 bool DP_tile_same_pixel(DP_Tile *tile_or_null, DP_Pixel *out_pixel);
 
+// Compares pixel content, regardless of identity or context id. A null tile
+// is equal to a transparent one.
+bool DP_tile_pixels_equal(DP_Tile *a_or_null, DP_Tile *b_or_null);
+
 
 void DP_tile_copy_to_image(DP_Tile *tile_or_null, DP_Image *img, int x, int y);
 
@@ -135,6 +202,8 @@ DP_TransientTile *DP_transient_tile_new_blank(unsigned int context_id);
 DP_TransientTile *DP_transient_tile_new_nullable(DP_Tile *tile_or_null,
                                                  unsigned int context_id);
 
+// May return a different, equal tile if interning is enabled, in which case
+// the given transient tile is freed. Always use the return value.
 DP_Tile *DP_transient_tile_persist(DP_TransientTile *tt);
 
 
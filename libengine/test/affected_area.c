@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/common.h>
+#include <dpengine/affected_area.h>
+#include <dpengine/blend_mode.h>
+#include <dpmsg/message.h>
+#include <dpmsg/messages/fill_rect.h>
+#include <dpengine_test.h>
+
+
+static DP_AffectedArea fill_rect_area(unsigned int context_id, int layer_id,
+                                      int x, int y, int width, int height)
+{
+    DP_Message *msg =
+        DP_msg_fill_rect_new(context_id, layer_id, DP_BLEND_MODE_NORMAL, x, y,
+                             width, height, 0xff000000u);
+    DP_AffectedArea aa = DP_affected_area_make(msg, NULL);
+    DP_message_decref(msg);
+    return aa;
+}
+
+static void assert_concurrent(const DP_AffectedArea *a,
+                              const DP_AffectedArea *b, bool expected)
+{
+    // Concurrency doesn't depend on which side is the local one.
+    assert_int_equal(DP_affected_area_concurrent_with(a, b), expected);
+    assert_int_equal(DP_affected_area_concurrent_with(b, a), expected);
+}
+
+static void test_affected_area_pixels(DP_UNUSED void **state)
+{
+    // A local and a remote fill on the same layer.
+    DP_AffectedArea local = fill_rect_area(1, 257, 10, 10, 20, 20);
+    DP_AffectedArea overlapping = fill_rect_area(2, 257, 25, 25, 20, 20);
+    DP_AffectedArea disjoint = fill_rect_area(2, 257, 100, 10, 20, 20);
+    DP_AffectedArea adjacent = fill_rect_area(2, 257, 30, 10, 20, 20);
+    DP_AffectedArea other_layer = fill_rect_area(2, 258, 10, 10, 20, 20);
+
+    // Overlapping pixels conflict, so the local fork has to be rolled back.
+    assert_concurrent(&local, &local, false);
+    assert_concurrent(&local, &overlapping, false);
+    // Disjoint pixels don't, even if they're right next to each other.
+    assert_concurrent(&local, &disjoint, true);
+    assert_concurrent(&local, &adjacent, true);
+    // Different layers never conflict.
+    assert_concurrent(&local, &other_layer, true);
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_affected_area_pixels),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/common.h>
+#include <dpengine/affected_area.h>
+#include <dpengine/affected_index.h>
+#include <dpengine_test.h>
+
+
+#define MAX_AREAS 64
+
+typedef struct AffectedIndexState {
+    DP_AffectedIndex *ai;
+    int count;
+    DP_AffectedArea areas[MAX_AREAS];
+    uint32_t seed;
+} AffectedIndexState;
+
+static void destroy_affected_index(void *value)
+{
+    DP_affected_index_free(value);
+}
+
+static DP_AffectedArea random_area(AffectedIndexState *ais)
+{
+    int domain = random_int(&ais->seed, 0, 39);
+    int affected_id = random_int(&ais->seed, 1, 3);
+    if (domain <= DP_AFFECTED_DOMAIN_EVERYTHING
+        && domain != DP_AFFECTED_DOMAIN_PIXELS) {
+        return (DP_AffectedArea){(DP_AffectedDomain)domain, affected_id,
+                                 DP_rect_make(0, 0, 1, 1)};
+    }
+    else {
+        // Mostly small areas, some of them wide enough to not get indexed.
+        bool wide = random_int(&ais->seed, 0, 15) == 0;
+        int size = wide ? 100000 : 1;
+        int x = random_int(&ais->seed, -256, 767);
+        int y = random_int(&ais->seed, -256, 767);
+        int width = random_int(&ais->seed, 1, 100 * size);
+        int height = random_int(&ais->seed, 1, 100 * size);
+        return (DP_AffectedArea){DP_AFFECTED_DOMAIN_PIXELS, affected_id,
+                                 DP_rect_make(x, y, width, height)};
+    }
+}
+
+static bool concurrent_with_all(AffectedIndexState *ais,
+                                const DP_AffectedArea *aa)
+{
+    for (int i = 0; i < ais->count; ++i) {
+        if (!DP_affected_area_concurrent_with(aa, &ais->areas[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_affected_index_matches_areas(void **state)
+{
+    AffectedIndexState ais = {DP_affected_index_new(), 0, {{0}}, 0x1f2e3d4cu};
+    destructor_push(state, ais.ai, destroy_affected_index);
+
+    int concurrent = 0;
+    int conflicts = 0;
+    for (int round = 0; round < 4000; ++round) {
+        int action = random_int(&ais.seed, 0, 3);
+        if (action == 0 && ais.count < MAX_AREAS) {
+            DP_AffectedArea aa = random_area(&ais);
+            ais.areas[ais.count++] = aa;
+            DP_affected_index_add(ais.ai, &aa);
+        }
+        else if (action == 1 && ais.count > 0) {
+            // Remove from the front, like the fork does.
+            DP_affected_index_remove(ais.ai, &ais.areas[0]);
+            --ais.count;
+            memmove(ais.areas, ais.areas + 1,
+                    sizeof(*ais.areas) * (size_t)ais.count);
+        }
+        else if (action == 2 && round % 500 == 0) {
+            DP_affected_index_clear(ais.ai);
+            ais.count = 0;
+        }
+        assert_int_equal(DP_affected_index_count(ais.ai), ais.count);
+
+        DP_AffectedArea query = random_area(&ais);
+        bool expected = concurrent_with_all(&ais, &query);
+        switch (DP_affected_index_concurrent_with(ais.ai, &query)) {
+        case DP_AFFECTED_INDEX_CONCURRENT:
+            assert_true(expected);
+            ++concurrent;
+            break;
+        case DP_AFFECTED_INDEX_CONFLICT:
+            assert_false(expected);
+            ++conflicts;
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Most queries should get answered without going through the areas.
+    assert_true(concurrent + conflicts > 3000);
+    assert_true(conflicts > 500);
+}
+
+static void test_affected_index_pixels(void **state)
+{
+    DP_AffectedIndex *ai = DP_affected_index_new();
+    destructor_push(state, ai, destroy_affected_index);
+
+    DP_AffectedArea left = {DP_AFFECTED_DOMAIN_PIXELS, 1,
+                            DP_rect_make(0, 0, 10, 10)};
+    DP_affected_index_add(ai, &left);
+
+    // Different tile, different layer or different domain is concurrent.
+    DP_AffectedArea far = {DP_AFFECTED_DOMAIN_PIXELS, 1,
+                           DP_rect_make(200, 200, 10, 10)};
+    DP_AffectedArea other_layer = {DP_AFFECTED_DOMAIN_PIXELS, 2,
+                                   DP_rect_make(0, 0, 10, 10)};
+    DP_AffectedArea attrs = {DP_AFFECTED_DOMAIN_LAYER_ATTRS, 1,
+                             DP_rect_make(0, 0, 1, 1)};
+    assert_int_equal(DP_affected_index_concurrent_with(ai, &far),
+                     DP_AFFECTED_INDEX_CONCURRENT);
+    assert_int_equal(DP_affected_index_concurrent_with(ai, &other_layer),
+                     DP_AFFECTED_INDEX_CONCURRENT);
+    assert_int_equal(DP_affected_index_concurrent_with(ai, &attrs),
+                     DP_AFFECTED_INDEX_CONCURRENT);
+
+    // Same tile may or may not overlap, that needs an exact check.
+    DP_AffectedArea near = {DP_AFFECTED_DOMAIN_PIXELS, 1,
+                            DP_rect_make(20, 20, 10, 10)};
+    assert_int_equal(DP_affected_index_concurrent_with(ai, &near),
+                     DP_AFFECTED_INDEX_UNSURE);
+    assert_true(DP_affected_area_concurrent_with(&near, &left));
+    assert_false(DP_affected_area_concurrent_with(&left, &left));
+
+    DP_affected_index_remove(ai, &left);
+    assert_int_equal(DP_affected_index_concurrent_with(ai, &near),
+                     DP_AFFECTED_INDEX_CONCURRENT);
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_affected_index_matches_areas),
+        dp_unit_test(test_affected_index_pixels),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpcommon/cpu.h>
+#include <dpcommon/binary.h>
+#include <dpcommon/worker.h>
+#include <dpengine/blend_mode.h>
+#include <dpengine/draw_context.h>
+#include <dpengine/layer_content.h>
+#include <dpengine/paint.h>
+#include <dpengine/tile.h>
+#include <dpmsg/message.h>
+#include <dpmsg/messages/draw_dabs.h>
+#include <dpengine_test.h>
+
+
+#define WIDTH       300
+#define HEIGHT      170
+#define STAMP_COUNT 400
+
+// One lookup table per hardness percentage.
+#define CLASSIC_LUT_COUNT 101
+
+static void destroy_transient_layer_content(void *value)
+{
+    DP_transient_layer_content_decref(value);
+}
+
+static DP_BrushStamp *make_stamps(DP_DrawContext *dc)
+{
+    // Stamps of all sizes, including ones hanging off the edges of the layer
+    // and ones that are out of bounds entirely, with overlap aplenty.
+    uint32_t rng = 0x2545f491u;
+    uint8_t *masks = DP_draw_context_dab_mask_buffer(dc);
+    DP_BrushStamp *stamps = DP_draw_context_dab_stamp_buffer(dc);
+    size_t mask_used = 0;
+    for (int i = 0; i < STAMP_COUNT; ++i) {
+        int diameter = i % 40 == 0 ? random_int(&rng, 100, 260)
+                                   : random_int(&rng, 1, 40);
+        size_t mask_size = DP_int_to_size(diameter * diameter);
+        assert_true(mask_used + mask_size
+                    <= DP_DRAW_CONTEXT_DAB_MASK_BUFFER_SIZE);
+        uint8_t *mask = masks + mask_used;
+        for (size_t j = 0; j < mask_size; ++j) {
+            mask[j] = DP_uint32_to_uint8(next_random(&rng) & 0xffu);
+        }
+        mask_used += mask_size;
+        stamps[i] = (DP_BrushStamp){random_int(&rng, -270, HEIGHT + 10),
+                                    random_int(&rng, -270, WIDTH + 10),
+                                    diameter, mask};
+    }
+    return stamps;
+}
+
+static void assert_layers_equal(DP_TransientLayerContent *expected,
+                                DP_TransientLayerContent *actual)
+{
+    int xtiles = DP_tile_count_round(WIDTH);
+    int ytiles = DP_tile_count_round(HEIGHT);
+    for (int y = 0; y < ytiles; ++y) {
+        for (int x = 0; x < xtiles; ++x) {
+            DP_Tile *e =
+                DP_transient_layer_content_tile_at_noinc(expected, x, y);
+            DP_Tile *a = DP_transient_layer_content_tile_at_noinc(actual, x, y);
+            assert_true(!e == !a);
+            assert_true(DP_tile_pixels_equal(e, a));
+        }
+    }
+}
+
+static void test_brush_stamps_binned(void **state)
+{
+    DP_TransientLayerContent *expected =
+        DP_transient_layer_content_new_init(WIDTH, HEIGHT, NULL);
+    destructor_push(state, expected, destroy_transient_layer_content);
+    DP_TransientLayerContent *actual =
+        DP_transient_layer_content_new_init(WIDTH, HEIGHT, NULL);
+    destructor_push(state, actual, destroy_transient_layer_content);
+    DP_DrawContext *dc = DP_draw_context_new();
+    push_draw_context(state, dc);
+    DP_BrushStamp *stamps = make_stamps(dc);
+
+    uint32_t color = 0xc0804020u;
+    for (int i = 0; i < STAMP_COUNT; ++i) {
+        DP_transient_layer_content_brush_stamp_apply(
+            expected, 1, color, DP_BLEND_MODE_NORMAL, &stamps[i]);
+    }
+    DP_transient_layer_content_brush_stamps_apply(
+        actual, 1, color, DP_BLEND_MODE_NORMAL, STAMP_COUNT, stamps,
+        DP_draw_context_dab_tile_ref_buffer(dc));
+
+    assert_layers_equal(expected, actual);
+}
+
+static void destroy_worker(void *value)
+{
+    DP_worker_free(value);
+}
+
+static void test_brush_stamps_parallel(void **state)
+{
+    DP_TransientLayerContent *expected =
+        DP_transient_layer_content_new_init(WIDTH, HEIGHT, NULL);
+    destructor_push(state, expected, destroy_transient_layer_content);
+    DP_DrawContext *dc = DP_draw_context_new();
+    push_draw_context(state, dc);
+    DP_Worker *worker = DP_worker_new(16, 3);
+    assert_non_null(worker);
+    destructor_push(state, worker, destroy_worker);
+    assert_true(DP_draw_context_paint_worker_set(dc, worker, 1));
+    DP_BrushStamp *stamps = make_stamps(dc);
+    DP_BrushStampTileRef *tile_refs = DP_draw_context_dab_tile_ref_buffer(dc);
+    int *group_starts = DP_draw_context_paint_group_buffer(dc);
+    DP_Semaphore *sem_done = DP_draw_context_paint_semaphore(dc);
+
+    uint32_t color = 0x80204080u;
+    DP_transient_layer_content_brush_stamps_apply(
+        expected, 1, color, DP_BLEND_MODE_NORMAL, STAMP_COUNT, stamps,
+        tile_refs);
+
+    // Run it a few times over with different batch sizes, a lost or doubled
+    // tile or a stamp applied out of order would show up in the pixels.
+    for (int min_batch_size = 1; min_batch_size <= 3; ++min_batch_size) {
+        for (int i = 0; i < 4; ++i) {
+            DP_TransientLayerContent *actual =
+                DP_transient_layer_content_new_init(WIDTH, HEIGHT, NULL);
+            destructor_push(state, actual, destroy_transient_layer_content);
+            DP_transient_layer_content_brush_stamps_apply_parallel(
+                actual, 1, color, DP_BLEND_MODE_NORMAL, STAMP_COUNT, stamps,
+                tile_refs, group_starts, worker, sem_done, min_batch_size);
+            assert_layers_equal(expected, actual);
+            destructor_run(state, actual);
+        }
+    }
+}
+
+#define CACHE_DAB_COUNT 240
+
+static DP_Message *make_classic_dabs(int origin_x, int origin_y, int count,
+                                     const unsigned char *dab_bytes)
+{
+    unsigned char buffer[15 + CACHE_DAB_COUNT * 6];
+    unsigned char *p = buffer;
+    p += DP_write_bigendian_uint16(1, p);
+    p += DP_write_bigendian_int32(origin_x, p);
+    p += DP_write_bigendian_int32(origin_y, p);
+    p += DP_write_bigendian_uint32(0x00402080u, p);
+    p += DP_write_bigendian_uint8(DP_BLEND_MODE_NORMAL, p);
+    size_t dab_length = DP_int_to_size(count) * 6;
+    memcpy(p, dab_bytes, dab_length);
+    DP_Message *msg = DP_msg_draw_dabs_classic_deserialize(
+        1, buffer, 15 + dab_length);
+    assert_non_null(msg);
+    return msg;
+}
+
+static void draw_classic_dabs(DP_DrawContext *dc,
+                              DP_TransientLayerContent *tlc, DP_Message *msg)
+{
+    DP_MsgDrawDabsClassic *mddc = DP_msg_draw_dabs_classic_cast(msg);
+    int dab_count;
+    DP_ClassicBrushDab *dabs = DP_msg_draw_dabs_classic_dabs(mddc, &dab_count);
+    DP_PaintDrawDabsParams params = {
+        DP_MSG_DRAW_DABS_CLASSIC,
+        dc,
+        1,
+        DP_msg_draw_dabs_classic_origin_x(mddc),
+        DP_msg_draw_dabs_classic_origin_y(mddc),
+        DP_msg_draw_dabs_classic_color(mddc),
+        DP_msg_draw_dabs_classic_blend_mode(mddc),
+        dab_count,
+        dabs,
+    };
+    DP_paint_draw_dabs(&params, tlc);
+}
+
+static void test_brush_stamps_cache(void **state)
+{
+    DP_TransientLayerContent *expected =
+        DP_transient_layer_content_new_init(WIDTH, HEIGHT, NULL);
+    destructor_push(state, expected, destroy_transient_layer_content);
+    DP_TransientLayerContent *actual =
+        DP_transient_layer_content_new_init(WIDTH, HEIGHT, NULL);
+    destructor_push(state, actual, destroy_transient_layer_content);
+    DP_DrawContext *dc = DP_draw_context_new();
+    push_draw_context(state, dc);
+
+    // Few enough distinct sizes, hardnesses and opacities that stamps get
+    // reused, but with subpixel positions enough of them to cause evictions.
+    static const int sizes[] = {100, 700, 1900, 5000, 26000};
+    uint32_t rng = 0x9e3779b9u;
+    unsigned char dab_bytes[CACHE_DAB_COUNT * 6];
+    unsigned char *p = dab_bytes;
+    for (int i = 0; i < CACHE_DAB_COUNT; ++i) {
+        p += DP_write_bigendian_int8(
+            DP_int_to_int8(random_int(&rng, -40, 40)), p);
+        p += DP_write_bigendian_int8(
+            DP_int_to_int8(random_int(&rng, -40, 40)), p);
+        p += DP_write_bigendian_uint16(
+            DP_int_to_uint16(sizes[random_int(&rng, 0, 4)]), p);
+        p += DP_write_bigendian_uint8(i % 2 == 0 ? 80 : 255, p);
+        p += DP_write_bigendian_uint8(i % 3 == 0 ? 60 : 255, p);
+    }
+
+    // Drawing each dab on its own with a cleared cache never hits it.
+    int x = WIDTH * 2;
+    int y = HEIGHT * 2;
+    for (int i = 0; i < CACHE_DAB_COUNT; ++i) {
+        DP_draw_context_stamp_cache_clear(dc);
+        DP_Message *msg = make_classic_dabs(x, y, 1, dab_bytes + i * 6);
+        draw_classic_dabs(dc, expected, msg);
+        x += DP_read_bigendian_int8(dab_bytes + i * 6);
+        y += DP_read_bigendian_int8(dab_bytes + i * 6 + 1);
+        DP_message_decref(msg);
+    }
+    DP_StampCacheStats uncached = DP_draw_context_stamp_cache_stats(dc);
+    assert_int_equal(uncached.hits, 0);
+    assert_int_equal(uncached.misses, CACHE_DAB_COUNT);
+
+    DP_Message *msg =
+        make_classic_dabs(WIDTH * 2, HEIGHT * 2, CACHE_DAB_COUNT, dab_bytes);
+    push_message(state, msg);
+    draw_classic_dabs(dc, actual, msg);
+    DP_StampCacheStats cached = DP_draw_context_stamp_cache_stats(dc);
+    assert_true(cached.hits > 0);
+    assert_true(cached.misses - uncached.misses
+                > DP_DRAW_CONTEXT_STAMP_CACHE_COUNT);
+    assert_int_equal(cached.hits + cached.misses, CACHE_DAB_COUNT * 2);
+
+    assert_layers_equal(expected, actual);
+}
+
+
+static void check_stamps_equal(DP_BrushStamp *expected, DP_BrushStamp *actual,
+                               DP_CpuSupport level, const char *what,
+                               int size)
+{
+    if (expected->diameter != actual->diameter
+        || expected->left != actual->left || expected->top != actual->top
+        || memcmp(expected->data, actual->data,
+                  DP_int_to_size(DP_square_int(expected->diameter)))
+               != 0) {
+        print_error("Mismatch with %s for %s stamp of size %d\n",
+                    DP_cpu_support_name(level), what, size);
+        assert_int_equal(expected->diameter, actual->diameter);
+        assert_int_equal(expected->left, actual->left);
+        assert_int_equal(expected->top, actual->top);
+        assert_memory_equal(expected->data, actual->data,
+                            DP_int_to_size(DP_square_int(expected->diameter)));
+    }
+}
+
+static void check_classic_stamp(DP_DrawContext *dc, uint8_t *expected_data,
+                                uint8_t *actual_data, DP_CpuSupport level,
+                                int size, int i)
+{
+    static const uint8_t hardnesses[] = {0, 37, 128, 200, 255};
+    static const uint8_t opacities[] = {1, 100, 255};
+    uint8_t hardness = hardnesses[i % (int)DP_ARRAY_LENGTH(hardnesses)];
+    uint8_t opacity = opacities[i % (int)DP_ARRAY_LENGTH(opacities)];
+    // Cover all the quarter-pixel offsets, in both directions.
+    int x = i % 4 - 400;
+    int y = i / 4 % 4 + 400;
+
+    DP_cpu_support = DP_CPU_SUPPORT_DEFAULT;
+    DP_BrushStamp expected = DP_paint_classic_brush_stamp_make(
+        dc, expected_data, size, hardness, opacity, x, y);
+    DP_cpu_support = level;
+    DP_BrushStamp actual = DP_paint_classic_brush_stamp_make(
+        dc, actual_data, size, hardness, opacity, x, y);
+    check_stamps_equal(&expected, &actual, level, "classic", size);
+}
+
+static void check_classic_stamps(DP_DrawContext *dc, uint8_t *expected_data,
+                                 uint8_t *actual_data, DP_CpuSupport level)
+{
+    // Small sizes densely, they take the high-resolution path below a radius
+    // of 8 pixels, then large ones more sparsely. Sizes below 7 overflow the
+    // lookup table distance, in both code paths.
+    int i = 0;
+    for (int size = 7; size < 4096; size += 7) {
+        for (int j = 0; j < 3; ++j) {
+            check_classic_stamp(dc, expected_data, actual_data, level, size,
+                                i++);
+        }
+    }
+    for (int size = 4096; size <= 65535; size += 1021) {
+        check_classic_stamp(dc, expected_data, actual_data, level, size, i++);
+    }
+    check_classic_stamp(dc, expected_data, actual_data, level, 65535, i++);
+}
+
+static void test_brush_stamps_simd(void **state)
+{
+    DP_DrawContext *dc = DP_draw_context_new();
+    push_draw_context(state, dc);
+    uint8_t *expected_data = DP_malloc(DP_DRAW_CONTEXT_STAMP_BUFFER_SIZE);
+    destructor_push(state, expected_data, DP_free);
+    uint8_t *actual_data = DP_malloc(DP_DRAW_CONTEXT_STAMP_BUFFER_SIZE);
+    destructor_push(state, actual_data, DP_free);
+
+    DP_CpuSupport max_level = DP_cpu_support_detect();
+    for (int level = DP_CPU_SUPPORT_DEFAULT + 1; level <= (int)max_level;
+         ++level) {
+        check_classic_stamps(dc, expected_data, actual_data,
+                             (DP_CpuSupport)level);
+        DP_paint_classic_luts_compact_set(true);
+        check_classic_stamps(dc, expected_data, actual_data,
+                             (DP_CpuSupport)level);
+        DP_paint_classic_luts_compact_set(false);
+
+        for (int size = 1; size <= 255; ++size) {
+            uint8_t opacity = DP_int_to_uint8(size * 37 % 256);
+            DP_cpu_support = DP_CPU_SUPPORT_DEFAULT;
+            DP_BrushStamp expected = DP_paint_pixel_brush_stamp_make(
+                expected_data, DP_MSG_DRAW_DABS_PIXEL, size, opacity, 7, 9);
+            DP_cpu_support = (DP_CpuSupport)level;
+            DP_BrushStamp actual = DP_paint_pixel_brush_stamp_make(
+                actual_data, DP_MSG_DRAW_DABS_PIXEL, size, opacity, 7, 9);
+            check_stamps_equal(&expected, &actual, (DP_CpuSupport)level,
+                               "round pixel", size);
+        }
+    }
+    DP_cpu_support = DP_CPU_SUPPORT_DEFAULT;
+}
+
+
+static void test_brush_stamps_compact_luts(void **state)
+{
+    DP_DrawContext *dc = DP_draw_context_new();
+    push_draw_context(state, dc);
+    uint8_t *expected_data = DP_malloc(DP_DRAW_CONTEXT_STAMP_BUFFER_SIZE);
+    destructor_push(state, expected_data, DP_free);
+    uint8_t *actual_data = DP_malloc(DP_DRAW_CONTEXT_STAMP_BUFFER_SIZE);
+    destructor_push(state, actual_data, DP_free);
+
+    // Generate the compact tables in the background while stamps are being
+    // made, so that both race to generate the same ones.
+    DP_Worker *worker = DP_worker_new(CLASSIC_LUT_COUNT, 3);
+    assert_non_null(worker);
+    destructor_push(state, worker, destroy_worker);
+    DP_paint_classic_luts_compact_set(true);
+    DP_paint_classic_luts_init(worker);
+
+    int max_difference = 0;
+    for (int size = 7; size <= 65535; size += size < 4096 ? 7 : 1021) {
+        uint8_t hardness = DP_int_to_uint8(size % 256);
+        uint8_t opacity = DP_int_to_uint8(255 - size % 200);
+        int x = size % 4;
+        int y = size / 4 % 4;
+        DP_paint_classic_luts_compact_set(false);
+        DP_BrushStamp expected = DP_paint_classic_brush_stamp_make(
+            dc, expected_data, size, hardness, opacity, x, y);
+        DP_paint_classic_luts_compact_set(true);
+        DP_BrushStamp actual = DP_paint_classic_brush_stamp_make(
+            dc, actual_data, size, hardness, opacity, x, y);
+
+        assert_int_equal(expected.diameter, actual.diameter);
+        assert_int_equal(expected.left, actual.left);
+        assert_int_equal(expected.top, actual.top);
+        int length = DP_square_int(expected.diameter);
+        for (int i = 0; i < length; ++i) {
+            int difference = abs(expected.data[i] - actual.data[i]);
+            max_difference = DP_max_int(max_difference, difference);
+        }
+    }
+    DP_paint_classic_luts_compact_set(false);
+    destructor_run(state, worker);
+
+    // Reduced precision is only supposed to matter at the rounding edges.
+    assert_true(max_difference <= 1);
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_brush_stamps_binned),
+        dp_unit_test(test_brush_stamps_parallel),
+        dp_unit_test(test_brush_stamps_cache),
+        dp_unit_test(test_brush_stamps_simd),
+        dp_unit_test(test_brush_stamps_compact_luts),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/binary.h>
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpcommon/geom.h>
+#include <dpengine/blend_mode.h>
+#include <dpengine/canvas_diff.h>
+#include <dpengine/canvas_state.h>
+#include <dpengine/draw_context.h>
+#include <dpengine/image.h>
+#include <dpengine/layer_content.h>
+#include <dpengine/pixels.h>
+#include <dpengine/tile.h>
+#include <dpmsg/message.h>
+#include <dpmsg/messages/canvas_background.h>
+#include <dpmsg/messages/canvas_resize.h>
+#include <dpmsg/messages/fill_rect.h>
+#include <dpmsg/messages/layer_create.h>
+#include <dpengine_test.h>
+
+
+#define MAX_TILES 1024
+
+typedef struct CanvasDiffState {
+    int xtiles, ytiles;
+    bool expected[MAX_TILES];
+    int seen[MAX_TILES];
+    int last_index;
+    int checked;
+} CanvasDiffState;
+
+
+static bool check_expected(void *data, int tile_index)
+{
+    CanvasDiffState *cds = data;
+    ++cds->checked;
+    return cds->expected[tile_index];
+}
+
+static void count_index(void *data, int tile_index)
+{
+    CanvasDiffState *cds = data;
+    assert_true(tile_index > cds->last_index);
+    cds->last_index = tile_index;
+    ++cds->seen[tile_index];
+}
+
+static void count_pos(void *data, int tile_x, int tile_y)
+{
+    CanvasDiffState *cds = data;
+    assert_true(tile_x >= 0 && tile_x < cds->xtiles);
+    assert_true(tile_y >= 0 && tile_y < cds->ytiles);
+    ++cds->seen[tile_y * cds->xtiles + tile_x];
+}
+
+static void count_rect(void *data, DP_Rect tile_rect)
+{
+    CanvasDiffState *cds = data;
+    assert_true(DP_rect_valid(tile_rect));
+    for (int y = tile_rect.y1; y <= tile_rect.y2; ++y) {
+        for (int x = tile_rect.x1; x <= tile_rect.x2; ++x) {
+            count_pos(cds, x, y);
+        }
+    }
+}
+
+static void assert_seen_expected(CanvasDiffState *cds)
+{
+    int count = cds->xtiles * cds->ytiles;
+    for (int i = 0; i < count; ++i) {
+        assert_int_equal(cds->seen[i], cds->expected[i] ? 1 : 0);
+        cds->seen[i] = 0;
+    }
+}
+
+static void check_pattern(DP_CanvasDiff *diff, int width, int height,
+                          uint32_t seed, int density)
+{
+    static CanvasDiffState cds;
+    cds.xtiles = DP_tile_size_round_up(width);
+    cds.ytiles = DP_tile_size_round_up(height);
+    int count = cds.xtiles * cds.ytiles;
+    assert_true(count <= MAX_TILES);
+
+    bool any = false;
+    uint32_t state = seed;
+    for (int i = 0; i < count; ++i) {
+        // Clump changes together a bit so that there's rectangles to merge.
+        bool changed = (int)(next_random(&state) % 100u) < density
+                    || (i > 0 && cds.expected[i - 1]
+                        && next_random(&state) % 2u == 0u);
+        cds.expected[i] = changed;
+        any = any || changed;
+    }
+
+    DP_canvas_diff_begin(diff, width, height, width, height, 0, 0, false);
+    assert_false(DP_canvas_diff_tiles_changed(diff));
+    cds.checked = 0;
+    DP_canvas_diff_check(diff, check_expected, &cds);
+    assert_int_equal(cds.checked, count);
+    assert_int_equal(DP_canvas_diff_tiles_changed(diff), any);
+
+    // Only tiles not marked as changed yet get checked again.
+    cds.checked = 0;
+    DP_canvas_diff_check(diff, check_expected, &cds);
+    int unchanged = 0;
+    for (int i = 0; i < count; ++i) {
+        unchanged += cds.expected[i] ? 0 : 1;
+    }
+    assert_int_equal(cds.checked, unchanged);
+
+    cds.last_index = -1;
+    DP_canvas_diff_each_index(diff, count_index, &cds);
+    assert_seen_expected(&cds);
+
+    DP_canvas_diff_each_pos(diff, count_pos, &cds);
+    assert_seen_expected(&cds);
+
+    DP_canvas_diff_each_rect(diff, count_rect, &cds);
+    assert_seen_expected(&cds);
+}
+
+static void check_all(DP_CanvasDiff *diff, int width, int height)
+{
+    static CanvasDiffState cds;
+    cds.xtiles = DP_tile_size_round_up(width);
+    cds.ytiles = DP_tile_size_round_up(height);
+    int count = cds.xtiles * cds.ytiles;
+    for (int i = 0; i < count; ++i) {
+        cds.expected[i] = true;
+    }
+
+    // A size change marks everything as changed.
+    DP_canvas_diff_begin(diff, 0, 0, width, height, 0, 0, false);
+    cds.last_index = -1;
+    DP_canvas_diff_each_index(diff, count_index, &cds);
+    assert_seen_expected(&cds);
+
+    DP_canvas_diff_begin(diff, width, height, width, height, 0, 0, false);
+    DP_canvas_diff_check_all(diff);
+    DP_canvas_diff_each_rect(diff, count_rect, &cds);
+    assert_seen_expected(&cds);
+    DP_canvas_diff_each_pos(diff, count_pos, &cds);
+    assert_seen_expected(&cds);
+}
+
+static void count_rects(void *data, DP_UNUSED DP_Rect tile_rect)
+{
+    ++*(int *)data;
+}
+
+static void destroy_canvas_diff(void *value)
+{
+    DP_canvas_diff_free(value);
+}
+
+static void test_canvas_diff(void **state)
+{
+    DP_CanvasDiff *diff = DP_canvas_diff_new();
+    destructor_push(state, diff, destroy_canvas_diff);
+
+    static const int sizes[][2] = {
+        {0, 0},     {64, 64},    {100, 100},  {4096, 64},
+        {4160, 64}, {1000, 700}, {640, 1500}, {2000, 2000},
+    };
+    for (size_t i = 0; i < DP_ARRAY_LENGTH(sizes); ++i) {
+        int width = sizes[i][0];
+        int height = sizes[i][1];
+        check_all(diff, width, height);
+        for (uint32_t seed = 1; seed <= 20; ++seed) {
+            check_pattern(diff, width, height, seed * 7919u,
+                          (int)(seed * 5u % 101u));
+        }
+    }
+
+    // A fully changed canvas collapses into a single rectangle.
+    DP_canvas_diff_begin(diff, 0, 0, 1000, 700, 0, 0, false);
+    int rects = 0;
+    DP_canvas_diff_each_rect(diff, count_rects, &rects);
+    assert_int_equal(rects, 1);
+}
+
+
+typedef struct CanvasDiffResizeState {
+    DP_DrawContext *dc;
+    DP_CanvasDiff *diff;
+    DP_CanvasState *cs;
+    DP_TransientLayerContent *tlc;
+} CanvasDiffResizeState;
+
+static void count_changed(void *data, DP_UNUSED int tile_index)
+{
+    ++*(int *)data;
+}
+
+static void assert_same_image(DP_TransientLayerContent *a,
+                              DP_TransientLayerContent *b)
+{
+    DP_Image *a_img = DP_layer_content_to_image((DP_LayerContent *)a);
+    DP_Image *b_img = DP_layer_content_to_image((DP_LayerContent *)b);
+    assert_int_equal(DP_image_width(a_img), DP_image_width(b_img));
+    assert_int_equal(DP_image_height(a_img), DP_image_height(b_img));
+    assert_memory_equal(DP_image_pixels(a_img), DP_image_pixels(b_img),
+                        sizeof(DP_Pixel) * DP_int_to_size(DP_image_width(a_img))
+                            * DP_int_to_size(DP_image_height(a_img)));
+    DP_image_free(b_img);
+    DP_image_free(a_img);
+}
+
+// Handles the message, renders the diff incrementally and checks the result
+// against rendering the whole canvas from scratch. Returns the number of tiles
+// that the diff marked as changed.
+static int handle_render(CanvasDiffResizeState *cdrs, DP_Message *msg)
+{
+    DP_CanvasState *next = DP_canvas_state_handle(cdrs->cs, cdrs->dc, msg);
+    DP_message_decref(msg);
+    assert_non_null(next);
+
+    DP_canvas_state_diff(next, cdrs->cs, cdrs->diff);
+    DP_canvas_state_decref(cdrs->cs);
+    cdrs->cs = next;
+
+    int changed = 0;
+    DP_canvas_diff_each_index(cdrs->diff, count_changed, &changed);
+    cdrs->tlc = DP_canvas_state_render(next, cdrs->tlc, cdrs->diff, NULL);
+
+    DP_CanvasDiff *full_diff = DP_canvas_diff_new();
+    DP_canvas_state_diff(next, NULL, full_diff);
+    DP_TransientLayerContent *full = DP_canvas_state_render(
+        next, DP_transient_layer_content_new_init(0, 0, NULL), full_diff, NULL);
+    assert_same_image(cdrs->tlc, full);
+    DP_transient_layer_content_decref(full);
+    DP_canvas_diff_free(full_diff);
+    return changed;
+}
+
+static DP_Message *background_new(uint32_t color)
+{
+    unsigned char buffer[4];
+    DP_write_bigendian_uint32(color, buffer);
+    return DP_msg_canvas_background_new(1, buffer, sizeof(buffer));
+}
+
+static void test_canvas_diff_resize(void **state)
+{
+    CanvasDiffResizeState cdrs = {
+        DP_draw_context_new(),
+        DP_canvas_diff_new(),
+        DP_canvas_state_new(),
+        DP_transient_layer_content_new_init(0, 0, NULL),
+    };
+    push_draw_context(state, cdrs.dc);
+
+    assert_int_equal(
+        handle_render(&cdrs, DP_msg_canvas_resize_new(1, 0, 300, 200, 0)), 20);
+    handle_render(&cdrs, background_new(0xffe0e0e0u));
+    handle_render(&cdrs, DP_msg_layer_create_new(1, 257, 0, 0, 0, "", 0));
+    handle_render(&cdrs, DP_msg_fill_rect_new(1, 257, DP_BLEND_MODE_NORMAL, 40,
+                                              30, 250, 160, 0xff3366ccu));
+
+    // Growing by whole tiles only exposes the new area, 7x6 tiles minus the
+    // 5x4 that were already there.
+    assert_int_equal(
+        handle_render(&cdrs, DP_msg_canvas_resize_new(1, 128, 64, 0, 64)), 22);
+
+    // Cropping by whole tiles doesn't expose anything at all.
+    assert_int_equal(
+        handle_render(&cdrs, DP_msg_canvas_resize_new(1, -64, 0, 0, -128)), 0);
+
+    // Anything not aligned to the tile grid moves every pixel.
+    assert_int_equal(
+        handle_render(&cdrs, DP_msg_canvas_resize_new(1, 0, 0, 0, 10)), 25);
+
+    // Setting the same background again is a no-op, a different one isn't.
+    assert_int_equal(handle_render(&cdrs, background_new(0xffe0e0e0u)), 0);
+    assert_int_equal(handle_render(&cdrs, background_new(0xff202020u)), 25);
+
+    DP_transient_layer_content_decref(cdrs.tlc);
+    DP_canvas_state_decref(cdrs.cs);
+    DP_canvas_diff_free(cdrs.diff);
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_canvas_diff),
+        dp_unit_test(test_canvas_diff_resize),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
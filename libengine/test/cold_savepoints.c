@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/common.h>
+#include <dpengine/blend_mode.h>
+#include <dpengine/canvas_history.h>
+#include <dpengine/canvas_state.h>
+#include <dpengine/draw_context.h>
+#include <dpengine/tile.h>
+#include <dpmsg/message.h>
+#include <dpmsg/messages/canvas_resize.h>
+#include <dpmsg/messages/fill_rect.h>
+#include <dpmsg/messages/layer_create.h>
+#include <dpmsg/messages/undo.h>
+#include <dpmsg/messages/undo_point.h>
+#include <dpengine_test.h>
+
+
+typedef struct ColdSavepointsState {
+    DP_DrawContext *dc;
+    DP_CanvasHistory *plain;
+    DP_CanvasHistory *cold;
+} ColdSavepointsState;
+
+static void handle(ColdSavepointsState *css, DP_Message *msg)
+{
+    handle_in_both(css->plain, css->cold, css->dc, msg);
+}
+
+static void put_image(ColdSavepointsState *css, int i)
+{
+    handle(css, make_test_put_image(1, 257, i * 13, i * 7, i));
+}
+
+static void test_cold_savepoints(void **state)
+{
+    ColdSavepointsState css = {DP_draw_context_new(),
+                               DP_canvas_history_new(NULL, NULL),
+                               DP_canvas_history_new(NULL, NULL)};
+    push_draw_context(state, css.dc);
+    push_canvas_history(state, css.plain);
+    push_canvas_history(state, css.cold);
+    DP_canvas_history_cold_savepoint_age_set(css.cold, 2);
+
+    handle(&css, DP_msg_canvas_resize_new(1, 0, 256, 256, 0));
+    handle(&css, DP_msg_layer_create_new(1, 257, 0, 0, 0, "", 0));
+    for (int i = 0; i < 10; ++i) {
+        handle(&css, DP_msg_undo_point_new(1));
+        put_image(&css, i);
+    }
+    assert_int_not_equal(DP_tile_memory_stats().cold_tiles, 0);
+    assert_canvas_histories_equal(css.plain, css.cold);
+
+    // Undoing far enough back has to replay from compressed savepoints.
+    for (int i = 0; i < 6; ++i) {
+        handle(&css, DP_msg_undo_new(1, 0, false));
+        assert_canvas_histories_equal(css.plain, css.cold);
+    }
+    for (int i = 0; i < 3; ++i) {
+        handle(&css, DP_msg_undo_new(1, 0, true));
+        assert_canvas_histories_equal(css.plain, css.cold);
+    }
+    for (int i = 10; i < 15; ++i) {
+        handle(&css, DP_msg_undo_point_new(1));
+        put_image(&css, i);
+        assert_canvas_histories_equal(css.plain, css.cold);
+    }
+}
+
+static DP_CanvasState *apply(DP_CanvasState *cs, DP_DrawContext *dc,
+                             DP_Message *msg)
+{
+    DP_CanvasState *next = DP_canvas_state_handle(cs, dc, msg);
+    assert_non_null(next);
+    DP_message_decref(msg);
+    DP_canvas_state_decref(cs);
+    return next;
+}
+
+static void test_compress_shared_tiles(void **state)
+{
+    DP_DrawContext *dc = DP_draw_context_new();
+    push_draw_context(state, dc);
+    DP_CanvasState *cs = DP_canvas_state_new();
+    cs = apply(cs, dc, DP_msg_canvas_resize_new(1, 0, 256, 256, 0));
+    cs = apply(cs, dc, DP_msg_layer_create_new(1, 257, 0, 0, 0, "", 0));
+    cs = apply(cs, dc, DP_msg_layer_create_new(1, 258, 0, 0, 0, "", 0));
+    cs = apply(cs, dc, make_test_put_image(1, 257, 0, 0, 0));
+
+    // Filling the other layer leaves the image's layer shared between both.
+    DP_CanvasState *shared =
+        apply(DP_canvas_state_incref(cs), dc,
+              DP_msg_fill_rect_new(1, 258, DP_BLEND_MODE_NORMAL, 0, 0, 256,
+                                   256, 0xff102030u));
+    int cold_tiles = DP_tile_memory_stats().cold_tiles;
+    assert_false(DP_canvas_state_compress_cold_tiles(cs));
+    assert_int_equal(DP_tile_memory_stats().cold_tiles, cold_tiles);
+
+    // Once the other state lets go, trying again gets to the image's tiles.
+    DP_canvas_state_decref(shared);
+    assert_true(DP_canvas_state_compress_cold_tiles(cs));
+    assert_int_not_equal(DP_tile_memory_stats().cold_tiles, cold_tiles);
+    assert_true(DP_canvas_state_decompress_cold_tiles(cs));
+    assert_int_equal(DP_tile_memory_stats().cold_tiles, cold_tiles);
+    DP_canvas_state_decref(cs);
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_cold_savepoints),
+        dp_unit_test(test_compress_shared_tiles),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpcommon/cpu.h>
+#include <dpengine/blend_mode.h>
+#include <dpengine/pixels.h>
+#include <dpengine_test.h>
+
+
+#define MAX_WIDTH  67
+#define MAX_HEIGHT 3
+#define MAX_SKIP   5
+#define BUFFER_LENGTH ((MAX_WIDTH + MAX_SKIP) * MAX_HEIGHT)
+
+static const int widths[] = {0, 1, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 64, 67};
+
+typedef struct CompositeBuffers {
+    uint32_t random_state;
+    DP_Pixel expected[BUFFER_LENGTH];
+    DP_Pixel actual[BUFFER_LENGTH];
+    DP_Pixel src[BUFFER_LENGTH];
+    uint8_t mask[BUFFER_LENGTH];
+} CompositeBuffers;
+
+
+static uint8_t random_channel(CompositeBuffers *cb)
+{
+    // Bias towards the edge cases that the kernels special-case.
+    uint32_t r = next_random(&cb->random_state);
+    switch (r % 8u) {
+    case 0:
+        return 0;
+    case 1:
+        return 255;
+    default:
+        return DP_uint32_to_uint8(r >> 8);
+    }
+}
+
+static DP_Pixel random_pixel(CompositeBuffers *cb)
+{
+    DP_Pixel pixel = {next_random(&cb->random_state)};
+    switch (pixel.color % 4u) {
+    case 0:
+        return (DP_Pixel){0};
+    case 1:
+        // Garbage pixel that isn't properly premultiplied.
+        return pixel;
+    default:
+        pixel.a = random_channel(cb);
+        return DP_pixel_premultiply(pixel);
+    }
+}
+
+static DP_Pixel opaque_pixel(CompositeBuffers *cb)
+{
+    DP_Pixel pixel = {next_random(&cb->random_state)};
+    pixel.a = 255;
+    return pixel;
+}
+
+static void fill_random(CompositeBuffers *cb)
+{
+    for (int i = 0; i < BUFFER_LENGTH; ++i) {
+        cb->expected[i] = cb->actual[i] = random_pixel(cb);
+        cb->src[i] = random_pixel(cb);
+        cb->mask[i] = random_channel(cb);
+    }
+    // Throw in some runs of transparent and opaque pixels, since the vector
+    // code paths may treat those specially.
+    for (int i = 0; i < BUFFER_LENGTH; i += 8) {
+        int end = DP_min_int(i + 8, BUFFER_LENGTH);
+        switch (next_random(&cb->random_state) % 4u) {
+        case 0:
+            for (int j = i; j < end; ++j) {
+                cb->src[j] = (DP_Pixel){0};
+            }
+            break;
+        case 1:
+            for (int j = i; j < end; ++j) {
+                cb->src[j] = opaque_pixel(cb);
+            }
+            break;
+        case 2:
+            for (int j = i; j < end; ++j) {
+                cb->expected[j] = cb->actual[j] = opaque_pixel(cb);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+
+static void check_composite_mask(CompositeBuffers *cb, DP_CpuSupport level,
+                                 int blend_mode, int w, int skip)
+{
+    fill_random(cb);
+    DP_Pixel src = cb->src[0];
+
+    DP_cpu_support = DP_CPU_SUPPORT_DEFAULT;
+    DP_pixels_composite_mask(cb->expected, src, blend_mode, cb->mask, w,
+                             MAX_HEIGHT, skip, skip);
+    DP_cpu_support = level;
+    DP_pixels_composite_mask(cb->actual, src, blend_mode, cb->mask, w,
+                             MAX_HEIGHT, skip, skip);
+
+    if (memcmp(cb->expected, cb->actual, sizeof(cb->expected)) != 0) {
+        print_error("Mismatch with %s for %s, width %d, skip %d\n",
+                    DP_cpu_support_name(level),
+                    DP_blend_mode_enum_name(blend_mode), w, skip);
+        assert_memory_equal(cb->expected, cb->actual, sizeof(cb->expected));
+    }
+}
+
+static void test_composite_mask(void **state)
+{
+    CompositeBuffers *cb = DP_malloc(sizeof(*cb));
+    destructor_push(state, cb, DP_free);
+    cb->random_state = 0x5eed1234u;
+
+    DP_CpuSupport max_level = DP_cpu_support_detect();
+    for (int level = DP_CPU_SUPPORT_DEFAULT + 1; level <= (int)max_level;
+         ++level) {
+        for (int blend_mode = 0; blend_mode < DP_BLEND_MODE_COUNT;
+             ++blend_mode) {
+            if (DP_blend_mode_valid_for_brush(blend_mode)) {
+                for (int i = 0; i < (int)DP_ARRAY_LENGTH(widths); ++i) {
+                    for (int skip = 0; skip <= MAX_SKIP; skip += MAX_SKIP) {
+                        for (int repeat = 0; repeat < 8; ++repeat) {
+                            check_composite_mask(cb, (DP_CpuSupport)level,
+                                                 blend_mode, widths[i], skip);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    DP_cpu_support = DP_CPU_SUPPORT_DEFAULT;
+}
+
+
+static void check_composite(CompositeBuffers *cb, DP_CpuSupport level,
+                            int blend_mode, int pixel_count, uint8_t opacity)
+{
+    fill_random(cb);
+
+    DP_cpu_support = DP_CPU_SUPPORT_DEFAULT;
+    DP_pixels_composite(cb->expected, cb->src, pixel_count, opacity,
+                        blend_mode);
+    DP_cpu_support = level;
+    DP_pixels_composite(cb->actual, cb->src, pixel_count, opacity, blend_mode);
+
+    if (memcmp(cb->expected, cb->actual, sizeof(cb->expected)) != 0) {
+        print_error("Mismatch with %s for %s, pixel count %d, opacity %d\n",
+                    DP_cpu_support_name(level),
+                    DP_blend_mode_enum_name(blend_mode), pixel_count,
+                    (int)opacity);
+        assert_memory_equal(cb->expected, cb->actual, sizeof(cb->expected));
+    }
+}
+
+static void test_composite(void **state)
+{
+    CompositeBuffers *cb = DP_malloc(sizeof(*cb));
+    destructor_push(state, cb, DP_free);
+    cb->random_state = 0x1234abcdu;
+
+    DP_CpuSupport max_level = DP_cpu_support_detect();
+    for (int level = DP_CPU_SUPPORT_DEFAULT + 1; level <= (int)max_level;
+         ++level) {
+        for (int blend_mode = 0; blend_mode < DP_BLEND_MODE_COUNT;
+             ++blend_mode) {
+            if (DP_blend_mode_exists(blend_mode)) {
+                for (int i = 0; i < (int)DP_ARRAY_LENGTH(widths); ++i) {
+                    int pixel_count = widths[i] * MAX_HEIGHT;
+                    for (int repeat = 0; repeat < 16; ++repeat) {
+                        uint8_t opacity = random_channel(cb);
+                        check_composite(cb, (DP_CpuSupport)level, blend_mode,
+                                        pixel_count, opacity);
+                    }
+                }
+            }
+        }
+    }
+    DP_cpu_support = DP_CPU_SUPPORT_DEFAULT;
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_composite_mask),
+        dp_unit_test(test_composite),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/binary.h>
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpengine/blend_mode.h>
+#include <dpengine/canvas_diff.h>
+#include <dpengine/canvas_state.h>
+#include <dpengine/draw_context.h>
+#include <dpengine/flatten_cache.h>
+#include <dpengine/image.h>
+#include <dpengine/layer_content.h>
+#include <dpengine/pixels.h>
+#include <dpmsg/message.h>
+#include <dpmsg/messages/canvas_background.h>
+#include <dpmsg/messages/canvas_resize.h>
+#include <dpmsg/messages/fill_rect.h>
+#include <dpmsg/messages/layer_attr.h>
+#include <dpmsg/messages/layer_create.h>
+#include <dpmsg/messages/layer_visibility.h>
+#include <dpengine_test.h>
+
+
+#define LAYER_COUNT 8
+#define TILE_COUNT  8
+
+typedef struct FlattenCacheState {
+    DP_DrawContext *dc;
+    DP_FlattenCache *fc;
+    DP_CanvasDiff *diff;
+    DP_CanvasState *cs;
+    DP_TransientLayerContent *cached;
+    DP_TransientLayerContent *uncached;
+    DP_FlattenCacheStats last_stats;
+    int tolerance;
+} FlattenCacheState;
+
+static void handle(FlattenCacheState *fcs, DP_Message *msg)
+{
+    DP_CanvasState *next = DP_canvas_state_handle(fcs->cs, fcs->dc, msg);
+    DP_message_decref(msg);
+    assert_non_null(next);
+    DP_canvas_state_decref(fcs->cs);
+    fcs->cs = next;
+}
+
+static void assert_close(int a, int b, int tolerance)
+{
+    assert_true(a - b <= tolerance && b - a <= tolerance);
+}
+
+// Renders the current state with and without the cache, checks that they
+// come out the same and returns the change in cache statistics.
+static DP_FlattenCacheStats render(FlattenCacheState *fcs,
+                                   DP_CanvasState *prev_or_null)
+{
+    DP_canvas_state_diff(fcs->cs, prev_or_null, fcs->diff);
+    fcs->cached =
+        DP_canvas_state_render(fcs->cs, fcs->cached, fcs->diff, fcs->fc);
+    fcs->uncached =
+        DP_canvas_state_render(fcs->cs, fcs->uncached, fcs->diff, NULL);
+
+    DP_Image *cached_img =
+        DP_layer_content_to_image((DP_LayerContent *)fcs->cached);
+    DP_Image *uncached_img =
+        DP_layer_content_to_image((DP_LayerContent *)fcs->uncached);
+    DP_Pixel *cached_pixels = DP_image_pixels(cached_img);
+    DP_Pixel *uncached_pixels = DP_image_pixels(uncached_img);
+    int pixel_count = DP_image_width(cached_img) * DP_image_height(cached_img);
+    for (int i = 0; i < pixel_count; ++i) {
+        DP_Pixel a = cached_pixels[i];
+        DP_Pixel b = uncached_pixels[i];
+        assert_close(a.b, b.b, fcs->tolerance);
+        assert_close(a.g, b.g, fcs->tolerance);
+        assert_close(a.r, b.r, fcs->tolerance);
+        assert_close(a.a, b.a, fcs->tolerance);
+    }
+    DP_image_free(uncached_img);
+    DP_image_free(cached_img);
+
+    DP_FlattenCacheStats stats = DP_flatten_cache_stats(fcs->fc);
+    DP_FlattenCacheStats last = fcs->last_stats;
+    fcs->last_stats = stats;
+    return (DP_FlattenCacheStats){
+        stats.hits - last.hits,
+        stats.prefix_hits - last.prefix_hits,
+        stats.above_hits - last.above_hits,
+        stats.misses - last.misses,
+        stats.composited_layers - last.composited_layers,
+    };
+}
+
+static DP_FlattenCacheStats handle_render(FlattenCacheState *fcs,
+                                          DP_Message *msg)
+{
+    DP_CanvasState *prev = DP_canvas_state_incref(fcs->cs);
+    handle(fcs, msg);
+    DP_FlattenCacheStats stats = render(fcs, prev);
+    DP_canvas_state_decref(prev);
+    return stats;
+}
+
+static void assert_stats(DP_FlattenCacheStats stats, int hits, int prefix_hits,
+                         int above_hits, int misses, int composited_layers)
+{
+    assert_int_equal(stats.hits, hits);
+    assert_int_equal(stats.prefix_hits, prefix_hits);
+    assert_int_equal(stats.above_hits, above_hits);
+    assert_int_equal(stats.misses, misses);
+    assert_int_equal(stats.composited_layers, composited_layers);
+}
+
+static DP_Message *paint(int layer, int x, uint32_t color)
+{
+    return DP_msg_fill_rect_new(1, 257 + layer, DP_BLEND_MODE_NORMAL, x, 8, 16,
+                                16, color);
+}
+
+// Sets up a canvas with layers that all cover the first tile. Every third
+// layer uses the given blend mode, the rest use normal blending.
+static FlattenCacheState init_canvas(void **state, int blend_mode)
+{
+    unsigned char background[4];
+    DP_write_bigendian_uint32(0xffd0d0d0u, background);
+
+    FlattenCacheState fcs = {DP_draw_context_new(),
+                             DP_flatten_cache_new(),
+                             DP_canvas_diff_new(),
+                             DP_canvas_state_new(),
+                             DP_transient_layer_content_new_init(0, 0, NULL),
+                             DP_transient_layer_content_new_init(0, 0, NULL),
+                             {0, 0, 0, 0, 0},
+                             0};
+    push_draw_context(state, fcs.dc);
+
+    handle(&fcs, DP_msg_canvas_resize_new(1, 0, 256, 128, 0));
+    handle(&fcs, DP_msg_canvas_background_new(1, background,
+                                              sizeof(background)));
+    for (int i = 0; i < LAYER_COUNT; ++i) {
+        handle(&fcs, DP_msg_layer_create_new(1, 257 + i, 0, 0, 0, "", 0));
+        handle(&fcs, DP_msg_layer_attr_new(
+                         1, 257 + i, 0, 0, 200,
+                         i % 3 == 2 ? blend_mode : DP_BLEND_MODE_NORMAL));
+        handle(&fcs, DP_msg_fill_rect_new(
+                         1, 257 + i, DP_BLEND_MODE_NORMAL, i * 8, i * 4, 160,
+                         100, 0x80000000u | DP_int_to_uint32(i * 0x1f3b57)));
+    }
+    return fcs;
+}
+
+static void dispose_canvas(FlattenCacheState *fcs)
+{
+    DP_transient_layer_content_decref(fcs->uncached);
+    DP_transient_layer_content_decref(fcs->cached);
+    DP_canvas_state_decref(fcs->cs);
+    DP_canvas_diff_free(fcs->diff);
+    DP_flatten_cache_free(fcs->fc);
+}
+
+static void test_flatten_cache(void **state)
+{
+    FlattenCacheState fcs = init_canvas(state, DP_BLEND_MODE_MULTIPLY);
+
+    // Initially, everything has to be composited.
+    DP_FlattenCacheStats stats = render(&fcs, NULL);
+    assert_int_equal(stats.hits, 0);
+    assert_int_equal(stats.misses, TILE_COUNT);
+
+    // Painting on the top layer for the first time only has a snapshot of the
+    // background to go on, but it takes one below the top layer.
+    int top = LAYER_COUNT - 1;
+    assert_stats(handle_render(&fcs, paint(top, 10, 0xff00ff00u)), 0, 0, 0, 1,
+                 LAYER_COUNT);
+
+    // Painting there again composites only the top layer.
+    for (int i = 0; i < 3; ++i) {
+        assert_stats(handle_render(&fcs, paint(top, 12 + i, 0xff0000ffu)), 0,
+                     1, 0, 0, 1);
+    }
+
+    // Rendering everything again reuses every result as-is.
+    assert_stats(render(&fcs, NULL), TILE_COUNT, 0, 0, 0, 0);
+
+    // Painting on a lower layer has to start over from the background, then
+    // moves the snapshot down.
+    assert_stats(handle_render(&fcs, paint(2, 10, 0xffff0000u)), 0, 0, 0, 1,
+                 LAYER_COUNT);
+    assert_stats(handle_render(&fcs, paint(2, 14, 0xffffff00u)), 0, 1, 0, 0,
+                 LAYER_COUNT - 2);
+
+    // Hiding the top layer changes every tile. Only the painted one has a
+    // snapshot below the top layer to start from.
+    stats = handle_render(
+        &fcs, DP_msg_layer_visibility_new(1, 257 + top, false));
+    assert_int_equal(stats.hits, 0);
+    assert_int_equal(stats.prefix_hits, 1);
+    assert_int_equal(stats.misses, TILE_COUNT - 1);
+
+    // Changing a hidden layer marks its tiles, but they look the same.
+    stats = handle_render(&fcs, DP_msg_layer_attr_new(1, 257 + top, 0, 0, 100,
+                                                      DP_BLEND_MODE_NORMAL));
+    assert_int_not_equal(stats.hits, 0);
+    assert_stats(stats, stats.hits, 0, 0, 0, 0);
+
+    // Changing a visible layer's opacity has to composite everything above.
+    stats = handle_render(&fcs, DP_msg_layer_attr_new(1, 257, 0, 0, 100,
+                                                      DP_BLEND_MODE_NORMAL));
+    assert_int_equal(stats.hits, 0);
+
+    dispose_canvas(&fcs);
+}
+
+static void test_flatten_cache_hot_layer(void **state)
+{
+    FlattenCacheState fcs = init_canvas(state, DP_BLEND_MODE_NORMAL);
+    // Merging the layers above rounds differently.
+    fcs.tolerance = 2;
+    int hot = 3;
+    DP_flatten_cache_hot_layer_id_set(fcs.fc, 257 + hot);
+    render(&fcs, NULL);
+
+    // Painting on the hot layer takes the snapshot below it, the hot layer
+    // itself and the merged layers above it.
+    for (int i = 0; i < 3; ++i) {
+        assert_stats(handle_render(&fcs, paint(hot, 10 + i, 0xff00ff00u)), 0,
+                     1, 1, 0, 2);
+    }
+
+    // Painting below the hot layer keeps the snapshot just below the hot
+    // layer, so painting on the hot layer afterwards is just as cheap.
+    assert_stats(handle_render(&fcs, paint(0, 10, 0xffff0000u)), 0, 0, 1, 1,
+                 hot + 2);
+    assert_stats(handle_render(&fcs, paint(hot, 14, 0xff0000ffu)), 0, 1, 1, 0,
+                 2);
+
+    // Painting above the hot layer merges the layers there again.
+    int above_count = LAYER_COUNT - hot - 1;
+    assert_stats(handle_render(&fcs, paint(LAYER_COUNT - 1, 10, 0xff00ffffu)),
+                 0, 1, 0, 0, above_count + 2);
+    assert_stats(handle_render(&fcs, paint(hot, 16, 0xffff00ffu)), 0, 1, 1, 0,
+                 2);
+
+    dispose_canvas(&fcs);
+}
+
+static void test_flatten_cache_hot_layer_unmergeable(void **state)
+{
+    FlattenCacheState fcs = init_canvas(state, DP_BLEND_MODE_MULTIPLY);
+    int hot = 3;
+    DP_flatten_cache_hot_layer_id_set(fcs.fc, 257 + hot);
+    render(&fcs, NULL);
+
+    // There's a multiply layer above, so the layers above get composited one
+    // by one. The snapshot below still helps and the result is exact.
+    int above_count = LAYER_COUNT - hot - 1;
+    for (int i = 0; i < 3; ++i) {
+        assert_stats(handle_render(&fcs, paint(hot, 10 + i, 0xff00ff00u)), 0,
+                     1, 0, 0, above_count + 1);
+    }
+
+    dispose_canvas(&fcs);
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_flatten_cache),
+        dp_unit_test(test_flatten_cache_hot_layer),
+        dp_unit_test(test_flatten_cache_hot_layer_unmergeable),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
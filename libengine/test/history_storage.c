@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/binary.h>
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpengine/blend_mode.h>
+#include <dpengine/canvas_history.h>
+#include <dpengine/canvas_state.h>
+#include <dpengine/draw_context.h>
+#include <dpmsg/message.h>
+#include <dpmsg/messages/canvas_resize.h>
+#include <dpmsg/messages/draw_dabs.h>
+#include <dpmsg/messages/fill_rect.h>
+#include <dpmsg/messages/layer_create.h>
+#include <dpmsg/messages/pen_up.h>
+#include <dpmsg/messages/undo.h>
+#include <dpmsg/messages/undo_point.h>
+#include <dpengine_test.h>
+
+
+#define ROUNDS          40
+#define FILLS_PER_ROUND 60
+#define DAB_ROUNDS      12
+#define DABS_PER_ROUND  20
+#define DABS_PER_MSG    4
+
+static void handle(DP_CanvasHistory *ch, DP_DrawContext *dc, DP_Message *msg)
+{
+    assert_true(DP_canvas_history_handle(ch, dc, msg));
+    DP_message_decref(msg);
+}
+
+static void test_history_wraps_around(void **state)
+{
+    DP_DrawContext *dc = DP_draw_context_new();
+    push_draw_context(state, dc);
+    DP_CanvasHistory *ch = DP_canvas_history_new(NULL, NULL);
+    push_canvas_history(state, ch);
+
+    handle(ch, dc, DP_msg_canvas_resize_new(1, 0, 128, 128, 0));
+    handle(ch, dc, DP_msg_layer_create_new(1, 257, 0, 0, 0, "", 0));
+
+    // Enough entries that the history gets truncated and then has to grow
+    // while its start isn't at the front of the buffer anymore.
+    DP_CanvasState *expected = NULL;
+    for (int i = 0; i < ROUNDS; ++i) {
+        if (i == ROUNDS - 5) {
+            expected = DP_canvas_history_compare_and_get(ch, NULL);
+        }
+        handle(ch, dc, DP_msg_undo_point_new(1));
+        for (int j = 0; j < FILLS_PER_ROUND; ++j) {
+            uint32_t color = 0xff000000u | DP_int_to_uint32(i * 4099 + j * 31);
+            handle(ch, dc,
+                   DP_msg_fill_rect_new(1, 257, DP_BLEND_MODE_NORMAL,
+                                        (i * 7 + j * 13) % 120, (j * 5) % 120,
+                                        8, 8, color));
+        }
+    }
+
+    DP_CanvasHistorySizeStats stats = DP_canvas_history_size_stats(ch);
+    assert_int_equal(stats.first_index + stats.entries,
+                     3 + ROUNDS * (FILLS_PER_ROUND + 1));
+    assert_true(stats.first_index > 0);
+    assert_true(stats.entries <= stats.capacity);
+    assert_int_equal(stats.capacity, 2048);
+    assert_int_equal(stats.fork_entries, 0);
+
+    for (int i = 0; i < 5; ++i) {
+        handle(ch, dc, DP_msg_undo_new(1, 0, false));
+    }
+    DP_CanvasState *actual = DP_canvas_history_compare_and_get(ch, NULL);
+    assert_canvas_states_equal(expected, actual);
+    DP_canvas_state_decref(actual);
+    DP_canvas_state_decref(expected);
+}
+
+static void test_history_batch(void **state)
+{
+    DP_DrawContext *dc = DP_draw_context_new();
+    push_draw_context(state, dc);
+    DP_CanvasHistory *ch = DP_canvas_history_new(NULL, NULL);
+    push_canvas_history(state, ch);
+
+    handle(ch, dc, DP_msg_canvas_resize_new(1, 0, 128, 128, 0));
+    handle(ch, dc, DP_msg_layer_create_new(1, 257, 0, 0, 0, "", 0));
+    DP_CanvasState *before = DP_canvas_history_compare_and_get(ch, NULL);
+
+    DP_canvas_history_batch_begin(ch);
+    assert_true(DP_canvas_history_batching(ch));
+    for (int i = 0; i < 10; ++i) {
+        handle(ch, dc, DP_msg_undo_point_new(1));
+        handle(ch, dc,
+               DP_msg_fill_rect_new(1, 257, DP_BLEND_MODE_NORMAL, i * 10, i * 5,
+                                    16, 16, 0xff000000u | DP_int_to_uint32(i)));
+    }
+    handle(ch, dc, DP_msg_undo_new(1, 0, false));
+    // Nothing gets published while the batch is running.
+    assert_null(DP_canvas_history_compare_and_get(ch, before));
+    DP_canvas_history_batch_end(ch);
+    assert_false(DP_canvas_history_batching(ch));
+
+    DP_CanvasState *batched = DP_canvas_history_compare_and_get(ch, before);
+    assert_non_null(batched);
+
+    // Doing the same thing without batching must end up the same.
+    DP_CanvasHistory *unbatched_ch = DP_canvas_history_new(NULL, NULL);
+    push_canvas_history(state, unbatched_ch);
+    handle(unbatched_ch, dc, DP_msg_canvas_resize_new(1, 0, 128, 128, 0));
+    handle(unbatched_ch, dc, DP_msg_layer_create_new(1, 257, 0, 0, 0, "", 0));
+    for (int i = 0; i < 9; ++i) {
+        handle(unbatched_ch, dc, DP_msg_undo_point_new(1));
+        handle(unbatched_ch, dc,
+               DP_msg_fill_rect_new(1, 257, DP_BLEND_MODE_NORMAL, i * 10, i * 5,
+                                    16, 16, 0xff000000u | DP_int_to_uint32(i)));
+    }
+    DP_CanvasState *unbatched =
+        DP_canvas_history_compare_and_get(unbatched_ch, NULL);
+    assert_canvas_states_equal(unbatched, batched);
+
+    DP_canvas_state_decref(unbatched);
+    DP_canvas_state_decref(batched);
+    DP_canvas_state_decref(before);
+}
+
+static DP_Message *make_dabs(int round, int i)
+{
+    unsigned char buffer[15 + DABS_PER_MSG * 6];
+    unsigned char *p = buffer;
+    p += DP_write_bigendian_uint16(257, p);
+    // Coordinates are in quarter pixels.
+    p += DP_write_bigendian_int32((round * 37 + i * 11) % 480, p);
+    p += DP_write_bigendian_int32((round * 23 + i * 7) % 480, p);
+    // Colors with alpha draw indirectly, onto a sublayer merged at pen up.
+    uint32_t alpha = round % 4 == 1 ? 0xff000000u : 0u;
+    p += DP_write_bigendian_uint32(
+        alpha | (DP_int_to_uint32(round * 0x1f3d + i * 0x107) & 0xffffffu), p);
+    p += DP_write_bigendian_uint8(DP_BLEND_MODE_NORMAL, p);
+    for (int j = 0; j < DABS_PER_MSG; ++j) {
+        p += DP_write_bigendian_int8(DP_int_to_int8(j * 5), p);
+        p += DP_write_bigendian_int8(DP_int_to_int8(j * 3), p);
+        p += DP_write_bigendian_uint16(DP_int_to_uint16(1024 + j * 512), p);
+        p += DP_write_bigendian_uint8(200, p);
+        p += DP_write_bigendian_uint8(DP_int_to_uint8(128 + j * 30), p);
+    }
+    DP_Message *msg =
+        DP_msg_draw_dabs_classic_deserialize(1, buffer, sizeof(buffer));
+    assert_non_null(msg);
+    return msg;
+}
+
+static DP_CanvasState *handle_state(DP_CanvasState *cs, DP_DrawContext *dc,
+                                    DP_Message *msg)
+{
+    DP_CanvasState *next = DP_canvas_state_handle(cs, dc, msg);
+    assert_non_null(next);
+    DP_canvas_state_decref(cs);
+    DP_message_decref(msg);
+    return next;
+}
+
+static void test_history_transient_dabs(void **state)
+{
+    DP_DrawContext *dc = DP_draw_context_new();
+    push_draw_context(state, dc);
+    DP_CanvasHistory *ch = DP_canvas_history_new(NULL, NULL);
+    push_canvas_history(state, ch);
+
+    // Runs of dabs are kept on a single transient state while batching, the
+    // savepoints in between must not be affected by that.
+    DP_canvas_history_batch_begin(ch);
+    handle(ch, dc, DP_msg_canvas_resize_new(1, 0, 128, 128, 0));
+    handle(ch, dc, DP_msg_layer_create_new(1, 257, 0, 0, 0, "", 0));
+    for (int i = 0; i < DAB_ROUNDS; ++i) {
+        handle(ch, dc, DP_msg_undo_point_new(1));
+        for (int j = 0; j < DABS_PER_ROUND; ++j) {
+            handle(ch, dc, make_dabs(i, j));
+        }
+        if (i % 4 == 1) {
+            handle(ch, dc, DP_msg_pen_up_new(1));
+        }
+        if (i % 3 == 0) {
+            handle(ch, dc,
+                   DP_msg_fill_rect_new(1, 257, DP_BLEND_MODE_NORMAL, i * 8, 4,
+                                        8, 8, 0xff00ff00u));
+        }
+    }
+    handle(ch, dc, DP_msg_undo_new(1, 0, false));
+    handle(ch, dc, DP_msg_undo_new(1, 0, true));
+    handle(ch, dc, DP_msg_undo_new(1, 0, false));
+    DP_canvas_history_batch_end(ch);
+
+    DP_CanvasState *actual = DP_canvas_history_compare_and_get(ch, NULL);
+    assert_false(DP_canvas_state_transient(actual));
+
+    DP_CanvasState *expected = DP_canvas_state_new();
+    expected =
+        handle_state(expected, dc, DP_msg_canvas_resize_new(1, 0, 128, 128, 0));
+    expected = handle_state(expected, dc,
+                            DP_msg_layer_create_new(1, 257, 0, 0, 0, "", 0));
+    for (int i = 0; i < DAB_ROUNDS - 1; ++i) {
+        for (int j = 0; j < DABS_PER_ROUND; ++j) {
+            expected = handle_state(expected, dc, make_dabs(i, j));
+        }
+        if (i % 4 == 1) {
+            expected = handle_state(expected, dc, DP_msg_pen_up_new(1));
+        }
+        if (i % 3 == 0) {
+            expected = handle_state(
+                expected, dc,
+                DP_msg_fill_rect_new(1, 257, DP_BLEND_MODE_NORMAL, i * 8, 4, 8,
+                                     8, 0xff00ff00u));
+        }
+    }
+
+    assert_canvas_states_equal(expected, actual);
+    DP_canvas_state_decref(expected);
+    DP_canvas_state_decref(actual);
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_history_wraps_around),
+        dp_unit_test(test_history_batch),
+        dp_unit_test(test_history_transient_dabs),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -23,10 +23,16 @@
 #include "dpcommon_test.h"
 #include "dpengine/draw_context.h"
 #include "dpengine/model_changes.h"
+#include <dpcommon/conversions.h>
 #include <dpcommon/input.h>
+#include <dpengine/blend_mode.h>
 #include <dpengine/canvas_history.h>
 #include <dpengine/canvas_state.h>
+#include <dpengine/compress.h>
 #include <dpengine/image.h>
+#include <dpengine/payload_decoder.h>
+#include <dpmsg/message.h>
+#include <dpmsg/messages/put_image.h>
 #include <endian.h>
 
 
@@ -80,6 +86,117 @@ void push_model_changes(void **state, DP_ModelChanges *value)
     destructor_push(state, value, destroy_model_changes);
 }
 
+static void destroy_payload_decoder(void *value)
+{
+    DP_payload_decoder_free(value);
+}
+
+void push_payload_decoder(void **state, DP_PayloadDecoder *value)
+{
+    destructor_push(state, value, destroy_payload_decoder);
+}
+
+
+uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+int random_int(uint32_t *state, int min, int max)
+{
+    return min + DP_uint32_to_int(next_random(state)
+                                  % DP_int_to_uint32(max - min + 1));
+}
+
+
+static unsigned char *get_image_buffer(size_t out_size, void *user)
+{
+    unsigned char **buffer = user;
+    *buffer = DP_malloc(out_size);
+    return *buffer;
+}
+
+unsigned char *make_test_image_data(int width, int height, int seed,
+                                    size_t *out_size)
+{
+    size_t count = DP_int_to_size(width) * DP_int_to_size(height);
+    uint32_t *pixels = DP_malloc(sizeof(*pixels) * count);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint32_t c = DP_int_to_uint32((x / 4 + y / 3 + seed * 5) % 256);
+            pixels[y * width + x] = 0xff000000u | (c << 16) | (c ^ 0x5au);
+        }
+    }
+
+    unsigned char *buffer = NULL;
+    *out_size = DP_compress_deflate((const unsigned char *)pixels,
+                                    sizeof(*pixels) * count, 9,
+                                    get_image_buffer, &buffer);
+    assert_true(*out_size != 0);
+    DP_free(pixels);
+    return buffer;
+}
+
+DP_Message *make_test_put_image(unsigned int context_id, int layer_id, int x,
+                                int y, int seed)
+{
+    size_t size;
+    unsigned char *buffer = make_test_image_data(
+        TEST_IMAGE_WIDTH, TEST_IMAGE_HEIGHT, seed, &size);
+    DP_Message *msg = DP_msg_put_image_new(
+        context_id, layer_id, DP_BLEND_MODE_NORMAL, x, y, TEST_IMAGE_WIDTH,
+        TEST_IMAGE_HEIGHT, buffer, size);
+    DP_free(buffer);
+    return msg;
+}
+
+
+void handle_in_both(DP_CanvasHistory *a, DP_CanvasHistory *b,
+                    DP_DrawContext *dc, DP_Message *msg)
+{
+    assert_true(DP_canvas_history_handle(a, dc, msg));
+    assert_true(DP_canvas_history_handle(b, dc, msg));
+    DP_message_decref(msg);
+}
+
+void _assert_canvas_states_equal(DP_CanvasState *a, DP_CanvasState *b,
+                                 const char *file, int line)
+{
+    DP_Image *img_a =
+        DP_canvas_state_to_flat_image(a, DP_FLAT_IMAGE_INCLUDE_BACKGROUND);
+    DP_Image *img_b =
+        DP_canvas_state_to_flat_image(b, DP_FLAT_IMAGE_INCLUDE_BACKGROUND);
+    int width = DP_image_width(img_a);
+    int height = DP_image_height(img_a);
+    _assert_int_equal(cast_to_largest_integral_type(width),
+                      cast_to_largest_integral_type(DP_image_width(img_b)),
+                      file, line);
+    _assert_int_equal(cast_to_largest_integral_type(height),
+                      cast_to_largest_integral_type(DP_image_height(img_b)),
+                      file, line);
+    _assert_memory_equal(DP_image_pixels(img_a), DP_image_pixels(img_b),
+                         sizeof(DP_Pixel) * DP_int_to_size(width)
+                             * DP_int_to_size(height),
+                         file, line);
+    DP_image_free(img_b);
+    DP_image_free(img_a);
+}
+
+void _assert_canvas_histories_equal(DP_CanvasHistory *a, DP_CanvasHistory *b,
+                                    const char *file, int line)
+{
+    DP_CanvasState *cs_a = DP_canvas_history_compare_and_get(a, NULL);
+    DP_CanvasState *cs_b = DP_canvas_history_compare_and_get(b, NULL);
+    _assert_canvas_states_equal(cs_a, cs_b, file, line);
+    DP_canvas_state_decref(cs_b);
+    DP_canvas_state_decref(cs_a);
+}
+
 
 static DP_Image *read_image(void **state, const char *path)
 {
@@ -27,7 +27,9 @@ typedef struct DP_CanvasHistory DP_CanvasHistory;
 typedef struct DP_CanvasState DP_CanvasState;
 typedef struct DP_DrawContext DP_DrawContext;
 typedef struct DP_Image DP_Image;
+typedef struct DP_Message DP_Message;
 typedef struct DP_ModelChanges DP_ModelChanges;
+typedef struct DP_PayloadDecoder DP_PayloadDecoder;
 
 
 void push_canvas_history(void **state, DP_CanvasHistory *value);
@@ -40,6 +42,47 @@ void push_image(void **state, DP_Image *value);
 
 void push_model_changes(void **state, DP_ModelChanges *value);
 
+void push_payload_decoder(void **state, DP_PayloadDecoder *value);
+
+
+// Xorshift, so that failures are reproducible. The state is the seed at first
+// and must not be zero.
+uint32_t next_random(uint32_t *state);
+
+// Random number between min and max, both inclusive.
+int random_int(uint32_t *state, int min, int max);
+
+
+// Deflated pixels in the format that PutImage and PutTile expect. The pattern
+// depends on the seed, so different seeds give different images.
+unsigned char *make_test_image_data(int width, int height, int seed,
+                                    size_t *out_size);
+
+#define TEST_IMAGE_WIDTH  100
+#define TEST_IMAGE_HEIGHT 80
+
+// PutImage of a test image of the above size with normal blending.
+DP_Message *make_test_put_image(unsigned int context_id, int layer_id, int x,
+                                int y, int seed);
+
+
+// Handles the message in both histories, asserting success, and decrefs it.
+void handle_in_both(DP_CanvasHistory *a, DP_CanvasHistory *b,
+                    DP_DrawContext *dc, DP_Message *msg);
+
+#define assert_canvas_states_equal(a, b) \
+    _assert_canvas_states_equal(a, b, __FILE__, __LINE__)
+
+void _assert_canvas_states_equal(DP_CanvasState *a, DP_CanvasState *b,
+                                 const char *file, int line);
+
+// Compares the current states of both histories.
+#define assert_canvas_histories_equal(a, b) \
+    _assert_canvas_histories_equal(a, b, __FILE__, __LINE__)
+
+void _assert_canvas_histories_equal(DP_CanvasHistory *a, DP_CanvasHistory *b,
+                                    const char *file, int line);
+
 
 #define assert_image_files_equal(state, a, b) \
     _assert_image_files_equal(state, a, b, __FILE__, __LINE__)
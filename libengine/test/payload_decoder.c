@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/common.h>
+#include <dpengine/blend_mode.h>
+#include <dpengine/canvas_history.h>
+#include <dpengine/draw_context.h>
+#include <dpengine/payload_decoder.h>
+#include <dpengine/tile.h>
+#include <dpmsg/message.h>
+#include <dpmsg/messages/canvas_background.h>
+#include <dpmsg/messages/canvas_resize.h>
+#include <dpmsg/messages/layer_create.h>
+#include <dpmsg/messages/put_image.h>
+#include <dpmsg/messages/put_tile.h>
+#include <dpengine_test.h>
+
+
+#define MAX_MESSAGES 128
+
+typedef struct PayloadDecoderState {
+    DP_DrawContext *dc;
+    DP_CanvasHistory *direct;
+    DP_CanvasHistory *decoded;
+    DP_PayloadDecoder *pd;
+    int pushed_count;
+    int handled_count;
+    int direct_error_count;
+    int decoded_error_count;
+    DP_Message *pushed[MAX_MESSAGES];
+} PayloadDecoderState;
+
+static void handle_decoded(void *user, DP_DrawContext *dc, DP_Message *msg)
+{
+    PayloadDecoderState *pds = user;
+    assert_true(pds->handled_count < pds->pushed_count);
+    assert_true(pds->pushed[pds->handled_count++] == msg);
+    if (!DP_canvas_history_handle(pds->decoded, dc, msg)) {
+        ++pds->decoded_error_count;
+    }
+}
+
+static void push(PayloadDecoderState *pds, DP_Message *msg)
+{
+    assert_true(pds->pushed_count < MAX_MESSAGES);
+    pds->pushed[pds->pushed_count++] = msg;
+    if (!DP_canvas_history_handle(pds->direct, pds->dc, msg)) {
+        ++pds->direct_error_count;
+    }
+    DP_payload_decoder_push_noinc(pds->pd, pds->dc, msg);
+}
+
+static void push_put_tile(PayloadDecoderState *pds, int x, int y, int seed)
+{
+    size_t size;
+    unsigned char *buffer =
+        make_test_image_data(DP_TILE_SIZE, DP_TILE_SIZE, seed, &size);
+    push(pds, DP_msg_put_tile_new(1, 257, 0, x, y, 0, buffer, size));
+    DP_free(buffer);
+}
+
+static void test_payload_decoder(void **state)
+{
+    PayloadDecoderState pds = {
+        DP_draw_context_new(),
+        DP_canvas_history_new(NULL, NULL),
+        DP_canvas_history_new(NULL, NULL),
+        NULL,
+        0,
+        0,
+        0,
+        0,
+        {0},
+    };
+    push_draw_context(state, pds.dc);
+    push_canvas_history(state, pds.direct);
+    push_canvas_history(state, pds.decoded);
+    pds.pd = DP_payload_decoder_new(3, handle_decoded, &pds);
+    assert_non_null(pds.pd);
+    push_payload_decoder(state, pds.pd);
+
+    push(&pds, DP_msg_canvas_resize_new(1, 0, 300, 200, 0));
+    push(&pds, DP_msg_layer_create_new(1, 257, 0, 0, 0, "", 0));
+    size_t background_size;
+    unsigned char *background =
+        make_test_image_data(DP_TILE_SIZE, DP_TILE_SIZE, 99, &background_size);
+    push(&pds, DP_msg_canvas_background_new(1, background, background_size));
+    DP_free(background);
+
+    // Enough messages to fill up the decoder, so it has to handle some early.
+    for (int i = 0; i < 60; ++i) {
+        push_put_tile(&pds, i % 5, (i / 5) % 4, i);
+        if (i % 12 == 0) {
+            push(&pds, make_test_put_image(1, 257, i * 3, i, i));
+        }
+    }
+    assert_true(DP_payload_decoder_pending(pds.pd) > 0);
+    DP_payload_decoder_flush(pds.pd, pds.dc);
+    assert_int_equal(DP_payload_decoder_pending(pds.pd), 0);
+    assert_int_equal(pds.handled_count, pds.pushed_count);
+    assert_int_equal(pds.direct_error_count, 0);
+    assert_int_equal(pds.decoded_error_count, 0);
+    assert_canvas_histories_equal(pds.direct, pds.decoded);
+
+    // Broken payloads fail on the handling side just like they do without
+    // decoding ahead, rather than getting lost on a worker thread.
+    static const unsigned char garbage[] = {0, 0, 0x40, 0, 1, 2, 3, 4};
+    push(&pds, DP_msg_put_tile_new(1, 257, 0, 1, 1, 0, garbage,
+                                   sizeof(garbage)));
+    push_put_tile(&pds, 2, 2, 1000);
+    DP_payload_decoder_flush(pds.pd, pds.dc);
+    assert_int_equal(pds.handled_count, pds.pushed_count);
+    assert_int_equal(pds.direct_error_count, 1);
+    assert_int_equal(pds.decoded_error_count, 1);
+    assert_canvas_histories_equal(pds.direct, pds.decoded);
+    // A missing layer is reported before even trying to inflate the image.
+    push(&pds, DP_msg_put_image_new(1, 999, DP_BLEND_MODE_NORMAL, 0, 0,
+                                    TEST_IMAGE_WIDTH, TEST_IMAGE_HEIGHT,
+                                    garbage, sizeof(garbage)));
+    assert_string_equal(DP_error(), "Put image: id 999 not found");
+    DP_payload_decoder_flush(pds.pd, pds.dc);
+    assert_string_equal(DP_error(), "Put image: id 999 not found");
+    assert_int_equal(pds.direct_error_count, 2);
+    assert_int_equal(pds.decoded_error_count, 2);
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_payload_decoder),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
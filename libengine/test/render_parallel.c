@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpcommon/input.h>
+#include <dpcommon/worker.h>
+#include <dpengine/canvas_diff.h>
+#include <dpengine/canvas_history.h>
+#include <dpengine/canvas_state.h>
+#include <dpengine/draw_context.h>
+#include <dpengine/flatten_cache.h>
+#include <dpengine/image.h>
+#include <dpengine/layer_content.h>
+#include <dpmsg/binary_reader.h>
+#include <dpmsg/message.h>
+#include <dpengine_test.h>
+
+
+// Render every few commands so that there's a mix of small and full diffs.
+#define RENDER_INTERVAL 23
+
+typedef struct RenderParallelState {
+    DP_CanvasDiff *diff;
+    DP_CanvasState *prev;
+    DP_TransientLayerContent *serial;
+    DP_TransientLayerContent *parallel;
+    DP_FlattenCache *fc;
+    DP_Worker *worker;
+} RenderParallelState;
+
+static void render(RenderParallelState *rps, DP_CanvasHistory *ch)
+{
+    DP_CanvasState *cs = DP_canvas_history_compare_and_get(ch, rps->prev);
+    if (!cs) {
+        return;
+    }
+
+    DP_canvas_state_diff(cs, rps->prev, rps->diff);
+    DP_canvas_state_decref_nullable(rps->prev);
+    rps->prev = cs;
+
+    // Only the parallel renderer goes through a cache, so that the cached
+    // results are checked against ones flattened from scratch.
+    rps->serial = DP_canvas_state_render(cs, rps->serial, rps->diff, NULL);
+    rps->parallel = DP_canvas_state_render_parallel(
+        cs, rps->parallel, rps->diff, rps->fc, rps->worker, 2);
+
+    DP_Image *serial_img =
+        DP_layer_content_to_image((DP_LayerContent *)rps->serial);
+    DP_Image *parallel_img =
+        DP_layer_content_to_image((DP_LayerContent *)rps->parallel);
+    assert_int_equal(DP_image_width(serial_img), DP_image_width(parallel_img));
+    assert_int_equal(DP_image_height(serial_img),
+                     DP_image_height(parallel_img));
+    assert_memory_equal(DP_image_pixels(serial_img),
+                        DP_image_pixels(parallel_img),
+                        sizeof(DP_Pixel)
+                            * DP_int_to_size(DP_image_width(serial_img))
+                            * DP_int_to_size(DP_image_height(serial_img)));
+    DP_image_free(parallel_img);
+    DP_image_free(serial_img);
+}
+
+static void test_render_parallel(void **state)
+{
+    const char *name = initial_state(state);
+    char *dprec_path =
+        push_format(state, "test/data/recordings/%s.dprec", name);
+
+    DP_Input *input = DP_file_input_new_from_path(dprec_path);
+    push_input(state, input);
+
+    DP_BinaryReader *reader = DP_binary_reader_new(input);
+    assert_non_null(reader);
+    push_binary_reader(state, reader, input);
+
+    DP_CanvasHistory *ch = DP_canvas_history_new(NULL, NULL);
+    push_canvas_history(state, ch);
+
+    DP_DrawContext *dc = DP_draw_context_new();
+    push_draw_context(state, dc);
+
+    RenderParallelState rps = {
+        DP_canvas_diff_new(),
+        NULL,
+        DP_transient_layer_content_new_init(0, 0, NULL),
+        DP_transient_layer_content_new_init(0, 0, NULL),
+        DP_flatten_cache_new(),
+        DP_worker_new(16, 3),
+    };
+    assert_non_null(rps.worker);
+
+    int commands = 0;
+    while (DP_binary_reader_has_next(reader)) {
+        DP_Message *msg = DP_binary_reader_read_next(reader);
+        assert_non_null(msg);
+        push_message(state, msg);
+
+        if (DP_message_type_command(DP_message_type(msg))) {
+            if (!DP_canvas_history_handle(ch, dc, msg)) {
+                DP_warn("%s", DP_error());
+            }
+            if (++commands % RENDER_INTERVAL == 0) {
+                render(&rps, ch);
+            }
+        }
+
+        destructor_run(state, msg);
+    }
+    render(&rps, ch);
+
+    DP_worker_free(rps.worker);
+    DP_flatten_cache_free(rps.fc);
+    DP_transient_layer_content_decref(rps.parallel);
+    DP_transient_layer_content_decref(rps.serial);
+    DP_canvas_state_decref_nullable(rps.prev);
+    DP_canvas_diff_free(rps.diff);
+}
+
+
+#define recording_unit_test(NAME)                         \
+    (struct CMUnitTest)                                   \
+    {                                                     \
+        NAME, test_render_parallel, setup, teardown, NAME \
+    }
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        recording_unit_test("layerops"),
+        recording_unit_test("resize"),
+        recording_unit_test("transform"),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
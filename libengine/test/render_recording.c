@@ -20,6 +20,7 @@
  * SOFTWARE.
  */
 #include <dpcommon/common.h>
+#include <dpcommon/cpu.h>
 #include <dpcommon/input.h>
 #include <dpcommon/output.h>
 #include <dpengine/canvas_history.h>
@@ -31,13 +32,14 @@
 #include <dpengine_test.h>
 
 
-static void test_render_recording(void **state)
+static void render_recording(void **state, bool batched)
 {
     const char *name = initial_state(state);
     char *dprec_path =
         push_format(state, "test/data/recordings/%s.dprec", name);
     char *out_path =
-        push_format(state, "test/tmp/render_recording_%s.png", name);
+        push_format(state, "test/tmp/render_recording_%s%s.png", name,
+                    batched ? "_batched" : "");
     char *expected_path =
         push_format(state, "test/data/recordings/%s.png", name);
 
@@ -56,6 +58,12 @@ static void test_render_recording(void **state)
     assert_non_null(dc);
     push_draw_context(state, dc);
 
+    // In a single batch, runs of dabs stay on one transient state until the
+    // next undo point or other command, the result must be the same.
+    if (batched) {
+        DP_canvas_history_batch_begin(ch);
+    }
+
     while (DP_binary_reader_has_next(reader)) {
         DP_Message *msg = DP_binary_reader_read_next(reader);
         assert_non_null(msg);
@@ -70,6 +78,10 @@ static void test_render_recording(void **state)
         destructor_run(state, msg);
     }
 
+    if (batched) {
+        DP_canvas_history_batch_end(ch);
+    }
+
     DP_CanvasState *cs = DP_canvas_history_compare_and_get(ch, NULL);
     push_canvas_state(state, cs);
     DP_Image *img =
@@ -87,6 +99,16 @@ static void test_render_recording(void **state)
     assert_image_files_equal(state, out_path, expected_path);
 }
 
+static void test_render_recording(void **state)
+{
+    render_recording(state, false);
+}
+
+static void test_render_recording_batched(void **state)
+{
+    render_recording(state, true);
+}
+
 
 #define recording_unit_test(NAME)                          \
     (struct CMUnitTest)                                    \
@@ -94,8 +116,17 @@ static void test_render_recording(void **state)
         NAME, test_render_recording, setup, teardown, NAME \
     }
 
+#define batched_recording_unit_test(NAME)                          \
+    (struct CMUnitTest)                                            \
+    {                                                              \
+        NAME, test_render_recording_batched, setup, teardown, NAME \
+    }
+
 int main(void)
 {
+    // Render with whatever vectorized code paths the CPU supports, they must
+    // produce the exact same results as the plain C ones.
+    DP_cpu_support_init();
     const struct CMUnitTest tests[] = {
         recording_unit_test("brushmodes"),
         recording_unit_test("layermodes"),
@@ -105,6 +136,14 @@ int main(void)
         recording_unit_test("resize"),
         recording_unit_test("transform"),
         recording_unit_test("transparentbackground"),
+        batched_recording_unit_test("brushmodes"),
+        batched_recording_unit_test("layermodes"),
+        batched_recording_unit_test("layerops"),
+        batched_recording_unit_test("persp"),
+        batched_recording_unit_test("rect"),
+        batched_recording_unit_test("resize"),
+        batched_recording_unit_test("transform"),
+        batched_recording_unit_test("transparentbackground"),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
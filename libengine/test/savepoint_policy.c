@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/common.h>
+#include <dpengine/blend_mode.h>
+#include <dpengine/canvas_history.h>
+#include <dpengine/canvas_state.h>
+#include <dpengine/draw_context.h>
+#include <dpmsg/message.h>
+#include <dpmsg/messages/canvas_resize.h>
+#include <dpmsg/messages/fill_rect.h>
+#include <dpmsg/messages/layer_create.h>
+#include <dpmsg/messages/undo.h>
+#include <dpmsg/messages/undo_point.h>
+#include <dpengine_test.h>
+
+
+typedef struct SavepointPolicyState {
+    DP_DrawContext *dc;
+    DP_CanvasHistory *plain;
+    DP_CanvasHistory *sparse;
+} SavepointPolicyState;
+
+static void handle(SavepointPolicyState *sps, DP_Message *msg)
+{
+    handle_in_both(sps->plain, sps->sparse, sps->dc, msg);
+}
+
+static void put_image(SavepointPolicyState *sps, unsigned int context_id,
+                      int i)
+{
+    handle(sps, make_test_put_image(context_id, 257, (i * 13) % 200,
+                                    (i * 7) % 200, i));
+}
+
+static void init_histories(void **state, SavepointPolicyState *sps,
+                           DP_CanvasHistorySavepointPolicy policy)
+{
+    *sps = (SavepointPolicyState){DP_draw_context_new(),
+                                  DP_canvas_history_new(NULL, NULL),
+                                  DP_canvas_history_new(NULL, NULL)};
+    push_draw_context(state, sps->dc);
+    push_canvas_history(state, sps->plain);
+    push_canvas_history(state, sps->sparse);
+    DP_canvas_history_savepoint_policy_set(sps->sparse, policy);
+    handle(sps, DP_msg_canvas_resize_new(1, 0, 256, 256, 0));
+    handle(sps, DP_msg_layer_create_new(1, 257, 0, 0, 0, "", 0));
+}
+
+// Two users take turns, so that undoing one of them has to replay the other's
+// actions from whatever savepoint is left before the undone part.
+static void draw_rounds(SavepointPolicyState *sps, int start, int end)
+{
+    for (int i = start; i < end; ++i) {
+        unsigned int context_id = i % 2 == 0 ? 1 : 2;
+        handle(sps, DP_msg_undo_point_new(context_id));
+        put_image(sps, context_id, i);
+    }
+}
+
+static void undo_and_redo(SavepointPolicyState *sps, unsigned int context_id,
+                          int undos, int redos)
+{
+    for (int i = 0; i < undos; ++i) {
+        handle(sps, DP_msg_undo_new(context_id, 0, false));
+        assert_canvas_histories_equal(sps->plain, sps->sparse);
+    }
+    for (int i = 0; i < redos; ++i) {
+        handle(sps, DP_msg_undo_new(context_id, 0, true));
+        assert_canvas_histories_equal(sps->plain, sps->sparse);
+    }
+}
+
+
+static void test_savepoint_spacing(void **state)
+{
+    SavepointPolicyState sps;
+    init_histories(state, &sps, (DP_CanvasHistorySavepointPolicy){0, 6, 4, 0});
+
+    draw_rounds(&sps, 0, 50);
+    assert_canvas_histories_equal(sps.plain, sps.sparse);
+    DP_CanvasHistorySavepointStats plain_stats =
+        DP_canvas_history_savepoint_stats(sps.plain);
+    DP_CanvasHistorySavepointStats sparse_stats =
+        DP_canvas_history_savepoint_stats(sps.sparse);
+    assert_true(sparse_stats.count * 2 < plain_stats.count);
+    assert_true(sparse_stats.pinned_bytes < plain_stats.pinned_bytes);
+
+    undo_and_redo(&sps, 1, 10, 4);
+    undo_and_redo(&sps, 2, 5, 5);
+    draw_rounds(&sps, 50, 70);
+    assert_canvas_histories_equal(sps.plain, sps.sparse);
+    undo_and_redo(&sps, 2, 12, 3);
+}
+
+static void test_savepoint_memory_limit(void **state)
+{
+    SavepointPolicyState sps;
+    // Smaller than a single tile, so only the oldest and newest savepoint can
+    // ever be kept around.
+    init_histories(state, &sps, (DP_CanvasHistorySavepointPolicy){1, 1, 0, 0});
+
+    for (int i = 0; i < 100; i += 10) {
+        draw_rounds(&sps, i, i + 10);
+        assert_canvas_histories_equal(sps.plain, sps.sparse);
+        assert_true(DP_canvas_history_savepoint_stats(sps.sparse).count <= 2);
+    }
+
+    undo_and_redo(&sps, 1, 12, 6);
+    assert_true(DP_canvas_history_savepoint_stats(sps.sparse).count <= 2);
+    undo_and_redo(&sps, 2, 3, 3);
+    draw_rounds(&sps, 100, 110);
+    assert_canvas_histories_equal(sps.plain, sps.sparse);
+}
+
+static void assert_pinned_bytes_tracked(SavepointPolicyState *sps,
+                                        DP_CanvasHistorySavepointPolicy policy)
+{
+    // Without a memory limit, pinned bytes are measured from scratch.
+    size_t tracked =
+        DP_canvas_history_savepoint_stats(sps->sparse).pinned_bytes;
+    DP_canvas_history_savepoint_policy_set(
+        sps->sparse, DP_CANVAS_HISTORY_SAVEPOINT_POLICY_DEFAULT);
+    size_t measured =
+        DP_canvas_history_savepoint_stats(sps->sparse).pinned_bytes;
+    DP_canvas_history_savepoint_policy_set(sps->sparse, policy);
+    assert_int_equal(tracked, measured);
+    assert_int_equal(
+        DP_canvas_history_savepoint_stats(sps->sparse).pinned_bytes, tracked);
+}
+
+static void check_pinned_bytes(void **state,
+                               DP_CanvasHistorySavepointPolicy policy)
+{
+    SavepointPolicyState sps;
+    init_histories(state, &sps, policy);
+    DP_canvas_history_cold_savepoint_age_set(sps.sparse, 2);
+
+    for (int i = 0; i < 60; i += 10) {
+        draw_rounds(&sps, i, i + 10);
+        assert_canvas_histories_equal(sps.plain, sps.sparse);
+        assert_pinned_bytes_tracked(&sps, policy);
+    }
+    assert_true(DP_canvas_history_savepoint_stats(sps.sparse).count
+                < DP_canvas_history_savepoint_stats(sps.plain).count);
+
+    undo_and_redo(&sps, 1, 8, 3);
+    assert_pinned_bytes_tracked(&sps, policy);
+    undo_and_redo(&sps, 2, 4, 4);
+    assert_pinned_bytes_tracked(&sps, policy);
+    draw_rounds(&sps, 60, 70);
+    assert_canvas_histories_equal(sps.plain, sps.sparse);
+    assert_pinned_bytes_tracked(&sps, policy);
+}
+
+static void test_savepoint_pinned_bytes(void **state)
+{
+    // Room for a few savepoints' worth of images, so some get dropped. Once
+    // with only the memory limit dropping them, once with thinning as well.
+    check_pinned_bytes(state, (DP_CanvasHistorySavepointPolicy){256 * 1024,
+                                                               1, 0, 0});
+    check_pinned_bytes(state, (DP_CanvasHistorySavepointPolicy){256 * 1024,
+                                                               2, 3, 0});
+}
+
+static void test_savepoint_replay_cost(void **state)
+{
+    SavepointPolicyState sps;
+    // Spacing is too wide to ever make a savepoint, so they're only placed
+    // based on replay cost. Aggressive thinning tries to get rid of them.
+    init_histories(state, &sps,
+                   (DP_CanvasHistorySavepointPolicy){0, 1000, 1, 20});
+
+    for (int i = 0; i < 60; i += 6) {
+        draw_rounds(&sps, i, i + 5);
+        // Filling the whole canvas is far more expensive than the images.
+        handle(&sps, DP_msg_undo_point_new(1));
+        handle(&sps, DP_msg_fill_rect_new(1, 257, DP_BLEND_MODE_NORMAL, 0, 0,
+                                          256, 256, 0xff102030u + (unsigned)i));
+        assert_canvas_histories_equal(sps.plain, sps.sparse);
+        assert_true(DP_canvas_history_savepoint_stats(sps.sparse)
+                        .worst_replay_cost
+                    < 20);
+    }
+
+    DP_CanvasHistorySavepointStats plain_stats =
+        DP_canvas_history_savepoint_stats(sps.plain);
+    DP_CanvasHistorySavepointStats sparse_stats =
+        DP_canvas_history_savepoint_stats(sps.sparse);
+    assert_true(sparse_stats.count < plain_stats.count);
+
+    undo_and_redo(&sps, 1, 8, 4);
+    undo_and_redo(&sps, 2, 6, 2);
+    assert_true(
+        DP_canvas_history_savepoint_stats(sps.sparse).worst_replay_cost < 20);
+
+    // Replaying puts savepoints at every undo point, which thinning has to
+    // drop again without losing track of the cost between the ones it keeps.
+    // Undoing the last stroke also moves the newest savepoint back before the
+    // expensive fill, whose cost has to be picked up again.
+    for (int i = 60; i < 120; i += 6) {
+        draw_rounds(&sps, i, i + 6);
+        undo_and_redo(&sps, 1, 2, 1);
+        handle(&sps, DP_msg_undo_point_new(2));
+        handle(&sps, DP_msg_fill_rect_new(2, 257, DP_BLEND_MODE_NORMAL, 0, 0,
+                                          256, 256, 0xff302010u + (unsigned)i));
+        handle(&sps, DP_msg_undo_point_new(1));
+        put_image(&sps, 1, i);
+        undo_and_redo(&sps, 1, 2, 1);
+        assert_true(DP_canvas_history_savepoint_stats(sps.sparse)
+                        .worst_replay_cost
+                    < 20);
+    }
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_savepoint_spacing),
+        dp_unit_test(test_savepoint_memory_limit),
+        dp_unit_test(test_savepoint_pinned_bytes),
+        dp_unit_test(test_savepoint_replay_cost),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2022 askmeaboutloom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <dpcommon/common.h>
+#include <dpcommon/conversions.h>
+#include <dpengine/blend_mode.h>
+#include <dpengine/image.h>
+#include <dpengine/pixels.h>
+#include <dpengine/tile.h>
+#include <dpengine_test.h>
+
+
+#define TILE_COUNT 100
+
+static DP_Tile *new_full_tile(unsigned int context_id)
+{
+    return DP_transient_tile_persist(DP_transient_tile_new_blank(context_id));
+}
+
+static void assert_stats(int live_tiles, int pooled_tiles)
+{
+    DP_TileMemoryStats stats = DP_tile_memory_stats();
+    assert_int_equal(stats.live_tiles, live_tiles);
+    assert_int_equal(stats.solid_tiles, 0);
+    assert_int_equal(stats.pooled_tiles, pooled_tiles);
+    assert_true(stats.live_bytes >= (size_t)live_tiles * DP_TILE_BYTES);
+    assert_true(stats.pooled_bytes >= (size_t)pooled_tiles * DP_TILE_BYTES);
+}
+
+static void test_tile_pool(DP_UNUSED void **state)
+{
+    DP_tile_pool_trim();
+    DP_tile_pool_limit_set(TILE_COUNT / 2);
+    assert_stats(0, 0);
+
+    DP_Tile *tiles[TILE_COUNT];
+    for (int i = 0; i < TILE_COUNT; ++i) {
+        tiles[i] = new_full_tile(0);
+        assert_true((uintptr_t)DP_tile_pixels(tiles[i]) % DP_TILE_ALIGNMENT
+                    == 0);
+    }
+    assert_stats(TILE_COUNT, 0);
+
+    // Only up to the limit of tiles are kept around.
+    for (int i = 0; i < TILE_COUNT; ++i) {
+        DP_tile_decref(tiles[i]);
+    }
+    assert_stats(0, TILE_COUNT / 2);
+
+    // Pooled tiles get reused and their contents reinitialized.
+    for (int i = 0; i < TILE_COUNT; ++i) {
+        tiles[i] = i % 2 == 0 ? new_full_tile(1)
+                              : (DP_Tile *)DP_transient_tile_new_blank(2);
+    }
+    assert_stats(TILE_COUNT, 0);
+    for (int i = 0; i < TILE_COUNT; ++i) {
+        assert_int_equal(DP_tile_context_id(tiles[i]), i % 2 == 0 ? 1 : 2);
+        assert_int_equal(DP_tile_transient(tiles[i]), i % 2 != 0);
+        assert_true(DP_tile_blank(tiles[i]));
+        DP_tile_decref(tiles[i]);
+    }
+    assert_stats(0, TILE_COUNT / 2);
+
+    DP_tile_pool_trim();
+    assert_stats(0, 0);
+
+    // A limit of zero disables pooling altogether.
+    DP_tile_pool_limit_set(0);
+    DP_tile_decref(new_full_tile(0));
+    assert_stats(0, 0);
+
+    DP_tile_pool_limit_set(DP_TILE_POOL_DEFAULT_LIMIT);
+}
+
+
+static void fill_pattern(DP_Pixel *pixels)
+{
+    for (int i = 0; i < DP_TILE_LENGTH; ++i) {
+        uint8_t a = (uint8_t)(i * 7);
+        pixels[i] = (DP_Pixel){.b = (uint8_t)(a / 3), .g = (uint8_t)(a / 2),
+                               .r = (uint8_t)(i % (a + 1)), .a = a};
+    }
+}
+
+static void assert_tiles_equal(DP_Tile *a, DP_Tile *b)
+{
+    for (int y = 0; y < DP_TILE_SIZE; ++y) {
+        for (int x = 0; x < DP_TILE_SIZE; ++x) {
+            assert_int_equal(DP_tile_pixel_at(a, x, y).color,
+                             DP_tile_pixel_at(b, x, y).color);
+        }
+    }
+}
+
+static void check_solid_tile(uint32_t color)
+{
+    DP_Tile *solid = DP_tile_new_from_bgra(1, color);
+    DP_Tile *full = DP_transient_tile_persist(DP_transient_tile_new(solid, 2));
+    assert_true(DP_tile_solid(solid));
+    assert_false(DP_tile_solid(full));
+    assert_int_equal(DP_tile_memory_stats().solid_tiles, 1);
+    assert_tiles_equal(solid, full);
+    assert_int_equal(DP_tile_blank(solid), DP_tile_blank(full));
+
+    DP_Pixel solid_pixel, full_pixel;
+    assert_true(DP_tile_same_pixel(solid, &solid_pixel));
+    assert_true(DP_tile_same_pixel(full, &full_pixel));
+    assert_int_equal(solid_pixel.color, color);
+    assert_int_equal(full_pixel.color, color);
+
+    DP_Image *solid_img = DP_image_new(100, 50);
+    DP_Image *full_img = DP_image_new(100, 50);
+    DP_tile_copy_to_image(solid, solid_img, 40, 10);
+    DP_tile_copy_to_image(full, full_img, 40, 10);
+    assert_memory_equal(DP_image_pixels(solid_img), DP_image_pixels(full_img),
+                        sizeof(DP_Pixel) * 100 * 50);
+    DP_image_free(full_img);
+    DP_image_free(solid_img);
+
+    uint8_t mask[20 * 10];
+    for (int i = 0; i < (int)DP_ARRAY_LENGTH(mask); ++i) {
+        mask[i] = (uint8_t)(i * 13);
+    }
+    DP_TileWeightedAverage solid_twa =
+        DP_tile_weighted_average(solid, mask, 5, 7, 20, 10, 0);
+    DP_TileWeightedAverage full_twa =
+        DP_tile_weighted_average(full, mask, 5, 7, 20, 10, 0);
+    assert_memory_equal(&solid_twa, &full_twa, sizeof(solid_twa));
+
+    for (int blend_mode = 0; blend_mode < DP_BLEND_MODE_COUNT; ++blend_mode) {
+        if (DP_blend_mode_exists(blend_mode)) {
+            DP_TransientTile *solid_dst = DP_transient_tile_new_blank(0);
+            DP_TransientTile *full_dst = DP_transient_tile_new_blank(0);
+            fill_pattern(DP_transient_tile_pixels((DP_Tile *)solid_dst));
+            fill_pattern(DP_transient_tile_pixels((DP_Tile *)full_dst));
+            DP_transient_tile_merge(solid_dst, solid, 200, blend_mode);
+            DP_transient_tile_merge(full_dst, full, 200, blend_mode);
+            assert_tiles_equal((DP_Tile *)solid_dst, (DP_Tile *)full_dst);
+            DP_tile_decref((DP_Tile *)full_dst);
+            DP_tile_decref((DP_Tile *)solid_dst);
+        }
+    }
+
+    DP_tile_decref(full);
+    DP_tile_decref(solid);
+    assert_int_equal(DP_tile_memory_stats().solid_tiles, 0);
+}
+
+static void test_solid_tile(DP_UNUSED void **state)
+{
+    check_solid_tile(0x00000000u);
+    check_solid_tile(0xffffffffu);
+    check_solid_tile(0xff3366ccu);
+    check_solid_tile(0x80402010u);
+}
+
+
+static DP_Tile *new_pattern_tile(unsigned int context_id, uint8_t tweak)
+{
+    DP_TransientTile *tt = DP_transient_tile_new_blank(context_id);
+    DP_Pixel *pixels = DP_transient_tile_pixels((DP_Tile *)tt);
+    fill_pattern(pixels);
+    pixels[DP_TILE_LENGTH - 1].a = tweak;
+    return DP_transient_tile_persist(tt);
+}
+
+static void assert_intern_stats(int interned_tiles, int hits, int misses)
+{
+    DP_TileInternStats stats = DP_tile_intern_stats();
+    assert_int_equal(stats.interned_tiles, interned_tiles);
+    assert_int_equal(stats.hits, hits);
+    assert_int_equal(stats.misses, misses);
+}
+
+static void test_tile_interning(DP_UNUSED void **state)
+{
+    assert_false(DP_tile_interning_enabled());
+    DP_Tile *a = new_pattern_tile(1, 0);
+    DP_Tile *b = new_pattern_tile(1, 0);
+    assert_true(a != b);
+    assert_intern_stats(0, 0, 0);
+    DP_tile_decref(b);
+    DP_tile_decref(a);
+
+    DP_tile_interning_enabled_set(true);
+    a = new_pattern_tile(1, 0);
+    b = new_pattern_tile(1, 0);
+    DP_Tile *c = new_pattern_tile(1, 1);
+    DP_Tile *d = new_pattern_tile(2, 0);
+    assert_true(a == b);
+    assert_true(a != c);
+    assert_true(a != d);
+    assert_intern_stats(3, 1, 3);
+
+    // Interned tiles leave the table when their last reference goes away.
+    DP_tile_decref(a);
+    assert_intern_stats(3, 1, 3);
+    DP_tile_decref(b);
+    DP_tile_decref(c);
+    DP_tile_decref(d);
+    assert_intern_stats(0, 1, 3);
+
+    // Enough tiles to make the table grow.
+    DP_Tile *tiles[2000];
+    for (int i = 0; i < (int)DP_ARRAY_LENGTH(tiles); ++i) {
+        tiles[i] = new_pattern_tile(DP_int_to_uint(i % 1000), 0);
+    }
+    for (int i = 0; i < (int)DP_ARRAY_LENGTH(tiles); ++i) {
+        assert_true(tiles[i] == tiles[i % 1000]);
+    }
+    assert_intern_stats(1000, 1001, 1003);
+    for (int i = 0; i < (int)DP_ARRAY_LENGTH(tiles); ++i) {
+        DP_tile_decref(tiles[i]);
+    }
+    assert_intern_stats(0, 1001, 1003);
+
+    DP_tile_interning_enabled_set(false);
+}
+
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        dp_unit_test(test_tile_pool),
+        dp_unit_test(test_solid_tile),
+        dp_unit_test(test_tile_interning),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}